@@ -1,7 +1,9 @@
 #include <iostream>
 #include <fstream>
 #include <string>
-#include <map>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
 
 // A simple, append-only key-value store backed by a disk file (log) with in-memory 
 // caching for fast lookups. Perfect for scenarios where you want:
@@ -17,10 +19,55 @@ struct MetaData {
     uint64_t byteSize;
 };
 
-class HashMap : public std::map<int, MetaData> {
+// Flat open-addressing index (linear probing) keyed by record key.
+//
+// Slots live in one contiguous array with MetaData stored inline, so a lookup
+// is a hash plus a short sequential probe over adjacent cache lines instead of
+// a red-black tree walk over heap nodes. Capacity is always a power of two and
+// the table doubles once it is 70% full to keep probe sequences short.
+class HashMap {
 private:
+    struct Slot {
+        int key;
+        bool used;
+        MetaData metaData;
+    };
+
+    static constexpr size_t MIN_CAPACITY = 16;
+
+    std::vector<Slot> slots;
+    size_t count = 0;
+    size_t mask = 0;
     uint64_t currByteOffset = 0;
-    HashMap() = default;
+
+    // Fibonacci hashing spreads sequential keys across the whole table
+    static size_t hash(int key) {
+        uint64_t h = static_cast<uint32_t>(key) * 0x9E3779B97F4A7C15ull;
+        return static_cast<size_t>(h ^ (h >> 32));
+    }
+
+    Slot& probe(int key) {
+        size_t i = hash(key) & mask;
+        while (slots[i].used && slots[i].key != key) {
+            i = (i + 1) & mask;
+        }
+        return slots[i];
+    }
+
+    void rehash(size_t capacity) {
+        std::vector<Slot> previous = std::move(slots);
+        slots.assign(capacity, Slot{ 0, false, { 0, 0 } });
+        mask = capacity - 1;
+        for (const Slot& slot : previous) {
+            if (slot.used) {
+                probe(slot.key) = slot;
+            }
+        }
+    }
+
+    HashMap() {
+        rehash(MIN_CAPACITY);
+    }
 
 public:
     static HashMap& getInstance() {
@@ -32,22 +79,40 @@ public:
         return currByteOffset;
     }
 
+    size_t size() const {
+        return count;
+    }
+
     void add(int key, uint64_t recordSize) {
-        (*this)[key] = { currByteOffset, recordSize };
+        if ((count + 1) * 10 > slots.size() * 7) {
+            rehash(slots.size() * 2);
+        }
+        Slot& slot = probe(key);
+        if (!slot.used) {
+            slot.used = true;
+            slot.key = key;
+            count++;
+        }
+        slot.metaData = { currByteOffset, recordSize };
         currByteOffset += recordSize;
     }
 
     MetaData get(int key) const {
-        auto it = find(key);
-        if (it == end()){
-            return { 0,0 };
+        size_t i = hash(key) & mask;
+        while (slots[i].used) {
+            if (slots[i].key == key) {
+                return slots[i].metaData;
+            }
+            i = (i + 1) & mask;
         }
-        return it->second;
+        return { 0,0 };
     }
 
     void reset() {
         currByteOffset = 0;
-        clear();
+        count = 0;
+        slots.assign(MIN_CAPACITY, Slot{ 0, false, { 0, 0 } });
+        mask = MIN_CAPACITY - 1;
     }
 };
 
@@ -56,8 +121,15 @@ class Store {
     std::string currDir;
     HashMap& cache;
     size_t files;
+    // Read-only descriptor kept for the lifetime of the store; gets use pread
+    // on it so concurrent readers never share a seek position
+    int readFd = -1;
+
     void open() {
         store.open(currDir, std::ios::app);
+        if (readFd < 0) {
+            readFd = ::open(currDir.c_str(), O_RDONLY);
+        }
     }
     void init() {
         // Make sure file is closed before reading
@@ -119,6 +191,12 @@ public:
         init();
     }
 
+    ~Store() {
+        if (readFd >= 0) {
+            ::close(readFd);
+        }
+    }
+
     bool set(int key, const std::string& value) {
         if (!store.is_open()) return false;
 
@@ -133,12 +211,22 @@ public:
     bool get(int key, std::string& out) const {
         MetaData metaData = cache.get(key);
         if (metaData.byteSize <= 0) return false;
-
-        std::ifstream in(currDir);
-        if (!in.is_open()) return false;
-
-        in.seekg(metaData.byteOffset, std::ios::beg);
-        std::getline(in, out, DELIMITER);
+        if (readFd < 0) return false;
+
+        // Record size is known from the index, so a single positional read
+        // fetches it without scanning for the delimiter
+        out.resize(metaData.byteSize);
+        uint64_t done = 0;
+        while (done < metaData.byteSize) {
+            ssize_t n = ::pread(readFd, &out[done], metaData.byteSize - done,
+                metaData.byteOffset + done);
+            if (n <= 0) {
+                out.clear();
+                return false;
+            }
+            done += n;
+        }
+        out.pop_back(); // trailing DELIMITER
         return true;
     }
 };
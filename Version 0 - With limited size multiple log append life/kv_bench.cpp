@@ -0,0 +1,363 @@
+#include "kvstore.h"
+
+#include <benchmark/benchmark.h>
+
+// Google Benchmark suite for the engines. Files go to $KV_BENCH_DIR (default
+// <tmp>/kv_bench); every benchmark starts from an empty directory of its own.
+// Run with: kv_bench --benchmark_out=kv_bench.json --benchmark_out_format=json
+// or build the `bench` target.
+
+namespace {
+
+std::string benchDirectory() {
+    if (const char* dir = std::getenv("KV_BENCH_DIR")) return dir;
+    return (std::filesystem::temp_directory_path() / "kv_bench").string();
+}
+
+// Options for a benchmark's own, emptied directory. Background merges and
+// fsyncs are off so they do not land inside unrelated measurements.
+EngineOptions freshOptions(const std::string& name) {
+    EngineOptions options;
+    options.directory = (std::filesystem::path(benchDirectory()) / name).string();
+    options.name = "bench";
+    options.merge.enabled = false;
+    std::error_code ec;
+    std::filesystem::remove_all(options.directory, ec);
+    return options;
+}
+
+template <typename Engine>
+std::unique_ptr<Engine> openEngine(const EngineOptions& options) {
+    return std::make_unique<Engine>(options);
+}
+
+template <>
+std::unique_ptr<ShardedStorageEngine<>> openEngine(const EngineOptions& options) {
+    return std::make_unique<ShardedStorageEngine<>>(ShardedStorageEngine<>::layout(options, 4));
+}
+
+template <typename Engine> constexpr const char* engineName = "";
+template <> constexpr const char* engineName<StorageEngine<>> = "hash";
+template <> constexpr const char* engineName<ShardedStorageEngine<>> = "sharded";
+template <> constexpr const char* engineName<LsmStorageEngine> = "lsm";
+
+// Half random, half repeated bytes, so compression has something to find
+std::string makeValue(size_t size, uint64_t seed) {
+    std::string value(size, 'v');
+    std::mt19937_64 rng(seed);
+    for (size_t i = 0; i < size / 2; i++) {
+        value[i] = static_cast<char>('a' + rng() % 26);
+    }
+    return value;
+}
+
+// i-th key of a pass over [0, 2^24): in order, or a fixed permutation of it
+int keyAt(uint64_t i, bool random) {
+    constexpr uint64_t mask = (1u << 24) - 1;
+    return static_cast<int>(random ? (i * 0x9E3779B1ull) & mask : i & mask);
+}
+
+// Records that fit the data set of a read benchmark
+size_t recordsFor(size_t valueBytes) {
+    return std::min<size_t>(200000, (256u << 20) / (valueBytes + 16));
+}
+
+// Engines preloaded with recordsFor(valueBytes) keys, shared by every read
+// benchmark of that engine and value size and kept until exit
+template <typename Engine>
+Engine& loadedEngine(size_t valueBytes) {
+    static std::mutex mutex;
+    static std::map<size_t, std::unique_ptr<Engine>> engines;
+    std::lock_guard<std::mutex> lock(mutex);
+    auto& engine = engines[valueBytes];
+    if (!engine) {
+        engine = openEngine<Engine>(freshOptions(std::string(engineName<Engine>) + "_read_"
+            + std::to_string(valueBytes)));
+        const std::string value = makeValue(valueBytes, 1);
+        const size_t records = recordsFor(valueBytes);
+        WriteBatch batch;
+        for (size_t i = 0; i < records; i++) {
+            batch.put(static_cast<int>(i), value);
+            if (batch.count() == 1024 || i + 1 == records) {
+                engine->write(batch);
+                batch.clear();
+            }
+        }
+    }
+    return *engine;
+}
+
+// set at range(0) value bytes; range(1) != 0 writes keys in random order.
+// Threads share one engine and write disjoint keys.
+template <typename Engine>
+void BM_Set(benchmark::State& state) {
+    static std::unique_ptr<Engine> engine;
+    const size_t valueBytes = static_cast<size_t>(state.range(0));
+    const bool random = state.range(1) != 0;
+    if (state.thread_index() == 0) {
+        engine = openEngine<Engine>(freshOptions(std::string(engineName<Engine>) + "_set"));
+    }
+    const std::string value = makeValue(valueBytes, state.thread_index());
+    const uint64_t base = static_cast<uint64_t>(state.thread_index()) << 20;
+    uint64_t i = 0;
+    for (auto _ : state) {
+        if (!engine->set(keyAt(base + i++, random), value)) {
+            state.SkipWithError("set failed");
+            break;
+        }
+    }
+    state.SetItemsProcessed(state.iterations());
+    state.SetBytesProcessed(state.iterations() * static_cast<int64_t>(valueBytes));
+    if (state.thread_index() == 0) {
+        engine.reset();
+    }
+}
+
+enum GetMode { Hot, Cold, Miss };
+
+// get at range(0) value bytes. Hot reads a 1% subset of the keys, Cold reads
+// uniformly over all of them and Miss reads keys that were never written.
+template <typename Engine>
+void BM_Get(benchmark::State& state) {
+    const size_t valueBytes = static_cast<size_t>(state.range(0));
+    const auto mode = static_cast<GetMode>(state.range(1));
+    const Engine& engine = loadedEngine<Engine>(valueBytes);
+    const size_t records = recordsFor(valueBytes);
+    const size_t span = mode == Hot ? std::max<size_t>(1, records / 100) : records;
+    const int offset = mode == Miss ? static_cast<int>(records) : 0;
+
+    std::mt19937 rng(state.thread_index() + 1);
+    std::uniform_int_distribution<size_t> pick(0, span - 1);
+    int64_t found = 0;
+    for (auto _ : state) {
+        ValueHandle handle = engine.get(offset + static_cast<int>(pick(rng)));
+        found += handle ? 1 : 0;
+        benchmark::DoNotOptimize(handle);
+    }
+    if (mode != Miss && found != state.iterations()) {
+        state.SkipWithError("get missed a loaded key");
+    }
+    state.SetItemsProcessed(state.iterations());
+    state.SetBytesProcessed(found * static_cast<int64_t>(valueBytes));
+}
+
+// multiGet of range(1) random keys at range(0) value bytes
+template <typename Engine>
+void BM_MultiGet(benchmark::State& state) {
+    const size_t valueBytes = static_cast<size_t>(state.range(0));
+    const size_t batchKeys = static_cast<size_t>(state.range(1));
+    const Engine& engine = loadedEngine<Engine>(valueBytes);
+    const size_t records = recordsFor(valueBytes);
+
+    std::mt19937 rng(state.thread_index() + 1);
+    std::uniform_int_distribution<size_t> pick(0, records - 1);
+    std::vector<int> keys(batchKeys);
+    for (auto _ : state) {
+        state.PauseTiming();
+        for (int& key : keys) {
+            key = static_cast<int>(pick(rng));
+        }
+        state.ResumeTiming();
+        std::vector<ValueHandle> values = engine.multiGet(keys);
+        benchmark::DoNotOptimize(values);
+    }
+    state.SetItemsProcessed(state.iterations() * static_cast<int64_t>(batchKeys));
+    state.SetBytesProcessed(state.iterations() * static_cast<int64_t>(batchKeys * valueBytes));
+}
+
+// getAsync of range(0) random 4 KiB values kept in flight at once, through
+// the backend range(1) (an AsyncIo). Sealed segments are read with pread
+// rather than mapped so that every get goes to the backend.
+void BM_GetAsync(benchmark::State& state) {
+    constexpr size_t valueBytes = 4096;
+    const size_t depth = static_cast<size_t>(state.range(0));
+    const auto backend = static_cast<AsyncIo>(state.range(1));
+    static std::map<AsyncIo, std::unique_ptr<StorageEngine<>>> engines;
+    auto& engine = engines[backend];
+    if (!engine) {
+        EngineOptions options = freshOptions(std::string("async_") + (backend == AsyncIo::IoUring ? "uring" : "blocking"));
+        options.sealedReadMode = SealedReadMode::Pread;
+        options.io.backend = backend;
+        options.io.queueDepth = 1024;
+        engine = std::make_unique<StorageEngine<>>(options);
+        const std::string value = makeValue(valueBytes, 1);
+        WriteBatch batch;
+        for (size_t i = 0; i < recordsFor(valueBytes); i++) {
+            batch.put(static_cast<int>(i), value);
+            if (batch.count() == 256) {
+                engine->write(batch);
+                batch.clear();
+            }
+        }
+        engine->write(batch);
+    }
+
+    std::mt19937 rng(1);
+    std::uniform_int_distribution<size_t> pick(0, recordsFor(valueBytes) - 1);
+    std::vector<int> keys(depth);
+    std::atomic<size_t> found{ 0 };
+    for (auto _ : state) {
+        state.PauseTiming();
+        for (int& key : keys) {
+            key = static_cast<int>(pick(rng));
+        }
+        state.ResumeTiming();
+        std::atomic<size_t> remaining{ depth };
+        engine->getAsync(keys, [&](size_t, ValueHandle handle) {
+            if (handle) found.fetch_add(1, std::memory_order_relaxed);
+            remaining.fetch_sub(1, std::memory_order_release);
+            remaining.notify_one();
+        });
+        for (size_t left = remaining.load(std::memory_order_acquire); left != 0;
+            left = remaining.load(std::memory_order_acquire)) {
+            remaining.wait(left, std::memory_order_acquire);
+        }
+    }
+    if (found != state.iterations() * depth) {
+        state.SkipWithError("getAsync missed a loaded key");
+    }
+    state.SetItemsProcessed(state.iterations() * static_cast<int64_t>(depth));
+    state.SetBytesProcessed(state.iterations() * static_cast<int64_t>(depth * valueBytes));
+    state.SetLabel(engine->ioBackend());
+}
+
+// scan over range(1) consecutive keys at range(0) value bytes
+template <typename Engine>
+void BM_Scan(benchmark::State& state) {
+    const size_t valueBytes = static_cast<size_t>(state.range(0));
+    const int rangeKeys = static_cast<int>(state.range(1));
+    const Engine& engine = loadedEngine<Engine>(valueBytes);
+    const int records = static_cast<int>(recordsFor(valueBytes));
+
+    std::mt19937 rng(state.thread_index() + 1);
+    std::uniform_int_distribution<int> pick(0, std::max(0, records - rangeKeys));
+    int64_t keys = 0;
+    for (auto _ : state) {
+        const int lo = pick(rng);
+        for (ScanIterator it = engine.scan(lo, lo + rangeKeys - 1); it.valid(); it.next()) {
+            benchmark::DoNotOptimize(it.value());
+            keys++;
+        }
+    }
+    state.SetItemsProcessed(keys);
+    state.SetBytesProcessed(keys * static_cast<int64_t>(valueBytes));
+}
+
+// Fills options' directory with `segments` sealed segments of about
+// options.segmentBytes each, writing `distinct` keys over and over
+uint64_t writeSegments(const EngineOptions& options, int64_t segments, int distinct) {
+    StorageEngine engine(options);
+    const std::string value = makeValue(256, 7);
+    const uint64_t records = static_cast<uint64_t>(segments) * options.segmentBytes / (value.size() + 16);
+    WriteBatch batch;
+    for (uint64_t i = 0; i < records; i++) {
+        batch.put(static_cast<int>(i % distinct), value);
+        if (batch.count() == 1024 || i + 1 == records) {
+            engine.write(batch);
+            batch.clear();
+        }
+    }
+    return records * value.size();
+}
+
+// Opening an engine over range(0) segments of range(1) bytes. range(2) != 0
+// keeps the hint files; without them every segment is scanned in full.
+void BM_Recovery(benchmark::State& state) {
+    EngineOptions options = freshOptions("recovery");
+    options.segmentBytes = static_cast<uint64_t>(state.range(1));
+    options.preallocate = false;
+    const bool hints = state.range(2) != 0;
+    const uint64_t bytes = writeSegments(options, state.range(0), 1 << 20);
+
+    for (auto _ : state) {
+        if (!hints) {
+            for (const auto& entry : std::filesystem::directory_iterator(options.directory)) {
+                if (entry.path().extension() == ".hint") {
+                    std::filesystem::remove(entry.path());
+                }
+            }
+        }
+        auto start = std::chrono::steady_clock::now();
+        auto engine = std::make_unique<StorageEngine<>>(options);
+        state.SetIterationTime(std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - start).count());
+        engine.reset();
+    }
+    state.SetBytesProcessed(state.iterations() * static_cast<int64_t>(bytes));
+    state.counters["segments"] = static_cast<double>(state.range(0));
+}
+
+// merge() over range(0) sealed segments of 4 MiB in which each key was
+// written range(1) times, so all but 1 / range(1) of the input is dropped
+void BM_Compaction(benchmark::State& state) {
+    const int64_t segments = state.range(0);
+    const int64_t overwrites = state.range(1);
+    EngineOptions options = freshOptions("compaction");
+    options.segmentBytes = 4 << 20;
+    options.preallocate = false;
+    options.merge.bytesPerSecond = 0;
+    const uint64_t records = static_cast<uint64_t>(segments) * options.segmentBytes / (256 + 16);
+    const int distinct = static_cast<int>(std::max<uint64_t>(1, records / overwrites));
+
+    uint64_t bytes = 0;
+    for (auto _ : state) {
+        std::error_code ec;
+        std::filesystem::remove_all(options.directory, ec);
+        bytes += writeSegments(options, segments, distinct);
+        StorageEngine engine(options);
+        auto start = std::chrono::steady_clock::now();
+        if (!engine.merge()) {
+            state.SkipWithError("merge failed");
+            break;
+        }
+        state.SetIterationTime(std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - start).count());
+    }
+    state.SetBytesProcessed(static_cast<int64_t>(bytes));
+}
+
+// Value sizes by thread counts, each for sequential and random keys
+void setArguments(benchmark::internal::Benchmark* b) {
+    b->ArgNames({ "value", "random" })->ArgsProduct({ { 16, 256, 4096 }, { 0, 1 } });
+    b->Threads(1)->Threads(4)->UseRealTime();
+}
+
+void getArguments(benchmark::internal::Benchmark* b) {
+    b->ArgNames({ "value", "mode" })->ArgsProduct({ { 16, 256, 4096 }, { Hot, Cold, Miss } });
+    b->Threads(1)->Threads(4)->UseRealTime();
+}
+
+}
+
+BENCHMARK_TEMPLATE(BM_Set, StorageEngine<>)->Apply(setArguments);
+BENCHMARK_TEMPLATE(BM_Set, ShardedStorageEngine<>)->Apply(setArguments);
+BENCHMARK_TEMPLATE(BM_Set, LsmStorageEngine)->Apply(setArguments);
+
+BENCHMARK_TEMPLATE(BM_Get, StorageEngine<>)->Apply(getArguments);
+BENCHMARK_TEMPLATE(BM_Get, ShardedStorageEngine<>)->Apply(getArguments);
+BENCHMARK_TEMPLATE(BM_Get, LsmStorageEngine)->Apply(getArguments);
+
+BENCHMARK_TEMPLATE(BM_MultiGet, StorageEngine<>)
+    ->ArgNames({ "value", "batch" })->ArgsProduct({ { 256 }, { 16, 256 } })->Threads(1)->Threads(4)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_MultiGet, ShardedStorageEngine<>)
+    ->ArgNames({ "value", "batch" })->ArgsProduct({ { 256 }, { 16, 256 } })->Threads(1)->Threads(4)->UseRealTime();
+
+BENCHMARK(BM_GetAsync)
+    ->ArgNames({ "depth", "backend" })
+    ->ArgsProduct({ { 1, 32, 512 }, { static_cast<int64_t>(AsyncIo::Blocking), static_cast<int64_t>(AsyncIo::IoUring) } })
+    ->UseRealTime();
+
+BENCHMARK_TEMPLATE(BM_Scan, StorageEngine<>)->ArgNames({ "value", "keys" })->ArgsProduct({ { 256 }, { 100, 10000 } });
+BENCHMARK_TEMPLATE(BM_Scan, LsmStorageEngine)->ArgNames({ "value", "keys" })->ArgsProduct({ { 256 }, { 100, 10000 } });
+
+BENCHMARK(BM_Recovery)
+    ->ArgNames({ "segments", "bytes", "hints" })
+    ->ArgsProduct({ { 4, 32 }, { 1 << 20, 16 << 20 }, { 0, 1 } })
+    ->UseManualTime()->Unit(benchmark::kMillisecond);
+
+BENCHMARK(BM_Compaction)
+    ->ArgNames({ "segments", "overwrites" })
+    ->ArgsProduct({ { 4, 16 }, { 1, 8 } })
+    ->UseManualTime()->Iterations(3)->Unit(benchmark::kMillisecond);
+
+BENCHMARK_MAIN();
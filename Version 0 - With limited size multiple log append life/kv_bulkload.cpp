@@ -0,0 +1,420 @@
+#include "kvstore.h"
+
+// Offline bulk loader. Reads key/value input, keeps the last record of every
+// key, and writes the result as sealed segments with hint files, the way a
+// merge writes its output: large sequential writes, no per-record flush and
+// no log replay when the segments are opened. Point an engine at the output
+// prefix, or hand the files to StorageEngine::ingest (--into does that).
+//
+// Input is CSV ("key,value" lines, the value running to the end of the line)
+// or binary (repeated uint32 key size, uint32 value size, key bytes, value
+// bytes, all little-endian; an int key is its four bytes). Files are mapped,
+// parsed in parallel chunks and split by key hash into partitions, which are
+// deduplicated and written in parallel. Keys of different partitions differ,
+// so segments never shadow each other and need no particular order. One
+// entry per input record is kept in memory; values stay in the mapping.
+//
+// Usage: kv_bulkload [options] --out <dir>/<name> <input>...
+//   --format csv|binary          (csv)
+//   --keys int|string            (int)
+//   --segment-bytes <bytes>      segments are cut before exceeding this (64 MiB)
+//   --threads <n>                (hardware concurrency)
+//   --compression none|lz4|zstd  (none)
+//   --into <dir>/<name>          ingest the segments into the engine there
+
+namespace {
+
+struct LoadOptions {
+    std::string out;
+    std::string into;
+    std::vector<std::string> inputs;
+    bool binary = false;
+    bool stringKeys = false;
+    uint64_t segmentBytes = 64 << 20;
+    size_t threads = std::max(1u, std::thread::hardware_concurrency());
+    CompressionOptions compression;
+};
+
+// Read-only mapping of a whole input file
+class MappedFile {
+    const char* base = nullptr;
+    size_t length = 0;
+    bool opened = false;
+
+public:
+    explicit MappedFile(const std::string& path) {
+        const int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            log(LogLevel::Error, "Cannot open " + path + ": " + std::strerror(errno));
+            return;
+        }
+        struct stat st;
+        if (::fstat(fd, &st) == 0) {
+            opened = st.st_size == 0;
+            void* region = opened ? MAP_FAILED : ::mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (region != MAP_FAILED) {
+                ::madvise(region, st.st_size, MADV_SEQUENTIAL);
+                base = static_cast<const char*>(region);
+                length = st.st_size;
+                opened = true;
+            }
+            else if (!opened) {
+                log(LogLevel::Error, "Cannot map " + path + ": " + std::strerror(errno));
+            }
+        }
+        ::close(fd);
+    }
+
+    ~MappedFile() {
+        if (base != nullptr) {
+            ::munmap(const_cast<char*>(base), length);
+        }
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    // Whether the file could be read, which an empty one can
+    bool ok() const {
+        return opened;
+    }
+
+    const char* data() const {
+        return base;
+    }
+
+    size_t size() const {
+        return length;
+    }
+};
+
+// Loads input into segments for StorageEngine<Key>
+template <typename Key>
+class BulkLoader {
+    using KeyCodec = CodecFor<Key>;
+    using Codec = DefaultCodec<Key, std::string>;
+    // Keys are looked at where they sit in the mapped input until written
+    using KeyRef = std::conditional_t<std::is_same_v<Key, std::string>, std::string_view, Key>;
+
+    struct Record {
+        KeyRef key;
+        std::string_view value;
+    };
+
+    // Records of one parse task, by partition, in input order
+    using Buckets = std::vector<std::vector<Record>>;
+
+    // A contiguous part of one input, parsed by one task
+    struct Chunk {
+        const MappedFile* file;
+        size_t begin;
+        size_t end;
+    };
+
+    const LoadOptions& options;
+    std::vector<std::unique_ptr<MappedFile>> files;
+    std::atomic<uint64_t> rejected{ 0 };
+    std::atomic<size_t> nextId{ 0 };
+    CompressionCounters counters;
+    std::mutex pathsMutex;
+    std::vector<std::pair<size_t, std::string>> written;
+
+    size_t partitionOf(const KeyRef& key) const {
+        const uint64_t h = KeyCodec::hash(key) * 0x9E3779B97F4A7C15ull;
+        return static_cast<size_t>((h >> 32) * options.threads >> 32);
+    }
+
+    void add(Buckets& buckets, std::string_view keyBytes, std::string_view value) {
+        KeyRef key{};
+        bool valid = Codec::fits(keyBytes, value);
+        if constexpr (std::is_same_v<Key, std::string>) {
+            key = keyBytes;
+        }
+        else if (options.binary) {
+            valid = valid && KeyCodec::decode(keyBytes, key);
+        }
+        else {
+            const auto parsed = std::from_chars(keyBytes.data(), keyBytes.data() + keyBytes.size(), key);
+            valid = valid && parsed.ec == std::errc() && parsed.ptr == keyBytes.data() + keyBytes.size() &&
+                !keyBytes.empty();
+        }
+        if (!valid) {
+            rejected.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        buckets[partitionOf(key)].push_back({ key, value });
+    }
+
+    void parseCsv(const Chunk& chunk, Buckets& buckets) {
+        const char* data = chunk.file->data();
+        size_t position = chunk.begin;
+        while (position < chunk.end) {
+            const void* newline = std::memchr(data + position, '\n', chunk.end - position);
+            const size_t lineEnd = newline != nullptr ? static_cast<const char*>(newline) - data : chunk.end;
+            std::string_view line(data + position, lineEnd - position);
+            position = lineEnd + 1;
+            if (!line.empty() && line.back() == '\r') line.remove_suffix(1);
+            if (line.empty()) continue;
+            const size_t comma = line.find(',');
+            if (comma == std::string_view::npos) {
+                rejected.fetch_add(1, std::memory_order_relaxed);
+                continue;
+            }
+            add(buckets, line.substr(0, comma), line.substr(comma + 1));
+        }
+    }
+
+    void parseBinary(const Chunk& chunk, Buckets& buckets) {
+        const char* data = chunk.file->data();
+        size_t position = chunk.begin;
+        while (position < chunk.end) {
+            uint32_t sizes[2];
+            if (chunk.end - position < sizeof(sizes)) break;
+            std::memcpy(sizes, data + position, sizeof(sizes));
+            position += sizeof(sizes);
+            if (chunk.end - position < static_cast<uint64_t>(sizes[0]) + sizes[1]) break;
+            add(buckets, { data + position, sizes[0] }, { data + position + sizes[0], sizes[1] });
+            position += static_cast<size_t>(sizes[0]) + sizes[1];
+        }
+        if (position != chunk.end) {
+            log(LogLevel::Warning, "Truncated record at the end of a binary input");
+            rejected.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    // CSV inputs are cut at line ends into a few chunks per thread; a binary
+    // input can only be read from its start, so it is one chunk
+    std::vector<Chunk> chunks() const {
+        std::vector<Chunk> list;
+        for (const auto& file : files) {
+            const size_t size = file->size();
+            if (options.binary) {
+                list.push_back({ file.get(), 0, size });
+                continue;
+            }
+            const size_t target = std::max<size_t>(4 << 20, size / (4 * options.threads) + 1);
+            size_t begin = 0;
+            while (begin < size) {
+                size_t end = std::min(size, begin + target);
+                if (end < size) {
+                    const void* newline = std::memchr(file->data() + end, '\n', size - end);
+                    end = newline != nullptr ? static_cast<const char*>(newline) - file->data() + 1 : size;
+                }
+                list.push_back({ file.get(), begin, end });
+                begin = end;
+            }
+        }
+        return list;
+    }
+
+    // Sorts a partition by key, keeping input order among records of one key,
+    // and drops all but the last record of every key. Sorted input is left
+    // as it is.
+    static void dedupe(std::vector<Record>& records) {
+        auto byKey = [](const Record& a, const Record& b) {
+            return a.key < b.key;
+        };
+        if (!std::is_sorted(records.begin(), records.end(), byKey)) {
+            std::stable_sort(records.begin(), records.end(), byKey);
+        }
+        size_t kept = 0;
+        for (size_t i = 0; i < records.size(); i++) {
+            if (i + 1 < records.size() && records[i + 1].key == records[i].key) continue;
+            records[kept++] = records[i];
+        }
+        records.resize(kept);
+    }
+
+    // Writes records as segments of at most segmentBytes each
+    bool write(const std::vector<Record>& records) {
+        std::unique_ptr<Store<KeyCodec>> store;
+        std::string buffer;
+        std::vector<std::pair<KeyRef, uint32_t>> pending;
+        std::vector<uint8_t> flags;
+        std::string stored;
+        bool ok = true;
+
+        auto flush = [&] {
+            ok = ok && store->append(buffer.data(), buffer.size());
+            for (size_t i = 0; i < pending.size(); i++) {
+                store->index(Key(pending[i].first), pending[i].second, flags[i]);
+            }
+            buffer.clear();
+            pending.clear();
+            flags.clear();
+        };
+        auto finish = [&] {
+            flush();
+            ok = ok && store->sync();
+            store->seal(SealedReadMode::Pread, AccessPattern::Sequential);
+            std::lock_guard<std::mutex> lock(pathsMutex);
+            written.emplace_back(store->id(), store->path());
+            store.reset();
+        };
+
+        for (const Record& record : records) {
+            stored.clear();
+            const bool compressed = compressCounted(options.compression, record.value, stored, counters);
+            const std::string_view value = compressed ? std::string_view(stored) : record.value;
+            const std::string_view key = KeyCodec::view(record.key);
+            const uint64_t bytes = sizeof(RecordHeader) + key.size() + value.size();
+            if (store != nullptr && store->getTotalBytes() + buffer.size() + bytes > options.segmentBytes) {
+                finish();
+            }
+            if (store == nullptr) {
+                const size_t id = ++nextId;
+                store = std::make_unique<Store<KeyCodec>>(options.out + "_" + std::to_string(id) + ".txt", id);
+            }
+            flags.push_back(compressed ? RECORD_FLAG_COMPRESSED : 0);
+            pending.emplace_back(record.key, static_cast<uint32_t>(encodeRecord(buffer, key, value, flags.back())));
+            if (buffer.size() >= (8u << 20)) {
+                flush();
+            }
+            if (!ok) break;
+        }
+        if (store != nullptr) {
+            finish();
+        }
+        return ok;
+    }
+
+public:
+    explicit BulkLoader(const LoadOptions& options) : options(options) {}
+
+    // Paths of the segments written, in file id order, or empty on failure
+    std::vector<std::string> run() {
+        for (const std::string& input : options.inputs) {
+            files.push_back(std::make_unique<MappedFile>(input));
+            if (!files.back()->ok()) return {};
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        const std::vector<Chunk> parts = chunks();
+        std::vector<Buckets> parsed(parts.size(), Buckets(options.threads));
+        parallelFor(parts.size(), [&](size_t i) {
+            if (options.binary) {
+                parseBinary(parts[i], parsed[i]);
+            }
+            else {
+                parseCsv(parts[i], parsed[i]);
+            }
+        });
+
+        std::atomic<uint64_t> inputRecords{ 0 };
+        std::atomic<uint64_t> keys{ 0 };
+        std::atomic<bool> ok{ true };
+        parallelFor(options.threads, [&](size_t partition) {
+            // Chunks are in input order, so the last record of a key is the
+            // newest
+            std::vector<Record> records;
+            size_t total = 0;
+            for (const Buckets& buckets : parsed) {
+                total += buckets[partition].size();
+            }
+            records.reserve(total);
+            for (Buckets& buckets : parsed) {
+                records.insert(records.end(), buckets[partition].begin(), buckets[partition].end());
+                std::vector<Record>().swap(buckets[partition]);
+            }
+            inputRecords += records.size();
+            dedupe(records);
+            keys += records.size();
+            if (!write(records)) {
+                ok = false;
+            }
+        });
+        std::sort(written.begin(), written.end());
+        std::vector<std::string> paths;
+        uint64_t bytes = 0;
+        for (const auto& [id, path] : written) {
+            paths.push_back(path);
+            bytes += std::filesystem::file_size(path);
+        }
+
+        const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::cout << "records: " << inputRecords.load() << " read, " << keys.load() << " keys written, "
+                  << rejected.load() << " rejected\n";
+        std::cout << "segments: " << paths.size() << ", " << bytes / (1 << 20) << " MiB in " << seconds << " s ("
+                  << (seconds > 0 ? bytes / seconds / (1 << 20) : 0) << " MiB/s)\n";
+        if (!ok) {
+            log(LogLevel::Error, "Failed to write the segments of " + options.out);
+            return {};
+        }
+        return paths;
+    }
+};
+
+template <typename Key>
+int load(const LoadOptions& options) {
+    const std::vector<std::string> paths = BulkLoader<Key>(options).run();
+    if (paths.empty()) return 1;
+    if (!options.into.empty()) {
+        StorageEngine<Key> engine(EngineOptions::fromPrefix(options.into));
+        if (!engine.ingest(paths)) return 1;
+        std::cout << "ingested into " << options.into << "\n";
+    }
+    return 0;
+}
+
+int usage() {
+    std::cerr << "usage: kv_bulkload [--format csv|binary] [--keys int|string] [--segment-bytes N]\n"
+                 "                   [--threads N] [--compression none|lz4|zstd] [--into PREFIX]\n"
+                 "                   --out PREFIX INPUT...\n";
+    return 2;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    LoadOptions options;
+    for (int i = 1; i < argc; i++) {
+        const std::string arg = argv[i];
+        const bool hasValue = i + 1 < argc;
+        if (arg == "--out" && hasValue) {
+            options.out = argv[++i];
+        }
+        else if (arg == "--into" && hasValue) {
+            options.into = argv[++i];
+        }
+        else if (arg == "--format" && hasValue) {
+            const std::string format = argv[++i];
+            if (format != "csv" && format != "binary") return usage();
+            options.binary = format == "binary";
+        }
+        else if (arg == "--keys" && hasValue) {
+            const std::string keys = argv[++i];
+            if (keys != "int" && keys != "string") return usage();
+            options.stringKeys = keys == "string";
+        }
+        else if (arg == "--segment-bytes" && hasValue) {
+            options.segmentBytes = std::stoull(argv[++i]);
+        }
+        else if (arg == "--threads" && hasValue) {
+            options.threads = std::max<size_t>(1, std::stoul(argv[++i]));
+        }
+        else if (arg == "--compression" && hasValue) {
+            const std::string codec = argv[++i];
+            if (codec == "none") options.compression.codec = Compression::None;
+            else if (codec == "lz4") options.compression.codec = Compression::LZ4;
+            else if (codec == "zstd") options.compression.codec = Compression::Zstd;
+            else return usage();
+        }
+        else if (!arg.empty() && arg[0] != '-') {
+            options.inputs.push_back(arg);
+        }
+        else {
+            return usage();
+        }
+    }
+    if (options.out.empty() || options.inputs.empty()) return usage();
+
+    // Segments already under the output prefix would be mixed with these
+    const EngineOptions out = EngineOptions::fromPrefix(options.out);
+    std::error_code ec;
+    std::filesystem::create_directories(out.directory, ec);
+    if (!discoverFiles(options.out, ".txt").empty()) {
+        std::cerr << "kv_bulkload: " << options.out << " already has segments\n";
+        return 1;
+    }
+    return options.stringKeys ? load<std::string>(options) : load<int>(options);
+}
@@ -0,0 +1,719 @@
+#include "kvstore.h"
+
+#include <cmath>
+
+// YCSB-style load generator. Loads `--records` keys, then drives the hash
+// engine or the sharded front end from many client threads with one of the
+// YCSB core workloads (or a custom mix) and reports throughput and latency
+// percentiles per operation.
+//
+// Closed loop (the default) issues each thread's next operation as soon as
+// the previous one returns. Open loop (--rate) schedules operations at a
+// fixed overall rate instead, and response times count from when an
+// operation was due rather than when it started, so a stall also charges
+// the operations that queued up behind it (coordinated omission). Service
+// times, from the actual start, are reported next to them.
+//
+// --trace-out writes every operation issued as a trace, one line each:
+//
+//   <microseconds since start> get|set|remove|scan|rmw <key> [<value bytes>|<scan length>]
+//
+// and --replay issues such a trace instead of a workload, at the recorded
+// pace times --speed (0: back to back). Operations are spread over the
+// threads by key, so those of one key stay in order.
+//
+// The directory is emptied and loaded first, unless --skip-load reuses
+// what is there.
+//
+// Workloads (keys are zipfian unless noted):
+//   a  50% read, 50% update         d  95% read, 5% insert, latest keys
+//   b  95% read, 5% update          e  95% scan, 5% insert
+//   c  100% read                    f  50% read, 50% read-modify-write
+
+namespace {
+
+enum class OpType { Read, Update, Insert, Scan, ReadModifyWrite, Remove };
+constexpr size_t OP_TYPES = 6;
+
+const char* opName(OpType type) {
+    static const char* const names[] = { "read", "update", "insert", "scan", "rmw", "remove" };
+    return names[static_cast<size_t>(type)];
+}
+
+// Trace name of an operation; updates and inserts are both sets
+const char* traceName(OpType type) {
+    static const char* const names[] = { "get", "set", "set", "scan", "rmw", "remove" };
+    return names[static_cast<size_t>(type)];
+}
+
+enum class KeyDistribution { Uniform, Zipfian, Latest };
+
+struct Mix {
+    std::array<double, OP_TYPES> proportions{};
+    KeyDistribution keys = KeyDistribution::Zipfian;
+};
+
+struct LoadgenOptions {
+    char workload = 'a';
+    std::optional<Mix> customMix;
+    std::optional<KeyDistribution> distribution;
+    bool sharded = false;
+    size_t shards = 4;
+    size_t threads = 8;
+    uint64_t records = 100000;
+    uint64_t operations = 1000000;
+    double seconds = 0;            // runs for this long instead of `operations` when set
+    double rate = 0;               // operations per second over all threads, 0 for closed loop
+    size_t valueMin = 100;
+    size_t valueMax = 100;
+    bool zipfianValues = false;
+    double theta = 0.99;
+    size_t scanLength = 100;
+    bool skipLoad = false;
+    std::string traceOut;
+    std::string replay;
+    double speed = 1.0;
+    uint64_t seed = 1;
+    EngineOptions engine;
+};
+
+Mix workloadMix(char workload) {
+    Mix mix;
+    auto set = [&](OpType type, double share) {
+        mix.proportions[static_cast<size_t>(type)] = share;
+    };
+    switch (workload) {
+    case 'a': set(OpType::Read, 0.5); set(OpType::Update, 0.5); break;
+    case 'b': set(OpType::Read, 0.95); set(OpType::Update, 0.05); break;
+    case 'c': set(OpType::Read, 1.0); break;
+    case 'd': set(OpType::Read, 0.95); set(OpType::Insert, 0.05); mix.keys = KeyDistribution::Latest; break;
+    case 'e': set(OpType::Scan, 0.95); set(OpType::Insert, 0.05); break;
+    case 'f': set(OpType::Read, 0.5); set(OpType::ReadModifyWrite, 0.5); break;
+    }
+    return mix;
+}
+
+// Zipfian ranks in [0, items) as YCSB draws them (Gray et al., "Quickly
+// generating billion-record synthetic databases"), rank 0 the most popular.
+// The item count may grow between calls, as inserts add keys; zeta is then
+// extended by the new items only.
+class ZipfianGenerator {
+    double theta;
+    double alpha;
+    double zeta2;
+    uint64_t zetaItems = 0;
+    double zetaN = 0;
+    double eta = 0;
+
+    void extend(uint64_t items) {
+        for (uint64_t i = zetaItems; i < items; i++) {
+            zetaN += 1.0 / std::pow(static_cast<double>(i + 1), theta);
+        }
+        zetaItems = items;
+        eta = (1 - std::pow(2.0 / items, 1 - theta)) / (1 - zeta2 / zetaN);
+    }
+
+public:
+    ZipfianGenerator(uint64_t items, double theta)
+        : theta(theta), alpha(1 / (1 - theta)), zeta2(1 + std::pow(0.5, theta)) {
+        extend(std::max<uint64_t>(items, 2));
+    }
+
+    uint64_t next(std::mt19937_64& rng, uint64_t items) {
+        if (items > zetaItems) extend(items);
+        const double u = std::uniform_real_distribution<double>(0, 1)(rng);
+        const double uz = u * zetaN;
+        if (uz < 1) return 0;
+        if (uz < zeta2) return 1;
+        const uint64_t rank = static_cast<uint64_t>(items * std::pow(eta * u - eta + 1, alpha));
+        return std::min(rank, items - 1);
+    }
+};
+
+// Spreads zipfian ranks over the key space, so the popular keys are not
+// also neighbours
+uint64_t scramble(uint64_t rank) {
+    uint64_t h = 0xCBF29CE484222325ull;
+    for (int i = 0; i < 8; i++, rank >>= 8) {
+        h = (h ^ (rank & 0xFF)) * 0x100000001B3ull;
+    }
+    return h;
+}
+
+void record(LatencyStats& stats, uint64_t nanos) {
+    stats.count++;
+    stats.totalNanos += nanos;
+    stats.maxNanos = std::max(stats.maxNanos, nanos);
+    stats.buckets[LatencyBuckets::index(nanos)]++;
+}
+
+// One operation of a trace
+struct TraceOp {
+    uint64_t micros;
+    OpType type;
+    int key;
+    uint32_t argument;  // value bytes of a set, length of a scan
+};
+
+bool parseTraceLine(const std::string& line, TraceOp& op) {
+    char name[16];
+    unsigned long long micros;
+    long long key;
+    unsigned argument = 0;
+    const int fields = std::sscanf(line.c_str(), "%llu %15s %lld %u", &micros, name, &key, &argument);
+    if (fields < 3 || key < INT_MIN || key > INT_MAX) return false;
+    const std::string_view type(name);
+    if (type == "get") op.type = OpType::Read;
+    else if (type == "set") op.type = OpType::Update;
+    else if (type == "remove") op.type = OpType::Remove;
+    else if (type == "scan") op.type = OpType::Scan;
+    else if (type == "rmw") op.type = OpType::ReadModifyWrite;
+    else return false;
+    if ((op.type == OpType::Update || op.type == OpType::Scan) && fields < 4) return false;
+    op.micros = micros;
+    op.key = static_cast<int>(key);
+    op.argument = argument;
+    return true;
+}
+
+// Per-thread results
+struct ThreadResult {
+    std::array<LatencyStats, OP_TYPES> service;
+    std::array<LatencyStats, OP_TYPES> response;
+    uint64_t notFound = 0;
+    uint64_t failed = 0;
+    std::vector<TraceOp> trace;
+};
+
+template <typename Engine>
+class LoadGenerator {
+    using Clock = std::chrono::steady_clock;
+
+    const LoadgenOptions& options;
+    Engine& engine;
+    Mix mix;
+    // Random text that values are cut from
+    std::string valueSource;
+    // Keys [0, inserted) exist; inserts take the next one
+    std::atomic<uint64_t> inserted;
+    std::atomic<uint64_t> nextInsert;
+    std::vector<ThreadResult> results;
+
+    std::string_view valueOf(std::mt19937_64& rng, size_t size) const {
+        const size_t offset = std::uniform_int_distribution<size_t>(0, valueSource.size() - size)(rng);
+        return std::string_view(valueSource).substr(offset, size);
+    }
+
+    size_t valueSize(std::mt19937_64& rng, ZipfianGenerator& sizes) const {
+        if (options.valueMin == options.valueMax) return options.valueMin;
+        const uint64_t span = options.valueMax - options.valueMin + 1;
+        if (options.zipfianValues) return options.valueMin + sizes.next(rng, span);
+        return options.valueMin + std::uniform_int_distribution<uint64_t>(0, span - 1)(rng);
+    }
+
+    int chooseKey(std::mt19937_64& rng, ZipfianGenerator& zipf) const {
+        const uint64_t items = std::max<uint64_t>(1, inserted.load(std::memory_order_relaxed));
+        switch (mix.keys) {
+        case KeyDistribution::Uniform:
+            return static_cast<int>(std::uniform_int_distribution<uint64_t>(0, items - 1)(rng));
+        case KeyDistribution::Zipfian:
+            return static_cast<int>(scramble(zipf.next(rng, items)) % items);
+        case KeyDistribution::Latest:
+            return static_cast<int>(items - 1 - zipf.next(rng, items));
+        }
+        return 0;
+    }
+
+    OpType chooseOp(std::mt19937_64& rng) const {
+        double u = std::uniform_real_distribution<double>(0, 1)(rng);
+        for (size_t i = 0; i < OP_TYPES; i++) {
+            u -= mix.proportions[i];
+            if (u < 0) return static_cast<OpType>(i);
+        }
+        return OpType::Read;
+    }
+
+    // Runs one operation; false when the engine reported a failure
+    bool execute(const TraceOp& op, std::string& buffer, std::mt19937_64& rng, ThreadResult& result) {
+        switch (op.type) {
+        case OpType::Read:
+            if (!engine.get(op.key, buffer)) result.notFound++;
+            return true;
+        case OpType::Update:
+        case OpType::Insert:
+            return engine.set(op.key, valueOf(rng, op.argument));
+        case OpType::Remove:
+            return engine.remove(op.key);
+        case OpType::Scan: {
+            const int last = static_cast<int>(std::min<int64_t>(INT_MAX, int64_t(op.key) + op.argument - 1));
+            size_t seen = 0;
+            for (auto it = engine.scan(op.key, last); it.valid() && seen < op.argument; it.next()) {
+                seen++;
+            }
+            return true;
+        }
+        case OpType::ReadModifyWrite:
+            if (!engine.get(op.key, buffer)) {
+                result.notFound++;
+                buffer.clear();
+            }
+            // The same size back, with the first bytes changed
+            buffer.resize(op.argument);
+            std::memcpy(buffer.data(), valueOf(rng, std::min<size_t>(8, op.argument)).data(),
+                std::min<size_t>(8, op.argument));
+            return engine.set(op.key, buffer);
+        }
+        return false;
+    }
+
+    void measure(const TraceOp& op, Clock::time_point due, std::string& buffer, std::mt19937_64& rng,
+        ThreadResult& result, Clock::time_point start) {
+        // Timer wakeups run late by tens of microseconds, which would be
+        // charged as queueing; the last stretch is waited out yielding
+        constexpr auto SLACK = std::chrono::microseconds(200);
+        if (due - Clock::now() > SLACK) {
+            std::this_thread::sleep_until(due - SLACK);
+        }
+        while (Clock::now() < due) {
+            std::this_thread::yield();
+        }
+        const Clock::time_point begin = Clock::now();
+        const bool ok = execute(op, buffer, rng, result);
+        const Clock::time_point end = Clock::now();
+        const size_t type = static_cast<size_t>(op.type);
+        if (!ok) result.failed++;
+        record(result.service[type], std::chrono::duration_cast<std::chrono::nanoseconds>(end - begin).count());
+        record(result.response[type], std::chrono::duration_cast<std::chrono::nanoseconds>(
+            end - std::min(due, begin)).count());
+        if (!options.traceOut.empty()) {
+            TraceOp traced = op;
+            traced.micros = std::chrono::duration_cast<std::chrono::microseconds>(std::min(due, begin) - start).count();
+            result.trace.push_back(traced);
+        }
+    }
+
+    // Closed loop ops are due when they start; open loop ones every
+    // threads/rate seconds, thread t offset by t/rate
+    void runWorkload(size_t thread, Clock::time_point start, const ZipfianGenerator& zipfian) {
+        ThreadResult& result = results[thread];
+        std::mt19937_64 rng(options.seed * 0x9E3779B97F4A7C15ull + thread);
+        ZipfianGenerator zipf = zipfian;
+        ZipfianGenerator sizes(options.valueMax - options.valueMin + 1, options.theta);
+        std::string buffer;
+        const uint64_t quota = options.operations / options.threads + (thread < options.operations % options.threads);
+        const double interval = options.rate > 0 ? options.threads / options.rate : 0;
+        const Clock::time_point deadline = start + std::chrono::duration_cast<Clock::duration>(
+            std::chrono::duration<double>(options.seconds));
+
+        for (uint64_t i = 0; options.seconds > 0 || i < quota; i++) {
+            Clock::time_point due = Clock::now();
+            if (interval > 0) {
+                due = start + std::chrono::duration_cast<Clock::duration>(
+                    std::chrono::duration<double>((i + double(thread) / options.threads) * interval));
+            }
+            if (options.seconds > 0 && std::max(due, Clock::now()) >= deadline) break;
+
+            TraceOp op{ 0, chooseOp(rng), 0, 0 };
+            switch (op.type) {
+            case OpType::Insert:
+                op.key = static_cast<int>(nextInsert++);
+                op.argument = static_cast<uint32_t>(valueSize(rng, sizes));
+                break;
+            case OpType::Scan:
+                op.key = chooseKey(rng, zipf);
+                op.argument = static_cast<uint32_t>(std::uniform_int_distribution<size_t>(1, options.scanLength)(rng));
+                break;
+            default:
+                op.key = chooseKey(rng, zipf);
+                op.argument = static_cast<uint32_t>(valueSize(rng, sizes));
+                break;
+            }
+            measure(op, due, buffer, rng, result, start);
+            if (op.type == OpType::Insert) {
+                // Approximate with many inserters: a key may become readable
+                // just before an older insert completes
+                uint64_t seen = inserted.load();
+                while (seen < uint64_t(op.key) + 1 && !inserted.compare_exchange_weak(seen, op.key + 1)) {}
+            }
+        }
+    }
+
+    void runTrace(size_t thread, Clock::time_point start, const std::vector<TraceOp>& ops) {
+        ThreadResult& result = results[thread];
+        std::mt19937_64 rng(options.seed * 0x9E3779B97F4A7C15ull + thread);
+        std::string buffer;
+        for (const TraceOp& op : ops) {
+            Clock::time_point due = Clock::now();
+            if (options.speed > 0) {
+                due = start + std::chrono::duration_cast<Clock::duration>(
+                    std::chrono::duration<double>(op.micros / 1e6 / options.speed));
+            }
+            measure(op, due, buffer, rng, result, start);
+        }
+    }
+
+    void load() {
+        std::atomic<uint64_t> next{ 0 };
+        constexpr uint64_t BATCH = 1000;
+        std::vector<std::thread> loaders;
+        for (size_t t = 0; t < options.threads; t++) {
+            loaders.emplace_back([&, t] {
+                std::mt19937_64 local(options.seed + t);
+                ZipfianGenerator sizes(options.valueMax - options.valueMin + 1, options.theta);
+                WriteBatch batch;
+                for (uint64_t first = next.fetch_add(BATCH); first < options.records; first = next.fetch_add(BATCH)) {
+                    batch.clear();
+                    for (uint64_t key = first; key < std::min(first + BATCH, options.records); key++) {
+                        batch.put(static_cast<int>(key), valueOf(local, valueSize(local, sizes)));
+                    }
+                    engine.write(batch);
+                }
+            });
+        }
+        for (auto& loader : loaders) {
+            loader.join();
+        }
+    }
+
+    static void printTable(const char* title, const std::array<LatencyStats, OP_TYPES>& stats, double seconds) {
+        std::printf("%s (us)\n", title);
+        std::printf("  %-7s %10s %10s %9s %9s %9s %9s %9s %9s\n", "op", "count", "ops/s", "mean", "p50", "p90",
+            "p99", "p99.9", "max");
+        for (size_t i = 0; i < OP_TYPES; i++) {
+            const LatencyStats& s = stats[i];
+            if (s.count == 0) continue;
+            std::printf("  %-7s %10llu %10.0f %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f\n", opName(static_cast<OpType>(i)),
+                static_cast<unsigned long long>(s.count), s.count / seconds, s.meanNanos() / 1e3,
+                s.quantileNanos(0.5) / 1e3, s.quantileNanos(0.9) / 1e3, s.quantileNanos(0.99) / 1e3,
+                s.quantileNanos(0.999) / 1e3, s.maxNanos / 1e3);
+        }
+    }
+
+    void writeTrace() const {
+        std::vector<TraceOp> all;
+        for (const auto& result : results) {
+            all.insert(all.end(), result.trace.begin(), result.trace.end());
+        }
+        std::stable_sort(all.begin(), all.end(), [](const TraceOp& a, const TraceOp& b) {
+            return a.micros < b.micros;
+        });
+        std::ofstream out(options.traceOut);
+        for (const TraceOp& op : all) {
+            out << op.micros << ' ' << traceName(op.type) << ' ' << op.key;
+            if (op.type != OpType::Read && op.type != OpType::Remove) out << ' ' << op.argument;
+            out << '\n';
+        }
+        if (!out) {
+            log(LogLevel::Error, "Failed to write trace " + options.traceOut);
+        }
+    }
+
+public:
+    LoadGenerator(const LoadgenOptions& options, Engine& engine)
+        : options(options), engine(engine), mix(options.customMix ? *options.customMix : workloadMix(options.workload)),
+        inserted(options.records), nextInsert(options.records), results(options.threads) {
+        if (options.distribution) {
+            mix.keys = *options.distribution;
+        }
+        std::mt19937_64 rng(options.seed);
+        valueSource.resize(std::max<size_t>(1 << 20, 2 * options.valueMax));
+        for (char& c : valueSource) {
+            c = static_cast<char>('a' + rng() % 26);
+        }
+    }
+
+    // False when the trace could not be read
+    bool run() {
+        std::vector<std::vector<TraceOp>> perThread(options.threads);
+        if (!options.replay.empty()) {
+            std::ifstream in(options.replay);
+            if (!in) {
+                log(LogLevel::Error, "Cannot open trace " + options.replay);
+                return false;
+            }
+            std::string line;
+            uint64_t lines = 0;
+            TraceOp op;
+            while (std::getline(in, line)) {
+                lines++;
+                if (line.empty() || line[0] == '#') continue;
+                if (!parseTraceLine(line, op)) {
+                    log(LogLevel::Error, "Bad trace line " + std::to_string(lines) + ": " + line);
+                    return false;
+                }
+                perThread[static_cast<uint32_t>(op.key) * 0x9E3779B1u % options.threads].push_back(op);
+            }
+        }
+        else if (!options.skipLoad) {
+            const Clock::time_point loadStart = Clock::now();
+            load();
+            const double seconds = std::chrono::duration<double>(Clock::now() - loadStart).count();
+            std::printf("load: %llu records in %.2f s (%.0f records/s)\n",
+                static_cast<unsigned long long>(options.records), seconds, options.records / seconds);
+        }
+
+        // Zeta over the loaded keys is computed once, not per thread
+        const ZipfianGenerator zipfian(options.records, options.theta);
+        const Clock::time_point start = Clock::now();
+        std::vector<std::thread> clients;
+        for (size_t t = 0; t < options.threads; t++) {
+            clients.emplace_back([&, t] {
+                if (options.replay.empty()) {
+                    runWorkload(t, start, zipfian);
+                }
+                else {
+                    runTrace(t, start, perThread[t]);
+                }
+            });
+        }
+        for (auto& client : clients) {
+            client.join();
+        }
+        const double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+        ThreadResult total;
+        uint64_t operations = 0;
+        for (const auto& result : results) {
+            for (size_t i = 0; i < OP_TYPES; i++) {
+                total.service[i].merge(result.service[i]);
+                total.response[i].merge(result.response[i]);
+            }
+            total.notFound += result.notFound;
+            total.failed += result.failed;
+        }
+        for (const auto& s : total.service) {
+            operations += s.count;
+        }
+
+        const bool openLoop = options.replay.empty() ? options.rate > 0 : options.speed > 0;
+        if (options.replay.empty()) {
+            std::printf("workload %s", options.customMix ? "custom" : std::string(1, options.workload).c_str());
+        }
+        else {
+            std::printf("replay %s", options.replay.c_str());
+        }
+        std::printf(": %llu operations in %.2f s, %.0f ops/s, %zu threads, %s loop\n",
+            static_cast<unsigned long long>(operations), seconds, operations / seconds, options.threads,
+            openLoop ? "open" : "closed");
+        if (options.rate > 0 && options.replay.empty()) {
+            std::printf("target rate %.0f ops/s\n", options.rate);
+        }
+        std::printf("not found %llu, failed %llu\n", static_cast<unsigned long long>(total.notFound),
+            static_cast<unsigned long long>(total.failed));
+        printTable("service time", total.service, seconds);
+        if (openLoop) {
+            printTable("response time, from when each operation was due", total.response, seconds);
+        }
+        if (!options.traceOut.empty()) {
+            writeTrace();
+        }
+        return true;
+    }
+};
+
+// Segments, garbage, cache and compaction of what the run left behind
+void printEngine(const std::vector<const EngineStats*>& engines) {
+    size_t segments = 0;
+    uint64_t live = 0;
+    uint64_t dead = 0;
+    ValueCacheStats cache;
+    uint64_t compactionRead = 0;
+    uint64_t compactionWritten = 0;
+    for (const EngineStats* stats : engines) {
+        segments += stats->segments.size();
+        live += stats->liveBytes;
+        dead += stats->deadBytes;
+        cache.hits += stats->cache.hits;
+        cache.misses += stats->cache.misses;
+        compactionRead += stats->metrics.counter(Counter::CompactionReadBytes);
+        compactionWritten += stats->metrics.counter(Counter::CompactionWrittenBytes);
+    }
+    std::printf("engine: %zu segments, %.1f MiB live, %.1f MiB dead", segments, live / 1048576.0, dead / 1048576.0);
+    if (cache.hits + cache.misses > 0) {
+        std::printf(", cache hit ratio %.3f", static_cast<double>(cache.hits) / (cache.hits + cache.misses));
+    }
+    std::printf(", compaction read %.1f MiB, written %.1f MiB\n", compactionRead / 1048576.0,
+        compactionWritten / 1048576.0);
+}
+
+template <typename Engine>
+bool drive(const LoadgenOptions& options, Engine& engine) {
+    LoadGenerator<Engine> generator(options, engine);
+    return generator.run();
+}
+
+bool parseSize(const std::string& text, size_t& low, size_t& high) {
+    const size_t dash = text.find('-');
+    low = std::stoul(text.substr(0, dash));
+    high = dash == std::string::npos ? low : std::stoul(text.substr(dash + 1));
+    return low >= 1 && high >= low;
+}
+
+// "read=0.9,update=0.1"; shares are normalised to sum to 1
+bool parseMix(const std::string& text, Mix& mix) {
+    double sum = 0;
+    size_t position = 0;
+    while (position < text.size()) {
+        size_t end = text.find(',', position);
+        if (end == std::string::npos) end = text.size();
+        const std::string item = text.substr(position, end - position);
+        const size_t equals = item.find('=');
+        if (equals == std::string::npos) return false;
+        const std::string name = item.substr(0, equals);
+        size_t type = 0;
+        while (type < OP_TYPES && name != opName(static_cast<OpType>(type))) type++;
+        if (type == OP_TYPES) return false;
+        mix.proportions[type] = std::stod(item.substr(equals + 1));
+        sum += mix.proportions[type];
+        position = end + 1;
+    }
+    if (sum <= 0) return false;
+    for (double& share : mix.proportions) {
+        share /= sum;
+    }
+    return true;
+}
+
+int usage() {
+    std::cerr <<
+        "usage: kv_loadgen [options]\n"
+        "  --workload a|b|c|d|e|f        YCSB core workload (a)\n"
+        "  --mix read=R,update=U,...     custom mix of read, update, insert, scan, rmw, remove\n"
+        "  --distribution zipfian|uniform|latest   key popularity, overriding the workload's\n"
+        "  --zipf THETA                  skew of zipfian keys and sizes (0.99)\n"
+        "  --records N                   keys loaded before the run (100000)\n"
+        "  --operations N | --duration S length of the run (1000000 operations)\n"
+        "  --threads N                   client threads (8)\n"
+        "  --rate OPS                    open loop at OPS operations/s in total (closed loop)\n"
+        "  --value-size N | MIN-MAX      value bytes, fixed or uniform in [MIN, MAX] (100)\n"
+        "  --zipfian-values              draw value sizes zipfian from MIN-MAX, small ones most often\n"
+        "  --scan-length N               longest scan (100)\n"
+        "  --engine hash|sharded         (hash), --shards N (4)\n"
+        "  --dir DIR                     engine files (<tmp>/kv_loadgen), emptied first\n"
+        "  --skip-load                   keep and use what DIR holds\n"
+        "  --segment-bytes N  --cache-bytes N  --sync none|interval|commit\n"
+        "  --compression none|lz4|zstd  --no-merge  --merge-rate BYTES/S  --merge-garbage RATIO\n"
+        "  --index keydir|persegment  --sealed mmap|pread\n"
+        "  --trace-out FILE              write the operations issued as a trace\n"
+        "  --replay FILE                 issue a trace instead of a workload\n"
+        "  --speed X                     replay at X times the recorded pace, 0 back to back (1)\n"
+        "  --seed N                      (1)\n";
+    return 2;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    LoadgenOptions options;
+    options.engine.directory = (std::filesystem::temp_directory_path() / "kv_loadgen").string();
+    try {
+        for (int i = 1; i < argc; i++) {
+            const std::string arg = argv[i];
+            auto value = [&]() -> std::string {
+                if (i + 1 >= argc) throw std::invalid_argument(arg);
+                return argv[++i];
+            };
+            if (arg == "--workload") {
+                const std::string workload = value();
+                if (workload.size() != 1 || workload[0] < 'a' || workload[0] > 'f') return usage();
+                options.workload = workload[0];
+            }
+            else if (arg == "--mix") {
+                Mix mix;
+                if (!parseMix(value(), mix)) return usage();
+                options.customMix = mix;
+            }
+            else if (arg == "--distribution") {
+                const std::string name = value();
+                if (name == "zipfian") options.distribution = KeyDistribution::Zipfian;
+                else if (name == "uniform") options.distribution = KeyDistribution::Uniform;
+                else if (name == "latest") options.distribution = KeyDistribution::Latest;
+                else return usage();
+            }
+            else if (arg == "--zipf") options.theta = std::stod(value());
+            else if (arg == "--records") options.records = std::max<uint64_t>(1, std::stoull(value()));
+            else if (arg == "--operations") options.operations = std::stoull(value());
+            else if (arg == "--duration") options.seconds = std::stod(value());
+            else if (arg == "--threads") options.threads = std::max<size_t>(1, std::stoul(value()));
+            else if (arg == "--rate") options.rate = std::stod(value());
+            else if (arg == "--value-size") {
+                if (!parseSize(value(), options.valueMin, options.valueMax)) return usage();
+            }
+            else if (arg == "--zipfian-values") options.zipfianValues = true;
+            else if (arg == "--scan-length") options.scanLength = std::max<size_t>(1, std::stoul(value()));
+            else if (arg == "--engine") {
+                const std::string name = value();
+                if (name != "hash" && name != "sharded") return usage();
+                options.sharded = name == "sharded";
+            }
+            else if (arg == "--shards") options.shards = std::max<size_t>(1, std::stoul(value()));
+            else if (arg == "--dir") options.engine.directory = value();
+            else if (arg == "--skip-load") options.skipLoad = true;
+            else if (arg == "--segment-bytes") options.engine.segmentBytes = std::stoull(value());
+            else if (arg == "--cache-bytes") options.engine.valueCacheBytes = std::stoull(value());
+            else if (arg == "--sync") {
+                const std::string policy = value();
+                if (policy == "none") options.engine.durability.policy = SyncPolicy::None;
+                else if (policy == "interval") options.engine.durability.policy = SyncPolicy::Interval;
+                else if (policy == "commit") options.engine.durability.policy = SyncPolicy::EveryCommit;
+                else return usage();
+            }
+            else if (arg == "--compression") {
+                const std::string codec = value();
+                if (codec == "none") options.engine.compression.codec = Compression::None;
+                else if (codec == "lz4") options.engine.compression.codec = Compression::LZ4;
+                else if (codec == "zstd") options.engine.compression.codec = Compression::Zstd;
+                else return usage();
+            }
+            else if (arg == "--no-merge") options.engine.merge.enabled = false;
+            else if (arg == "--merge-rate") options.engine.merge.bytesPerSecond = std::stoull(value());
+            else if (arg == "--merge-garbage") options.engine.merge.minGarbageRatio = std::stod(value());
+            else if (arg == "--index") {
+                const std::string mode = value();
+                if (mode == "keydir") options.engine.indexMode = IndexMode::KeyDir;
+                else if (mode == "persegment") options.engine.indexMode = IndexMode::PerSegment;
+                else return usage();
+            }
+            else if (arg == "--sealed") {
+                const std::string mode = value();
+                if (mode == "mmap") options.engine.sealedReadMode = SealedReadMode::Mmap;
+                else if (mode == "pread") options.engine.sealedReadMode = SealedReadMode::Pread;
+                else return usage();
+            }
+            else if (arg == "--trace-out") options.traceOut = value();
+            else if (arg == "--replay") options.replay = value();
+            else if (arg == "--speed") options.speed = std::stod(value());
+            else if (arg == "--seed") options.seed = std::stoull(value());
+            else return usage();
+        }
+    }
+    catch (const std::exception&) {
+        return usage();
+    }
+    if (options.theta <= 0 || options.theta >= 1) return usage();
+
+    options.engine.name = "loadgen";
+    if (!options.skipLoad && options.replay.empty()) {
+        std::error_code ec;
+        std::filesystem::remove_all(options.engine.directory, ec);
+    }
+
+    bool ok;
+    if (options.sharded) {
+        ShardedStorageEngine<> engine(ShardedStorageEngine<>::layout(options.engine, options.shards));
+        ok = drive(options, engine);
+        const ShardingStats stats = engine.stats();
+        std::vector<const EngineStats*> engines;
+        for (const auto& shard : stats.shards) {
+            engines.push_back(&shard.engine);
+        }
+        printEngine(engines);
+    }
+    else {
+        StorageEngine<> engine(options.engine);
+        ok = drive(options, engine);
+        const EngineStats stats = engine.stats();
+        printEngine({ &stats });
+    }
+    return ok ? 0 : 1;
+}
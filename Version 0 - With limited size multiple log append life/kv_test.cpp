@@ -0,0 +1,656 @@
+#include "kvstore.h"
+
+// Recovery and crash-safety checks run by ctest. Each test gets an empty directory under the
+// system temp directory and reports what it expected on failure.
+
+namespace {
+
+int failures = 0;
+
+void check(bool condition, const std::string& what) {
+    if (!condition) {
+        std::cerr << "FAILED: " << what << "\n";
+        failures++;
+    }
+}
+
+EngineOptions freshOptions(const std::string& test) {
+    EngineOptions options;
+    options.directory = (std::filesystem::temp_directory_path() / ("kv_test_" + test)).string();
+    std::filesystem::remove_all(options.directory);
+    std::filesystem::create_directories(options.directory);
+    return options;
+}
+
+void writeFile(const std::string& path, std::string_view bytes) {
+    std::ofstream out(path, std::ios::binary);
+    out.write(bytes.data(), static_cast<std::streamsize>(bytes.size()));
+}
+
+template <typename Engine>
+std::string valueOf(const Engine& engine, int key) {
+    std::string value;
+    return engine.get(key, value) ? value : "<missing>";
+}
+
+// A legacy segment small enough to be buffered whole by the header probe,
+// with a corrupted record, an overwrite and a torn tail
+void legacyRecovery() {
+    EngineOptions options = freshOptions("legacy");
+    static const char records[] = "1,one\0" "2,two\0" "bad\0" "1,uno\0" "2,tw";
+    writeFile(options.prefix() + "_1.txt", std::string_view(records, sizeof(records) - 1));
+
+    StorageEngine<> engine(options);
+    check(valueOf(engine, 1) == "uno", "legacy key 1 recovers its last value");
+    check(valueOf(engine, 2) == "two", "legacy key 2 recovers, not its torn tail");
+}
+
+// Every record in a segment of its own, so sets and removes land in
+// different files
+EngineOptions segmentPerRecord(const std::string& test) {
+    EngineOptions options = freshOptions(test);
+    options.segmentBytes = 64;
+    options.preallocate = false;
+    options.merge.enabled = false;
+    return options;
+}
+
+// A merge that dropped the tombstone of a key set in an older input, with a
+// crash before that input was unlinked
+void mergeKeepsTombstones() {
+    EngineOptions options = segmentPerRecord("merge_tombstone");
+    const std::string older = options.prefix() + "_1.txt";
+    const std::string saved = options.prefix() + "_saved";
+    {
+        StorageEngine<> engine(options);
+        engine.set(1, std::string(100, 'a'));
+        engine.remove(1);
+        engine.set(2, std::string(100, 'b'));
+        std::filesystem::copy_file(older, saved);
+        check(engine.merge(), "the sealed segments merge");
+    }
+    check(!std::filesystem::exists(older), "the older input is unlinked");
+    std::filesystem::rename(saved, older);
+
+    StorageEngine<> engine(options);
+    check(valueOf(engine, 1) == "<missing>", "a removed key stays removed when a merge input survives");
+    check(valueOf(engine, 2) == std::string(100, 'b'), "other keys survive the merge");
+}
+
+// The tombstone a merge had to keep goes with the next merge of its
+// segment, and the key stays removed
+void laterMergeDropsTombstones() {
+    EngineOptions options = segmentPerRecord("reclaim_tombstone");
+    options.merge.minGarbageRatio = 0.1;
+    {
+        StorageEngine<> engine(options);
+        engine.set(1, std::string(100, 'a'));
+        engine.remove(1);
+        engine.set(2, std::string(100, 'b'));
+        check(engine.merge(), "the sealed segments merge");
+        const SegmentStats merged = engine.stats().segments.back();
+        check(merged.tombstoneBytes == 0 && merged.deadBytes > 0, "the kept tombstone counts as reclaimable");
+
+        check(engine.reclaim(), "reclaim merges the segment holding the tombstone");
+        check(engine.stats().segments.back().deadBytes == 0, "reclaim drops the tombstone");
+        check(!engine.merge(), "nothing is left to merge");
+        check(valueOf(engine, 1) == "<missing>", "the removed key stays removed after reclaim");
+    }
+    StorageEngine<> engine(options);
+    check(valueOf(engine, 1) == "<missing>", "the removed key stays removed after reopening");
+    check(valueOf(engine, 2) == std::string(100, 'b'), "other keys survive reclaim");
+}
+
+// Cached values follow removes, overwrites and merges, also when a put and
+// a remove of the key share a commit group
+void cacheInvalidation() {
+    EngineOptions options = freshOptions("cache");
+    options.valueCacheBytes = 1 << 20;
+    options.segmentBytes = 4096;
+    options.merge.enabled = false;
+    StorageEngine<> engine(options);
+
+    WriteBatch batch;
+    batch.put(2, "x");
+    batch.remove(2);
+    engine.write(batch);
+    check(valueOf(engine, 2) == "<missing>", "a put and a remove in one batch leave the key removed");
+    batch.clear();
+    batch.remove(3);
+    batch.put(3, "y");
+    engine.write(batch);
+    check(valueOf(engine, 3) == "y", "a remove and a put in one batch leave the put");
+
+    engine.set(1, "one");
+    check(valueOf(engine, 1) == "one", "a set is cached");
+    engine.set(1, "uno");
+    check(valueOf(engine, 1) == "uno", "an overwrite replaces the cached value");
+    engine.remove(1);
+    check(valueOf(engine, 1) == "<missing>", "a remove drops the cached value");
+
+    for (int key = 10; key < 200; key++) {
+        engine.set(key, std::string(40, 'a'));
+        check(valueOf(engine, key) == std::string(40, 'a'), "the first value is cached");
+        engine.set(key, std::string(40, 'b'));
+    }
+    engine.remove(10);
+    check(engine.merge(), "the sealed segments merge");
+    check(valueOf(engine, 10) == "<missing>", "a removed key stays removed across a merge");
+    check(valueOf(engine, 11) == std::string(40, 'b'), "a merge keeps the newest cached value");
+}
+
+// Writers setting and removing the same keys, grouped into shared commits:
+// what the cache serves is what the segments hold
+void cacheUnderConcurrentWriters() {
+    EngineOptions options = freshOptions("cache_writers");
+    options.valueCacheBytes = 1 << 20;
+    options.merge.enabled = false;
+    constexpr int KEYS = 16;
+    std::vector<std::string> cached(KEYS);
+    {
+        StorageEngine<> engine(options);
+        std::vector<std::thread> writers;
+        for (int t = 0; t < 4; t++) {
+            writers.emplace_back([&engine, t] {
+                for (int i = 0; i < 2000; i++) {
+                    const int key = i % KEYS;
+                    if ((i + t) % 2 == 0) {
+                        engine.set(key, std::to_string(t * 100000 + i));
+                    }
+                    else {
+                        engine.remove(key);
+                    }
+                    std::string value;
+                    engine.get(key, value);
+                }
+            });
+        }
+        for (auto& writer : writers) {
+            writer.join();
+        }
+        for (int key = 0; key < KEYS; key++) {
+            cached[key] = valueOf(engine, key);
+        }
+    }
+    options.valueCacheBytes = 0;
+    StorageEngine<> reopened(options);
+    for (int key = 0; key < KEYS; key++) {
+        check(valueOf(reopened, key) == cached[key], "the cache agrees with the segments for key " + std::to_string(key));
+    }
+}
+
+// Segments rotated out are sealed in the background: they stay readable
+// in between, and all of them are sealed with a hint by shutdown
+void rotationSealsInBackground() {
+    EngineOptions options = freshOptions("rotation");
+    options.segmentBytes = 4096;
+    options.merge.enabled = false;
+    const std::string value(100, 'r');
+    size_t segments = 0;
+    {
+        StorageEngine<> engine(options);
+        for (int key = 0; key < 2000; key++) {
+            engine.set(key, value);
+            if (key >= 40) {
+                check(valueOf(engine, key - 40) == value, "a key of a segment being sealed is readable");
+            }
+        }
+        segments = engine.stats().segments.size();
+    }
+    check(segments > 10, "the writes rotated");
+    const auto files = discoverFiles(options.prefix(), ".txt");
+    for (size_t i = 0; i + 1 < files.size(); i++) {
+        check(std::filesystem::exists(files[i].second + ".hint"), "sealed segment " + files[i].second + " has a hint");
+    }
+
+    StorageEngine<> engine(options);
+    size_t found = 0;
+    for (int key = 0; key < 2000; key++) {
+        found += valueOf(engine, key) == value;
+    }
+    check(found == 2000, "every key is readable after reopening");
+}
+
+// Hints are written after rotation: a merge straight after it reopens with
+// the merged segment's hint, and a segment whose hint never got written is
+// scanned instead
+void hintsAfterRotation() {
+    EngineOptions options = freshOptions("hints");
+    options.segmentBytes = 4096;
+    options.merge.enabled = false;
+    {
+        StorageEngine<> engine(options);
+        for (int key = 0; key < 500; key++) {
+            engine.set(key, std::string(100, 'a'));
+        }
+        for (int key = 0; key < 500; key += 2) {
+            engine.set(key, std::string(100, 'b'));
+        }
+        check(engine.merge(), "the freshly rotated segments merge");
+    }
+    auto expected = [](int key) { return std::string(100, key % 2 == 0 ? 'b' : 'a'); };
+    {
+        StorageEngine<> engine(options);
+        size_t found = 0;
+        for (int key = 0; key < 500; key++) {
+            found += valueOf(engine, key) == expected(key);
+        }
+        check(found == 500, "every key reads back through the merged segment's hint");
+        for (int key = 500; key < 600; key++) {
+            engine.set(key, std::string(100, 'c'));
+        }
+    }
+    const auto files = discoverFiles(options.prefix(), ".txt");
+    check(files.size() >= 2 && std::filesystem::remove(files[files.size() - 2].second + ".hint"),
+        "a sealed segment's hint is removed");
+
+    StorageEngine<> engine(options);
+    size_t found = 0;
+    for (int key = 0; key < 600; key++) {
+        found += valueOf(engine, key) == (key < 500 ? expected(key) : std::string(100, 'c'));
+    }
+    check(found == 600, "a segment without its hint is scanned on open");
+}
+
+// A batch is applied whole, and a crash that tears it, mid-record or between
+// two of its records, loses all of it and nothing before it
+void batchAtomicity() {
+    EngineOptions options = freshOptions("batch");
+    options.preallocate = false;
+    options.merge.enabled = false;
+    const std::string segment = options.prefix() + "_1.txt";
+    constexpr int KEYS = 5;
+    {
+        StorageEngine<> engine(options);
+        engine.set(100, "before");
+        WriteBatch batch;
+        batch.put(1, "smaller");
+        batch.remove(1);
+        batch.put(2, "two");
+        for (int key = 1; key <= KEYS; key++) {
+            batch.put(key, std::string(20, 'a'));
+        }
+        batch.remove(4);
+        check(batch.count() == KEYS + 4, "a batch holds every put and remove");
+        check(engine.write(batch), "the batch is written");
+        check(valueOf(engine, 1) == std::string(20, 'a') && valueOf(engine, 4) == "<missing>",
+            "the batch applies its records in order");
+    }
+    const auto committed = std::filesystem::file_size(segment);
+    {
+        StorageEngine<> engine(options);
+        size_t found = 0;
+        for (int key = 1; key <= KEYS; key++) {
+            found += valueOf(engine, key) == (key == 4 ? "<missing>" : std::string(20, 'a'));
+        }
+        check(found == KEYS, "a complete batch survives reopening");
+
+        WriteBatch batch;
+        for (int key = 1; key <= KEYS; key++) {
+            batch.put(key, std::string(20, 'b'));
+        }
+        check(engine.write(batch), "a second batch is written");
+    }
+    const auto written = std::filesystem::file_size(segment);
+    const auto recordBytes = (written - committed) / KEYS;
+
+    auto reopenTorn = [&](uint64_t size, const std::string& what) {
+        const std::string saved = segment + ".saved";
+        std::filesystem::copy_file(segment, saved, std::filesystem::copy_options::overwrite_existing);
+        std::filesystem::resize_file(segment, size);
+        {
+            StorageEngine<> engine(options);
+            bool untouched = valueOf(engine, 100) == "before";
+            for (int key = 1; key <= KEYS; key++) {
+                untouched &= valueOf(engine, key) == (key == 4 ? "<missing>" : std::string(20, 'a'));
+            }
+            check(untouched, "a batch torn " + what + " is dropped whole");
+            engine.set(200, "after");
+        }
+        StorageEngine<> engine(options);
+        check(valueOf(engine, 200) == "after" && valueOf(engine, 2) == std::string(20, 'a'),
+            "writes after a batch torn " + what + " are recovered");
+        std::filesystem::rename(saved, segment);
+    };
+    reopenTorn(written - recordBytes / 2, "mid-record");
+    reopenTorn(written - recordBytes, "between records");
+    reopenTorn(committed + recordBytes, "after its first record");
+}
+
+// Keys are spread over every shard, each key lives in exactly one of them,
+// and the same layout finds every key again after reopening
+void shardedRouting() {
+    EngineOptions options = freshOptions("sharded");
+    options.merge.enabled = false;
+    const auto layout = ShardedStorageEngine<>::layout(options, 4);
+    constexpr int KEYS = 2000;
+    {
+        ShardedStorageEngine<> engine(layout);
+        for (int key = 0; key < KEYS; key++) {
+            engine.set(key, std::to_string(key));
+        }
+        WriteBatch batch;
+        for (int key = 0; key < KEYS; key += 10) {
+            batch.remove(key);
+        }
+        check(engine.write(batch), "a batch over every shard is written");
+
+        const ShardingStats stats = engine.stats();
+        uint64_t records = 0;
+        bool spread = stats.shards.size() == 4;
+        for (const auto& shard : stats.shards) {
+            records += shard.records;
+            spread &= shard.records > KEYS / 8;
+        }
+        check(spread, "every shard takes a share of the keys");
+        check(records == KEYS + KEYS / 10, "every record is written to one shard");
+        check(stats.writeSkew >= 1.0 && stats.writeSkew < 1.5, "the write skew is that of a hash spread");
+
+        bool ordered = true;
+        int previous = -1;
+        int scanned = 0;
+        for (auto it = engine.scan(100, 1099); it.valid(); it.next(), scanned++) {
+            ordered &= it.key() > previous && it.key() % 10 != 0 && it.value() == std::to_string(it.key());
+            previous = it.key();
+        }
+        check(ordered, "a scan over shards yields the live keys in order with their values");
+        check(scanned == 900, "a scan over shards covers the range");
+    }
+    {
+        ShardedStorageEngine<> engine(layout);
+        size_t found = 0;
+        for (int key = 0; key < KEYS; key++) {
+            found += valueOf(engine, key) == (key % 10 == 0 ? "<missing>" : std::to_string(key));
+        }
+        check(found == KEYS, "every key is routed to its shard after reopening");
+    }
+
+    std::vector<std::unique_ptr<StorageEngine<>>> shards;
+    for (const auto& shardOptions : layout) {
+        shards.push_back(std::make_unique<StorageEngine<>>(shardOptions));
+    }
+    size_t owned = 0;
+    for (int key = 1; key < KEYS; key += 10) {
+        size_t holders = 0;
+        for (const auto& shard : shards) {
+            holders += valueOf(*shard, key) != "<missing>";
+        }
+        owned += holders == 1;
+    }
+    check(owned == KEYS / 10, "each key is held by exactly one shard");
+}
+
+// A compressible value, and a short one stored raw
+std::string jsonValue(int key, int version) {
+    if (key % 7 == 0) return "short " + std::to_string(key);
+    std::string value = "{\"id\":" + std::to_string(key) + ",\"version\":" + std::to_string(version) + ",\"tags\":[";
+    for (int i = 0; i < 20; i++) {
+        value += "\"tag" + std::to_string((key + i) % 13) + "\",";
+    }
+    return value + "\"end\"]}";
+}
+
+// Values come back as written from the active segment, from sealed ones,
+// after reopening, and after a merge recompressed them, even once
+// compression is turned off
+void compressionRoundtrip(Compression codec, const std::string& test) {
+    EngineOptions options = freshOptions(test);
+    options.segmentBytes = 4096;
+    options.merge.enabled = false;
+    options.compression.codec = codec;
+    constexpr int KEYS = 400;
+    auto readsBack = [&](const StorageEngine<>& engine, int version) {
+        size_t found = 0;
+        for (int key = 0; key < KEYS; key++) {
+            found += valueOf(engine, key) == jsonValue(key, key % 2 == 0 ? version : 1);
+        }
+        return found == KEYS;
+    };
+    {
+        StorageEngine<> engine(options);
+        for (int key = 0; key < KEYS; key++) {
+            engine.set(key, jsonValue(key, 1));
+        }
+        check(readsBack(engine, 1), test + " values read back as written");
+        const CompressionStats stats = engine.stats().compression;
+        check(stats.compressedValues > 0 && stats.compressedValues < KEYS, test + " compresses all but short values");
+        check(stats.ratio() > 1.5, test + " shrinks the values");
+    }
+    {
+        StorageEngine<> engine(options);
+        check(readsBack(engine, 1), test + " values read back after reopening");
+        for (int key = 0; key < KEYS; key += 2) {
+            engine.set(key, jsonValue(key, 2));
+        }
+        check(engine.merge(), test + " segments merge");
+        check(readsBack(engine, 2), test + " values read back after a merge");
+    }
+    options.compression.codec = Compression::None;
+    StorageEngine<> engine(options);
+    check(readsBack(engine, 2), test + " values read back with compression turned off");
+}
+
+// Gets and scans see the newest version of each key wherever it lives: the
+// memtable, flushed level 0 tables, compacted levels, or a log replayed on open
+void lsmAcrossLevels() {
+    EngineOptions options = freshOptions("lsm");
+    options.lsm.memtableBytes = 16 << 10;
+    options.lsm.blockBytes = 512;
+    options.lsm.tableBytes = 8 << 10;
+    options.lsm.level0Runs = 2;
+    constexpr int KEYS = 1000;
+    auto expected = [](int key) {
+        if (key % 5 == 0) return std::string("<missing>");
+        return (key % 2 == 0 ? "v2_" : "v1_") + std::to_string(key);
+    };
+    auto consistent = [&](const LsmStorageEngine& engine, const std::string& where) {
+        size_t found = 0;
+        for (int key = 0; key < KEYS; key++) {
+            found += valueOf(engine, key) == expected(key);
+        }
+        check(found == KEYS, "gets read the newest versions " + where);
+
+        bool ordered = true;
+        int previous = 99;
+        for (auto it = engine.scan(100, 399); it.valid(); it.next()) {
+            for (int key = previous + 1; key < it.key(); key++) {
+                ordered &= expected(key) == "<missing>";
+            }
+            ordered &= it.key() > previous && it.key() <= 399 && std::string(it.value()) == expected(it.key());
+            previous = it.key();
+        }
+        ordered &= previous == 399;
+        check(ordered, "a scan yields the live keys of its range in order " + where);
+        check(!engine.scan(KEYS, KEYS + 100).valid(), "a scan past the last key is empty " + where);
+    };
+    {
+        LsmStorageEngine engine(options);
+        for (int key = 0; key < KEYS; key++) {
+            engine.set(key, "v1_" + std::to_string(key));
+        }
+        check(engine.flush(), "the memtable flushes");
+        for (int key = 0; key < KEYS; key += 2) {
+            engine.set(key, "v2_" + std::to_string(key));
+        }
+        check(engine.flush(), "the overwrites flush");
+        for (int key = 0; key < KEYS; key += 5) {
+            engine.remove(key);
+        }
+        const LsmStats stats = engine.stats();
+        check(stats.flushes >= 2 && !stats.levels.empty() && stats.memtableBytes > 0,
+            "the keys span the memtable and flushed tables");
+        consistent(engine, "across the memtable and tables");
+    }
+    {
+        LsmStorageEngine engine(options);
+        consistent(engine, "with the memtable replayed from its log");
+        check(engine.flush(), "the replayed memtable flushes");
+        engine.compact();
+        check(engine.stats().compactions > 0, "level 0 compacts");
+        consistent(engine, "after compaction");
+    }
+    LsmStorageEngine engine(options);
+    consistent(engine, "after reopening the compacted tables");
+}
+
+// Scans yield each live key of [lo, hi] once, in order, with its newest
+// value, whichever segment holds it and whichever index resolves it, and
+// follow writes landing in batches not fetched yet
+void scanOrderAndBounds(IndexMode indexMode, const std::string& test) {
+    EngineOptions options = freshOptions(test);
+    options.segmentBytes = 4096;
+    options.merge.enabled = false;
+    options.indexMode = indexMode;
+    options.scan.batchKeys = 16;
+    StorageEngine<> engine(options);
+    // Keys -500 .. 499 in a scattered order over many segments, every
+    // third one overwritten and every seventh removed
+    for (int i = 0; i < 1000; i++) {
+        const int key = (i * 367) % 1000 - 500;
+        engine.set(key, "old");
+    }
+    for (int key = -500; key < 500; key += 3) {
+        engine.set(key, std::to_string(key));
+    }
+    for (int key = -500; key < 500; key += 7) {
+        engine.remove(key);
+    }
+    auto expected = [](int key) {
+        if ((key + 500) % 7 == 0) return std::string("<missing>");
+        return (key + 500) % 3 == 0 ? std::to_string(key) : std::string("old");
+    };
+    auto scanned = [&](int lo, int hi) {
+        std::vector<std::pair<int, std::string>> result;
+        for (auto it = engine.scan(lo, hi); it.valid(); it.next()) {
+            result.emplace_back(it.key(), std::string(it.value()));
+        }
+        return result;
+    };
+    auto matches = [&](int lo, int hi) {
+        std::vector<std::pair<int, std::string>> wanted;
+        for (int key = std::max(lo, -500); key <= std::min(hi, 499); key++) {
+            if (expected(key) != "<missing>") wanted.emplace_back(key, expected(key));
+        }
+        return scanned(lo, hi) == wanted;
+    };
+    check(engine.stats().segments.size() > 5, test + " keys span many segments");
+    check(matches(-500, 499), test + " a full scan yields every live key in order");
+    check(matches(-37, 120), test + " a scan is bounded by lo and hi, both included");
+    check(matches(-1000, -450) && matches(450, 1000), test + " a scan past either end stops at the last key");
+    check(matches(10, 10) && scanned(12, 12).size() == 1, test + " a scan of one key yields just it");
+    check(scanned(-493, -493).empty(), test + " a scan of a removed key is empty");
+    check(scanned(20, 10).empty() && scanned(600, 700).empty(), test + " an empty range yields nothing");
+
+    auto it = engine.scan(0, 499);
+    check(it.valid() && it.key() == 0, test + " a scan starts at its first live key");
+    engine.remove(400);
+    engine.set(401, "new");
+    bool removedSkipped = true;
+    bool overwriteSeen = false;
+    for (; it.valid(); it.next()) {
+        removedSkipped &= it.key() != 400;
+        overwriteSeen |= it.key() == 401 && it.value() == "new";
+    }
+    check(removedSkipped && overwriteSeen, test + " a scan follows writes made while it runs");
+
+    const auto before = scanned(-500, 499);
+    check(engine.merge(), test + " segments merge");
+    check(scanned(-500, 499) == before, test + " a merge leaves what a scan yields");
+}
+
+// An ingest a crash interrupted is finished on open once its marker is
+// written, its first file possibly moved into place already, and undone
+// before that, leaving the engine as it was
+void ingestRecovery() {
+    EngineOptions source = segmentPerRecord("ingest_source");
+    {
+        StorageEngine<> engine(source);
+        engine.set(1, std::string(100, 'n'));
+        engine.set(2, std::string(100, 'm'));
+        engine.set(3, "active");
+    }
+    const std::vector<std::string> inputs{ source.prefix() + "_1.txt", source.prefix() + "_2.txt" };
+    for (const auto& input : inputs) {
+        check(std::filesystem::exists(input + ".hint"), "ingest input " + input + " has a hint");
+    }
+
+    EngineOptions options = freshOptions("ingest");
+    options.preallocate = false;
+    options.merge.enabled = false;
+    {
+        StorageEngine<> engine(options);
+        engine.set(1, "old1");
+        engine.set(2, "old2");
+        engine.set(5, "five");
+    }
+    auto copyInput = [](const std::string& input, const std::string& path) {
+        std::filesystem::copy_file(input, path);
+        std::filesystem::copy_file(input + ".hint", path + ".hint");
+    };
+    auto staged = [&](size_t id) { return options.prefix() + "_" + std::to_string(id) + ".txt.ingest"; };
+    const std::string marker = options.prefix() + ".ingest";
+
+    // Interrupted before the marker: the staged links are dropped
+    copyInput(inputs[0], staged(10));
+    copyInput(inputs[1], staged(11));
+    {
+        StorageEngine<> engine(options);
+        check(valueOf(engine, 1) == "old1" && valueOf(engine, 2) == "old2" && valueOf(engine, 5) == "five",
+            "an ingest interrupted before its marker changes nothing");
+    }
+    check(!std::filesystem::exists(staged(10)) && !std::filesystem::exists(staged(11) + ".hint"),
+        "the files of an ingest interrupted before its marker are removed");
+
+    // Interrupted after the marker and the first rename: the rest is moved
+    copyInput(inputs[0], options.prefix() + "_10.txt");
+    copyInput(inputs[1], staged(11));
+    writeFile(marker, {});
+    {
+        StorageEngine<> engine(options);
+        check(valueOf(engine, 1) == std::string(100, 'n') && valueOf(engine, 2) == std::string(100, 'm'),
+            "an ingest interrupted after its marker is finished");
+        check(valueOf(engine, 5) == "five", "an ingest keeps the keys it does not hold");
+        engine.set(2, "newest");
+    }
+    check(!std::filesystem::exists(marker) && !std::filesystem::exists(staged(11)),
+        "a finished ingest leaves neither its marker nor staged files");
+    {
+        StorageEngine<> engine(options);
+        check(valueOf(engine, 1) == std::string(100, 'n') && valueOf(engine, 2) == "newest",
+            "writes after a finished ingest shadow it");
+    }
+
+    // And one that is not interrupted
+    const std::string input = options.directory + "/input.txt";
+    copyInput(inputs[0], input);
+    StorageEngine<> engine(options);
+    engine.set(1, "before");
+    check(engine.ingest({ input }), "a sealed segment with its hint is ingested");
+    check(valueOf(engine, 1) == std::string(100, 'n') && valueOf(engine, 2) == "newest",
+        "an ingested segment shadows what was written before it");
+    check(!std::filesystem::exists(input) && !std::filesystem::exists(marker), "an ingest consumes its input");
+}
+
+}  // namespace
+
+int main() {
+    legacyRecovery();
+    mergeKeepsTombstones();
+    laterMergeDropsTombstones();
+    cacheInvalidation();
+    cacheUnderConcurrentWriters();
+    rotationSealsInBackground();
+    hintsAfterRotation();
+    batchAtomicity();
+    shardedRouting();
+    compressionRoundtrip(Compression::LZ4, "lz4");
+#if KV_HAVE_ZSTD
+    compressionRoundtrip(Compression::Zstd, "zstd");
+#endif
+    lsmAcrossLevels();
+    scanOrderAndBounds(IndexMode::KeyDir, "scan_keydir");
+    scanOrderAndBounds(IndexMode::PerSegment, "scan_segments");
+    ingestRecovery();
+    if (failures == 0) std::cout << "all passed\n";
+    return failures == 0 ? 0 : 1;
+}
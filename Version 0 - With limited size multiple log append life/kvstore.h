@@ -0,0 +1,9060 @@
+#pragma once
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <map>
+#include <deque>
+#include <thread>
+#include <vector>
+#include <memory>
+#include <functional>
+#include <type_traits>
+#include <array>
+#include <bit>
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <filesystem>
+#include <shared_mutex>
+#include <set>
+#include <unordered_set>
+#include <unordered_map>
+#include <span>
+#include <cstring>
+#include <cstdio>
+#include <string_view>
+#include <tuple>
+#include <utility>
+#include <cerrno>
+#include <climits>
+#include <limits>
+#include <charconv>
+#include <future>
+#include <optional>
+#include <coroutine>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// An append-only, log-structured key–value store with per-file in-memory indexing.
+//
+// Design:
+//   - O(1) writes via sequential log appends
+//   - O(1) reads using in-memory hash indexes
+//   - Durable storage with crash recovery by replaying log files
+//   - Automatic log rotation when a file reaches a configurable size limit,
+//     into a segment preallocated ahead of time
+//
+// Records are stored in a versioned binary format (see RecordHeader); files
+// written in the original "key,value\0" text format are still recovered and
+// served, but never appended to.
+//
+// When a log file is sealed a hint file ("<file>.hint") is written next to it
+// with the (key, offset, size) of every live record, so restarts load the
+// index directly instead of replaying the data file.
+//
+// A global key directory maps every key to (segment id, offset, size) of its
+// newest record, so a get is one in-memory lookup and one read no matter how
+// many segments exist.
+//
+// With the key directory disabled (IndexMode::PerSegment) a get probes the
+// segments newest first, and each segment's Bloom filter rejects most keys it
+// does not hold without touching its index or file.
+//
+// Any number of threads may get while others write. Gets take no lock: the
+// key directory and per-segment indexes are seqlock-protected flat tables,
+// and the segment list is an immutable snapshot replaced with one atomic
+// store; memory unlinked from either is reclaimed through epochs once no
+// reader can still see it.
+//
+// ShardedStorageEngine hash-partitions keys over several engines, each with
+// its own files and writer thread, to scale writes past one append point.
+//
+// remove(key) appends a tombstone record. Every segment knows how many of
+// its bytes are live and how many are dead (overwritten, deleted, or
+// tombstones), and a background merge thread uses that to pick the sealed
+// segments whose rewrite reclaims the most space: it copies only their
+// still-current records (and the tombstones something older still needs)
+// into one merged segment plus hint file, swaps it in for its inputs and
+// deletes them.
+//
+// LsmStorageEngine is the alternative for keyspaces whose index does not fit
+// in memory: a memtable with the log as its write-ahead log, flushed to
+// sorted SSTables that compaction merges level by level. Only a sparse block
+// index and a Bloom filter per table stay in memory.
+//
+// scan(lo, hi) walks a key range in order on either engine, fetching values
+// ahead in batches.
+//
+// ReplicationLeader streams an engine's log over TCP to ReplicationFollowers,
+// read replicas that append it to segments of their own; a new follower
+// bootstraps by copying the sealed segments and hint files first.
+//
+// ingest() adds sealed segments built elsewhere, such as by the offline
+// kv_bulkload tool, straight from their hint files and in one step.
+//
+// getAsync and setAsync return futures, take callbacks or can be co_awaited.
+// Reads go through an io_uring per engine (or, where there is none, a small
+// pread thread pool) so a few threads can keep many reads in flight; writes
+// join the group commit without anyone waiting to lead it.
+//
+// Values can be stored LZ4- or zstd-compressed (CompressionOptions); writers
+// compress before taking the write lock, and merges may train a per-segment
+// zstd dictionary over the values they copy.
+//
+// Every engine keeps latency histograms and counters (Metrics) that stats()
+// snapshots and toPrometheus() renders. Log lines go through an asynchronous
+// sink (LogSink), so nothing on the read or write path waits for the console.
+//
+// Each log file maintains its own in-memory index (HashMap) that maps keys to
+// their corresponding byte offsets and record sizes within that file. This
+// allows fast lookups without scanning disk contents. Values themselves are
+// only cached when a ValueCache is configured.
+//
+// Records are written sequentially to disk, ensuring efficient writes and
+// durability. On startup, each log file is replayed to rebuild its index.
+// When the active log file exceeds the configured size threshold, a new log
+// file is created and becomes the active write target, while older files
+// remain readable.
+
+enum class LogLevel {
+    Debug,    // per-segment events such as rotation
+    Info,     // recovery, merges
+    Warning,  // recoverable trouble: a rescan, a skipped hint
+    Error,    // failed I/O, data that could not be written or read
+    Off,
+};
+
+inline const char* logLevelName(LogLevel level) {
+    static const char* const names[] = { "debug", "info", "warning", "error", "off" };
+    return names[static_cast<size_t>(level)];
+}
+
+// Process-wide log sink. Callers only queue the line; a background thread
+// writes queued lines to the output (std::cout unless replaced). Lines below
+// the level are dropped before being queued, and so are lines beyond
+// MAX_QUEUED while the writer is behind, which are counted instead.
+class LogSink {
+public:
+    using Output = std::function<void(LogLevel, const std::string&)>;
+
+private:
+    static constexpr size_t MAX_QUEUED = 4096;
+
+    std::atomic<LogLevel> threshold{ LogLevel::Info };
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable drained;
+    std::vector<std::pair<LogLevel, std::string>> queued;
+    Output output;
+    uint64_t dropped = 0;
+    bool writing = false;
+    bool stopping = false;
+    std::thread thread;
+
+    static void print(LogLevel level, const std::string& line) {
+        std::cout << "LOG " << logLevelName(level) << ": " << line << "\n";
+    }
+
+    void run() {
+        std::unique_lock<std::mutex> lock(mutex);
+        std::vector<std::pair<LogLevel, std::string>> batch;
+        for (;;) {
+            wake.wait(lock, [this] { return stopping || !queued.empty() || dropped > 0; });
+            if (queued.empty() && dropped == 0 && stopping) break;
+            batch.swap(queued);
+            const uint64_t lost = std::exchange(dropped, 0);
+            Output write = output;
+            writing = true;
+            lock.unlock();
+            for (const auto& [level, line] : batch) {
+                write(level, line);
+            }
+            if (lost > 0) {
+                write(LogLevel::Warning, std::to_string(lost) + " log lines dropped");
+            }
+            batch.clear();
+            lock.lock();
+            writing = false;
+            drained.notify_all();
+        }
+    }
+
+    LogSink() : output(print), thread(&LogSink::run, this) {}
+
+public:
+    static LogSink& instance() {
+        static LogSink sink;
+        return sink;
+    }
+
+    ~LogSink() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_one();
+        thread.join();
+    }
+
+    bool enabled(LogLevel level) const {
+        return level >= threshold.load(std::memory_order_relaxed);
+    }
+
+    void setLevel(LogLevel level) {
+        threshold.store(level, std::memory_order_relaxed);
+    }
+
+    // Replaces where lines are written; nullptr restores std::cout
+    void setOutput(Output next) {
+        std::lock_guard<std::mutex> lock(mutex);
+        output = next ? std::move(next) : Output(print);
+    }
+
+    void write(LogLevel level, std::string line) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (queued.size() >= MAX_QUEUED) {
+                dropped++;
+                return;
+            }
+            queued.emplace_back(level, std::move(line));
+        }
+        wake.notify_one();
+    }
+
+    // Waits until every line queued so far has been written
+    void flush() {
+        std::unique_lock<std::mutex> lock(mutex);
+        drained.wait(lock, [this] { return queued.empty() && dropped == 0 && !writing; });
+    }
+};
+
+inline void log(LogLevel level, std::string msg) {
+    LogSink& sink = LogSink::instance();
+    if (sink.enabled(level)) {
+        sink.write(level, std::move(msg));
+    }
+}
+
+// Runs fn(0) .. fn(count - 1) on up to hardware_concurrency worker threads,
+// each worker pulling the next index until all are done
+template <typename Fn>
+void parallelFor(size_t count, Fn&& fn) {
+    size_t workers = std::min<size_t>(count, std::max(1u, std::thread::hardware_concurrency()));
+    std::atomic<size_t> next{ 0 };
+    auto work = [&] {
+        for (size_t i = next++; i < count; i = next++) {
+            fn(i);
+        }
+    };
+    std::vector<std::thread> threads;
+    for (size_t w = 1; w < workers; w++) {
+        threads.emplace_back(work);
+    }
+    work();
+    for (auto& thread : threads) {
+        thread.join();
+    }
+}
+
+// Record separator of the legacy text format
+const char DELIMITER = '\0';
+
+// How sealed segments (rotated out, never written again) serve reads
+enum class SealedReadMode {
+    Pread,  // same positional-read path as the active segment
+    Mmap,   // read-only mapping, a get is a bounds-checked memcpy
+};
+
+// Expected access pattern of sealed segments, forwarded to madvise
+enum class AccessPattern {
+    Normal,
+    Random,      // point lookups: disable kernel read-ahead
+    Sequential,  // scans/merges: aggressive read-ahead
+    WillNeed,    // hot data: prefetch the whole segment
+};
+
+// When appended records are forced to stable storage
+enum class SyncPolicy {
+    None,         // write() into the page cache only
+    Interval,     // a background thread fdatasyncs every interval
+    EveryCommit,  // every group commit is fdatasynced before set() returns
+};
+
+struct Durability {
+    SyncPolicy policy = SyncPolicy::None;
+    std::chrono::milliseconds interval{ 100 };
+};
+
+// Which in-memory structure resolves a key to its segment
+enum class IndexMode {
+    KeyDir,      // one engine-wide map, one probe per get
+    PerSegment,  // only per-segment indexes and Bloom filters, less memory
+};
+
+// Background compaction of sealed segments. Segments are chosen by how much
+// of them a merge would reclaim, not by age; see StorageEngine::reclaim.
+struct MergeOptions {
+    bool enabled = true;
+    size_t minSegments = 4;               // sealed segments needed before background merges run
+    uint64_t bytesPerSecond = 32 << 20;   // merge I/O budget, 0 means unlimited
+    std::chrono::milliseconds interval{ 1000 };
+    double minGarbageRatio = 0.5;         // a segment at least this share reclaimable is merged
+    double maxSpaceAmplification = 1.5;   // above this (disk over live bytes) the next best segments are too
+    size_t maxInputs = 16;                // segments rewritten by one background merge
+};
+
+// Codec applied to values on the write path
+enum class Compression {
+    None,
+    LZ4,   // fast, built in when liblz4 is missing
+    Zstd,  // better ratio, needs libzstd
+};
+
+struct CompressionOptions {
+    Compression codec = Compression::None;
+    size_t minValueBytes = 64;            // smaller values are stored raw
+    int zstdLevel = 3;
+    // Merges compress with a zstd dictionary trained on the merged values
+    bool mergeDictionary = true;
+    size_t dictionaryBytes = 16 << 10;
+};
+
+struct CompressionStats {
+    uint64_t compressedValues = 0;    // values stored compressed
+    uint64_t rawBytes = 0;            // size of the values compression was tried on
+    uint64_t storedBytes = 0;         // and what was written for them
+    uint64_t compressNanos = 0;
+    uint64_t decompressedValues = 0;
+    uint64_t decompressNanos = 0;
+
+    double ratio() const {
+        return storedBytes == 0 ? 1.0 : static_cast<double>(rawBytes) / storedBytes;
+    }
+};
+
+// How an LsmStorageEngine shapes its levels
+enum class CompactionStyle {
+    Leveled,  // every level past 0 is one sorted run, each level multiplier times the last
+    Tiered,   // levels collect runs and merge them into one run of the next level
+};
+
+struct LsmOptions {
+    size_t memtableBytes = 4 << 20;       // the memtable is flushed to level 0 beyond this
+    size_t blockBytes = 4 << 10;          // SSTable block size, one index entry per block
+    uint64_t tableBytes = 2 << 20;        // compactions split their output into tables of about this
+    CompactionStyle compaction = CompactionStyle::Leveled;
+    size_t level0Runs = 4;                // flushed runs that trigger a level 0 compaction
+    uint64_t levelBaseBytes = 10 << 20;   // leveled: budget of level 1
+    size_t levelMultiplier = 10;          // leveled: budget growth from one level to the next
+    size_t tierRuns = 4;                  // tiered: runs that trigger merging a level
+    size_t maxLevels = 7;
+};
+
+// Range scans (scan())
+struct ScanOptions {
+    size_t batchKeys = 256;               // values fetched ahead per batch
+    uint64_t readAheadBytes = 1 << 20;    // table data prefetched ahead of an LSM scan or compaction
+};
+
+// Backend of the asynchronous API (getAsync)
+enum class AsyncIo {
+    Blocking,  // worker threads issuing pread
+    IoUring,   // one io_uring per engine; falls back to Blocking where unavailable
+};
+
+struct IoOptions {
+    AsyncIo backend = AsyncIo::IoUring;
+    unsigned queueDepth = 256;            // reads in flight; more are done inline by the caller
+    size_t fixedBuffers = 64;             // io_uring: registered buffers, for reads up to fixedBufferBytes
+    size_t fixedBufferBytes = 16 << 10;
+    size_t registeredFiles = 256;         // io_uring: segments read through a registered descriptor
+    size_t blockingThreads = 4;           // Blocking: worker threads
+};
+
+// Log shipping between a ReplicationLeader and its ReplicationFollowers
+struct ReplicationOptions {
+    std::string host;                     // leader: address to listen on, "" for all; follower: the leader's
+    uint16_t port = 7400;                 // leader: 0 takes any free port, see ReplicationLeader::port()
+    size_t frameBytes = 1 << 20;          // leader: most bytes of a segment per frame
+    std::chrono::milliseconds heartbeatInterval{ 100 };   // leader: while there is nothing new to send
+    std::chrono::milliseconds ioTimeout{ 5000 };          // a peer silent for longer is dropped
+    std::chrono::milliseconds reconnectInterval{ 500 };   // follower: between connection attempts
+};
+
+// Configuration of a StorageEngine (and, with lsm, of an LsmStorageEngine)
+struct EngineOptions {
+    std::string directory = ".";          // created if missing
+    std::string name = "store";           // segments are <directory>/<name>_<N>.txt
+    uint64_t segmentBytes = 64 << 20;     // the active segment rotates before exceeding this
+    bool preallocate = true;              // reserve segmentBytes of extents for every new segment
+    Durability durability;
+    SealedReadMode sealedReadMode = SealedReadMode::Mmap;
+    AccessPattern accessPattern = AccessPattern::Random;
+    MergeOptions merge;
+    IndexMode indexMode = IndexMode::KeyDir;
+    uint64_t valueCacheBytes = 0;         // ValueCache budget, 0 disables it
+    size_t valueCacheShards = 16;
+    CompressionOptions compression;
+    LsmOptions lsm;
+    ScanOptions scan;
+    IoOptions io;
+    bool metrics = true;                  // latency histograms and counters, see stats()
+
+    std::string prefix() const {
+        return (std::filesystem::path(directory) / name).string();
+    }
+
+    // Splits a "<directory>/<name>" prefix
+    static EngineOptions fromPrefix(const std::string& prefix) {
+        const std::filesystem::path path(prefix);
+        EngineOptions options;
+        options.directory = path.has_parent_path() ? path.parent_path().string() : ".";
+        options.name = path.filename().string();
+        return options;
+    }
+};
+
+// Token bucket pacing background I/O to a byte rate so merges do not compete
+// with foreground reads and writes for disk bandwidth. Not thread-safe.
+class RateLimiter {
+    uint64_t bytesPerSecond;
+    double available = 0;
+    std::chrono::steady_clock::time_point last = std::chrono::steady_clock::now();
+
+public:
+    explicit RateLimiter(uint64_t bytesPerSecond) : bytesPerSecond(bytesPerSecond) {}
+
+    void acquire(uint64_t bytes) {
+        if (bytesPerSecond == 0) return;
+        auto now = std::chrono::steady_clock::now();
+        available += std::chrono::duration<double>(now - last).count() * bytesPerSecond;
+        // Allow bursts of at most one second worth of I/O
+        available = std::min(available, static_cast<double>(bytesPerSecond));
+        last = now;
+        available -= bytes;
+        if (available < 0) {
+            std::this_thread::sleep_for(std::chrono::duration<double>(-available / bytesPerSecond));
+        }
+    }
+};
+
+struct MetaData {
+    uint64_t byteOffset;
+    uint32_t byteSize;
+    uint32_t flags;  // RECORD_FLAG_* of the record
+};
+
+// Epoch-based reclamation for structures that readers traverse without locks.
+//
+// A reader pins the current epoch for the duration of a lookup (EpochGuard).
+// A writer that unlinks an object (an outgrown table, a replaced segment list)
+// retires it instead of deleting it, and it is freed once every reader that
+// could still hold a pointer to it has unpinned. Pinning only writes a slot
+// owned by the calling thread, so readers never contend with each other or
+// with the writer.
+class EpochManager {
+    static constexpr size_t MAX_THREADS = 1024;
+
+    struct alignas(64) Participant {
+        std::atomic<uint64_t> epoch{ 0 };  // 0 while not pinned
+        std::atomic<bool> taken{ false };
+    };
+
+    struct ThreadState {
+        Participant* participant = nullptr;
+        bool joined = false;
+        size_t depth = 0;
+
+        ~ThreadState() {
+            if (participant != nullptr) {
+                participant->taken.store(false, std::memory_order_release);
+            }
+        }
+    };
+
+    Participant participants[MAX_THREADS];
+    std::atomic<uint64_t> globalEpoch{ 1 };
+    // Pins of threads that found no free participant slot; while there are
+    // any, nothing is reclaimed
+    std::atomic<size_t> overflowPins{ 0 };
+    std::mutex retiredMutex;
+    std::vector<std::pair<uint64_t, std::function<void()>>> retired;
+
+    static ThreadState& local() {
+        thread_local ThreadState state;
+        return state;
+    }
+
+    Participant* join() {
+        for (Participant& participant : participants) {
+            bool expected = false;
+            if (!participant.taken.load(std::memory_order_relaxed) &&
+                participant.taken.compare_exchange_strong(expected, true, std::memory_order_acquire)) {
+                return &participant;
+            }
+        }
+        return nullptr;
+    }
+
+    // Requires retiredMutex held
+    void collect() {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (overflowPins.load(std::memory_order_relaxed) > 0) return;
+        uint64_t oldest = UINT64_MAX;
+        for (const Participant& participant : participants) {
+            // Acquire pairs with unpin, so a reader's last loads happen before
+            // anything it could see is freed
+            uint64_t epoch = participant.epoch.load(std::memory_order_acquire);
+            if (epoch != 0) {
+                oldest = std::min(oldest, epoch);
+            }
+        }
+        // Readers pinned after an object was retired cannot have reached it
+        auto freeable = std::stable_partition(retired.begin(), retired.end(),
+            [oldest](const auto& entry) { return entry.first >= oldest; });
+        for (auto it = freeable; it != retired.end(); ++it) {
+            it->second();
+        }
+        retired.erase(freeable, retired.end());
+    }
+
+public:
+    // Never destroyed, so thread exit and static destruction order do not matter
+    static EpochManager& instance() {
+        static EpochManager* manager = new EpochManager();
+        return *manager;
+    }
+
+    // Pins nest; only the outermost pin of a thread publishes an epoch
+    void pin() {
+        ThreadState& state = local();
+        if (state.depth++ > 0) return;
+        if (!state.joined) {
+            state.participant = join();
+            state.joined = true;
+        }
+        if (state.participant == nullptr) {
+            overflowPins.fetch_add(1, std::memory_order_seq_cst);
+            return;
+        }
+        state.participant->epoch.store(globalEpoch.load(std::memory_order_acquire), std::memory_order_relaxed);
+        // Orders the pin before every load the reader makes under it
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+    }
+
+    void unpin() {
+        ThreadState& state = local();
+        if (--state.depth > 0) return;
+        if (state.participant == nullptr) {
+            overflowPins.fetch_sub(1, std::memory_order_release);
+            return;
+        }
+        state.participant->epoch.store(0, std::memory_order_release);
+    }
+
+    // Schedules deleter to run once no reader can reach the object. The
+    // object must already be unreachable for new readers.
+    void retire(std::function<void()> deleter) {
+        std::lock_guard<std::mutex> lock(retiredMutex);
+        uint64_t epoch = globalEpoch.fetch_add(1, std::memory_order_seq_cst);
+        retired.emplace_back(epoch, std::move(deleter));
+        collect();
+    }
+
+    // Frees whatever retired objects are no longer pinned
+    void reclaim() {
+        std::lock_guard<std::mutex> lock(retiredMutex);
+        collect();
+    }
+};
+
+class EpochGuard {
+public:
+    EpochGuard() {
+        EpochManager::instance().pin();
+    }
+    ~EpochGuard() {
+        EpochManager::instance().unpin();
+    }
+    EpochGuard(const EpochGuard&) = delete;
+    EpochGuard& operator=(const EpochGuard&) = delete;
+};
+
+// ---------------------------------------------------------------------------
+// Key and value codecs
+//
+// A codec maps a key or value type to the bytes records store, through
+// static members:
+//
+//   Type               the type encoded
+//   Param              how a value of it is passed in
+//   FIXED, SIZE        whether every value encodes to exactly SIZE bytes
+//   view(value)        the encoded bytes, viewing value itself
+//   decode(bytes, out) false when bytes are not an encoding of Type
+//   hash(value)        64 bits identifying the value; for fixed-width types
+//                      of up to eight bytes, the bytes themselves
+//
+// A fixed-width key codec is what lets record decoding check the key
+// against a compile-time size and index slots hold the key inline; keys of
+// other codecs are stored out of line and compared after their hash.
+// ---------------------------------------------------------------------------
+
+// 64-bit hash of a byte string, eight bytes at a time, for keys that do not
+// fit in a word
+inline uint64_t hashBytes(const char* data, size_t size) {
+    uint64_t h = 0x9E3779B97F4A7C15ull ^ (size * 0xC2B2AE3D27D4EB4Full);
+    auto absorb = [&h](uint64_t word) {
+        h = (h ^ (word * 0xBF58476D1CE4E5B9ull)) * 0x94D049BB133111EBull;
+        h ^= h >> 29;
+    };
+    for (; size >= 8; data += 8, size -= 8) {
+        uint64_t word;
+        std::memcpy(&word, data, 8);
+        absorb(word);
+    }
+    if (size > 0) {
+        uint64_t word = 0;
+        std::memcpy(&word, data, size);
+        absorb(word);
+    }
+    h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ull;
+    h = (h ^ (h >> 27)) * 0x94D049BB133111EBull;
+    return h ^ (h >> 31);
+}
+
+// Any trivially copyable type, stored as its object representation in host
+// byte order. Keys compare by their bytes, so key types with padding must
+// keep it zeroed.
+template <typename T>
+struct FixedCodec {
+    static_assert(std::is_trivially_copyable_v<T>, "fixed-width codecs copy the object representation");
+
+    using Type = T;
+    using Param = const T&;
+    static constexpr bool FIXED = true;
+    static constexpr size_t SIZE = sizeof(T);
+
+    static std::string_view view(const T& value) {
+        return { reinterpret_cast<const char*>(&value), SIZE };
+    }
+
+    static bool decode(std::string_view bytes, T& out) {
+        if (bytes.size() != SIZE) return false;
+        std::memcpy(&out, bytes.data(), SIZE);
+        return true;
+    }
+
+    static uint64_t hash(const T& value) {
+        if constexpr (SIZE <= sizeof(uint64_t)) {
+            uint64_t word = 0;
+            std::memcpy(&word, &value, SIZE);
+            return word;
+        }
+        else {
+            return hashBytes(reinterpret_cast<const char*>(&value), SIZE);
+        }
+    }
+};
+
+// Strings stored as their bytes. As keys they are limited to the 16-bit key
+// size of a record.
+struct StringCodec {
+    using Type = std::string;
+    using Param = std::string_view;
+    static constexpr bool FIXED = false;
+    static constexpr size_t SIZE = 0;
+
+    static std::string_view view(std::string_view value) {
+        return value;
+    }
+
+    static bool decode(std::string_view bytes, std::string& out) {
+        out.assign(bytes.data(), bytes.size());
+        return true;
+    }
+
+    static uint64_t hash(std::string_view value) {
+        return hashBytes(value.data(), value.size());
+    }
+};
+
+// The codec of a type unless an engine is given another
+template <typename T>
+using CodecFor = std::conditional_t<std::is_same_v<T, std::string>, StringCodec, FixedCodec<T>>;
+
+// Hash and equality by encoded key, for standard containers of keys
+template <typename KeyCodec>
+struct KeyHash {
+    size_t operator()(const typename KeyCodec::Type& key) const {
+        return static_cast<size_t>(KeyCodec::hash(key));
+    }
+};
+
+template <typename KeyCodec>
+struct KeyEqual {
+    bool operator()(const typename KeyCodec::Type& a, const typename KeyCodec::Type& b) const {
+        return KeyCodec::view(a) == KeyCodec::view(b);
+    }
+};
+
+template <typename KeyCodec>
+using KeySet = std::unordered_set<typename KeyCodec::Type, KeyHash<KeyCodec>, KeyEqual<KeyCodec>>;
+
+// How a FlatTable slot holds its key. A fixed-width key of up to eight bytes
+// is kept in the slot as a four- or eight-byte word, so matching a key is
+// one comparison; any other key lives in a heap copy the slot points to,
+// next to its hash, which is compared first.
+//
+// Stored is what a reader copies out of a slot and Probe what a lookup
+// compares it against. adopt() makes the slot's copy of a new key and
+// free() releases it once no reader can see it any more.
+template <typename KeyCodec, bool INLINE = KeyCodec::FIXED && KeyCodec::SIZE <= sizeof(uint64_t)>
+struct SlotKey;
+
+template <typename KeyCodec>
+struct SlotKey<KeyCodec, true> {
+    using Key = typename KeyCodec::Type;
+    using Word = std::conditional_t<KeyCodec::SIZE <= sizeof(uint32_t), uint32_t, uint64_t>;
+    using Stored = Word;
+    using Probe = Word;
+    static constexpr bool OWNS_MEMORY = false;
+
+    struct Field {
+        std::atomic<Word> word{ 0 };
+    };
+
+    static Probe probe(const Key& key) {
+        return static_cast<Word>(KeyCodec::hash(key));
+    }
+
+    static uint64_t hashOf(Word word) {
+        return word;
+    }
+
+    static Stored load(const Field& field) {
+        return field.word.load(std::memory_order_relaxed);
+    }
+
+    static void store(Field& field, Stored key) {
+        field.word.store(key, std::memory_order_relaxed);
+    }
+
+    static bool matches(Stored key, Probe probe) {
+        return key == probe;
+    }
+
+    static Key keyOf(Stored key) {
+        Key out;
+        std::memcpy(&out, &key, KeyCodec::SIZE);
+        return out;
+    }
+
+    static Stored adopt(Probe probe) {
+        return probe;
+    }
+
+    static void free(Stored) {}
+};
+
+template <typename KeyCodec>
+struct SlotKey<KeyCodec, false> {
+    using Key = typename KeyCodec::Type;
+    // Followed by size key bytes
+    struct Blob {
+        size_t size;
+    };
+    struct Stored {
+        uint64_t hash = 0;
+        const Blob* blob = nullptr;
+    };
+    struct Probe {
+        uint64_t hash;
+        std::string_view bytes;
+    };
+    static constexpr bool OWNS_MEMORY = true;
+
+    struct Field {
+        std::atomic<uint64_t> hash{ 0 };
+        std::atomic<const Blob*> blob{ nullptr };
+    };
+
+    static std::string_view bytesOf(const Blob* blob) {
+        return { reinterpret_cast<const char*>(blob + 1), blob->size };
+    }
+
+    static Probe probe(const Key& key) {
+        return { KeyCodec::hash(key), KeyCodec::view(key) };
+    }
+
+    static uint64_t hashOf(const Stored& key) {
+        return key.hash;
+    }
+
+    static uint64_t hashOf(const Probe& probe) {
+        return probe.hash;
+    }
+
+    static Stored load(const Field& field) {
+        return { field.hash.load(std::memory_order_relaxed), field.blob.load(std::memory_order_relaxed) };
+    }
+
+    static void store(Field& field, const Stored& key) {
+        field.hash.store(key.hash, std::memory_order_relaxed);
+        field.blob.store(key.blob, std::memory_order_relaxed);
+    }
+
+    // Only called on live slots, which always have a blob
+    static bool matches(const Stored& key, const Probe& probe) {
+        return key.hash == probe.hash && bytesOf(key.blob) == probe.bytes;
+    }
+
+    static Key keyOf(const Stored& key) {
+        Key out{};
+        KeyCodec::decode(bytesOf(key.blob), out);
+        return out;
+    }
+
+    static Stored adopt(const Probe& probe) {
+        Blob* blob = static_cast<Blob*>(::operator new(sizeof(Blob) + probe.bytes.size()));
+        blob->size = probe.bytes.size();
+        std::memcpy(blob + 1, probe.bytes.data(), probe.bytes.size());
+        return { probe.hash, blob };
+    }
+
+    static void free(const Stored& key) {
+        ::operator delete(const_cast<Blob*>(key.blob));
+    }
+};
+
+// Flat open-addressing table (linear probing) keyed by record key, with one
+// writer and any number of concurrent readers.
+//
+// Slots live in one contiguous array with the value stored inline, so a lookup
+// is a hash plus a short sequential probe over adjacent cache lines instead of
+// a red-black tree walk over heap nodes. Capacity is always a power of two and
+// the table is rebuilt once 70% of the slots are in use to keep probe
+// sequences short. Keys are held as SlotKey lays them out for KeyCodec.
+//
+// Readers take no lock. Each slot is a seqlock: the writer makes the slot's
+// sequence number odd while it rewrites the slot, and a reader retries a slot
+// whose sequence number was odd or changed while it was copied. Erased keys
+// leave a deleted marker rather than shifting later slots back, so a probe
+// running concurrently with an erase never misses a key. A rebuild fills a new
+// array, publishes it with one atomic store and retires the old one through
+// the EpochManager; out-of-line keys move to the new array as they are and
+// are retired only once erased. Mutations must be serialised by the owner.
+template <typename Value, typename KeyCodec = FixedCodec<int>>
+class FlatTable {
+private:
+    static_assert(std::is_trivially_copyable_v<Value>, "values are copied word by word");
+
+    using Key = typename KeyCodec::Type;
+    using Keys = SlotKey<KeyCodec>;
+    using Stored = typename Keys::Stored;
+    using Probe = typename Keys::Probe;
+
+    static constexpr size_t MIN_CAPACITY = 16;
+    static constexpr size_t WORDS = (sizeof(Value) + 7) / 8;
+    static constexpr uint32_t EMPTY = 0;
+    static constexpr uint32_t LIVE = 1;
+    static constexpr uint32_t DELETED = 2;
+    // Erased out-of-line keys are retired this many at a time
+    static constexpr size_t GARBAGE_BATCH = 64;
+
+    // seq: bit 0 is set while the slot is being written, bits 1-2 hold the
+    // slot state and the remaining bits count writes to the slot
+    struct Slot {
+        std::atomic<uint32_t> seq{ 0 };
+        typename Keys::Field key;
+        std::atomic<uint64_t> words[WORDS]{};
+    };
+
+    struct Table {
+        std::unique_ptr<Slot[]> slots;
+        size_t mask;
+
+        explicit Table(size_t capacity) : slots(new Slot[capacity]), mask(capacity - 1) {}
+    };
+
+    std::atomic<Table*> table;
+    std::atomic<size_t> count{ 0 };
+    // Live plus deleted slots; only touched by the writer
+    size_t used = 0;
+    // Keys erased since the last retire; only touched by the writer
+    std::vector<Stored> garbage;
+
+    // Fibonacci hashing spreads sequential keys across the whole table
+    static size_t hash(uint64_t keyHash) {
+        uint64_t h = keyHash * 0x9E3779B97F4A7C15ull;
+        return static_cast<size_t>(h ^ (h >> 32));
+    }
+
+    static uint32_t stateOf(uint32_t seq) {
+        return (seq >> 1) & 3;
+    }
+
+    static void write(Slot& slot, uint32_t state, const Stored& key, const Value& value) {
+        uint64_t words[WORDS] = {};
+        std::memcpy(words, &value, sizeof(Value));
+        uint32_t seq = slot.seq.load(std::memory_order_relaxed);
+        slot.seq.store(seq | 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        Keys::store(slot.key, key);
+        for (size_t i = 0; i < WORDS; i++) {
+            slot.words[i].store(words[i], std::memory_order_relaxed);
+        }
+        slot.seq.store((((seq >> 3) + 1) << 3) | (state << 1), std::memory_order_release);
+    }
+
+    // Consistent copy of a slot, retried while the writer is rewriting it.
+    // Returns the slot state.
+    static uint32_t read(const Slot& slot, Stored& key, Value& value) {
+        uint64_t words[WORDS];
+        for (unsigned attempt = 0;; attempt++) {
+            uint32_t seq = slot.seq.load(std::memory_order_acquire);
+            if ((seq & 1) == 0) {
+                key = Keys::load(slot.key);
+                for (size_t i = 0; i < WORDS; i++) {
+                    words[i] = slot.words[i].load(std::memory_order_relaxed);
+                }
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if (slot.seq.load(std::memory_order_relaxed) == seq) {
+                    std::memcpy(&value, words, sizeof(Value));
+                    return stateOf(seq);
+                }
+            }
+            // The writer may have been preempted mid-write
+            if (attempt >= 64) {
+                std::this_thread::yield();
+            }
+        }
+    }
+
+    // Writer side: the live slot holding key, or nullptr. `free` is set to the
+    // slot an insert of key should use.
+    static Slot* probe(Table& t, const Probe& key, Slot*& free) {
+        free = nullptr;
+        for (size_t i = hash(Keys::hashOf(key)) & t.mask;; i = (i + 1) & t.mask) {
+            Slot& slot = t.slots[i];
+            uint32_t state = stateOf(slot.seq.load(std::memory_order_relaxed));
+            if (state == EMPTY) {
+                if (free == nullptr) free = &slot;
+                return nullptr;
+            }
+            if (state == LIVE && Keys::matches(Keys::load(slot.key), key)) {
+                return &slot;
+            }
+            if (state == DELETED && free == nullptr) {
+                free = &slot;
+            }
+        }
+    }
+
+    // Rebuilds into a fresh array sized for the live keys, dropping deleted
+    // markers, and retires the old array
+    Table* rebuild() {
+        size_t live = count.load(std::memory_order_relaxed);
+        size_t capacity = MIN_CAPACITY;
+        while ((live + 1) * 2 * 10 > capacity * 7) {
+            capacity *= 2;
+        }
+        Table* previous = table.load(std::memory_order_relaxed);
+        Table* fresh = new Table(capacity);
+        for (size_t i = 0; i <= previous->mask; i++) {
+            Stored key;
+            Value value;
+            if (read(previous->slots[i], key, value) != LIVE) continue;
+            // Keys are unique and the fresh array has no deleted markers
+            size_t j = hash(Keys::hashOf(key)) & fresh->mask;
+            while (stateOf(fresh->slots[j].seq.load(std::memory_order_relaxed)) != EMPTY) {
+                j = (j + 1) & fresh->mask;
+            }
+            write(fresh->slots[j], LIVE, key, value);
+        }
+        used = live;
+        table.store(fresh, std::memory_order_release);
+        EpochManager::instance().retire([previous] { delete previous; });
+        return fresh;
+    }
+
+    // Hands the erased keys to the EpochManager
+    void retireGarbage() {
+        if (garbage.empty()) return;
+        EpochManager::instance().retire([keys = std::move(garbage)] {
+            for (const Stored& key : keys) {
+                Keys::free(key);
+            }
+        });
+        garbage.clear();
+    }
+
+    // Appends the keys of the live slots of t to out (writer only)
+    static void liveKeys(const Table& t, std::vector<Stored>& out) {
+        for (size_t i = 0; i <= t.mask; i++) {
+            if (stateOf(t.slots[i].seq.load(std::memory_order_relaxed)) == LIVE) {
+                out.push_back(Keys::load(t.slots[i].key));
+            }
+        }
+    }
+
+public:
+    FlatTable() : table(new Table(MIN_CAPACITY)) {}
+
+    ~FlatTable() {
+        Table* t = table.load();
+        if constexpr (Keys::OWNS_MEMORY) {
+            liveKeys(*t, garbage);
+            for (const Stored& key : garbage) {
+                Keys::free(key);
+            }
+        }
+        delete t;
+    }
+
+    FlatTable(const FlatTable&) = delete;
+    FlatTable& operator=(const FlatTable&) = delete;
+
+    size_t size() const {
+        return count.load(std::memory_order_relaxed);
+    }
+
+    // Inserts or overwrites the value of key (writer only)
+    void put(const Key& key, const Value& value) {
+        const Probe wanted = Keys::probe(key);
+        Table* t = table.load(std::memory_order_relaxed);
+        Slot* free;
+        if (Slot* slot = probe(*t, wanted, free)) {
+            write(*slot, LIVE, Keys::load(slot->key), value);
+            return;
+        }
+        if (stateOf(free->seq.load(std::memory_order_relaxed)) == EMPTY) {
+            if ((used + 1) * 10 > (t->mask + 1) * 7) {
+                t = rebuild();
+                probe(*t, wanted, free);
+            }
+            if (stateOf(free->seq.load(std::memory_order_relaxed)) == EMPTY) {
+                used++;
+            }
+        }
+        write(*free, LIVE, Keys::adopt(wanted), value);
+        count.store(count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+
+    // Copies the value of key into out; safe from any thread
+    bool find(const Key& key, Value& out) const {
+        const Probe wanted = Keys::probe(key);
+        EpochGuard guard;
+        const Table* t = table.load(std::memory_order_acquire);
+        size_t i = hash(Keys::hashOf(wanted)) & t->mask;
+        for (size_t probes = 0; probes <= t->mask; probes++, i = (i + 1) & t->mask) {
+            Stored slotKey;
+            Value value;
+            uint32_t state = read(t->slots[i], slotKey, value);
+            if (state == EMPTY) return false;
+            if (state == LIVE && Keys::matches(slotKey, wanted)) {
+                out = value;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Writer only
+    bool erase(const Key& key) {
+        Table* t = table.load(std::memory_order_relaxed);
+        Slot* free;
+        Slot* slot = probe(*t, Keys::probe(key), free);
+        if (slot == nullptr) return false;
+        const Stored erased = Keys::load(slot->key);
+        write(*slot, DELETED, Stored{}, Value{});
+        count.store(count.load(std::memory_order_relaxed) - 1, std::memory_order_relaxed);
+        if constexpr (Keys::OWNS_MEMORY) {
+            garbage.push_back(erased);
+            if (garbage.size() >= GARBAGE_BATCH) {
+                retireGarbage();
+            }
+        }
+        return true;
+    }
+
+    // Visits every (key, value) pair in unspecified order. Safe from any
+    // thread, but only a snapshot if the writer is active.
+    template <typename Fn>
+    void forEach(Fn&& fn) const {
+        EpochGuard guard;
+        const Table* t = table.load(std::memory_order_acquire);
+        for (size_t i = 0; i <= t->mask; i++) {
+            Stored key;
+            Value value;
+            if (read(t->slots[i], key, value) == LIVE) {
+                fn(Keys::keyOf(key), value);
+            }
+        }
+    }
+
+    // Writer only
+    void clear() {
+        Table* previous = table.exchange(new Table(MIN_CAPACITY), std::memory_order_acq_rel);
+        if constexpr (Keys::OWNS_MEMORY) {
+            liveKeys(*previous, garbage);
+            retireGarbage();
+        }
+        EpochManager::instance().retire([previous] { delete previous; });
+        count.store(0, std::memory_order_relaxed);
+        used = 0;
+    }
+};
+
+// Bloom filter over keys (double hashing, ~1% false positives at the default
+// 10 bits per key), fed either int keys or the hash of a key codec. Sized
+// for an expected key count; the owner rebuilds it larger once more keys
+// than that have been added. Bits are set atomically, so one thread may add
+// while others test.
+class BloomFilter {
+    static constexpr size_t BITS_PER_KEY = 10;
+    static constexpr int HASHES = 7;
+
+    std::unique_ptr<std::atomic<uint64_t>[]> bits;
+    size_t bitCount = 0;
+    size_t capacity = 0;
+    size_t count = 0;
+
+    static uint64_t mix(uint64_t keyHash) {
+        uint64_t h = keyHash + 0x9E3779B97F4A7C15ull;
+        h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ull;
+        h = (h ^ (h >> 27)) * 0x94D049BB133111EBull;
+        return h ^ (h >> 31);
+    }
+
+public:
+    explicit BloomFilter(size_t expectedKeys = 64) {
+        capacity = std::max<size_t>(expectedKeys, 64);
+        bitCount = capacity * BITS_PER_KEY;
+        bits.reset(new std::atomic<uint64_t>[(bitCount + 63) / 64]());
+    }
+
+    // keyHash as returned by KeyCodec::hash; an int key hashes to its bits
+    void addHash(uint64_t keyHash) {
+        uint64_t h = mix(keyHash);
+        uint64_t delta = (h >> 32) | 1;
+        for (int i = 0; i < HASHES; i++, h += delta) {
+            size_t bit = h % bitCount;
+            bits[bit / 64].fetch_or(1ull << (bit % 64), std::memory_order_relaxed);
+        }
+        count++;
+    }
+
+    bool mayContainHash(uint64_t keyHash) const {
+        uint64_t h = mix(keyHash);
+        uint64_t delta = (h >> 32) | 1;
+        for (int i = 0; i < HASHES; i++, h += delta) {
+            size_t bit = h % bitCount;
+            if ((bits[bit / 64].load(std::memory_order_relaxed) & (1ull << (bit % 64))) == 0) return false;
+        }
+        return true;
+    }
+
+    void add(int key) {
+        addHash(static_cast<uint32_t>(key));
+    }
+
+    bool mayContain(int key) const {
+        return mayContainHash(static_cast<uint32_t>(key));
+    }
+
+    bool isFull() const {
+        return count >= capacity;
+    }
+
+    // Appends the filter in the form load() reads back
+    void save(std::string& out) const {
+        const uint64_t header[2] = { capacity, count };
+        out.append(reinterpret_cast<const char*>(header), sizeof(header));
+        for (size_t i = 0; i < (bitCount + 63) / 64; i++) {
+            uint64_t word = bits[i].load(std::memory_order_relaxed);
+            out.append(reinterpret_cast<const char*>(&word), sizeof(word));
+        }
+    }
+
+    // A filter saved by save(), or nullptr if data is not one
+    static std::unique_ptr<BloomFilter> load(std::string_view data) {
+        uint64_t header[2];
+        if (data.size() < sizeof(header)) return nullptr;
+        std::memcpy(header, data.data(), sizeof(header));
+        if (header[0] < 64 || header[0] > data.size() * 8) return nullptr;
+        const size_t words = (header[0] * BITS_PER_KEY + 63) / 64;
+        if (data.size() != sizeof(header) + words * sizeof(uint64_t)) return nullptr;
+        auto filter = std::make_unique<BloomFilter>(header[0]);
+        for (size_t i = 0; i < words; i++) {
+            uint64_t word;
+            std::memcpy(&word, data.data() + sizeof(header) + i * sizeof(word), sizeof(word));
+            filter->bits[i].store(word, std::memory_order_relaxed);
+        }
+        filter->count = header[1];
+        return filter;
+    }
+
+    size_t memoryBytes() const {
+        return (bitCount + 63) / 64 * sizeof(uint64_t);
+    }
+};
+
+// Location of the newest record of a key across all segments
+struct KeyDirEntry {
+    uint32_t segmentUid;  // see SegmentSet
+    MetaData metaData;
+};
+
+// Per-file index: key -> location of its newest record in that file. Offsets
+// are assigned from a running total, so records must be added in file order.
+// One thread adds while any number of threads get.
+template <typename KeyCodec = FixedCodec<int>>
+class HashMap {
+private:
+    using Key = typename KeyCodec::Type;
+
+    FlatTable<MetaData, KeyCodec> table;
+    uint64_t currByteOffset = 0;
+
+public:
+    HashMap() = default;
+
+    uint64_t currentOffset() const {
+        return currByteOffset;
+    }
+
+    size_t size() const {
+        return table.size();
+    }
+
+    MetaData add(const Key& key, uint32_t recordSize, uint32_t flags = 0) {
+        MetaData metaData{ currByteOffset, recordSize, flags };
+        table.put(key, metaData);
+        currByteOffset += recordSize;
+        return metaData;
+    }
+
+    // Visits every (key, metaData) pair in unspecified order
+    template <typename Fn>
+    void forEach(Fn&& fn) const {
+        table.forEach(fn);
+    }
+
+    // Advances the running offset over bytes that are not an indexed record
+    // (file header, corrupted or dropped records)
+    void skip(uint64_t bytes) {
+        currByteOffset += bytes;
+    }
+
+    MetaData get(const Key& key) const {
+        MetaData metaData{ 0,0,0 };
+        table.find(key, metaData);
+        return metaData;
+    }
+
+    void reset() {
+        currByteOffset = 0;
+        table.clear();
+    }
+};
+
+// ---------------------------------------------------------------------------
+// On-disk format
+//
+// Every binary segment starts with a FileHeader, followed by records:
+//
+//   | crc32c | flags | reserved | keySize | valueSize | key bytes | value bytes |
+//     4        1       1          2         4
+//
+// The CRC covers everything after the crc field. All integers are stored in
+// host (little-endian) byte order. All records of a WriteBatch except the last
+// carry RECORD_FLAG_BATCH, so recovery can drop a batch torn by a crash as a
+// whole. A segment that does not start with the
+// magic is a legacy text segment of "key,value\0" records.
+// ---------------------------------------------------------------------------
+
+const uint32_t FILE_MAGIC = 0x474C564B; // "KVLG"
+const uint16_t FORMAT_VERSION = 1;
+
+const uint8_t RECORD_FLAG_TOMBSTONE = 1;  // delete marker, value is empty
+const uint8_t RECORD_FLAG_BATCH = 2;      // more records of this batch follow
+const uint8_t RECORD_FLAG_COMPRESSED = 4; // value is stored compressed, see compressValue
+const uint8_t RECORD_FLAG_DICTIONARY = 8; // zstd dictionary of the segment, not a key
+
+struct FileHeader {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t reserved;
+};
+
+struct RecordHeader {
+    uint32_t crc;
+    uint8_t flags;
+    uint8_t reserved;
+    uint16_t keySize;
+    uint32_t valueSize;
+};
+
+static_assert(sizeof(FileHeader) == 8, "FileHeader must be packed");
+static_assert(sizeof(RecordHeader) == 12, "RecordHeader must be packed");
+
+// Hint file: HintHeader, `count` HintEntry values sorted by offset, then a
+// CRC32C over both. Only written for sealed segments. Version 2 is for
+// four-byte keys, held in the entry; in version 3 every entry is followed by
+// keyBytes bytes of key instead.
+const uint32_t HINT_MAGIC = 0x544E4948; // "HINT"
+const uint16_t HINT_VERSION = 2;
+const uint16_t HINT_VERSION_KEYED = 3;
+const uint16_t HINT_FLAG_LEGACY = 1;
+
+struct HintHeader {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t flags;
+    uint64_t dataSize;  // size of the data file the hint describes
+    uint64_t count;
+};
+
+struct HintEntry {
+    uint64_t byteOffset;
+    uint32_t byteSize;
+    int32_t key;        // version 2 only
+    uint32_t flags;
+    uint32_t keyBytes;  // version 3 only
+};
+
+static_assert(sizeof(HintHeader) == 24, "HintHeader must be packed");
+static_assert(sizeof(HintEntry) == 24, "HintEntry must be packed");
+
+// CRC32C (Castagnoli), using the SSE4.2 instruction when it is available
+#if defined(__SSE4_2__)
+#include <nmmintrin.h>
+
+inline uint32_t crc32c(uint32_t crc, const char* data, size_t size) {
+    crc = ~crc;
+    while (size >= 8) {
+        uint64_t word;
+        std::memcpy(&word, data, 8);
+        crc = static_cast<uint32_t>(_mm_crc32_u64(crc, word));
+        data += 8;
+        size -= 8;
+    }
+    while (size-- > 0) {
+        crc = _mm_crc32_u8(crc, static_cast<uint8_t>(*data++));
+    }
+    return ~crc;
+}
+#else
+inline uint32_t crc32c(uint32_t crc, const char* data, size_t size) {
+    static const auto table = [] {
+        std::array<uint32_t, 256> t{};
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++) {
+                c = (c & 1) ? (c >> 1) ^ 0x82F63B78u : c >> 1;
+            }
+            t[i] = c;
+        }
+        return t;
+    }();
+    crc = ~crc;
+    while (size-- > 0) {
+        crc = table[(crc ^ static_cast<uint8_t>(*data++)) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+#endif
+
+// Largest value that still fits the 32-bit record size kept in the index,
+// with an int key
+const size_t MAX_VALUE_SIZE = UINT32_MAX - sizeof(RecordHeader) - sizeof(int);
+
+// Appends one encoded record of key bytes and value to `out` and returns its
+// size in bytes. The key must fit the 16-bit key size.
+inline size_t encodeRecord(std::string& out, std::string_view key, std::string_view value, uint8_t flags = 0) {
+    RecordHeader header{ 0, flags, 0, static_cast<uint16_t>(key.size()), static_cast<uint32_t>(value.size()) };
+    size_t start = out.size();
+    out.append(reinterpret_cast<const char*>(&header), sizeof(header));
+    out.append(key.data(), key.size());
+    out.append(value.data(), value.size());
+
+    uint32_t crc = crc32c(0, out.data() + start + sizeof(header.crc),
+        out.size() - start - sizeof(header.crc));
+    std::memcpy(&out[start], &crc, sizeof(crc));
+    return out.size() - start;
+}
+
+inline size_t encodeRecord(std::string& out, int key, std::string_view value, uint8_t flags = 0) {
+    return encodeRecord(out, FixedCodec<int>::view(key), value, flags);
+}
+
+// Validates the record stored in data[0, size) and extracts the bytes of its
+// key, stored value and flags. With a fixed-width KeyCodec a key of any other
+// size is rejected before the checksum is computed.
+template <typename KeyCodec>
+bool decodeRecord(const char* data, size_t size, std::string_view& key, std::string_view& value, uint8_t& flags) {
+    if (size < sizeof(RecordHeader)) return false;
+    RecordHeader header;
+    std::memcpy(&header, data, sizeof(header));
+    if constexpr (KeyCodec::FIXED) {
+        if (header.keySize != KeyCodec::SIZE) return false;
+    }
+    if (sizeof(header) + header.keySize + header.valueSize != size) return false;
+    if (crc32c(0, data + sizeof(header.crc), size - sizeof(header.crc)) != header.crc) return false;
+
+    key = std::string_view(data + sizeof(header), header.keySize);
+    value = std::string_view(data + sizeof(header) + header.keySize, header.valueSize);
+    flags = header.flags;
+    return true;
+}
+
+inline bool decodeRecord(const char* data, size_t size, int& key, std::string_view& value, uint8_t& flags) {
+    std::string_view keyBytes;
+    return decodeRecord<FixedCodec<int>>(data, size, keyBytes, value, flags) &&
+        FixedCodec<int>::decode(keyBytes, key);
+}
+
+inline bool decodeRecord(const char* data, size_t size, int& key, std::string_view& value) {
+    uint8_t flags;
+    return decodeRecord(data, size, key, value, flags);
+}
+
+// Extracts the value of a legacy "key,value\0" record
+inline bool decodeLegacyRecord(const char* data, size_t size, std::string_view& value) {
+    std::string_view record(data, size);
+    size_t commaPos = record.find(',');
+    if (commaPos == std::string_view::npos || record.back() != DELIMITER) return false;
+    value = record.substr(commaPos + 1, record.size() - commaPos - 2);
+    return true;
+}
+
+// Byte masks of ',' and DELIMITER in the 64 bytes at data: bit i is set when
+// data[i] is one. AVX2 or SSE2 on x86-64, NEON on AArch64, a plain loop
+// (which compilers vectorise as they can) elsewhere.
+#if defined(__AVX2__)
+#include <immintrin.h>
+
+inline void legacySeparators(const char* data, uint64_t& commas, uint64_t& delimiters) {
+    const __m256i comma = _mm256_set1_epi8(',');
+    const __m256i delimiter = _mm256_set1_epi8(DELIMITER);
+    const __m256i low = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data));
+    const __m256i high = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + 32));
+    commas = static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(low, comma))) |
+        static_cast<uint64_t>(static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(high, comma)))) << 32;
+    delimiters = static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(low, delimiter))) |
+        static_cast<uint64_t>(static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(high, delimiter)))) << 32;
+}
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+
+inline void legacySeparators(const char* data, uint64_t& commas, uint64_t& delimiters) {
+    const __m128i comma = _mm_set1_epi8(',');
+    const __m128i delimiter = _mm_set1_epi8(DELIMITER);
+    commas = 0;
+    delimiters = 0;
+    for (int i = 0; i < 4; i++) {
+        const __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 16 * i));
+        const uint16_t commaBits = static_cast<uint16_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, comma)));
+        const uint16_t delimiterBits = static_cast<uint16_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, delimiter)));
+        commas |= static_cast<uint64_t>(commaBits) << (16 * i);
+        delimiters |= static_cast<uint64_t>(delimiterBits) << (16 * i);
+    }
+}
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+
+// NEON has no movemask: narrowing each 16-byte compare to 4 bits per byte
+// gives a 64-bit nibble mask with one nibble per byte
+inline uint64_t neonNibbleMask(uint8x16_t matches) {
+    return vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(matches), 4)), 0);
+}
+
+// Folds a nibble mask (0x0 or 0xF per byte) to one bit per byte
+inline uint64_t neonBitMask(uint64_t nibbles) {
+    nibbles &= 0x1111111111111111ull;
+    uint64_t bits = 0;
+    for (int i = 0; i < 16; i++) {
+        bits |= ((nibbles >> (4 * i)) & 1) << i;
+    }
+    return bits;
+}
+
+inline void legacySeparators(const char* data, uint64_t& commas, uint64_t& delimiters) {
+    const uint8x16_t comma = vdupq_n_u8(',');
+    const uint8x16_t delimiter = vdupq_n_u8(static_cast<uint8_t>(DELIMITER));
+    commas = 0;
+    delimiters = 0;
+    for (int i = 0; i < 4; i++) {
+        const uint8x16_t bytes = vld1q_u8(reinterpret_cast<const uint8_t*>(data + 16 * i));
+        const uint64_t commaNibbles = neonNibbleMask(vceqq_u8(bytes, comma));
+        const uint64_t delimiterNibbles = neonNibbleMask(vceqq_u8(bytes, delimiter));
+        if (commaNibbles != 0) commas |= neonBitMask(commaNibbles) << (16 * i);
+        if (delimiterNibbles != 0) delimiters |= neonBitMask(delimiterNibbles) << (16 * i);
+    }
+}
+#else
+inline void legacySeparators(const char* data, uint64_t& commas, uint64_t& delimiters) {
+    commas = 0;
+    delimiters = 0;
+    for (int i = 0; i < 64; i++) {
+        commas |= static_cast<uint64_t>(data[i] == ',') << i;
+        delimiters |= static_cast<uint64_t>(data[i] == DELIMITER) << i;
+    }
+}
+#endif
+
+// One legacy record found by scanLegacyRecords: its text starts at `text`,
+// comma is its first ',' (nullptr without one) and size includes the
+// delimiter
+struct LegacyRecord {
+    const char* text;
+    const char* comma;
+    uint32_t size;
+};
+
+// Splits data[0, size) into legacy records, 64 bytes per step: delimiters
+// end records and only the first comma of each record is kept. Appends the
+// complete records to out and returns the bytes they cover; the rest is an
+// unfinished record.
+inline size_t scanLegacyRecords(const char* data, size_t size, std::vector<LegacyRecord>& out) {
+    size_t start = 0;
+    const char* comma = nullptr;
+    size_t block = 0;
+    for (; block + 64 <= size; block += 64) {
+        uint64_t commas;
+        uint64_t delimiters;
+        legacySeparators(data + block, commas, delimiters);
+        while (delimiters != 0) {
+            const int bit = std::countr_zero(delimiters);
+            const uint64_t upTo = bit == 63 ? ~0ull : (2ull << bit) - 1;
+            if (comma == nullptr && (commas & upTo) != 0) {
+                comma = data + block + std::countr_zero(commas & upTo);
+            }
+            const size_t end = block + bit + 1;
+            out.push_back({ data + start, comma, static_cast<uint32_t>(end - start) });
+            start = end;
+            comma = nullptr;
+            commas &= ~upTo;
+            delimiters &= delimiters - 1;
+        }
+        if (comma == nullptr && commas != 0) {
+            comma = data + block + std::countr_zero(commas);
+        }
+    }
+    for (; block < size; block++) {
+        if (data[block] == ',' && comma == nullptr) {
+            comma = data + block;
+        }
+        else if (data[block] == DELIMITER) {
+            out.push_back({ data + start, comma, static_cast<uint32_t>(block + 1 - start) });
+            start = block + 1;
+            comma = nullptr;
+        }
+    }
+    return start;
+}
+
+// Key and value codec of an engine (StorageEngine<Key, Value, Codec>)
+template <typename KeyCodecType, typename ValueCodecType>
+struct RecordCodec {
+    using KeyCodec = KeyCodecType;
+    using ValueCodec = ValueCodecType;
+
+    static_assert(!KeyCodec::FIXED || KeyCodec::SIZE <= UINT16_MAX, "keys must fit the 16-bit key size");
+
+    // Whether a record of these key and value bytes can be encoded and
+    // indexed at all
+    static bool fits(std::string_view key, std::string_view value) {
+        return key.size() <= UINT16_MAX && value.size() <= UINT32_MAX - sizeof(RecordHeader) - key.size();
+    }
+};
+
+template <typename Key, typename Value>
+using DefaultCodec = RecordCodec<CodecFor<Key>, CodecFor<Value>>;
+
+// ---------------------------------------------------------------------------
+// Value compression
+//
+// A record with RECORD_FLAG_COMPRESSED stores, in place of its value,
+//
+//   | codec | rawSize | compressed bytes |
+//     1       4
+//
+// CODEC_LZ4 data is an LZ4 block. liblz4 is used when its header is found,
+// otherwise the built-in block codec below, and both read each other's
+// output. Zstd needs libzstd. Merges can also train a zstd dictionary over
+// the values they copy; it is stored as the first record of the merged
+// segment (RECORD_FLAG_DICTIONARY) and used by every CODEC_ZSTD_DICTIONARY
+// record of that segment. Builds that find the headers must link -llz4 and
+// -lzstd.
+// ---------------------------------------------------------------------------
+
+// Detected from the headers unless the build says otherwise (see
+// CMakeLists.txt, which also links the libraries)
+#if !defined(KV_HAVE_LZ4)
+#if __has_include(<lz4.h>)
+#define KV_HAVE_LZ4 1
+#else
+#define KV_HAVE_LZ4 0
+#endif
+#endif
+
+#if !defined(KV_HAVE_ZSTD)
+#if __has_include(<zstd.h>) && __has_include(<zdict.h>)
+#define KV_HAVE_ZSTD 1
+#else
+#define KV_HAVE_ZSTD 0
+#endif
+#endif
+
+#if KV_HAVE_LZ4
+#include <lz4.h>
+#endif
+#if KV_HAVE_ZSTD
+#include <zstd.h>
+#include <zdict.h>
+#endif
+
+const uint8_t CODEC_LZ4 = 1;
+const uint8_t CODEC_ZSTD = 2;
+const uint8_t CODEC_ZSTD_DICTIONARY = 3;
+const size_t COMPRESSED_PREFIX = 5;
+
+// Compression work done by an engine. Updated concurrently by writers,
+// readers and merges.
+struct CompressionCounters {
+    std::atomic<uint64_t> compressedValues{ 0 };
+    std::atomic<uint64_t> rawBytes{ 0 };
+    std::atomic<uint64_t> storedBytes{ 0 };
+    std::atomic<uint64_t> compressNanos{ 0 };
+    std::atomic<uint64_t> decompressedValues{ 0 };
+    std::atomic<uint64_t> decompressNanos{ 0 };
+
+    CompressionStats snapshot() const {
+        CompressionStats stats;
+        stats.compressedValues = compressedValues.load(std::memory_order_relaxed);
+        stats.rawBytes = rawBytes.load(std::memory_order_relaxed);
+        stats.storedBytes = storedBytes.load(std::memory_order_relaxed);
+        stats.compressNanos = compressNanos.load(std::memory_order_relaxed);
+        stats.decompressedValues = decompressedValues.load(std::memory_order_relaxed);
+        stats.decompressNanos = decompressNanos.load(std::memory_order_relaxed);
+        return stats;
+    }
+};
+
+inline uint64_t elapsedNanos(std::chrono::steady_clock::time_point start) {
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - start).count());
+}
+
+// Operations with a latency histogram in Metrics
+enum class Op {
+    Set,         // one write() call, batch or single put, until committed
+    Get,
+    Flush,       // writing a commit group to the log, or a memtable to a table
+    Fsync,
+    Rotation,    // sealing the active segment (memtable) and swapping in the next
+    Compaction,  // one merge or compaction
+};
+const size_t OP_COUNT = 6;
+
+enum class Counter {
+    WrittenBytes,           // encoded bytes of committed writes
+    ReadBytes,              // value bytes returned by gets
+    GetMisses,
+    CompactionReadBytes,
+    CompactionWrittenBytes,
+};
+const size_t COUNTER_COUNT = 5;
+
+inline const char* opName(Op op) {
+    static const char* const names[] = { "set", "get", "flush", "fsync", "rotation", "compaction" };
+    return names[static_cast<size_t>(op)];
+}
+
+inline const char* counterName(Counter counter) {
+    static const char* const names[] = {
+        "written_bytes", "read_bytes", "get_misses", "compaction_read_bytes", "compaction_written_bytes",
+    };
+    return names[static_cast<size_t>(counter)];
+}
+
+// Log-linear latency buckets in the manner of HdrHistogram. Values below
+// SUB_BUCKETS nanoseconds get a bucket each; above that every power of two is
+// split into SUB_BUCKETS buckets, so a bucket is never wider than 1/8 of the
+// values it holds. Anything from 2^MAX_MAGNITUDE ns (about 69 s) up lands in
+// the last bucket.
+struct LatencyBuckets {
+    static constexpr unsigned SUB_BITS = 3;
+    static constexpr size_t SUB_BUCKETS = size_t(1) << SUB_BITS;
+    static constexpr unsigned MAX_MAGNITUDE = 36;
+    static constexpr size_t COUNT = (MAX_MAGNITUDE - SUB_BITS + 1) * SUB_BUCKETS;
+
+    static size_t index(uint64_t nanos) {
+        if (nanos < SUB_BUCKETS) return static_cast<size_t>(nanos);
+        const unsigned magnitude = 63 - std::countl_zero(nanos);
+        if (magnitude >= MAX_MAGNITUDE) return COUNT - 1;
+        const unsigned shift = magnitude - SUB_BITS;
+        return (shift + 1) * SUB_BUCKETS + static_cast<size_t>((nanos >> shift) - SUB_BUCKETS);
+    }
+
+    // Largest value that falls into bucket i
+    static uint64_t upperBound(size_t i) {
+        if (i < SUB_BUCKETS) return i;
+        const size_t shift = i / SUB_BUCKETS - 1;
+        return ((SUB_BUCKETS + i % SUB_BUCKETS) << shift) + (uint64_t(1) << shift) - 1;
+    }
+};
+
+// Snapshot of one latency histogram
+struct LatencyStats {
+    uint64_t count = 0;
+    uint64_t totalNanos = 0;
+    uint64_t maxNanos = 0;
+    std::vector<uint64_t> buckets = std::vector<uint64_t>(LatencyBuckets::COUNT);
+
+    double meanNanos() const {
+        return count == 0 ? 0.0 : static_cast<double>(totalNanos) / count;
+    }
+
+    // Upper bound of the bucket holding the q-th quantile, q in [0, 1]
+    uint64_t quantileNanos(double q) const {
+        if (count == 0) return 0;
+        const uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(q * count + 0.5));
+        uint64_t seen = 0;
+        for (size_t i = 0; i < buckets.size(); i++) {
+            seen += buckets[i];
+            if (seen >= rank) return std::min(LatencyBuckets::upperBound(i), maxNanos);
+        }
+        return maxNanos;
+    }
+
+    void merge(const LatencyStats& other) {
+        count += other.count;
+        totalNanos += other.totalNanos;
+        maxNanos = std::max(maxNanos, other.maxNanos);
+        for (size_t i = 0; i < buckets.size(); i++) {
+            buckets[i] += other.buckets[i];
+        }
+    }
+};
+
+struct MetricsSnapshot {
+    std::array<LatencyStats, OP_COUNT> latencies;
+    std::array<uint64_t, COUNTER_COUNT> counters{};
+
+    const LatencyStats& latency(Op op) const {
+        return latencies[static_cast<size_t>(op)];
+    }
+
+    uint64_t counter(Counter counter) const {
+        return counters[static_cast<size_t>(counter)];
+    }
+
+    void merge(const MetricsSnapshot& other) {
+        for (size_t i = 0; i < OP_COUNT; i++) {
+            latencies[i].merge(other.latencies[i]);
+        }
+        for (size_t i = 0; i < COUNTER_COUNT; i++) {
+            counters[i] += other.counters[i];
+        }
+    }
+};
+
+// Latency histograms and counters of one engine. Threads are assigned a
+// stripe each, round robin, and only ever touch their own stripe with relaxed
+// atomic adds, so recording takes no lock and shares no cache line as long as
+// there are no more threads than stripes. snapshot() sums the stripes.
+class Metrics {
+    static constexpr size_t STRIPES = 8;
+
+    struct Histogram {
+        std::atomic<uint64_t> count{ 0 };
+        std::atomic<uint64_t> totalNanos{ 0 };
+        std::atomic<uint64_t> maxNanos{ 0 };
+        std::array<std::atomic<uint64_t>, LatencyBuckets::COUNT> buckets{};
+    };
+
+    struct alignas(64) Stripe {
+        std::array<Histogram, OP_COUNT> histograms;
+        std::array<std::atomic<uint64_t>, COUNTER_COUNT> counters{};
+    };
+
+    // Null when metrics are disabled
+    std::unique_ptr<Stripe[]> stripes;
+
+    Stripe& stripe() const {
+        static std::atomic<size_t> nextStripe{ 0 };
+        thread_local const size_t index = nextStripe.fetch_add(1, std::memory_order_relaxed) % STRIPES;
+        return stripes[index];
+    }
+
+public:
+    // Measures the time from its construction to its destruction
+    class Timer {
+        const Metrics* metrics;
+        Op op;
+        std::chrono::steady_clock::time_point start;
+
+    public:
+        Timer(const Metrics* metrics, Op op) : metrics(metrics), op(op) {
+            if (metrics != nullptr) start = std::chrono::steady_clock::now();
+        }
+        Timer(const Timer&) = delete;
+        Timer& operator=(const Timer&) = delete;
+        ~Timer() {
+            if (metrics != nullptr) metrics->record(op, elapsedNanos(start));
+        }
+    };
+
+    explicit Metrics(bool enabled) {
+        if (enabled) stripes.reset(new Stripe[STRIPES]);
+    }
+
+    bool enabled() const {
+        return stripes != nullptr;
+    }
+
+    [[nodiscard]] Timer time(Op op) const {
+        return Timer(enabled() ? this : nullptr, op);
+    }
+
+    void record(Op op, uint64_t nanos) const {
+        if (!enabled()) return;
+        Histogram& histogram = stripe().histograms[static_cast<size_t>(op)];
+        histogram.buckets[LatencyBuckets::index(nanos)].fetch_add(1, std::memory_order_relaxed);
+        histogram.count.fetch_add(1, std::memory_order_relaxed);
+        histogram.totalNanos.fetch_add(nanos, std::memory_order_relaxed);
+        uint64_t max = histogram.maxNanos.load(std::memory_order_relaxed);
+        while (nanos > max && !histogram.maxNanos.compare_exchange_weak(max, nanos, std::memory_order_relaxed)) {}
+    }
+
+    void add(Counter counter, uint64_t amount = 1) const {
+        if (!enabled()) return;
+        stripe().counters[static_cast<size_t>(counter)].fetch_add(amount, std::memory_order_relaxed);
+    }
+
+    // Sums the stripes. Concurrent updates may or may not be included, and a
+    // histogram's count can be a few updates off the sum of its buckets.
+    MetricsSnapshot snapshot() const {
+        MetricsSnapshot snapshot;
+        if (!enabled()) return snapshot;
+        for (size_t s = 0; s < STRIPES; s++) {
+            const Stripe& source = stripes[s];
+            for (size_t op = 0; op < OP_COUNT; op++) {
+                const Histogram& histogram = source.histograms[op];
+                LatencyStats& stats = snapshot.latencies[op];
+                stats.count += histogram.count.load(std::memory_order_relaxed);
+                stats.totalNanos += histogram.totalNanos.load(std::memory_order_relaxed);
+                stats.maxNanos = std::max(stats.maxNanos, histogram.maxNanos.load(std::memory_order_relaxed));
+                for (size_t i = 0; i < LatencyBuckets::COUNT; i++) {
+                    stats.buckets[i] += histogram.buckets[i].load(std::memory_order_relaxed);
+                }
+            }
+            for (size_t c = 0; c < COUNTER_COUNT; c++) {
+                snapshot.counters[c] += source.counters[c].load(std::memory_order_relaxed);
+            }
+        }
+        return snapshot;
+    }
+};
+
+// Builds a Prometheus text exposition (format 0.0.4). Samples of one metric
+// share a single HELP/TYPE header in the output, in whatever order and with
+// whatever labels they were added. Labels are given as a comma separated
+// list of name="value" pairs, like shard="0".
+class PrometheusWriter {
+    struct Family {
+        std::string help;
+        std::string type;
+        std::string samples;
+    };
+    std::vector<std::pair<std::string, Family>> families;
+    std::unordered_map<std::string, size_t> byName;
+
+    Family& family(const std::string& name, const char* help, const char* type) {
+        auto [it, inserted] = byName.emplace(name, families.size());
+        if (inserted) {
+            families.push_back({ name, { help, type, {} } });
+        }
+        return families[it->second].second;
+    }
+
+    static std::string labelSet(const std::string& labels, const std::string& extra = {}) {
+        if (labels.empty() && extra.empty()) return {};
+        return "{" + labels + (labels.empty() || extra.empty() ? "" : ",") + extra + "}";
+    }
+
+    static std::string number(double value) {
+        char text[32];
+        std::snprintf(text, sizeof(text), "%.9g", value);
+        return text;
+    }
+
+    static void sample(Family& family, const std::string& name, const std::string& labels, const std::string& value) {
+        family.samples += name + labels + " " + value + "\n";
+    }
+
+public:
+    void counter(const std::string& name, const char* help, uint64_t value, const std::string& labels = {}) {
+        sample(family(name, help, "counter"), name, labelSet(labels), std::to_string(value));
+    }
+
+    void gauge(const std::string& name, const char* help, double value, const std::string& labels = {}) {
+        sample(family(name, help, "gauge"), name, labelSet(labels), number(value));
+    }
+
+    // Histogram in seconds with one bucket per power of two nanoseconds from
+    // 1 us up, which coincide with bucket boundaries of LatencyStats
+    void histogram(const std::string& name, const char* help, const LatencyStats& stats,
+        const std::string& labels = {}) {
+        const unsigned FIRST_MAGNITUDE = 10;
+        Family& out = family(name, help, "histogram");
+        uint64_t cumulative = 0;
+        size_t i = 0;
+        for (unsigned magnitude = FIRST_MAGNITUDE; magnitude <= LatencyBuckets::MAX_MAGNITUDE; magnitude++) {
+            const uint64_t bound = uint64_t(1) << magnitude;
+            for (; i < LatencyBuckets::COUNT - 1 && LatencyBuckets::upperBound(i) < bound; i++) {
+                cumulative += stats.buckets[i];
+            }
+            sample(out, name + "_bucket", labelSet(labels, "le=\"" + number(bound / 1e9) + "\""),
+                std::to_string(cumulative));
+        }
+        sample(out, name + "_bucket", labelSet(labels, "le=\"+Inf\""), std::to_string(stats.count));
+        sample(out, name + "_sum", labelSet(labels), number(stats.totalNanos / 1e9));
+        sample(out, name + "_count", labelSet(labels), std::to_string(stats.count));
+    }
+
+    // Every latency histogram and counter of an engine
+    void metrics(const MetricsSnapshot& snapshot, const std::string& labels = {}) {
+        for (size_t op = 0; op < OP_COUNT; op++) {
+            const std::string opLabel = "op=\"" + std::string(opName(static_cast<Op>(op))) + "\"";
+            histogram("kv_latency_seconds", "Latency of engine operations", snapshot.latencies[op],
+                labels.empty() ? opLabel : labels + "," + opLabel);
+        }
+        static const char* const help[COUNTER_COUNT] = {
+            "Encoded bytes of committed writes",
+            "Value bytes returned by gets",
+            "Gets of keys that were not found",
+            "Bytes read by merges and compactions",
+            "Bytes written by merges and compactions",
+        };
+        for (size_t c = 0; c < COUNTER_COUNT; c++) {
+            counter(std::string("kv_") + counterName(static_cast<Counter>(c)) + "_total",
+                help[c], snapshot.counters[c], labels);
+        }
+    }
+
+    std::string text() const {
+        std::string out;
+        for (const auto& [name, family] : families) {
+            out += "# HELP " + name + " " + family.help + "\n";
+            out += "# TYPE " + name + " " + family.type + "\n";
+            out += family.samples;
+        }
+        return out;
+    }
+};
+
+// Worst-case size of an LZ4 block for size input bytes
+inline size_t lz4Bound(size_t size) {
+    return size + size / 255 + 16;
+}
+
+// Greedy LZ4 block compressor with a 4096-entry hash of 4-byte sequences.
+// dst must hold lz4Bound(size) bytes; returns the block size.
+inline size_t lz4CompressBlock(const char* src, size_t size, char* dst) {
+    // Format limits: the last match starts at least 12 bytes before the end
+    // and the last 5 bytes are always literals
+    const size_t MIN_MATCH = 4;
+    const size_t MF_LIMIT = 12;
+    const size_t LAST_LITERALS = 5;
+    const int HASH_BITS = 12;
+
+    auto load32 = [src](size_t position) {
+        uint32_t word;
+        std::memcpy(&word, src + position, sizeof(word));
+        return word;
+    };
+    char* out = dst;
+    auto writeLength = [&out](size_t length) {
+        for (; length >= 255; length -= 255) {
+            *out++ = static_cast<char>(255);
+        }
+        *out++ = static_cast<char>(length);
+    };
+    auto emit = [&](size_t literalStart, size_t literalLength, size_t offset, size_t matchLength) {
+        uint8_t token = static_cast<uint8_t>(std::min<size_t>(literalLength, 15) << 4);
+        if (matchLength > 0) {
+            token |= static_cast<uint8_t>(std::min<size_t>(matchLength - MIN_MATCH, 15));
+        }
+        *out++ = static_cast<char>(token);
+        if (literalLength >= 15) writeLength(literalLength - 15);
+        std::memcpy(out, src + literalStart, literalLength);
+        out += literalLength;
+        if (matchLength == 0) return;
+        *out++ = static_cast<char>(offset & 0xFF);
+        *out++ = static_cast<char>(offset >> 8);
+        if (matchLength - MIN_MATCH >= 15) writeLength(matchLength - MIN_MATCH - 15);
+    };
+
+    size_t anchor = 0;
+    if (size > MF_LIMIT) {
+        // Positions are stored plus one, so 0 means empty. One table per
+        // thread, cleared rather than allocated for every value.
+        thread_local std::array<uint32_t, size_t(1) << HASH_BITS> table;
+        table.fill(0);
+        size_t position = 0;
+        while (position < size - MF_LIMIT) {
+            uint32_t sequence = load32(position);
+            uint32_t hash = (sequence * 2654435761u) >> (32 - HASH_BITS);
+            size_t candidate = table[hash];
+            table[hash] = static_cast<uint32_t>(position + 1);
+            if (candidate == 0 || position - (candidate - 1) > 65535 || load32(candidate - 1) != sequence) {
+                position++;
+                continue;
+            }
+            size_t match = candidate - 1;
+            size_t length = MIN_MATCH;
+            while (position + length < size - LAST_LITERALS && src[match + length] == src[position + length]) {
+                length++;
+            }
+            while (position > anchor && match > 0 && src[position - 1] == src[match - 1]) {
+                position--;
+                match--;
+                length++;
+            }
+            emit(anchor, position - anchor, position - match, length);
+            position += length;
+            anchor = position;
+        }
+    }
+    emit(anchor, size - anchor, 0, 0);
+    return out - dst;
+}
+
+// Decodes an LZ4 block that must expand to exactly rawSize bytes
+inline bool lz4DecompressBlock(const char* src, size_t size, char* dst, size_t rawSize) {
+    const uint8_t* in = reinterpret_cast<const uint8_t*>(src);
+    size_t ip = 0, op = 0;
+    auto readLength = [&](size_t& length) {
+        uint8_t byte;
+        do {
+            if (ip >= size) return false;
+            byte = in[ip++];
+            length += byte;
+        } while (byte == 255);
+        return true;
+    };
+    while (ip < size) {
+        uint8_t token = in[ip++];
+        size_t literalLength = token >> 4;
+        if (literalLength == 15 && !readLength(literalLength)) return false;
+        if (literalLength > size - ip || literalLength > rawSize - op) return false;
+        std::memcpy(dst + op, src + ip, literalLength);
+        ip += literalLength;
+        op += literalLength;
+        if (ip == size) break;  // the last sequence has no match
+
+        if (size - ip < 2) return false;
+        size_t offset = in[ip] | (static_cast<size_t>(in[ip + 1]) << 8);
+        ip += 2;
+        if (offset == 0 || offset > op) return false;
+        size_t matchLength = token & 15;
+        if (matchLength == 15 && !readLength(matchLength)) return false;
+        matchLength += 4;
+        if (matchLength > rawSize - op) return false;
+        // Byte by byte, since the match may overlap the bytes it produces
+        for (size_t i = 0; i < matchLength; i++, op++) {
+            dst[op] = dst[op - offset];
+        }
+    }
+    return op == rawSize;
+}
+
+#if KV_HAVE_ZSTD
+// One compression and one decompression context per thread
+inline ZSTD_CCtx* zstdCompressionContext() {
+    thread_local std::unique_ptr<ZSTD_CCtx, size_t (*)(ZSTD_CCtx*)> context(ZSTD_createCCtx(), ZSTD_freeCCtx);
+    return context.get();
+}
+
+inline ZSTD_DCtx* zstdDecompressionContext() {
+    thread_local std::unique_ptr<ZSTD_DCtx, size_t (*)(ZSTD_DCtx*)> context(ZSTD_createDCtx(), ZSTD_freeDCtx);
+    return context.get();
+}
+#endif
+
+// A zstd dictionary with its digested compression and decompression forms;
+// level 0 prepares it for decompression only. Without libzstd it only
+// carries the bytes, and records that need it do not decode.
+class ZstdDictionary {
+    std::string bytes;
+#if KV_HAVE_ZSTD
+    ZSTD_CDict* cdict = nullptr;
+    ZSTD_DDict* ddict = nullptr;
+#endif
+
+public:
+    ZstdDictionary(std::string dictionary, int level) : bytes(std::move(dictionary)) {
+#if KV_HAVE_ZSTD
+        if (level > 0) {
+            cdict = ZSTD_createCDict(bytes.data(), bytes.size(), level);
+        }
+        ddict = ZSTD_createDDict(bytes.data(), bytes.size());
+#else
+        (void)level;
+#endif
+    }
+
+    ~ZstdDictionary() {
+#if KV_HAVE_ZSTD
+        ZSTD_freeCDict(cdict);
+        ZSTD_freeDDict(ddict);
+#endif
+    }
+
+    ZstdDictionary(const ZstdDictionary&) = delete;
+    ZstdDictionary& operator=(const ZstdDictionary&) = delete;
+
+    const std::string& data() const {
+        return bytes;
+    }
+
+#if KV_HAVE_ZSTD
+    const ZSTD_CDict* compression() const {
+        return cdict;
+    }
+    const ZSTD_DDict* decompression() const {
+        return ddict;
+    }
+#endif
+
+    // Trains a dictionary of at most capacity bytes from concatenated
+    // samples, or returns nullptr (too few samples, or no libzstd)
+    static std::unique_ptr<ZstdDictionary> train(const std::string& samples,
+        const std::vector<size_t>& sampleSizes, size_t capacity, int level) {
+#if KV_HAVE_ZSTD
+        if (sampleSizes.size() < 8) return nullptr;
+        std::string dictionary(capacity, '\0');
+        size_t size = ZDICT_trainFromBuffer(&dictionary[0], capacity, samples.data(),
+            sampleSizes.data(), static_cast<unsigned>(sampleSizes.size()));
+        if (ZDICT_isError(size)) return nullptr;
+        dictionary.resize(size);
+        return std::make_unique<ZstdDictionary>(std::move(dictionary), level);
+#else
+        (void)samples;
+        (void)sampleSizes;
+        (void)capacity;
+        (void)level;
+        return nullptr;
+#endif
+    }
+};
+
+// Appends the compressed form of value, prefix included, to out. Fails and
+// leaves out unchanged when the codec is not built in or does not shrink the
+// value. A dictionary, if given, is used instead of plain zstd.
+inline bool compressValue(Compression codec, int level, std::string_view value, std::string& out,
+    const ZstdDictionary* dictionary = nullptr, CompressionCounters* counters = nullptr) {
+    if (codec == Compression::None || value.size() > UINT32_MAX) return false;
+    auto start = std::chrono::steady_clock::now();
+    const size_t offset = out.size();
+    const uint32_t rawSize = static_cast<uint32_t>(value.size());
+    uint8_t id = 0;
+    size_t size = 0;
+
+    if (codec == Compression::LZ4) {
+        id = CODEC_LZ4;
+        out.resize(offset + COMPRESSED_PREFIX + lz4Bound(value.size()));
+        char* dst = &out[offset + COMPRESSED_PREFIX];
+#if KV_HAVE_LZ4
+        int written = LZ4_compress_default(value.data(), dst, static_cast<int>(value.size()),
+            static_cast<int>(lz4Bound(value.size())));
+        size = written > 0 ? static_cast<size_t>(written) : 0;
+#else
+        size = lz4CompressBlock(value.data(), value.size(), dst);
+#endif
+    }
+    else {
+#if KV_HAVE_ZSTD
+        out.resize(offset + COMPRESSED_PREFIX + ZSTD_compressBound(value.size()));
+        char* dst = &out[offset + COMPRESSED_PREFIX];
+        size_t capacity = out.size() - offset - COMPRESSED_PREFIX;
+        if (dictionary != nullptr && dictionary->compression() != nullptr) {
+            id = CODEC_ZSTD_DICTIONARY;
+            size = ZSTD_compress_usingCDict(zstdCompressionContext(), dst, capacity,
+                value.data(), value.size(), dictionary->compression());
+        }
+        else {
+            id = CODEC_ZSTD;
+            size = ZSTD_compressCCtx(zstdCompressionContext(), dst, capacity, value.data(), value.size(), level);
+        }
+        if (ZSTD_isError(size)) size = 0;
+#else
+        (void)level;
+        (void)dictionary;
+        return false;
+#endif
+    }
+
+    if (counters != nullptr) {
+        counters->compressNanos.fetch_add(elapsedNanos(start), std::memory_order_relaxed);
+    }
+    if (size == 0 || COMPRESSED_PREFIX + size >= value.size()) {
+        out.resize(offset);
+        return false;
+    }
+    out[offset] = static_cast<char>(id);
+    std::memcpy(&out[offset + 1], &rawSize, sizeof(rawSize));
+    out.resize(offset + COMPRESSED_PREFIX + size);
+    return true;
+}
+
+// Expands a value stored with RECORD_FLAG_COMPRESSED into out
+inline bool decompressValue(std::string_view stored, std::string& out,
+    const ZstdDictionary* dictionary = nullptr, CompressionCounters* counters = nullptr) {
+    if (stored.size() < COMPRESSED_PREFIX) return false;
+    auto start = std::chrono::steady_clock::now();
+    const uint8_t id = static_cast<uint8_t>(stored[0]);
+    uint32_t rawSize;
+    std::memcpy(&rawSize, stored.data() + 1, sizeof(rawSize));
+    const char* src = stored.data() + COMPRESSED_PREFIX;
+    const size_t size = stored.size() - COMPRESSED_PREFIX;
+    out.resize(rawSize);
+
+    bool ok = false;
+    if (id == CODEC_LZ4) {
+#if KV_HAVE_LZ4
+        ok = LZ4_decompress_safe(src, &out[0], static_cast<int>(size), static_cast<int>(rawSize)) ==
+            static_cast<int>(rawSize);
+#else
+        ok = lz4DecompressBlock(src, size, &out[0], rawSize);
+#endif
+    }
+#if KV_HAVE_ZSTD
+    else if (id == CODEC_ZSTD) {
+        ok = ZSTD_decompressDCtx(zstdDecompressionContext(), &out[0], rawSize, src, size) == rawSize;
+    }
+    else if (id == CODEC_ZSTD_DICTIONARY && dictionary != nullptr && dictionary->decompression() != nullptr) {
+        ok = ZSTD_decompress_usingDDict(zstdDecompressionContext(), &out[0], rawSize, src, size,
+            dictionary->decompression()) == rawSize;
+    }
+#else
+    (void)dictionary;
+#endif
+    if (!ok) {
+        out.clear();
+        return false;
+    }
+    if (counters != nullptr) {
+        counters->decompressedValues.fetch_add(1, std::memory_order_relaxed);
+        counters->decompressNanos.fetch_add(elapsedNanos(start), std::memory_order_relaxed);
+    }
+    return true;
+}
+
+// compressValue as configured by options, with the attempt accounted in
+// counters. Fails, leaving out unchanged, for values below minValueBytes and
+// values that do not shrink.
+inline bool compressCounted(const CompressionOptions& options, std::string_view value, std::string& out,
+    CompressionCounters& counters, const ZstdDictionary* dictionary = nullptr) {
+    if (options.codec == Compression::None || value.size() < options.minValueBytes) {
+        return false;
+    }
+    const size_t offset = out.size();
+    bool ok = compressValue(options.codec, options.zstdLevel, value, out, dictionary, &counters);
+    counters.rawBytes.fetch_add(value.size(), std::memory_order_relaxed);
+    counters.storedBytes.fetch_add(ok ? out.size() - offset : value.size(), std::memory_order_relaxed);
+    if (ok) {
+        counters.compressedValues.fetch_add(1, std::memory_order_relaxed);
+    }
+    return ok;
+}
+
+// ---------------------------------------------------------------------------
+// Asynchronous I/O
+//
+// getAsync reads records through an IoBackend: read() queues a positional
+// read and submit() hands everything queued to the backend at once, so a
+// batch of lookups costs one system call. The completion runs on a thread of
+// the backend with a view of the bytes read, valid only for the duration of
+// the call.
+//
+// IoUringBackend drives one io_uring directly through its system calls. It
+// registers files (Store::attachIo) and a pool of fixed buffers with the ring
+// so reads skip the per-request fd lookup and page pinning. Where io_uring is
+// missing or refused, makeIoBackend falls back to BlockingIoBackend, a few
+// threads issuing pread.
+// ---------------------------------------------------------------------------
+
+#if !defined(KV_HAVE_IO_URING)
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#define KV_HAVE_IO_URING 1
+#else
+#define KV_HAVE_IO_URING 0
+#endif
+#endif
+
+#if KV_HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#endif
+
+// Reads [offset, offset + size) of fd into out, retrying short reads
+inline bool preadFully(int fd, char* out, size_t size, uint64_t offset) {
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = ::pread(fd, out + done, size - done, offset + done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        done += n;
+    }
+    return true;
+}
+
+// Makes the entries of directory dir (created, renamed or removed files)
+// durable
+inline bool syncDirectory(const std::string& dir) {
+    const int fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+    if (fd < 0) return false;
+    const bool ok = ::fsync(fd) == 0;
+    ::close(fd);
+    return ok;
+}
+
+class IoBackend {
+public:
+    // ok is false when the read failed or hit the end of the file
+    using ReadCompletion = std::function<void(bool ok, std::string_view data)>;
+
+    // A file to read from: its descriptor, and the slot it is registered
+    // under with the backend or -1
+    struct File {
+        int fd = -1;
+        int slot = -1;
+    };
+
+    virtual ~IoBackend() = default;
+
+    // Queues a read; it is only started by the next submit()
+    virtual void read(File file, uint64_t offset, size_t size, ReadCompletion done) = 0;
+    // Starts every queued read
+    virtual void submit() = 0;
+    // Submits and waits until no read is in flight. Must not be called from
+    // a completion.
+    virtual void drain() = 0;
+
+    // Slot for fd, or -1 when the backend does not register files (or has
+    // no slot left). Reads must no longer be in flight when it is released.
+    virtual int registerFile(int) { return -1; }
+    virtual void releaseFile(int) {}
+
+    virtual const char* name() const = 0;
+};
+
+#if KV_HAVE_IO_URING
+class IoUringBackend : public IoBackend {
+    static constexpr uint64_t WAKE = std::numeric_limits<uint64_t>::max();
+
+    struct Request {
+        ReadCompletion done;
+        int fd = -1;
+        uint64_t offset = 0;
+        size_t size = 0;
+        int buffer = -1;             // fixed buffer index, or -1 for heap
+        std::unique_ptr<char[]> heap;
+    };
+
+    int ringFd = -1;
+    unsigned entries = 0;
+    void* sqRing = MAP_FAILED;
+    void* cqRing = MAP_FAILED;
+    size_t sqRingBytes = 0;
+    size_t cqRingBytes = 0;
+    io_uring_sqe* sqes = static_cast<io_uring_sqe*>(MAP_FAILED);
+    unsigned* sqHead = nullptr;
+    unsigned* sqTail = nullptr;
+    unsigned* sqMask = nullptr;
+    unsigned* sqArray = nullptr;
+    unsigned* cqHead = nullptr;
+    unsigned* cqTail = nullptr;
+    unsigned* cqMask = nullptr;
+    io_uring_cqe* cqes = nullptr;
+
+    // Guards the submission queue, the request slots and both free lists
+    std::mutex mutex;
+    std::condition_variable idle;
+    std::vector<Request> requests;
+    std::vector<uint32_t> freeRequests;
+    unsigned unsubmitted = 0;
+    size_t inFlight = 0;
+
+    char* bufferPool = static_cast<char*>(MAP_FAILED);
+    size_t bufferCount = 0;
+    size_t bufferBytes = 0;
+    std::vector<int> freeBuffers;
+
+    std::vector<int> freeSlots;
+    bool filesRegistered = false;
+
+    bool stopping = false;
+    int setupError = 0;
+    std::thread reaper;
+
+    static int enter(int fd, unsigned toSubmit, unsigned minComplete, unsigned flags) {
+        return static_cast<int>(::syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, nullptr, 0));
+    }
+
+    static int registerRing(int fd, unsigned opcode, const void* arg, unsigned count) {
+        return static_cast<int>(::syscall(__NR_io_uring_register, fd, opcode, arg, count));
+    }
+
+    bool mapRings(const io_uring_params& params) {
+        sqRingBytes = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cqRingBytes = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        const bool single = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+        if (single) {
+            sqRingBytes = cqRingBytes = std::max(sqRingBytes, cqRingBytes);
+        }
+        sqRing = ::mmap(nullptr, sqRingBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+            ringFd, IORING_OFF_SQ_RING);
+        if (sqRing == MAP_FAILED) return false;
+        cqRing = single ? sqRing : ::mmap(nullptr, cqRingBytes, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+        if (cqRing == MAP_FAILED) return false;
+        void* entriesMap = ::mmap(nullptr, params.sq_entries * sizeof(io_uring_sqe), PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+        if (entriesMap == MAP_FAILED) return false;
+        sqes = static_cast<io_uring_sqe*>(entriesMap);
+
+        char* sq = static_cast<char*>(sqRing);
+        char* cq = static_cast<char*>(cqRing);
+        sqHead = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+        sqTail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+        sqMask = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+        sqArray = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+        cqHead = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+        cqTail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+        cqMask = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+        cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+        return true;
+    }
+
+    // Fixed buffers are only an optimisation, so failing to pin them (for
+    // instance over RLIMIT_MEMLOCK) leaves reads on heap buffers
+    void registerBuffers(size_t count, size_t bytes) {
+        if (count == 0 || bytes == 0) return;
+        void* pool = ::mmap(nullptr, count * bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (pool == MAP_FAILED) return;
+        std::vector<iovec> iovecs(count);
+        for (size_t i = 0; i < count; i++) {
+            iovecs[i] = { static_cast<char*>(pool) + i * bytes, bytes };
+        }
+        if (registerRing(ringFd, IORING_REGISTER_BUFFERS, iovecs.data(), static_cast<unsigned>(count)) != 0) {
+            log(LogLevel::Warning, std::string("io_uring buffer registration failed: ") + std::strerror(errno));
+            ::munmap(pool, count * bytes);
+            return;
+        }
+        bufferPool = static_cast<char*>(pool);
+        bufferCount = count;
+        bufferBytes = bytes;
+        for (size_t i = count; i-- > 0;) {
+            freeBuffers.push_back(static_cast<int>(i));
+        }
+    }
+
+    // Registers a sparse table that registerFile fills in slot by slot
+    void registerFileTable(size_t count) {
+        if (count == 0) return;
+        std::vector<int> fds(count, -1);
+        if (registerRing(ringFd, IORING_REGISTER_FILES, fds.data(), static_cast<unsigned>(count)) != 0) {
+            log(LogLevel::Warning, std::string("io_uring file registration failed: ") + std::strerror(errno));
+            return;
+        }
+        filesRegistered = true;
+        for (size_t i = count; i-- > 0;) {
+            freeSlots.push_back(static_cast<int>(i));
+        }
+    }
+
+    bool updateFile(int slot, int fd) {
+        io_uring_files_update update{};
+        update.offset = static_cast<uint32_t>(slot);
+        update.fds = reinterpret_cast<uint64_t>(&fd);
+        return registerRing(ringFd, IORING_REGISTER_FILES_UPDATE, &update, 1) == 1;
+    }
+
+    // Requires mutex held and a free entry in the submission queue
+    io_uring_sqe& nextEntry() {
+        const unsigned tail = *sqTail;
+        const unsigned index = tail & *sqMask;
+        io_uring_sqe& entry = sqes[index];
+        std::memset(&entry, 0, sizeof(entry));
+        sqArray[index] = index;
+        __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+        unsubmitted++;
+        return entry;
+    }
+
+    bool queueFull() const {
+        return *sqTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) >= entries;
+    }
+
+    // Requires mutex held
+    void submitLocked() {
+        while (unsubmitted > 0) {
+            const int n = enter(ringFd, unsubmitted, 0, 0);
+            if (n < 0) {
+                if (errno == EINTR || errno == EAGAIN || errno == EBUSY) continue;
+                // Entries stay queued and go out with the next submit
+                log(LogLevel::Error, std::string("io_uring submit failed: ") + std::strerror(errno));
+                return;
+            }
+            unsubmitted -= std::min<unsigned>(unsubmitted, static_cast<unsigned>(n));
+        }
+    }
+
+    void complete(uint32_t id, int result) {
+        Request request;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            request = std::move(requests[id]);
+        }
+        char* data = request.buffer >= 0 ? bufferPool + request.buffer * bufferBytes : request.heap.get();
+        bool ok = result >= 0;
+        // Short reads of regular files only happen at the end of the file or
+        // on signals; the rest is read here rather than resubmitted
+        if (ok && static_cast<size_t>(result) < request.size) {
+            ok = result > 0 && preadFully(request.fd, data + result, request.size - result, request.offset + result);
+        }
+        request.done(ok, ok ? std::string_view(data, request.size) : std::string_view());
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (request.buffer >= 0) {
+            freeBuffers.push_back(request.buffer);
+        }
+        freeRequests.push_back(id);
+        if (--inFlight == 0) {
+            idle.notify_all();
+        }
+    }
+
+    void reapLoop() {
+        for (;;) {
+            if (enter(ringFd, 0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR) {
+                log(LogLevel::Error, std::string("io_uring wait failed: ") + std::strerror(errno));
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+            unsigned head = *cqHead;
+            const unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+            bool woken = false;
+            for (; head != tail; head++) {
+                const io_uring_cqe& entry = cqes[head & *cqMask];
+                const uint64_t id = entry.user_data;
+                const int result = entry.res;
+                // Handing the entry back first keeps the completion queue
+                // from filling up while callbacks run
+                __atomic_store_n(cqHead, head + 1, __ATOMIC_RELEASE);
+                if (id == WAKE) {
+                    woken = true;
+                    continue;
+                }
+                complete(static_cast<uint32_t>(id), result);
+            }
+            if (woken) {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (stopping) return;
+            }
+        }
+    }
+
+public:
+    // Fails (ok() is false) when the kernel has no io_uring or refuses it
+    IoUringBackend(unsigned queueDepth, size_t fixedBuffers, size_t fixedBufferBytes, size_t registeredFiles) {
+        io_uring_params params{};
+        ringFd = static_cast<int>(::syscall(__NR_io_uring_setup, std::max(queueDepth, 2u), &params));
+        if (ringFd < 0) {
+            setupError = errno;
+            return;
+        }
+        if (!mapRings(params)) {
+            setupError = errno;
+            ::close(ringFd);
+            ringFd = -1;
+            return;
+        }
+        entries = params.sq_entries;
+        // Never more requests than completion entries, so it cannot overflow
+        requests.resize(std::min(params.sq_entries, params.cq_entries));
+        for (size_t i = requests.size(); i-- > 0;) {
+            freeRequests.push_back(static_cast<uint32_t>(i));
+        }
+        registerBuffers(std::min(fixedBuffers, requests.size()), fixedBufferBytes);
+        registerFileTable(registeredFiles);
+        reaper = std::thread(&IoUringBackend::reapLoop, this);
+    }
+
+    ~IoUringBackend() override {
+        if (reaper.joinable()) {
+            drain();
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stopping = true;
+                // The reaper only looks at the flag once a completion wakes it
+                io_uring_sqe& entry = nextEntry();
+                entry.opcode = IORING_OP_NOP;
+                entry.user_data = WAKE;
+                submitLocked();
+            }
+            // The last reference may be dropped by a completion
+            if (reaper.get_id() == std::this_thread::get_id()) {
+                reaper.detach();
+            }
+            else {
+                reaper.join();
+            }
+        }
+        if (sqes != MAP_FAILED) ::munmap(sqes, entries * sizeof(io_uring_sqe));
+        if (cqRing != MAP_FAILED && cqRing != sqRing) ::munmap(cqRing, cqRingBytes);
+        if (sqRing != MAP_FAILED) ::munmap(sqRing, sqRingBytes);
+        if (bufferPool != MAP_FAILED) ::munmap(bufferPool, bufferCount * bufferBytes);
+        if (ringFd >= 0) ::close(ringFd);
+    }
+
+    bool ok() const {
+        return reaper.joinable();
+    }
+
+    // errno of the failed setup when !ok()
+    int error() const {
+        return setupError;
+    }
+
+    // With every request slot taken the read is done inline instead, which
+    // also keeps completions that issue reads from waiting on themselves
+    void read(File file, uint64_t offset, size_t size, ReadCompletion done) override {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (freeRequests.empty()) {
+            lock.unlock();
+            std::string buffer(size, '\0');
+            const bool ok = preadFully(file.fd, &buffer[0], size, offset);
+            done(ok, ok ? std::string_view(buffer) : std::string_view());
+            return;
+        }
+        if (queueFull()) {
+            submitLocked();
+        }
+        const uint32_t id = freeRequests.back();
+        freeRequests.pop_back();
+        Request& request = requests[id];
+        request.done = std::move(done);
+        request.fd = file.fd;
+        request.offset = offset;
+        request.size = size;
+        request.buffer = -1;
+        if (size <= bufferBytes && !freeBuffers.empty()) {
+            request.buffer = freeBuffers.back();
+            freeBuffers.pop_back();
+        }
+        else {
+            request.heap.reset(new char[size]);
+        }
+        inFlight++;
+
+        io_uring_sqe& entry = nextEntry();
+        entry.opcode = request.buffer >= 0 ? IORING_OP_READ_FIXED : IORING_OP_READ;
+        entry.fd = file.fd;
+        if (file.slot >= 0) {
+            entry.fd = file.slot;
+            entry.flags = IOSQE_FIXED_FILE;
+        }
+        entry.off = offset;
+        entry.addr = reinterpret_cast<uint64_t>(request.buffer >= 0 ?
+            bufferPool + request.buffer * bufferBytes : request.heap.get());
+        entry.len = static_cast<uint32_t>(size);
+        if (request.buffer >= 0) {
+            entry.buf_index = static_cast<uint16_t>(request.buffer);
+        }
+        entry.user_data = id;
+    }
+
+    void submit() override {
+        std::lock_guard<std::mutex> lock(mutex);
+        submitLocked();
+    }
+
+    void drain() override {
+        std::unique_lock<std::mutex> lock(mutex);
+        submitLocked();
+        idle.wait(lock, [this] { return inFlight == 0; });
+    }
+
+    int registerFile(int fd) override {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!filesRegistered || freeSlots.empty() || fd < 0) return -1;
+        const int slot = freeSlots.back();
+        if (!updateFile(slot, fd)) return -1;
+        freeSlots.pop_back();
+        return slot;
+    }
+
+    void releaseFile(int slot) override {
+        if (slot < 0) return;
+        std::lock_guard<std::mutex> lock(mutex);
+        updateFile(slot, -1);
+        freeSlots.push_back(slot);
+    }
+
+    const char* name() const override {
+        return "io_uring";
+    }
+};
+#endif
+
+// Fallback backend: worker threads serving queued reads with pread
+class BlockingIoBackend : public IoBackend {
+    struct Request {
+        File file;
+        uint64_t offset;
+        size_t size;
+        ReadCompletion done;
+    };
+
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable idle;
+    // Queued by read() until the next submit()
+    std::vector<Request> unsubmitted;
+    std::vector<Request> queue;
+    size_t inFlight = 0;
+    bool stopping = false;
+    std::vector<std::thread> workers;
+
+    void work() {
+        std::string buffer;
+        std::unique_lock<std::mutex> lock(mutex);
+        for (;;) {
+            wake.wait(lock, [this] { return stopping || !queue.empty(); });
+            if (queue.empty()) return;
+            Request request = std::move(queue.back());
+            queue.pop_back();
+            lock.unlock();
+
+            buffer.resize(request.size);
+            const bool ok = preadFully(request.file.fd, &buffer[0], request.size, request.offset);
+            request.done(ok, ok ? std::string_view(buffer) : std::string_view());
+
+            lock.lock();
+            if (--inFlight == 0) {
+                idle.notify_all();
+            }
+        }
+    }
+
+public:
+    explicit BlockingIoBackend(size_t threads) {
+        for (size_t i = 0; i < std::max<size_t>(threads, 1); i++) {
+            workers.emplace_back(&BlockingIoBackend::work, this);
+        }
+    }
+
+    ~BlockingIoBackend() override {
+        drain();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto& worker : workers) {
+            if (worker.get_id() == std::this_thread::get_id()) {
+                worker.detach();
+            }
+            else {
+                worker.join();
+            }
+        }
+    }
+
+    void read(File file, uint64_t offset, size_t size, ReadCompletion done) override {
+        std::lock_guard<std::mutex> lock(mutex);
+        unsubmitted.push_back({ file, offset, size, std::move(done) });
+        inFlight++;
+    }
+
+    void submit() override {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (unsubmitted.empty()) return;
+            queue.insert(queue.end(), std::make_move_iterator(unsubmitted.begin()),
+                std::make_move_iterator(unsubmitted.end()));
+            unsubmitted.clear();
+        }
+        wake.notify_all();
+    }
+
+    void drain() override {
+        submit();
+        std::unique_lock<std::mutex> lock(mutex);
+        idle.wait(lock, [this] { return inFlight == 0; });
+    }
+
+    const char* name() const override {
+        return "blocking";
+    }
+};
+
+// The backend asked for, or the blocking one where io_uring cannot be used
+inline std::shared_ptr<IoBackend> makeIoBackend(const IoOptions& options) {
+#if KV_HAVE_IO_URING
+    if (options.backend == AsyncIo::IoUring) {
+        auto backend = std::make_shared<IoUringBackend>(options.queueDepth, options.fixedBuffers,
+            options.fixedBufferBytes, options.registeredFiles);
+        if (backend->ok()) return backend;
+        log(LogLevel::Warning, std::string("io_uring unavailable, using blocking reads: ") + std::strerror(backend->error()));
+    }
+#endif
+    return std::make_shared<BlockingIoBackend>(options.blockingThreads);
+}
+
+// Sequential view of a file for recovery. Records are parsed in place out of
+// one large buffer that is refilled as the scan advances, so replaying a
+// segment costs a handful of read() calls and no allocation per record.
+class FileScanner {
+    static constexpr size_t CHUNK_BYTES = 1 << 20;
+
+    int fd;
+    uint64_t remaining;      // file bytes not read into the buffer yet
+    std::unique_ptr<char[]> buffer;
+    size_t capacity = 0;
+    size_t begin = 0;        // [begin, end) of the buffer is unconsumed
+    size_t end = 0;
+
+public:
+    // Scans fd from offset to the end of the file
+    FileScanner(int fd, uint64_t offset) : fd(fd), remaining(0) {
+        struct stat st;
+        if (fd >= 0 && ::fstat(fd, &st) == 0 && static_cast<uint64_t>(st.st_size) > offset) {
+            remaining = st.st_size - offset;
+            ::lseek(fd, static_cast<off_t>(offset), SEEK_SET);
+        }
+    }
+
+    // Makes at least size bytes available at data(), reading ahead as much
+    // as fits. False when the file has fewer left, without growing the
+    // buffer for a size that cannot be there.
+    bool ensure(size_t size) {
+        if (end - begin >= size) return true;
+        if (begin == end) {
+            // Nothing to keep: read into the whole buffer again
+            begin = end = 0;
+        }
+        if (size > end - begin + remaining) return false;
+        if (size > capacity - begin) {
+            const size_t kept = end - begin;
+            if (size > capacity) {
+                // Past the first chunk only a record bigger than the buffer
+                // grows it, geometrically
+                const size_t grown = std::max<size_t>(size,
+                    std::min<uint64_t>(std::max(CHUNK_BYTES, 2 * capacity), kept + remaining));
+                std::unique_ptr<char[]> larger(new char[grown]);
+                if (kept > 0) std::memcpy(larger.get(), buffer.get() + begin, kept);
+                buffer = std::move(larger);
+                capacity = grown;
+            }
+            else if (kept > 0) {
+                std::memmove(buffer.get(), buffer.get() + begin, kept);
+            }
+            begin = 0;
+            end = kept;
+        }
+        while (end - begin < size) {
+            const size_t want = static_cast<size_t>(std::min<uint64_t>(capacity - end, remaining));
+            ssize_t n = ::read(fd, buffer.get() + end, want);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) {
+                remaining = 0;
+                return false;
+            }
+            end += n;
+            remaining -= n;
+        }
+        return true;
+    }
+
+    const char* data() const {
+        return buffer.get() + begin;
+    }
+
+    size_t available() const {
+        return end - begin;
+    }
+
+    bool atEnd() const {
+        return begin == end && remaining == 0;
+    }
+
+    void consume(size_t size) {
+        begin += size;
+    }
+};
+
+// One segment file and its index, keyed as KeyCodec encodes keys
+template <typename KeyCodec = FixedCodec<int>>
+class Store {
+    using Key = typename KeyCodec::Type;
+    // Hint entries hold four-byte keys themselves (version 2), any other
+    // key follows its entry (version 3)
+    static constexpr bool KEY_IN_HINT_ENTRY = KeyCodec::FIXED && KeyCodec::SIZE == sizeof(HintEntry::key);
+
+    // Append-only write descriptor, closed once the store is sealed
+    int writeFd = -1;
+    std::string currDir;
+    // Sequence number of the segment, newer segments have higher ids
+    size_t segmentId;
+    std::unique_ptr<HashMap<KeyCodec>> offsets;
+    // Replaced by the writer when it fills up, read by concurrent gets
+    std::atomic<BloomFilter*> bloom{ nullptr };
+    // Grown by the commit leader while writers read it to decide on rotation
+    std::atomic<size_t> totalBytes;
+    // Read-only descriptor kept for the lifetime of the store; gets use pread
+    // on it so concurrent readers never share a seek position
+    int readFd = -1;
+    // Set once the store is sealed in mmap mode
+    // Published with release ordering after mappedSize, since readers of the
+    // store may already be running when it is sealed
+    std::atomic<const char*> mapped{ nullptr };
+    size_t mappedSize = 0;
+    // Text segment from before the binary format; recovered read-only
+    bool legacy = false;
+    // The hint file on disk matches this (sealed) store
+    bool hasHint = false;
+    // Extents reserved past the end of a new file, released again on seal
+    uint64_t preallocateBytes = 0;
+    bool preallocated = false;
+    // Dictionary record at the start of a merged segment, if any
+    std::unique_ptr<ZstdDictionary> dictionary;
+    // Bytes of records the engine's key directory points at, and of records
+    // since overwritten or deleted. Tombstones count as dead from the start,
+    // but are also tracked on their own while they still have to be kept.
+    // Maintained by the engine, which is what knows about shadowing.
+    std::atomic<uint64_t> live{ 0 };
+    std::atomic<uint64_t> dead{ 0 };
+    std::atomic<uint64_t> tombstones{ 0 };
+    // File header plus dictionary record, which are not records of any key
+    uint64_t preambleBytes = 0;
+    // Backend of readAsync, with readFd registered under ioSlot if it could be
+    std::shared_ptr<IoBackend> io;
+    int ioSlot = -1;
+
+    void open() {
+        writeFd = ::open(currDir.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if (readFd < 0) {
+            readFd = ::open(currDir.c_str(), O_RDONLY);
+        }
+    }
+    std::string hintPath() const {
+        return currDir + ".hint";
+    }
+
+    // Loads the index of a sealed segment from its hint file. Fails, leaving
+    // the index untouched, when there is no hint or it does not match the
+    // data file.
+    bool loadHint() {
+        std::ifstream in(hintPath(), std::ios::binary | std::ios::ate);
+        if (!in.is_open()) return false;
+        const std::streamoff fileSize = in.tellg();
+        in.seekg(0);
+
+        HintHeader header;
+        if (!in.read(reinterpret_cast<char*>(&header), sizeof(header))) return false;
+        const uint16_t version = KEY_IN_HINT_ENTRY ? HINT_VERSION : HINT_VERSION_KEYED;
+        if (header.magic != HINT_MAGIC || header.version != version) return false;
+
+        struct stat st;
+        if (::stat(currDir.c_str(), &st) != 0 ||
+            static_cast<uint64_t>(st.st_size) != header.dataSize) {
+            return false;
+        }
+
+        // Entries, then the CRC
+        if (fileSize < static_cast<std::streamoff>(sizeof(header) + sizeof(uint32_t))) return false;
+        std::string body(static_cast<size_t>(fileSize) - sizeof(header) - sizeof(uint32_t), '\0');
+        uint32_t expectedCrc;
+        if (KEY_IN_HINT_ENTRY && body.size() != header.count * sizeof(HintEntry)) return false;
+        if (!in.read(&body[0], body.size())) return false;
+        if (!in.read(reinterpret_cast<char*>(&expectedCrc), sizeof(expectedCrc))) return false;
+        uint32_t crc = crc32c(0, reinterpret_cast<const char*>(&header), sizeof(header));
+        crc = crc32c(crc, body.data(), body.size());
+        if (crc != expectedCrc) {
+            log(LogLevel::Warning, "Hint checksum mismatch, rescanning " + currDir);
+            return false;
+        }
+
+        size_t position = 0;
+        Key key{};
+        for (uint64_t i = 0; i < header.count; i++) {
+            HintEntry entry;
+            bool valid = body.size() - position >= sizeof(entry);
+            if (valid) {
+                std::memcpy(&entry, body.data() + position, sizeof(entry));
+                position += sizeof(entry);
+                if constexpr (KEY_IN_HINT_ENTRY) {
+                    valid = KeyCodec::decode({ reinterpret_cast<const char*>(&entry.key), sizeof(entry.key) }, key);
+                }
+                else {
+                    valid = body.size() - position >= entry.keyBytes &&
+                        KeyCodec::decode(std::string_view(body).substr(position, entry.keyBytes), key);
+                    position += entry.keyBytes;
+                }
+            }
+            if (!valid || entry.byteOffset < offsets->currentOffset() ||
+                entry.byteOffset + entry.byteSize > header.dataSize) {
+                offsets->reset();
+                return false;
+            }
+            offsets->skip(entry.byteOffset - offsets->currentOffset());
+            offsets->add(key, entry.byteSize, entry.flags);
+        }
+        if (position != body.size()) {
+            offsets->reset();
+            return false;
+        }
+        offsets->skip(header.dataSize - offsets->currentOffset());
+        totalBytes = header.dataSize;
+        legacy = (header.flags & HINT_FLAG_LEGACY) != 0;
+        hasHint = true;
+        return true;
+    }
+
+    // Writes the hint to a temporary file and renames it into place so a crash
+    // never leaves a partial hint behind
+    bool writeHint() {
+        std::vector<std::pair<HintEntry, Key>> entries;
+        entries.reserve(offsets->size());
+        offsets->forEach([&](const Key& key, const MetaData& metaData) {
+            entries.push_back({ { metaData.byteOffset, metaData.byteSize, 0, metaData.flags, 0 }, key });
+        });
+        std::sort(entries.begin(), entries.end(), [](const auto& a, const auto& b) {
+            return a.first.byteOffset < b.first.byteOffset;
+        });
+
+        std::string body;
+        body.reserve(entries.size() * sizeof(HintEntry));
+        for (auto& [entry, key] : entries) {
+            const std::string_view bytes = KeyCodec::view(key);
+            if constexpr (KEY_IN_HINT_ENTRY) {
+                std::memcpy(&entry.key, bytes.data(), sizeof(entry.key));
+            }
+            else {
+                entry.keyBytes = static_cast<uint32_t>(bytes.size());
+            }
+            body.append(reinterpret_cast<const char*>(&entry), sizeof(entry));
+            if (!KEY_IN_HINT_ENTRY) body.append(bytes.data(), bytes.size());
+        }
+
+        HintHeader header{ HINT_MAGIC, KEY_IN_HINT_ENTRY ? HINT_VERSION : HINT_VERSION_KEYED,
+            static_cast<uint16_t>(legacy ? HINT_FLAG_LEGACY : 0), totalBytes, entries.size() };
+        uint32_t crc = crc32c(0, reinterpret_cast<const char*>(&header), sizeof(header));
+        crc = crc32c(crc, body.data(), body.size());
+
+        const std::string tmpPath = hintPath() + ".tmp";
+        int fd = ::open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) return false;
+        bool ok = ::write(fd, &header, sizeof(header)) == sizeof(header) &&
+            (body.empty() || ::write(fd, body.data(), body.size()) == static_cast<ssize_t>(body.size())) &&
+            ::write(fd, &crc, sizeof(crc)) == sizeof(crc) &&
+            ::fdatasync(fd) == 0;
+        ::close(fd);
+        if (!ok || ::rename(tmpPath.c_str(), hintPath().c_str()) != 0) {
+            log(LogLevel::Error, "Failed to write hint file for " + currDir);
+            ::unlink(tmpPath.c_str());
+            return false;
+        }
+        hasHint = true;
+        return true;
+    }
+
+    void init() {
+        // Make sure file is closed before reading
+        if (writeFd >= 0) {
+            ::close(writeFd);
+            writeFd = -1;
+        }
+
+        // A valid hint means the segment is sealed: no scan and no writer
+        if (loadHint()) {
+            readFd = ::open(currDir.c_str(), O_RDONLY);
+            return;
+        }
+
+        readFd = ::open(currDir.c_str(), O_RDONLY);
+        FileScanner scanner(readFd, 0);
+        if (scanner.atEnd()) {
+            // File doesn't exist yet (or is empty) means it a fresh start
+            // nothing to recover
+            open();
+            FileHeader header;
+            header = { FILE_MAGIC, FORMAT_VERSION, 0 };
+            append(reinterpret_cast<const char*>(&header), sizeof(header));
+            offsets->skip(sizeof(header));
+            preallocate();
+            return;
+        }
+
+        FileHeader header{};
+        if (scanner.ensure(sizeof(header))) {
+            std::memcpy(&header, scanner.data(), sizeof(header));
+        }
+        if (header.magic == FILE_MAGIC && header.version == FORMAT_VERSION) {
+            scanner.consume(sizeof(header));
+            offsets->skip(sizeof(header));
+            totalBytes = recoverBinary(scanner, sizeof(header));
+            // Drop a torn or corrupted tail so new appends line up with the index
+            if (::truncate(currDir.c_str(), totalBytes) != 0) {
+                log(LogLevel::Error, "Failed to truncate " + currDir + ": " + std::strerror(errno));
+            }
+        }
+        else {
+            legacy = true;
+            totalBytes = recoverLegacy(scanner);
+        }
+        open();
+        if (!legacy) {
+            preallocate();
+        }
+    }
+
+    // Loads the zstd dictionary a merge may have written as the first record
+    void loadDictionary() {
+        if (legacy || totalBytes < sizeof(FileHeader) + sizeof(RecordHeader)) return;
+        RecordHeader header;
+        if (!readRaw(sizeof(FileHeader), sizeof(header), reinterpret_cast<char*>(&header))) return;
+        if (!(header.flags & RECORD_FLAG_DICTIONARY)) return;
+        std::string record(sizeof(header) + header.keySize + header.valueSize, '\0');
+        std::string_view key;
+        std::string_view value;
+        uint8_t flags;
+        if (sizeof(FileHeader) + record.size() > totalBytes ||
+            !readRaw(sizeof(FileHeader), record.size(), &record[0]) ||
+            !decodeRecord<KeyCodec>(record.data(), record.size(), key, value, flags)) {
+            log(LogLevel::Warning, "Unreadable dictionary in " + currDir);
+            return;
+        }
+        dictionary = std::make_unique<ZstdDictionary>(std::string(value), 0);
+        preambleBytes += record.size();
+    }
+
+    // Reserves extents for the whole segment up front, so appends never wait
+    // on block allocation. KEEP_SIZE leaves the file size (and with it
+    // O_APPEND and recovery) unaffected. Filesystems without fallocate just
+    // allocate on write as before.
+    void preallocate() {
+        if (preallocateBytes <= totalBytes || writeFd < 0) return;
+        if (::fallocate(writeFd, FALLOC_FL_KEEP_SIZE, 0, preallocateBytes) == 0) {
+            preallocated = true;
+        }
+        else if (errno != EOPNOTSUPP) {
+            log(LogLevel::Warning, "fallocate failed for " + currDir + ": " + std::strerror(errno));
+        }
+    }
+
+    // Replays binary records, skipping each one by its length. Stops at the
+    // first record that is truncated or fails its checksum and returns the
+    // size of the valid prefix; an unfinished batch before that point is not
+    // part of it. Records are validated where they sit in the scan buffer.
+    uint64_t recoverBinary(FileScanner& scanner, uint64_t offset) {
+        RecordHeader header;
+        std::vector<std::pair<Key, MetaData>> batch;
+        uint64_t batchBytes = 0;
+        while (scanner.ensure(sizeof(header))) {
+            std::memcpy(&header, scanner.data(), sizeof(header));
+            const size_t recordSize = sizeof(header) + static_cast<size_t>(header.keySize) + header.valueSize;
+            if (!scanner.ensure(recordSize)) break;
+
+            std::string_view keyBytes;
+            std::string_view value;
+            uint8_t flags;
+            if (!decodeRecord<KeyCodec>(scanner.data(), recordSize, keyBytes, value, flags)) break;
+            if (header.flags & RECORD_FLAG_DICTIONARY) {
+                // Not a key; loadDictionary picks it up
+                scanner.consume(recordSize);
+                offsets->skip(recordSize);
+                offset += recordSize;
+                continue;
+            }
+            Key key;
+            if (!KeyCodec::decode(keyBytes, key)) break;
+            scanner.consume(recordSize);
+            batch.push_back({ std::move(key), { 0, static_cast<uint32_t>(recordSize), header.flags } });
+            batchBytes += recordSize;
+            if (header.flags & RECORD_FLAG_BATCH) continue;
+
+            for (const auto& entry : batch) {
+                offsets->add(entry.first, entry.second.byteSize, entry.second.flags);
+            }
+            offset += batchBytes;
+            batch.clear();
+            batchBytes = 0;
+        }
+        return offset;
+    }
+
+    // The key text of a legacy record: a number for integral keys, the text
+    // itself for string keys. Other key types have no text form.
+    static bool parseLegacyKey(const char* begin, const char* end, Key& key) {
+        if constexpr (std::is_integral_v<Key>) {
+            const auto parsed = std::from_chars(begin, end, key);
+            return parsed.ec == std::errc() && parsed.ptr != begin;
+        }
+        else if constexpr (std::is_same_v<Key, std::string>) {
+            key.assign(begin, end);
+            return true;
+        }
+        else {
+            return false;
+        }
+    }
+
+    // Replays "key,value\0" records a buffer at a time: scanLegacyRecords
+    // splits everything read so far into records, which are then indexed as
+    // a batch with parseLegacyKey on the text before the comma. A last
+    // record lacking its delimiter is skipped.
+    uint64_t recoverLegacy(FileScanner& scanner) {
+        uint64_t currentOffset = 0;
+        std::vector<LegacyRecord> batch;
+        Key key{};
+        auto index = [&] {
+            for (const LegacyRecord& record : batch) {
+                if (record.comma != nullptr && parseLegacyKey(record.text, record.comma, key)) {
+                    offsets->add(key, record.size);
+                }
+                else {
+                    // Skip corrupted record or bad key
+                    offsets->skip(record.size);
+                }
+                currentOffset += record.size;
+            }
+            batch.clear();
+        };
+
+        // What is buffered is split first (the header probe may have read
+        // the whole file); an unfinished record stays in the buffer and is
+        // scanned again once a further read has completed it
+        for (;;) {
+            const size_t scanned = scanLegacyRecords(scanner.data(), scanner.available(), batch);
+            index();
+            scanner.consume(scanned);
+            if (scanned == 0 && !scanner.ensure(scanner.available() + 1)) break;
+        }
+        if (scanner.available() > 0) {
+            // A record without its delimiter was torn by a crash mid-write and
+            // cannot be decoded; the key keeps its previous value
+            const size_t size = scanner.available();
+            log(LogLevel::Warning, "Discarded a torn " + std::to_string(size) + " byte record at the end of " + currDir);
+            offsets->skip(size);
+            currentOffset += size;
+            scanner.consume(size);
+        }
+        return currentOffset;
+    }
+    // Common to every way of opening, once the index is loaded
+    void loaded() {
+        preambleBytes = legacy ? 0 : std::min<uint64_t>(totalBytes, sizeof(FileHeader));
+        loadDictionary();
+        rebuildBloom(offsets->size() * 2);
+    }
+
+    struct HintOnly {};
+
+    Store(const std::string& dir, size_t id, HintOnly)
+        : currDir(dir), segmentId(id), offsets(std::make_unique<HashMap<KeyCodec>>()), totalBytes(0) {}
+
+public:
+    // preallocateBytes is applied to a writable (new or recovered) segment
+    Store(const std::string& dir, size_t id = 0, uint64_t preallocateBytes = 0)
+        : currDir(dir), segmentId(id), offsets(nullptr), totalBytes(0), preallocateBytes(preallocateBytes) {
+        offsets = std::make_unique<HashMap<KeyCodec>>();
+        init();
+        loaded();
+    }
+
+    // A sealed segment opened from its hint file alone, or nullptr when there
+    // is no hint matching the data file. The data file is never scanned or
+    // written.
+    static std::shared_ptr<Store> openSealed(const std::string& dir, size_t id) {
+        std::shared_ptr<Store> store(new Store(dir, id, HintOnly{}));
+        if (!store->loadHint()) return nullptr;
+        store->readFd = ::open(dir.c_str(), O_RDONLY);
+        if (store->readFd < 0) return nullptr;
+        store->loaded();
+        return store;
+    }
+
+    ~Store() {
+        delete bloom.load();
+        if (const char* base = mapped.load()) {
+            ::munmap(const_cast<char*>(base), mappedSize);
+        }
+        if (writeFd >= 0) {
+            ::close(writeFd);
+        }
+        // In-flight reads hold a reference, so none can still use the slot
+        if (io != nullptr) {
+            io->releaseFile(ioSlot);
+        }
+        if (readFd >= 0) {
+            ::close(readFd);
+        }
+    }
+
+    // Routes readAsync through backend. Called once, before the store is
+    // shared with readers. Mapped stores never need a registered descriptor.
+    void attachIo(std::shared_ptr<IoBackend> backend) {
+        io = std::move(backend);
+        ioSlot = readFd >= 0 && mapped.load() == nullptr ? io->registerFile(readFd) : -1;
+    }
+
+    // Queues a read of file bytes [offset, offset + size) with the backend,
+    // which calls done from its completion thread once the caller (or
+    // anyone) submits. Without a backend, or for a mapped store, done runs
+    // before this returns. The caller keeps the store alive until then.
+    void readAsync(uint64_t offset, size_t size, IoBackend::ReadCompletion done) const {
+        if (io == nullptr || readFd < 0 || mapped.load(std::memory_order_acquire) != nullptr) {
+            std::string buffer(size, '\0');
+            const bool ok = readRaw(offset, size, &buffer[0]);
+            done(ok, ok ? std::string_view(buffer) : std::string_view());
+            return;
+        }
+        io->read({ readFd, ioSlot }, offset, size, std::move(done));
+    }
+
+    // Writes already encoded records to the end of the file. The records only
+    // become visible to get() once they are indexed.
+    bool append(const char* data, size_t size) {
+        if (writeFd < 0) {
+            return false;
+        }
+        size_t done = 0;
+        while (done < size) {
+            ssize_t n = ::write(writeFd, data + done, size - done);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) {
+                // Roll back a partial append so the file keeps matching the index
+                if (::ftruncate(writeFd, totalBytes) != 0) {
+                    log(LogLevel::Error, "Failed to roll back append to " + currDir);
+                }
+                return false;
+            }
+            done += n;
+        }
+        totalBytes += size;
+        return true;
+    }
+
+    // Writes a zstd dictionary as the first record of the store. It takes
+    // up file space but has no index entry.
+    bool appendDictionary(std::string_view bytes) {
+        // Keyed with zero bytes, of the size a fixed-width key has
+        const std::string key(KeyCodec::FIXED ? KeyCodec::SIZE : 0, '\0');
+        std::string record;
+        encodeRecord(record, key, bytes, RECORD_FLAG_DICTIONARY);
+        if (!append(record.data(), record.size())) return false;
+        offsets->skip(record.size());
+        preambleBytes += record.size();
+        return true;
+    }
+
+    // Records must be indexed in the order they were appended, since the
+    // index derives each offset from the running size
+    MetaData index(const Key& key, uint32_t bytes, uint32_t flags = 0) {
+        BloomFilter* filter = bloom.load(std::memory_order_relaxed);
+        if (filter->isFull()) {
+            filter = rebuildBloom(offsets->size() * 2);
+        }
+        // Added before the index entry, so a reader that finds the key in the
+        // index never has it rejected by the filter
+        filter->addHash(KeyCodec::hash(key));
+        return offsets->add(key, bytes, flags);
+    }
+
+    // Replaces the filter with one sized for expectedKeys. Readers still
+    // testing the old filter finish before it is freed.
+    BloomFilter* rebuildBloom(size_t expectedKeys) {
+        BloomFilter* filter = new BloomFilter(expectedKeys);
+        offsets->forEach([filter](const Key& key, const MetaData&) {
+            filter->addHash(KeyCodec::hash(key));
+        });
+        if (BloomFilter* previous = bloom.exchange(filter, std::memory_order_acq_rel)) {
+            EpochManager::instance().retire([previous] { delete previous; });
+        }
+        return filter;
+    }
+
+    // False means the key is definitely not in this store
+    bool mayContain(const Key& key) const {
+        EpochGuard guard;
+        return bloom.load(std::memory_order_acquire)->mayContainHash(KeyCodec::hash(key));
+    }
+
+    bool sync() const {
+        return writeFd < 0 || ::fdatasync(writeFd) == 0;
+    }
+
+    bool get(const Key& key, std::string& out) const {
+        return read(offsets->get(key), out);
+    }
+
+    // Location of the newest record of key in this store. byteSize is 0 when
+    // the store has no record of it; a tombstone is a record too.
+    MetaData find(const Key& key) const {
+        return offsets->get(key);
+    }
+
+    // Reads the value of the record at metaData, as returned by the index.
+    // Tombstones have no value and read as missing.
+    bool read(const MetaData& metaData, std::string& out, CompressionCounters* counters = nullptr) const {
+        if (metaData.byteSize <= 0) return false;
+        if (metaData.flags & RECORD_FLAG_TOMBSTONE) return false;
+
+        std::string_view value;
+        std::string inflated;
+        if (const char* base = mapped.load(std::memory_order_acquire)) {
+            if (metaData.byteOffset + metaData.byteSize > mappedSize) return false;
+            if (!decode(base + metaData.byteOffset, metaData.byteSize, inflated, value, counters)) return false;
+            out.assign(value.data(), value.size());
+            return true;
+        }
+        if (readFd < 0) return false;
+
+        // Record size is known from the index, so a single positional read
+        // fetches it without scanning for the delimiter
+        out.resize(metaData.byteSize);
+        if (!readRaw(metaData.byteOffset, metaData.byteSize, &out[0]) ||
+            !decode(out.data(), out.size(), inflated, value, counters)) {
+            out.clear();
+            return false;
+        }
+        if (!inflated.empty() && value.data() == inflated.data()) {
+            out = std::move(inflated);
+            return true;
+        }
+        // The value is the tail of the record minus the legacy delimiter
+        size_t valueStart = value.data() - out.data();
+        out.resize(valueStart + value.size());
+        out.erase(0, valueStart);
+        return true;
+    }
+
+    // Copies file bytes [offset, offset + size) into out with one pread (or a
+    // memcpy from the mapping of a sealed store)
+    bool readRaw(uint64_t offset, size_t size, char* out) const {
+        if (const char* base = mapped.load(std::memory_order_acquire)) {
+            if (offset + size > mappedSize) return false;
+            std::memcpy(out, base + offset, size);
+            return true;
+        }
+        return readFd >= 0 && preadFully(readFd, out, size, offset);
+    }
+
+    // Bytes [offset, offset + size) of a mapped store, or nullptr if the store
+    // is not mapped or the range is out of bounds
+    const char* view(uint64_t offset, size_t size) const {
+        const char* base = mapped.load(std::memory_order_acquire);
+        if (base == nullptr || offset + size > mappedSize) return nullptr;
+        return base + offset;
+    }
+
+    // Validates a raw record read from this store and extracts its value.
+    // A compressed value is expanded into scratch and value then views it.
+    bool decode(const char* data, size_t size, std::string& scratch, std::string_view& value,
+        CompressionCounters* counters = nullptr) const {
+        if (legacy) {
+            return decodeLegacyRecord(data, size, value);
+        }
+        std::string_view key;
+        uint8_t flags;
+        if (!decodeRecord<KeyCodec>(data, size, key, value, flags)) return false;
+        if (!(flags & RECORD_FLAG_COMPRESSED)) return true;
+        if (!decompressValue(value, scratch, dictionary.get(), counters)) return false;
+        value = scratch;
+        return true;
+    }
+
+    size_t getTotalBytes() const {
+        return totalBytes;
+    }
+
+    // Bytes of the file taken by key records. Only stable once sealed.
+    uint64_t recordBytes() const {
+        return totalBytes - preambleBytes;
+    }
+
+    void addLive(uint64_t bytes) {
+        live.fetch_add(bytes, std::memory_order_relaxed);
+    }
+
+    void addDead(uint64_t bytes) {
+        dead.fetch_add(bytes, std::memory_order_relaxed);
+    }
+
+    // Moves a record that was live from live to dead bytes
+    void supersede(uint64_t bytes) {
+        live.fetch_sub(bytes, std::memory_order_relaxed);
+        dead.fetch_add(bytes, std::memory_order_relaxed);
+    }
+
+    void addTombstone(uint64_t bytes) {
+        dead.fetch_add(bytes, std::memory_order_relaxed);
+        tombstones.fetch_add(bytes, std::memory_order_relaxed);
+    }
+
+    // A tombstone rewritten within this store no longer needs keeping
+    void releaseTombstone(uint64_t bytes) {
+        tombstones.fetch_sub(bytes, std::memory_order_relaxed);
+    }
+
+    uint64_t liveBytes() const {
+        return live.load(std::memory_order_relaxed);
+    }
+
+    uint64_t deadBytes() const {
+        return dead.load(std::memory_order_relaxed);
+    }
+
+    uint64_t tombstoneBytes() const {
+        return tombstones.load(std::memory_order_relaxed);
+    }
+
+    // Dead bytes a merge of this store would drop
+    uint64_t reclaimableBytes() const {
+        const uint64_t deadNow = deadBytes();
+        const uint64_t kept = tombstoneBytes();
+        return deadNow > kept ? deadNow - kept : 0;
+    }
+
+    bool isEmpty() const {
+        return offsets->size() == 0;
+    }
+
+    // Keys indexed: records minus those a newer record of the same key hides
+    size_t recordCount() const {
+        return offsets->size();
+    }
+
+    // Without a key directory, whether the records this (sealed) store
+    // shadows in older stores have been counted dead. Owned by the engine's
+    // merge path.
+    bool settled = false;
+
+    bool isLegacy() const {
+        return legacy;
+    }
+
+    size_t id() const {
+        return segmentId;
+    }
+
+    const std::string& path() const {
+        return currDir;
+    }
+
+    // Follows a rename of the data file and its hint to dir, where the
+    // segment is file id `id`. Only before the store is shared.
+    void moved(const std::string& dir, size_t id) {
+        currDir = dir;
+        segmentId = id;
+    }
+
+    template <typename Fn>
+    void forEach(Fn&& fn) const {
+        offsets->forEach(fn);
+    }
+
+    // Marks the store read-only. The write stream is closed, the hint file is
+    // written and, in mmap mode, the file is mapped so gets no longer issue
+    // syscalls. An empty file or a failed mapping keeps the pread path.
+    void seal(SealedReadMode mode, AccessPattern pattern) {
+        if (writeFd >= 0) {
+            // Give back the extents preallocated beyond the data
+            if (preallocated && ::ftruncate(writeFd, totalBytes) != 0) {
+                log(LogLevel::Warning, "Failed to trim " + currDir + ": " + std::strerror(errno));
+            }
+            ::close(writeFd);
+            writeFd = -1;
+        }
+        if (!hasHint) {
+            writeHint();
+        }
+        if (mode != SealedReadMode::Mmap || mapped.load() != nullptr) return;
+        if (readFd < 0 || totalBytes == 0) return;
+
+        void* region = ::mmap(nullptr, totalBytes, PROT_READ, MAP_SHARED, readFd, 0);
+        if (region == MAP_FAILED) {
+            log(LogLevel::Warning, "mmap failed for " + currDir + ": " + std::strerror(errno));
+            return;
+        }
+        int advice = MADV_NORMAL;
+        switch (pattern) {
+        case AccessPattern::Normal: advice = MADV_NORMAL; break;
+        case AccessPattern::Random: advice = MADV_RANDOM; break;
+        case AccessPattern::Sequential: advice = MADV_SEQUENTIAL; break;
+        case AccessPattern::WillNeed: advice = MADV_WILLNEED; break;
+        }
+        ::madvise(region, totalBytes, advice);
+        mappedSize = totalBytes;
+        mapped.store(static_cast<const char*>(region), std::memory_order_release);
+    }
+
+    bool isSealed() const {
+        return writeFd < 0;
+    }
+};
+
+// Result of a get. A value from a mapped (sealed) segment is a view straight
+// into the mapping, and the handle holds a reference on that segment so a
+// merge cannot unmap it while the handle is alive; a value cache hit is a view
+// of the cached string, held the same way. Values from the active segment are
+// read into a buffer owned by the handle. An empty handle means the key was
+// not found.
+class ValueHandle {
+    // Keeps the memory behind `viewed` alive
+    std::shared_ptr<const void> owner;
+    std::string owned;
+    std::string_view viewed;
+    bool found = false;
+    bool isOwned = false;
+
+public:
+    ValueHandle() = default;
+
+    static ValueHandle view(std::shared_ptr<const void> owner, std::string_view value) {
+        ValueHandle handle;
+        handle.owner = std::move(owner);
+        handle.viewed = value;
+        handle.found = true;
+        return handle;
+    }
+
+    static ValueHandle copy(std::string value) {
+        ValueHandle handle;
+        handle.owned = std::move(value);
+        handle.found = true;
+        handle.isOwned = true;
+        return handle;
+    }
+
+    explicit operator bool() const {
+        return found;
+    }
+
+    // Valid for as long as the handle; empty when not found
+    std::string_view value() const {
+        return isOwned ? std::string_view(owned) : viewed;
+    }
+};
+
+// Awaitable form of a callback-based call (awaitGet, awaitSet): co_await
+// starts the call and the coroutine resumes with its result on whichever
+// thread completes it, often the engine's I/O or commit thread. Long work
+// after the co_await should be handed off from there.
+template <typename T>
+class AsyncResult {
+public:
+    using Start = std::function<void(std::function<void(T)>)>;
+
+private:
+    Start start;
+    std::optional<T> result;
+
+public:
+    explicit AsyncResult(Start start) : start(std::move(start)) {}
+
+    bool await_ready() const noexcept {
+        return false;
+    }
+
+    void await_suspend(std::coroutine_handle<> coroutine) {
+        // The call may complete, and the coroutine run on past this
+        // awaiter, before it returns
+        Start run = std::move(start);
+        run([this, coroutine](T value) {
+            result.emplace(std::move(value));
+            coroutine.resume();
+        });
+    }
+
+    T await_resume() {
+        return std::move(*result);
+    }
+};
+
+// Ordered cursor over the live keys of a range, returned by scan(). Values
+// are fetched ahead in batches, so walking a range costs mostly sequential
+// reads. The iterator must not outlive the engine that created it.
+template <typename Key = int>
+class ScanIterator {
+public:
+    using Entry = std::pair<Key, ValueHandle>;
+    // Appends the next entries in key order; false once nothing follows them
+    using Source = std::function<bool(std::vector<Entry>&)>;
+
+private:
+    Source source;
+    std::vector<Entry> batch;
+    size_t position = 0;
+    bool exhausted = false;
+
+    void fill() {
+        while (position >= batch.size() && !exhausted) {
+            batch.clear();
+            position = 0;
+            exhausted = !source(batch);
+        }
+    }
+
+public:
+    ScanIterator() : exhausted(true) {}
+
+    explicit ScanIterator(Source source) : source(std::move(source)) {
+        fill();
+    }
+
+    bool valid() const {
+        return position < batch.size();
+    }
+
+    void next() {
+        position++;
+        fill();
+    }
+
+    const Key& key() const {
+        return batch[position].first;
+    }
+
+    // Valid until the iterator moves
+    std::string_view value() const {
+        return batch[position].second.value();
+    }
+
+    // The current value as a handle that outlives the iterator
+    ValueHandle handle() const {
+        return batch[position].second;
+    }
+};
+
+// Puts and deletes that are applied atomically: the batch is encoded once
+// into a contiguous buffer, appended to the active segment with one write
+// and indexed in one pass. It is never split across a segment rotation.
+// Keys and values are encoded with the codecs of Codec, as in the engine the
+// batch is written to.
+template <typename Key = int, typename Value = std::string, typename Codec = DefaultCodec<Key, Value>>
+class WriteBatch {
+    template <typename, typename, typename> friend class StorageEngine;
+    template <typename, typename, typename> friend class ShardedStorageEngine;
+    friend class LsmStorageEngine;
+
+    using KeyCodec = typename Codec::KeyCodec;
+    using ValueCodec = typename Codec::ValueCodec;
+
+    struct Entry {
+        Key key;
+        uint32_t byteSize;
+        uint8_t flags;
+    };
+
+    std::string buffer;
+    std::vector<Entry> entries;
+
+    // value is already encoded (and possibly compressed)
+    void add(const Key& key, std::string_view value, uint8_t flags) {
+        // The previous record is no longer the last one of the batch
+        if (!entries.empty()) {
+            size_t last = buffer.size() - entries.back().byteSize;
+            markContinued(last);
+            entries.back().flags |= RECORD_FLAG_BATCH;
+        }
+        size_t bytes = encodeRecord(buffer, KeyCodec::view(key), value, flags);
+        entries.push_back({ key, static_cast<uint32_t>(bytes), flags });
+    }
+
+    // Sets RECORD_FLAG_BATCH on the record starting at `offset` and fixes its CRC
+    void markContinued(size_t offset) {
+        RecordHeader header;
+        std::memcpy(&header, &buffer[offset], sizeof(header));
+        header.flags |= RECORD_FLAG_BATCH;
+        std::memcpy(&buffer[offset], &header, sizeof(header));
+        size_t size = sizeof(header) + header.keySize + header.valueSize;
+        uint32_t crc = crc32c(0, &buffer[offset + sizeof(header.crc)], size - sizeof(header.crc));
+        std::memcpy(&buffer[offset], &crc, sizeof(crc));
+    }
+
+public:
+    // False, adding nothing, for a key or value too large for a record
+    bool put(const Key& key, typename ValueCodec::Param value) {
+        const std::string_view bytes = ValueCodec::view(value);
+        if (!Codec::fits(KeyCodec::view(key), bytes)) return false;
+        add(key, bytes, 0);
+        return true;
+    }
+
+    bool remove(const Key& key) {
+        if (!Codec::fits(KeyCodec::view(key), {})) return false;
+        add(key, {}, RECORD_FLAG_TOMBSTONE);
+        return true;
+    }
+
+    // Appends the records of other, so both are applied as one batch
+    void append(const WriteBatch& other) {
+        if (other.entries.empty()) return;
+        if (!entries.empty()) {
+            markContinued(buffer.size() - entries.back().byteSize);
+            entries.back().flags |= RECORD_FLAG_BATCH;
+        }
+        buffer += other.buffer;
+        entries.insert(entries.end(), other.entries.begin(), other.entries.end());
+    }
+
+    // Visits every record in order as fn(key, value, isDelete), the value
+    // as ValueCodec encoded it
+    template <typename Fn>
+    void forEach(Fn&& fn) const {
+        size_t offset = 0;
+        for (const Entry& entry : entries) {
+            std::string_view key;
+            std::string_view value;
+            uint8_t flags;
+            decodeRecord<KeyCodec>(buffer.data() + offset, entry.byteSize, key, value, flags);
+            fn(entry.key, value, (entry.flags & RECORD_FLAG_TOMBSTONE) != 0);
+            offset += entry.byteSize;
+        }
+    }
+
+    size_t count() const {
+        return entries.size();
+    }
+
+    size_t byteSize() const {
+        return buffer.size();
+    }
+
+    void clear() {
+        buffer.clear();
+        entries.clear();
+    }
+
+    // An empty batch owned by the calling thread, for single-key writes: its
+    // buffers keep their capacity from one call to the next (up to
+    // SCRATCH_BYTES), so a steady stream of sets does not allocate. Only
+    // valid until the next scratch() call on the same thread.
+    static WriteBatch& scratch() {
+        static constexpr size_t SCRATCH_BYTES = 1 << 20;
+        thread_local WriteBatch batch;
+        if (batch.buffer.capacity() > SCRATCH_BYTES) {
+            batch = WriteBatch();
+        }
+        batch.clear();
+        return batch;
+    }
+};
+
+// Counters of a ValueCache, shared by every key type
+struct ValueCacheStats {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t evictions = 0;
+    uint64_t entries = 0;
+    uint64_t bytes = 0;
+};
+
+// Sharded in-memory cache of values, bounded by a byte budget, so that hot
+// keys are served without touching a segment. Each shard has its own lock and
+// CLOCK eviction: a hit only sets the entry's reference bit, so lookups share
+// the shard lock, and only inserts and evictions take it exclusively.
+//
+// Fills from the read path carry the shard version seen before the index was
+// consulted and are dropped if a write to the shard happened since, so a
+// reader racing with set() can never cache the value that set() replaced.
+template <typename KeyCodec = FixedCodec<int>>
+class ValueCache {
+    using Key = typename KeyCodec::Type;
+
+    // Rough per-entry bookkeeping cost, charged on top of the value bytes
+    static constexpr size_t ENTRY_OVERHEAD = 64;
+
+    struct Entry {
+        Key key;
+        std::shared_ptr<const std::string> value;
+        size_t charge;
+        mutable std::atomic<bool> referenced{ false };
+
+        Entry(const Key& key, std::shared_ptr<const std::string> value, size_t charge)
+            : key(key), value(std::move(value)), charge(charge) {}
+        // Only moved with the shard lock held exclusively
+        Entry(Entry&& other) noexcept
+            : key(std::move(other.key)), value(std::move(other.value)), charge(other.charge),
+            referenced(other.referenced.load(std::memory_order_relaxed)) {}
+        Entry& operator=(Entry&& other) noexcept {
+            key = std::move(other.key);
+            value = std::move(other.value);
+            charge = other.charge;
+            referenced.store(other.referenced.load(std::memory_order_relaxed), std::memory_order_relaxed);
+            return *this;
+        }
+    };
+
+    struct alignas(64) Shard {
+        mutable std::shared_mutex mutex;
+        std::unordered_map<Key, size_t, KeyHash<KeyCodec>, KeyEqual<KeyCodec>> positions;  // key -> index in entries
+        std::vector<Entry> entries;
+        size_t hand = 0;
+        size_t bytes = 0;
+        // Bumped by every write to the shard
+        uint64_t version = 0;
+        mutable std::atomic<uint64_t> hits{ 0 };
+        mutable std::atomic<uint64_t> misses{ 0 };
+        uint64_t evictions = 0;
+    };
+
+    std::vector<std::unique_ptr<Shard>> shards;
+    size_t shardBudget;
+
+    Shard& shardOf(const Key& key) const {
+        uint64_t h = KeyCodec::hash(key) * 0x9E3779B97F4A7C15ull;
+        return *shards[(h >> 32) & (shards.size() - 1)];
+    }
+
+    // Requires the shard lock held exclusively
+    void removeAt(Shard& shard, size_t index) {
+        shard.bytes -= shard.entries[index].charge;
+        shard.positions.erase(shard.entries[index].key);
+        if (index + 1 != shard.entries.size()) {
+            shard.entries[index] = std::move(shard.entries.back());
+            shard.positions[shard.entries[index].key] = index;
+        }
+        shard.entries.pop_back();
+        if (shard.hand >= shard.entries.size()) {
+            shard.hand = 0;
+        }
+    }
+
+    // Requires the shard lock held exclusively
+    void insert(Shard& shard, const Key& key, std::string_view value) {
+        size_t charge = value.size() + ENTRY_OVERHEAD;
+        auto it = shard.positions.find(key);
+        if (it != shard.positions.end()) {
+            removeAt(shard, it->second);
+        }
+        // Values that would take over a large part of the shard are not cached
+        if (charge > shardBudget / 8) return;
+
+        // CLOCK: sweep, giving referenced entries a second chance
+        while (shard.bytes + charge > shardBudget && !shard.entries.empty()) {
+            Entry& entry = shard.entries[shard.hand];
+            if (entry.referenced.exchange(false, std::memory_order_relaxed)) {
+                shard.hand = (shard.hand + 1) % shard.entries.size();
+                continue;
+            }
+            removeAt(shard, shard.hand);
+            shard.evictions++;
+        }
+        shard.positions[key] = shard.entries.size();
+        shard.entries.emplace_back(key, std::make_shared<const std::string>(value), charge);
+        shard.bytes += charge;
+    }
+
+public:
+    using Stats = ValueCacheStats;
+
+    // shardCount is rounded up to a power of two
+    ValueCache(uint64_t budgetBytes, size_t shardCount) {
+        size_t count = 1;
+        while (count < shardCount) {
+            count *= 2;
+        }
+        for (size_t i = 0; i < count; i++) {
+            shards.push_back(std::make_unique<Shard>());
+        }
+        shardBudget = budgetBytes / count;
+    }
+
+    // The cached value, or nullptr and the shard version to pass to fill()
+    std::shared_ptr<const std::string> lookup(const Key& key, uint64_t& version) const {
+        Shard& shard = shardOf(key);
+        std::shared_lock<std::shared_mutex> lock(shard.mutex);
+        auto it = shard.positions.find(key);
+        if (it == shard.positions.end()) {
+            version = shard.version;
+            shard.misses.fetch_add(1, std::memory_order_relaxed);
+            return nullptr;
+        }
+        const Entry& entry = shard.entries[it->second];
+        // Relaxed is enough, the bit is only a hint for eviction
+        entry.referenced.store(true, std::memory_order_relaxed);
+        shard.hits.fetch_add(1, std::memory_order_relaxed);
+        return entry.value;
+    }
+
+    // Caches a value read from a segment, unless the shard was written since
+    // the lookup that returned version
+    void fill(const Key& key, std::string_view value, uint64_t version) {
+        Shard& shard = shardOf(key);
+        std::unique_lock<std::shared_mutex> lock(shard.mutex);
+        if (shard.version != version) return;
+        insert(shard, key, value);
+    }
+
+    // Write-through of a value that was just indexed
+    void put(const Key& key, std::string_view value) {
+        Shard& shard = shardOf(key);
+        std::unique_lock<std::shared_mutex> lock(shard.mutex);
+        shard.version++;
+        insert(shard, key, value);
+    }
+
+    // Drops key, once a new record of it is indexed
+    void invalidate(const Key& key) {
+        Shard& shard = shardOf(key);
+        std::unique_lock<std::shared_mutex> lock(shard.mutex);
+        shard.version++;
+        auto it = shard.positions.find(key);
+        if (it != shard.positions.end()) {
+            removeAt(shard, it->second);
+        }
+    }
+
+    Stats stats() const {
+        Stats result;
+        for (const auto& shard : shards) {
+            std::shared_lock<std::shared_mutex> lock(shard->mutex);
+            result.hits += shard->hits.load(std::memory_order_relaxed);
+            result.misses += shard->misses.load(std::memory_order_relaxed);
+            result.evictions += shard->evictions;
+            result.entries += shard->entries.size();
+            result.bytes += shard->bytes;
+        }
+        return result;
+    }
+};
+
+// Finds "<prefix>_<N><extension>" files next to the prefix, ordered by N
+inline std::vector<std::pair<size_t, std::string>> discoverFiles(const std::string& prefixFileName,
+    const std::string& extension) {
+    namespace fs = std::filesystem;
+    const fs::path prefix(prefixFileName);
+    const fs::path dir = prefix.has_parent_path() ? prefix.parent_path() : fs::path(".");
+    const std::string stem = prefix.filename().string() + "_";
+    const size_t suffix = extension.size();
+
+    std::vector<std::pair<size_t, std::string>> files;
+    std::error_code ec;
+    for (const auto& entry : fs::directory_iterator(dir, ec)) {
+        if (!entry.is_regular_file()) continue;
+        const std::string name = entry.path().filename().string();
+        if (name.size() <= stem.size() + suffix || name.compare(0, stem.size(), stem) != 0 ||
+            name.compare(name.size() - suffix, suffix, extension) != 0) {
+            continue;
+        }
+        const std::string number = name.substr(stem.size(), name.size() - stem.size() - suffix);
+        if (number.find_first_not_of("0123456789") != std::string::npos) continue;
+        files.emplace_back(std::stoul(number), prefixFileName + "_" + number + extension);
+    }
+    std::sort(files.begin(), files.end());
+    return files;
+}
+
+// Immutable snapshot of an engine's segments, the active one first and then
+// newest to oldest. Rotation and merges publish a new snapshot with a single
+// atomic store and retire the old one; readers load it under an EpochGuard.
+//
+// The key directory refers to segments by uid rather than by file id: a
+// merged segment takes over the newest input's file name and id, but gets a
+// fresh uid, so an entry still pointing at an input is never mistaken for one
+// pointing at the merge result.
+template <typename KeyCodec = FixedCodec<int>>
+struct SegmentSet {
+    struct Segment {
+        uint32_t uid;
+        // Reference counted so that value handles can outlive a merge
+        std::shared_ptr<Store<KeyCodec>> store;
+    };
+
+    std::vector<Segment> segments;
+    std::unordered_map<uint32_t, size_t> byUid;
+
+    explicit SegmentSet(std::vector<Segment> list) : segments(std::move(list)) {
+        for (size_t i = 0; i < segments.size(); i++) {
+            byUid[segments[i].uid] = i;
+        }
+    }
+
+    const Segment* find(uint32_t uid) const {
+        auto it = byUid.find(uid);
+        return it == byUid.end() ? nullptr : &segments[it->second];
+    }
+
+    const Segment& active() const {
+        return segments.front();
+    }
+};
+
+// Record bytes of one segment as reported by StorageEngine::stats(). Records
+// shadowed by a newer segment are only known with IndexMode::KeyDir; in
+// PerSegment mode a segment's dead bytes are its tombstones and the records
+// it rewrote itself.
+struct SegmentStats {
+    size_t id = 0;
+    std::string path;
+    bool active = false;
+    uint64_t liveBytes = 0;
+    uint64_t deadBytes = 0;
+    uint64_t tombstoneBytes = 0;          // part of deadBytes, kept while they shadow older records
+
+    double deadRatio() const {
+        const uint64_t total = liveBytes + deadBytes;
+        return total == 0 ? 0.0 : static_cast<double>(deadBytes) / total;
+    }
+};
+
+struct EngineStats {
+    MetricsSnapshot metrics;
+    std::vector<SegmentStats> segments;   // active first, then newest to oldest
+    uint64_t liveBytes = 0;
+    uint64_t deadBytes = 0;
+    ValueCacheStats cache;
+    CompressionStats compression;
+
+    // Record bytes on disk per live byte, 1.0 without garbage
+    double spaceAmplification() const {
+        return liveBytes == 0 ? (deadBytes == 0 ? 1.0 : std::numeric_limits<double>::infinity())
+            : static_cast<double>(liveBytes + deadBytes) / liveBytes;
+    }
+};
+
+// Adds stats to writer, every sample carrying labels
+inline void addEngineStats(PrometheusWriter& writer, const EngineStats& stats, const std::string& labels = {}) {
+    writer.metrics(stats.metrics, labels);
+    const std::string prefix = labels.empty() ? "" : labels + ",";
+    for (const auto& segment : stats.segments) {
+        const std::string segmentLabels = prefix + "segment=\"" + std::to_string(segment.id) + "\"";
+        writer.gauge("kv_segment_live_bytes", "Bytes of records still current", static_cast<double>(segment.liveBytes),
+            segmentLabels);
+        writer.gauge("kv_segment_dead_bytes", "Bytes of overwritten and deleted records",
+            static_cast<double>(segment.deadBytes), segmentLabels);
+        writer.gauge("kv_segment_tombstone_bytes", "Bytes of tombstones still shadowing older records",
+            static_cast<double>(segment.tombstoneBytes), segmentLabels);
+    }
+    writer.gauge("kv_segments", "Segment files, the active one included", static_cast<double>(stats.segments.size()),
+        labels);
+    writer.counter("kv_cache_hits_total", "Value cache hits", stats.cache.hits, labels);
+    writer.counter("kv_cache_misses_total", "Value cache misses", stats.cache.misses, labels);
+    writer.counter("kv_cache_evictions_total", "Value cache evictions", stats.cache.evictions, labels);
+    writer.gauge("kv_cache_bytes", "Bytes held by the value cache", static_cast<double>(stats.cache.bytes), labels);
+    writer.counter("kv_compression_raw_bytes_total", "Value bytes compression was tried on",
+        stats.compression.rawBytes, labels);
+    writer.counter("kv_compression_stored_bytes_total", "Bytes stored for those values",
+        stats.compression.storedBytes, labels);
+}
+
+inline std::string toPrometheus(const EngineStats& stats) {
+    PrometheusWriter writer;
+    addEngineStats(writer, stats);
+    return writer.text();
+}
+
+// A point in an engine's log: a segment file id and a byte offset in that
+// file. Segments follow each other in id order.
+struct LogPosition {
+    uint64_t segment = 0;
+    uint64_t offset = 0;
+
+    bool operator==(const LogPosition&) const = default;
+};
+
+// The hash-indexed engine. Key and Value are encoded by the key and value
+// codecs of Codec, by default fixed-width ones for trivially copyable types
+// and length-prefixed bytes for std::string; StorageEngine<> is the engine
+// over int keys and string values whose files every earlier version wrote.
+template <typename Key = int, typename Value = std::string, typename Codec = DefaultCodec<Key, Value>>
+class StorageEngine {
+public:
+    using KeyCodec = typename Codec::KeyCodec;
+    using ValueCodec = typename Codec::ValueCodec;
+    using WriteBatch = ::WriteBatch<Key, Value, Codec>;
+    using ScanIterator = ::ScanIterator<Key>;
+
+private:
+    static_assert(std::is_same_v<typename KeyCodec::Type, Key> && std::is_same_v<typename ValueCodec::Type, Value>,
+        "Codec must encode Key and Value");
+
+    using Store = ::Store<KeyCodec>;
+    using SegmentSet = ::SegmentSet<KeyCodec>;
+    using Segment = typename SegmentSet::Segment;
+    using ValueCache = ::ValueCache<KeyCodec>;
+    using ValueParam = typename ValueCodec::Param;
+
+    // Current segment list. Readers only load it; it is replaced with
+    // writeMutex held (see publish).
+    std::atomic<const SegmentSet*> segments{ nullptr };
+    uint32_t nextUid = 0;
+    std::string prefixFileName;
+    // Newest location of every key. Written by the commit leader and merge
+    // swaps under writeMutex, read lock-free by gets.
+    FlatTable<KeyDirEntry, KeyCodec> keyDir;
+    std::unique_ptr<ValueCache> valueCache;
+    mutable CompressionCounters compressionCounters;
+    Metrics metrics;
+    // Serves the reads of getAsync. Stores hold a reference too, for the
+    // descriptor they registered with it.
+    std::shared_ptr<IoBackend> io;
+    size_t totalMerged;
+    EngineOptions options;
+
+    // Serialises merges, whether run by the merge thread or merge()
+    std::mutex mergeRunMutex;
+    std::mutex mergeMutex;
+    std::condition_variable mergeWake;
+    bool mergeStopping = false;
+    bool mergeRequested = false;
+    std::thread mergeThread;
+
+    // Group commit: writers append encoded records to the pending group and
+    // one of them (the leader) writes the whole group with a single write()
+    // and, depending on the sync policy, a single fdatasync. Everyone else
+    // waits on `committed` until their group is done.
+    struct CommitGroup {
+        std::string buffer;
+        std::vector<typename WriteBatch::Entry> records;
+        // Of writeAsync calls, run by the commit thread once the group is done
+        std::vector<std::function<void(bool)>> callbacks;
+        bool done = false;
+        bool ok = false;
+    };
+    // Also serialises every change to the segment list and the key directory
+    std::mutex writeMutex;
+    std::condition_variable committed;
+    std::shared_ptr<CommitGroup> pending = std::make_shared<CommitGroup>();
+    // Groups recycled as the next pending group once nobody refers to them,
+    // so steady-state commits do not allocate. Every reference to a group is
+    // dropped under writeMutex, which is what makes use_count() exact here.
+    std::vector<std::shared_ptr<CommitGroup>> spareGroups;
+    // Held by whoever is doing I/O on the active store outside writeMutex
+    bool commitInProgress = false;
+    bool unsynced = false;
+    bool stopping = false;
+    std::condition_variable syncWake;
+    std::thread syncThread;
+    // writeAsync: commitThread leads groups that only asynchronous writers
+    // wait on, and runs the callbacks of finished groups outside
+    // writeMutex. Started by the first writeAsync.
+    std::condition_variable commitWake;
+    std::vector<std::pair<std::function<void(bool)>, bool>> finished;
+    std::once_flag commitStarted;
+    std::thread commitThread;
+
+    // The next segment is created (file, header, preallocation) ahead of time
+    // by spareThread, so rotation only has to swap it in. The segment rotated
+    // out is sealed (hint written, trimmed and mapped) by spareThread too,
+    // after the swap; until then it is read with pread.
+    std::mutex spareMutex;
+    std::condition_variable spareWake;
+    std::shared_ptr<Store> spare;
+    bool preparingSpare = false;
+    bool spareStopping = false;
+    std::deque<std::shared_ptr<Store>> sealQueue;
+    bool sealing = false;
+    // Highest segment file id handed out; guarded by spareMutex
+    size_t totalFiles = 0;
+    std::thread spareThread;
+
+    // End of the last commit or rotation, which replication streams up to
+    mutable std::mutex logMutex;
+    mutable std::condition_variable logAdvanced;
+    LogPosition logTail;
+    // First segment ids of the parts of the log followers are streaming;
+    // merges leave the lowest of them and every newer segment alone
+    mutable std::mutex retainMutex;
+    std::multiset<size_t> retained;
+    // Records a follower splits off a stream, reused from call to call
+    std::vector<typename WriteBatch::Entry> replicated;
+
+    void init() {
+        recoverIngest();
+        // Recover existing segments oldest to newest, one segment per worker.
+        // All but the newest are sealed, which writes any missing hint file.
+        std::vector<std::pair<size_t, std::string>> segments = discoverSegments();
+        std::vector<std::shared_ptr<Store>> recovered(segments.size());
+        parallelFor(segments.size(), [&](size_t i) {
+            const bool newest = i + 1 == segments.size();
+            recovered[i] = std::make_shared<Store>(segments[i].second, segments[i].first,
+                newest && options.preallocate ? options.segmentBytes : 0);
+            if (!newest) {
+                recovered[i]->seal(options.sealedReadMode, options.accessPattern);
+            }
+            recovered[i]->attachIo(io);
+        });
+        std::vector<Segment> list;
+        std::unordered_map<uint32_t, Store*> byUid;
+        auto storeOf = [&](uint32_t uid) {
+            auto it = byUid.find(uid);
+            return it == byUid.end() ? nullptr : it->second;
+        };
+        for (auto& store : recovered) {
+            // Oldest first, so newer segments overwrite older locations
+            const uint32_t uid = nextUid++;
+            byUid[uid] = store.get();
+            addToKeyDir(*store, uid, storeOf);
+            list.insert(list.begin(), { uid, std::move(store) });
+        }
+        if (!segments.empty()) {
+            totalFiles = segments.back().first;
+            log(LogLevel::Info, "Recovered " + std::to_string(segments.size()) + " segments of " + prefixFileName);
+        }
+
+        // Legacy text segments and segments recovered from a hint file are
+        // only read, new records go to a fresh file
+        if (list.empty()) {
+            createStore();
+            return;
+        }
+        Store& newest = *list.front().store;
+        publish(std::make_unique<SegmentSet>(std::move(list)));
+        if (newest.isLegacy() || newest.isSealed()) {
+            newest.seal(options.sealedReadMode, options.accessPattern);
+            createStore();
+        }
+        advanceLog();
+    }
+
+    // The segment list as seen by the writer. Requires writeMutex held (or
+    // the engine not yet shared).
+    const SegmentSet& current() const {
+        return *segments.load(std::memory_order_acquire);
+    }
+
+    // Makes next the current segment list, under the same locking as
+    // current(). The replaced list is freed once no reader can be using it.
+    void publish(std::unique_ptr<SegmentSet> next) {
+        const SegmentSet* previous = segments.exchange(next.release(), std::memory_order_acq_rel);
+        if (previous != nullptr) {
+            EpochManager::instance().retire([previous] { delete previous; });
+        }
+    }
+
+    // Finds "<prefix>_<N>.txt" files next to the prefix, ordered by N
+    std::vector<std::pair<size_t, std::string>> discoverSegments() const {
+        return discoverFiles(prefixFileName, ".txt");
+    }
+
+    std::string segmentPath(size_t id) const {
+        return prefixFileName + "_" + std::to_string(id) + ".txt";
+    }
+
+    // An ingested segment and its hint ("<staged>.hint") are linked here
+    // first, and moved to segmentPath(id) once the marker file exists
+    std::string stagedPath(size_t id) const {
+        return segmentPath(id) + ".ingest";
+    }
+
+    std::string ingestMarker() const {
+        return prefixFileName + ".ingest";
+    }
+
+    // Finishes an ingest a crash interrupted after it wrote its marker, and
+    // drops the files of one interrupted before, whose inputs are all still
+    // where they were
+    void recoverIngest() {
+        const bool complete = ::access(ingestMarker().c_str(), F_OK) == 0;
+        for (const auto& [id, staged] : discoverFiles(prefixFileName, ".txt.ingest")) {
+            if (complete) {
+                ::rename((staged + ".hint").c_str(), (segmentPath(id) + ".hint").c_str());
+                ::rename(staged.c_str(), segmentPath(id).c_str());
+            }
+            else {
+                ::unlink((staged + ".hint").c_str());
+                ::unlink(staged.c_str());
+            }
+        }
+        if (complete) {
+            log(LogLevel::Info, "Finished an interrupted ingest into " + prefixFileName);
+            syncDirectory(options.directory);
+            ::unlink(ingestMarker().c_str());
+        }
+    }
+
+    std::shared_ptr<Store> makeSegment(size_t id) const {
+        auto store = std::make_shared<Store>(segmentPath(id), id,
+            options.preallocate ? options.segmentBytes : 0);
+        store->attachIo(io);
+        return store;
+    }
+
+    // A new, empty segment of file id `id` (the next free one when 0),
+    // preferring the spare
+    std::shared_ptr<Store> takeSpare(size_t id) {
+        std::shared_ptr<Store> store;
+        {
+            std::unique_lock<std::mutex> lock(spareMutex);
+            // A spare still being prepared has the next id, so it is waited
+            // for rather than skipped
+            spareWake.wait(lock, [this] { return !preparingSpare; });
+            store = std::move(spare);
+            if (store != nullptr && id != 0 && store->id() != id) {
+                ::unlink(store->path().c_str());
+                store.reset();
+            }
+            if (store == nullptr) {
+                if (id == 0) {
+                    id = ++totalFiles;
+                }
+                totalFiles = std::max(totalFiles, id);
+                store = makeSegment(id);
+            }
+        }
+        spareWake.notify_all();
+        return store;
+    }
+
+    // Makes a new, empty segment the active one, preferring the spare. A
+    // follower passes the file id its leader continued in instead.
+    void createStore(size_t id = 0) {
+        std::shared_ptr<Store> store = takeSpare(id);
+        std::vector<Segment> list{ { nextUid++, store } };
+        if (const SegmentSet* set = segments.load(std::memory_order_acquire)) {
+            list.insert(list.end(), set->segments.begin(), set->segments.end());
+        }
+        publish(std::make_unique<SegmentSet>(std::move(list)));
+        advanceLog();
+        log(LogLevel::Debug, "Create a storage object with name: " + store->path());
+    }
+
+    // Replaces the active segment, which must be empty, with a new one of
+    // file id `id`. Requires writeMutex held.
+    void replaceEmptyActive(size_t id) {
+        const std::shared_ptr<Store> empty = current().active().store;
+        createStore(id);
+        std::vector<Segment> list;
+        for (const auto& segment : current().segments) {
+            if (segment.store != empty) {
+                list.push_back(segment);
+            }
+        }
+        publish(std::make_unique<SegmentSet>(std::move(list)));
+        ::unlink(empty->path().c_str());
+    }
+
+    // Publishes the end of the active segment as the end of the log, for
+    // waitForLog. Requires writeMutex held (or the engine not yet shared).
+    void advanceLog() {
+        const Store& active = *current().active().store;
+        {
+            std::lock_guard<std::mutex> lock(logMutex);
+            logTail = { active.id(), active.getTotalBytes() };
+        }
+        logAdvanced.notify_all();
+    }
+
+    // Seals store, just rotated out, on spareThread. Inline once that has
+    // stopped. Requires writeMutex held.
+    void sealLater(std::shared_ptr<Store> store) {
+        {
+            std::lock_guard<std::mutex> lock(spareMutex);
+            if (!spareStopping) {
+                sealQueue.push_back(std::move(store));
+                spareWake.notify_all();
+                return;
+            }
+        }
+        store->seal(options.sealedReadMode, options.accessPattern);
+    }
+
+    // Returns once every segment rotated out so far is sealed. Merges wait,
+    // so that no hint is written for an input after the merge replaced it.
+    void waitForSeals() {
+        std::unique_lock<std::mutex> lock(spareMutex);
+        spareWake.wait(lock, [this] { return sealQueue.empty() && !sealing; });
+    }
+
+    // Prepares the spare first, since a rotation without one creates the
+    // file under writeMutex, then seals what was rotated out. Seals queued
+    // when stopping are still carried out.
+    void spareLoop() {
+        std::unique_lock<std::mutex> lock(spareMutex);
+        for (;;) {
+            spareWake.wait(lock, [this] { return spareStopping || spare == nullptr || !sealQueue.empty(); });
+            if (!spareStopping && spare == nullptr) {
+                const size_t id = ++totalFiles;
+                preparingSpare = true;
+                lock.unlock();
+                std::shared_ptr<Store> store = makeSegment(id);
+                lock.lock();
+                spare = std::move(store);
+                preparingSpare = false;
+                spareWake.notify_all();
+                continue;
+            }
+            if (!sealQueue.empty()) {
+                std::shared_ptr<Store> store = std::move(sealQueue.front());
+                sealQueue.pop_front();
+                sealing = true;
+                lock.unlock();
+                store->seal(options.sealedReadMode, options.accessPattern);
+                store.reset();
+                lock.lock();
+                sealing = false;
+                spareWake.notify_all();
+                continue;
+            }
+            if (spareStopping) break;
+        }
+        // Nothing was ever written to an unused spare
+        if (spare != nullptr) {
+            ::unlink(spare->path().c_str());
+            spare.reset();
+        }
+    }
+
+    // Makes metaData, just indexed in store, the newest record of key and
+    // accounts its bytes and those of the record it replaces as live or dead.
+    // storeOf(uid) is the store of a segment uid, nullptr once dropped.
+    // Requires writeMutex held (or the engine not yet shared).
+    template <typename StoreOf>
+    void updateKeyDir(const Key& key, uint32_t uid, Store& store, const MetaData& metaData, StoreOf&& storeOf) {
+        const bool tombstone = (metaData.flags & RECORD_FLAG_TOMBSTONE) != 0;
+        if (tombstone) {
+            store.addTombstone(metaData.byteSize);
+        }
+        else {
+            store.addLive(metaData.byteSize);
+        }
+        if (options.indexMode != IndexMode::KeyDir) return;
+        KeyDirEntry previous;
+        if (keyDir.find(key, previous)) {
+            if (Store* owner = storeOf(previous.segmentUid)) {
+                owner->supersede(previous.metaData.byteSize);
+            }
+        }
+        if (tombstone) {
+            keyDir.erase(key);
+        }
+        else {
+            keyDir.put(key, { uid, metaData });
+        }
+    }
+
+    // Indexes a recovered store; stores must be added oldest first
+    template <typename StoreOf>
+    void addToKeyDir(Store& store, uint32_t uid, StoreOf&& storeOf) {
+        uint64_t indexed = 0;
+        store.forEach([&](const Key& key, const MetaData& metaData) {
+            indexed += metaData.byteSize;
+            updateKeyDir(key, uid, store, metaData, storeOf);
+        });
+        // Older records of keys the store rewrote, which its index dropped
+        if (store.recordBytes() > indexed) {
+            store.addDead(store.recordBytes() - indexed);
+        }
+    }
+
+    bool syncStore(const Store& store) const {
+        Metrics::Timer timer = metrics.time(Op::Fsync);
+        return store.sync();
+    }
+
+    // Resolves key to the segment and location of its newest live record.
+    // Requires an EpochGuard, which also keeps the returned segment valid.
+    bool locate(const Key& key, const Segment*& segment, MetaData& metaData) const {
+        if (options.indexMode == IndexMode::KeyDir) {
+            for (;;) {
+                KeyDirEntry entry;
+                if (!keyDir.find(key, entry)) return false;
+                // Loaded after the entry, so the list is at least as new as
+                // the segment the entry points at
+                segment = segments.load(std::memory_order_acquire)->find(entry.segmentUid);
+                if (segment != nullptr) {
+                    metaData = entry.metaData;
+                    return true;
+                }
+                // A merge swap moved the key between the two loads; its entry
+                // already points at the merged segment
+            }
+        }
+        for (const auto& candidate : segments.load(std::memory_order_acquire)->segments) {
+            if (!candidate.store->mayContain(key)) continue;
+            metaData = candidate.store->find(key);
+            if (metaData.byteSize == 0) continue;
+            // The newest record decides, even if it is a tombstone
+            if (metaData.flags & RECORD_FLAG_TOMBSTONE) return false;
+            segment = &candidate;
+            return true;
+        }
+        return false;
+    }
+
+    size_t sealedCount() const {
+        EpochGuard guard;
+        return segments.load(std::memory_order_acquire)->segments.size() - 1;
+    }
+
+    void mergeLoop() {
+        std::unique_lock<std::mutex> lock(mergeMutex);
+        while (!mergeStopping) {
+            mergeWake.wait_for(lock, options.merge.interval,
+                [this] { return mergeStopping || mergeRequested; });
+            if (mergeStopping) break;
+            mergeRequested = false;
+            if (sealedCount() < options.merge.minSegments) continue;
+            lock.unlock();
+            reclaim();
+            lock.lock();
+        }
+    }
+
+    // Called with writeMutex held and nothing pending or in flight. The next
+    // segment gets file id nextId, or the next free one when that is 0.
+    void onCapacityExceeded(size_t nextId = 0) {
+        Metrics::Timer timer = metrics.time(Op::Rotation);
+        // The current store is never written again once rotated out
+        Store& sealed = *current().active().store;
+        if (options.durability.policy != SyncPolicy::None) {
+            syncStore(sealed);
+        }
+        unsynced = false;
+        // The hint, trimming and mapping wait for spareThread; a crash before
+        // the hint is written costs a scan of the segment on the next open
+        sealLater(current().active().store);
+        createStore(nextId);
+        if (options.merge.enabled) {
+            std::lock_guard<std::mutex> lock(mergeMutex);
+            mergeRequested = true;
+            mergeWake.notify_one();
+        }
+    }
+
+    // Writes the pending group as the leader. Requires writeMutex held and no
+    // commit in progress; the lock is released for the duration of the I/O so
+    // other writers can keep filling the next group.
+    void commitPending(std::unique_lock<std::mutex>& lock) {
+        std::shared_ptr<CommitGroup> group = std::move(pending);
+        pending = nextGroup();
+        commitInProgress = true;
+        // Copied, since a merge may replace the segment list during the I/O
+        const uint32_t uid = current().active().uid;
+        std::shared_ptr<Store> store = current().active().store;
+
+        lock.unlock();
+        bool ok;
+        {
+            Metrics::Timer timer = metrics.time(Op::Flush);
+            ok = store->append(group->buffer.data(), group->buffer.size());
+        }
+        if (ok && options.durability.policy == SyncPolicy::EveryCommit) {
+            ok = syncStore(*store);
+        }
+        lock.lock();
+
+        if (ok) {
+            indexRecords(*store, uid, group->records);
+            metrics.add(Counter::WrittenBytes, group->buffer.size());
+            unsynced = options.durability.policy == SyncPolicy::Interval;
+            if (valueCache) {
+                writeThrough(*group);
+            }
+            advanceLog();
+        }
+        group->ok = ok;
+        group->done = true;
+        for (auto& callback : group->callbacks) {
+            finished.emplace_back(std::move(callback), ok);
+        }
+        commitInProgress = false;
+        committed.notify_all();
+        commitWake.notify_one();
+    }
+
+    // Indexes records just appended to store, the segment with uid `uid`, and
+    // drops their keys from the value cache. Requires writeMutex held.
+    void indexRecords(Store& store, uint32_t uid, std::span<const typename WriteBatch::Entry> records) {
+        auto storeOf = [this](uint32_t segmentUid) -> Store* {
+            const Segment* segment = current().find(segmentUid);
+            return segment == nullptr ? nullptr : segment->store.get();
+        };
+        for (const auto& record : records) {
+            // The store's own older record of the key, which its index is
+            // about to drop. Without a key directory it is the only
+            // shadowed record known about.
+            const MetaData previous = store.find(record.key);
+            if (previous.byteSize > 0) {
+                if (previous.flags & RECORD_FLAG_TOMBSTONE) {
+                    store.releaseTombstone(previous.byteSize);
+                }
+                else if (options.indexMode != IndexMode::KeyDir) {
+                    store.supersede(previous.byteSize);
+                }
+            }
+            MetaData metaData = store.index(record.key, record.byteSize, record.flags);
+            updateKeyDir(record.key, uid, store, metaData, storeOf);
+        }
+        // Only once the new locations are visible: a reader that looked up
+        // the old one before this fills under a version that is now stale
+        if (valueCache) {
+            for (const auto& record : records) {
+                valueCache->invalidate(record.key);
+            }
+        }
+    }
+
+    // A spare group no writer refers to any more, reset, or a new one.
+    // Requires writeMutex held.
+    std::shared_ptr<CommitGroup> nextGroup() {
+        static constexpr size_t MAX_SPARE_GROUPS = 4;
+        static constexpr size_t MAX_SPARE_BYTES = 4 << 20;
+        for (const auto& spare : spareGroups) {
+            if (spare.use_count() != 1) continue;
+            CommitGroup& group = *spare;
+            if (group.buffer.capacity() > MAX_SPARE_BYTES) {
+                group.buffer = std::string();
+            }
+            group.buffer.clear();
+            group.records.clear();
+            group.callbacks.clear();
+            group.done = false;
+            group.ok = false;
+            return spare;
+        }
+        auto group = std::make_shared<CommitGroup>();
+        if (spareGroups.size() < MAX_SPARE_GROUPS) {
+            spareGroups.push_back(group);
+        }
+        return group;
+    }
+
+    // Caches the values of a group that was just indexed, in order, so the
+    // last record of a key decides: a tombstone drops what an earlier put of
+    // the group cached
+    void writeThrough(const CommitGroup& group) {
+        size_t offset = 0;
+        std::string inflated;
+        for (const auto& record : group.records) {
+            std::string_view key;
+            uint8_t flags;
+            std::string_view value;
+            bool cached = false;
+            if (!(record.flags & RECORD_FLAG_TOMBSTONE) &&
+                decodeRecord<KeyCodec>(group.buffer.data() + offset, record.byteSize, key, value, flags)) {
+                if (!(flags & RECORD_FLAG_COMPRESSED)) {
+                    valueCache->put(record.key, value);
+                    cached = true;
+                }
+                else if (decompressValue(value, inflated)) {
+                    valueCache->put(record.key, inflated);
+                    cached = true;
+                }
+            }
+            if (!cached) {
+                valueCache->invalidate(record.key);
+            }
+            offset += record.byteSize;
+        }
+    }
+
+    // Appends value to out compressed with the configured codec (and the
+    // dictionary, if any), see compressCounted
+    bool compress(std::string_view value, std::string& out, const ZstdDictionary* dictionary = nullptr) {
+        return compressCounted(options.compression, value, out, compressionCounters, dictionary);
+    }
+
+    // Re-encodes batch with every value that compresses stored compressed,
+    // into a batch of the calling thread that is reused by its next call.
+    // Runs before the write lock is taken, so writers compress in parallel.
+    const WriteBatch& compressBatch(const WriteBatch& batch) {
+        thread_local WriteBatch out;
+        thread_local std::string stored;
+        out.clear();
+        batch.forEach([&](const Key& key, std::string_view value, bool isDelete) {
+            if (isDelete) {
+                out.remove(key);
+                return;
+            }
+            stored.clear();
+            if (compress(value, stored)) {
+                out.add(key, stored, RECORD_FLAG_COMPRESSED);
+            }
+            else {
+                out.add(key, value, 0);
+            }
+        });
+        return out;
+    }
+
+    // Waits for the in-flight commit and writes whatever is still pending, so
+    // the active store is quiescent when this returns
+    void drain(std::unique_lock<std::mutex>& lock) {
+        committed.wait(lock, [this] { return !commitInProgress; });
+        if (!pending->records.empty()) {
+            commitPending(lock);
+        }
+    }
+
+    void syncLoop() {
+        std::unique_lock<std::mutex> lock(writeMutex);
+        while (!stopping) {
+            syncWake.wait_for(lock, options.durability.interval, [this] { return stopping; });
+            committed.wait(lock, [this] { return !commitInProgress; });
+            if (!unsynced) continue;
+
+            unsynced = false;
+            commitInProgress = true;
+            std::shared_ptr<Store> store = current().active().store;
+            lock.unlock();
+            syncStore(*store);
+            lock.lock();
+            commitInProgress = false;
+            committed.notify_all();
+            commitWake.notify_one();
+        }
+    }
+
+    // Commits what asynchronous writers queued, since none of them waits to
+    // lead, and completes them. Finishes whatever is queued before stopping.
+    void commitLoop() {
+        std::unique_lock<std::mutex> lock(writeMutex);
+        for (;;) {
+            commitWake.wait(lock, [this] {
+                return !finished.empty() || (!commitInProgress && (stopping || !pending->callbacks.empty()));
+            });
+            if (!finished.empty()) {
+                std::vector<std::pair<std::function<void(bool)>, bool>> ready;
+                ready.swap(finished);
+                lock.unlock();
+                for (auto& [callback, ok] : ready) {
+                    callback(ok);
+                }
+                lock.lock();
+            }
+            else if (!pending->callbacks.empty()) {
+                commitPending(lock);
+            }
+            else {
+                break;
+            }
+        }
+    }
+
+    // Rotates if the batch does not fit the active store and adds it to the
+    // pending group, which is returned. Requires writeMutex held.
+    std::shared_ptr<CommitGroup> enqueue(const WriteBatch& batch, std::unique_lock<std::mutex>& lock) {
+        // Checking if store capacity is exceeded (a record larger than the
+        // limit still goes into an empty store rather than rotating forever).
+        // Bytes already queued for the active store count towards its size.
+        // drain releases the lock, so another writer may have rotated by the
+        // time it returns: the check is repeated, and only a store with
+        // nothing left in flight is sealed.
+        for (;;) {
+            Store& currStore = *current().active().store;
+            uint64_t queuedBytes = currStore.getTotalBytes() + pending->buffer.size();
+            bool hasRecords = !currStore.isEmpty() || !pending->records.empty();
+            if (!hasRecords || queuedBytes + batch.byteSize() <= options.segmentBytes) break;
+            if (commitInProgress || !pending->records.empty()) {
+                drain(lock);
+                continue;
+            }
+            onCapacityExceeded();
+            break;
+        }
+
+        std::shared_ptr<CommitGroup> group = pending;
+        group->buffer += batch.buffer;
+        group->records.insert(group->records.end(), batch.entries.begin(), batch.entries.end());
+        return group;
+    }
+public:
+    explicit StorageEngine(const EngineOptions& options)
+        : prefixFileName(options.prefix()), metrics(options.metrics), io(makeIoBackend(options.io)),
+        totalMerged(0), options(options) {
+        if (options.valueCacheBytes > 0) {
+            valueCache = std::make_unique<ValueCache>(options.valueCacheBytes, options.valueCacheShards);
+        }
+        std::error_code ec;
+        std::filesystem::create_directories(options.directory, ec);
+        init();
+        if (options.durability.policy == SyncPolicy::Interval) {
+            syncThread = std::thread(&StorageEngine::syncLoop, this);
+        }
+        if (options.merge.enabled) {
+            mergeThread = std::thread(&StorageEngine::mergeLoop, this);
+        }
+        spareThread = std::thread(&StorageEngine::spareLoop, this);
+    }
+
+    // Default options with segment files named "<prefixFileName>_<N>.txt"
+    explicit StorageEngine(const std::string& prefixFileName)
+        : StorageEngine(EngineOptions::fromPrefix(prefixFileName)) {}
+
+    ~StorageEngine() {
+        // Completions of getAsync use the caches and counters below
+        io->drain();
+        {
+            std::lock_guard<std::mutex> lock(spareMutex);
+            spareStopping = true;
+        }
+        spareWake.notify_all();
+        spareThread.join();
+        {
+            std::lock_guard<std::mutex> lock(mergeMutex);
+            mergeStopping = true;
+        }
+        mergeWake.notify_all();
+        if (mergeThread.joinable()) {
+            mergeThread.join();
+        }
+        {
+            std::lock_guard<std::mutex> lock(writeMutex);
+            stopping = true;
+        }
+        syncWake.notify_all();
+        commitWake.notify_all();
+        if (syncThread.joinable()) {
+            syncThread.join();
+        }
+        if (commitThread.joinable()) {
+            commitThread.join();
+        }
+        if (options.durability.policy != SyncPolicy::None) {
+            syncStore(*current().active().store);
+        }
+        // Readers must be gone by now, so only other engines' pins can delay
+        // freeing the segment lists retired by this one
+        delete segments.load();
+        EpochManager::instance().reclaim();
+    }
+
+    bool set(const Key& key, ValueParam value) {
+        WriteBatch& batch = WriteBatch::scratch();
+        return batch.put(key, value) && write(batch);
+    }
+
+    // Appends a tombstone for key. Deleting a missing key is not an error.
+    bool remove(const Key& key) {
+        WriteBatch& batch = WriteBatch::scratch();
+        return batch.remove(key) && write(batch);
+    }
+
+    // Applies every put and delete of the batch, or none of them
+    bool write(const WriteBatch& input) {
+        if (input.count() == 0) return true;
+        Metrics::Timer timer = metrics.time(Op::Set);
+        const WriteBatch& batch = options.compression.codec != Compression::None ? compressBatch(input) : input;
+
+        std::unique_lock<std::mutex> lock(writeMutex);
+        std::shared_ptr<CommitGroup> group = enqueue(batch, lock);
+        while (!group->done) {
+            if (!commitInProgress) {
+                commitPending(lock);
+            }
+            else {
+                committed.wait(lock);
+            }
+        }
+        return group->ok;
+    }
+
+    // Safe to call from any number of threads, concurrently with writes and
+    // merges. Takes no lock: the key directory and segment list are read
+    // under an EpochGuard. The handle holds the value as ValueCodec encoded
+    // it, which for string values is the string itself.
+    ValueHandle get(const Key& key) const {
+        Metrics::Timer timer = metrics.time(Op::Get);
+        ValueHandle handle = fetch(key);
+        if (handle) {
+            metrics.add(Counter::ReadBytes, handle.value().size());
+        }
+        else {
+            metrics.add(Counter::GetMisses);
+        }
+        return handle;
+    }
+
+    // Copies the value into a caller-provided one; a string reuses its
+    // capacity
+    bool get(const Key& key, Value& out) const {
+        Metrics::Timer timer = metrics.time(Op::Get);
+        bool found;
+        size_t bytes;
+        if constexpr (std::is_same_v<ValueCodec, StringCodec>) {
+            found = fetch(key, out);
+            bytes = out.size();
+        }
+        else {
+            thread_local std::string encoded;
+            found = fetch(key, encoded) && ValueCodec::decode(encoded, out);
+            bytes = encoded.size();
+        }
+        if (found) {
+            metrics.add(Counter::ReadBytes, bytes);
+        }
+        else {
+            metrics.add(Counter::GetMisses);
+        }
+        return found;
+    }
+
+private:
+    ValueHandle fetch(const Key& key) const {
+        uint64_t version = 0;
+        if (valueCache) {
+            if (auto cached = valueCache->lookup(key, version)) {
+                std::string_view value = *cached;
+                return ValueHandle::view(std::move(cached), value);
+            }
+        }
+
+        EpochGuard guard;
+        const Segment* segment = nullptr;
+        MetaData metaData{};
+        if (!locate(key, segment, metaData)) return {};
+
+        // Sealed segments are served straight from the mapping
+        const Store& store = *segment->store;
+        if (const char* record = store.view(metaData.byteOffset, metaData.byteSize)) {
+            return decodeHandle(segment->store, { record, metaData.byteSize }, true, key, version);
+        }
+        std::string value;
+        if (!store.read(metaData, value, &compressionCounters)) return {};
+        if (valueCache) {
+            valueCache->fill(key, value, version);
+        }
+        return ValueHandle::copy(std::move(value));
+    }
+
+    // Decodes a record of store into a handle and fills the value cache with
+    // it. Only uncompressed values of a mapped store are viewed in place.
+    ValueHandle decodeHandle(const std::shared_ptr<Store>& store, std::string_view record, bool mapped,
+        const Key& key, uint64_t version) const {
+        std::string inflated;
+        std::string_view value;
+        if (!store->decode(record.data(), record.size(), inflated, value, &compressionCounters)) return {};
+        if (valueCache) {
+            valueCache->fill(key, value, version);
+        }
+        if (value.data() != inflated.data()) {
+            return mapped ? ValueHandle::view(store, value) : ValueHandle::copy(std::string(value));
+        }
+        return ValueHandle::copy(std::move(inflated));
+    }
+
+    // Resolves key and queues the read of its record with the I/O backend.
+    // Cache hits, misses and mapped segments complete before this returns.
+    void startGet(const Key& key, std::function<void(ValueHandle)> done) const {
+        const auto start = std::chrono::steady_clock::now();
+        auto finish = [this, start, done = std::move(done)](ValueHandle handle) {
+            if (metrics.enabled()) {
+                metrics.record(Op::Get, elapsedNanos(start));
+                if (handle) {
+                    metrics.add(Counter::ReadBytes, handle.value().size());
+                }
+                else {
+                    metrics.add(Counter::GetMisses);
+                }
+            }
+            done(std::move(handle));
+        };
+
+        uint64_t version = 0;
+        if (valueCache) {
+            if (auto cached = valueCache->lookup(key, version)) {
+                std::string_view value = *cached;
+                finish(ValueHandle::view(std::move(cached), value));
+                return;
+            }
+        }
+        // The reference taken here keeps the store, and its descriptor,
+        // alive until the read completes
+        std::shared_ptr<Store> store;
+        MetaData metaData{};
+        {
+            EpochGuard guard;
+            const Segment* segment = nullptr;
+            if (locate(key, segment, metaData)) {
+                store = segment->store;
+            }
+        }
+        if (store == nullptr) {
+            finish({});
+            return;
+        }
+        if (const char* record = store->view(metaData.byteOffset, metaData.byteSize)) {
+            finish(decodeHandle(store, { record, metaData.byteSize }, true, key, version));
+            return;
+        }
+        const Store& target = *store;
+        target.readAsync(metaData.byteOffset, metaData.byteSize,
+            [this, store = std::move(store), key, version, finish = std::move(finish)](bool ok, std::string_view record) {
+                finish(ok ? decodeHandle(store, record, false, key, version) : ValueHandle{});
+            });
+    }
+
+    bool fetch(const Key& key, std::string& out) const {
+        uint64_t version = 0;
+        if (valueCache) {
+            if (auto cached = valueCache->lookup(key, version)) {
+                out.assign(*cached);
+                return true;
+            }
+        }
+
+        EpochGuard guard;
+        const Segment* segment = nullptr;
+        MetaData metaData{};
+        if (!locate(key, segment, metaData) || !segment->store->read(metaData, out, &compressionCounters)) {
+            return false;
+        }
+        if (valueCache) {
+            valueCache->fill(key, out, version);
+        }
+        return true;
+    }
+
+public:
+    // Asynchronous get. done receives what get(key) would return, on the I/O
+    // backend's thread once the read completes, or before this returns when
+    // no read is needed (cache hits, misses, mapped segments). The engine
+    // must outlive every call still pending.
+    void getAsync(const Key& key, std::function<void(ValueHandle)> done) const {
+        startGet(key, std::move(done));
+        io->submit();
+    }
+
+    // Queues the reads of all keys and submits them together, so a batch
+    // costs one system call; done(i, handle) is called once for every keys[i]
+    void getAsync(std::span<const Key> keys, std::function<void(size_t, ValueHandle)> done) const {
+        auto shared = std::make_shared<std::function<void(size_t, ValueHandle)>>(std::move(done));
+        for (size_t i = 0; i < keys.size(); i++) {
+            startGet(keys[i], [shared, i](ValueHandle handle) {
+                (*shared)(i, std::move(handle));
+            });
+        }
+        io->submit();
+    }
+
+    std::future<ValueHandle> getAsync(const Key& key) const {
+        auto promise = std::make_shared<std::promise<ValueHandle>>();
+        std::future<ValueHandle> result = promise->get_future();
+        getAsync(key, [promise](ValueHandle handle) {
+            promise->set_value(std::move(handle));
+        });
+        return result;
+    }
+
+    // co_await engine.awaitGet(key)
+    AsyncResult<ValueHandle> awaitGet(const Key& key) const {
+        return AsyncResult<ValueHandle>([this, key](std::function<void(ValueHandle)> done) {
+            getAsync(key, std::move(done));
+        });
+    }
+
+    // Asynchronous write. The batch joins the pending group like write()
+    // does, but nobody waits for it: the engine's commit thread writes the
+    // group and calls done with the result. Rotating to a new segment is
+    // still done by the caller.
+    void writeAsync(const WriteBatch& input, std::function<void(bool)> done) {
+        if (input.count() == 0) {
+            done(true);
+            return;
+        }
+        const auto start = std::chrono::steady_clock::now();
+        const WriteBatch& batch = options.compression.codec != Compression::None ? compressBatch(input) : input;
+        std::call_once(commitStarted, [this] {
+            commitThread = std::thread(&StorageEngine::commitLoop, this);
+        });
+        {
+            std::unique_lock<std::mutex> lock(writeMutex);
+            std::shared_ptr<CommitGroup> group = enqueue(batch, lock);
+            group->callbacks.push_back([this, start, done = std::move(done)](bool ok) {
+                if (metrics.enabled()) {
+                    metrics.record(Op::Set, elapsedNanos(start));
+                }
+                done(ok);
+            });
+        }
+        commitWake.notify_one();
+    }
+
+    void setAsync(const Key& key, ValueParam value, std::function<void(bool)> done) {
+        WriteBatch& batch = WriteBatch::scratch();
+        if (!batch.put(key, value)) {
+            done(false);
+            return;
+        }
+        writeAsync(batch, std::move(done));
+    }
+
+    std::future<bool> setAsync(const Key& key, ValueParam value) {
+        auto promise = std::make_shared<std::promise<bool>>();
+        std::future<bool> result = promise->get_future();
+        setAsync(key, value, [promise](bool ok) {
+            promise->set_value(ok);
+        });
+        return result;
+    }
+
+    // co_await engine.awaitSet(key, value)
+    AsyncResult<bool> awaitSet(Key key, Value value) {
+        return AsyncResult<bool>([this, key, value = std::move(value)](std::function<void(bool)> done) {
+            setAsync(key, value, std::move(done));
+        });
+    }
+
+    // Name of the backend serving getAsync ("io_uring" or "blocking")
+    const char* ioBackend() const {
+        return io->name();
+    }
+
+    // Looks up many keys at once. All keys are resolved against the index
+    // first, then grouped by segment and sorted by offset so that records
+    // close to each other are fetched with one larger read. Reads for
+    // different ranges run in parallel when there is enough to read.
+    // results[i] is an empty handle when keys[i] is missing.
+    std::vector<ValueHandle> multiGet(std::span<const Key> keys) const {
+        // Ranges further apart than this are read separately
+        const uint64_t MAX_GAP = 4096;
+        const uint64_t MAX_RANGE = 1 << 20;
+        const uint64_t PARALLEL_BYTES = 256 << 10;
+
+        struct Lookup {
+            const Segment* segment;
+            MetaData metaData;
+            size_t index;
+            uint64_t cacheVersion;
+        };
+        std::vector<ValueHandle> results(keys.size());
+        std::vector<Lookup> lookups;
+        lookups.reserve(keys.size());
+
+        // Keeps every segment reached below valid, including for the workers
+        EpochGuard guard;
+        for (size_t i = 0; i < keys.size(); i++) {
+            Lookup lookup{ nullptr, {}, i, 0 };
+            if (valueCache) {
+                if (auto cached = valueCache->lookup(keys[i], lookup.cacheVersion)) {
+                    std::string_view value = *cached;
+                    results[i] = ValueHandle::view(std::move(cached), value);
+                    continue;
+                }
+            }
+            if (locate(keys[i], lookup.segment, lookup.metaData)) {
+                lookups.push_back(lookup);
+            }
+        }
+        // Lookups may have resolved against different snapshots of the
+        // segment list, so group by store rather than by list entry
+        std::sort(lookups.begin(), lookups.end(), [](const Lookup& a, const Lookup& b) {
+            const Store* left = a.segment->store.get();
+            const Store* right = b.segment->store.get();
+            if (left != right) return left < right;
+            return a.metaData.byteOffset < b.metaData.byteOffset;
+        });
+
+        // Coalesce sorted lookups into ranges [begin, end) of the lookup list
+        struct Range {
+            size_t begin, end;
+            uint64_t offset, size;
+        };
+        std::vector<Range> ranges;
+        uint64_t totalBytes = 0;
+        for (size_t i = 0; i < lookups.size(); i++) {
+            const Lookup& lookup = lookups[i];
+            uint64_t start = lookup.metaData.byteOffset;
+            uint64_t end = start + lookup.metaData.byteSize;
+            if (!ranges.empty()) {
+                Range& last = ranges.back();
+                uint64_t lastEnd = last.offset + last.size;
+                if (lookups[last.begin].segment->store == lookup.segment->store && start <= lastEnd + MAX_GAP &&
+                    std::max(end, lastEnd) - last.offset <= MAX_RANGE) {
+                    totalBytes += end > lastEnd ? end - lastEnd : 0;
+                    last.size = std::max(end, lastEnd) - last.offset;
+                    last.end = i + 1;
+                    continue;
+                }
+            }
+            ranges.push_back({ i, i + 1, start, end - start });
+            totalBytes += end - start;
+        }
+
+        auto readRange = [&](size_t r) {
+            const Range& range = ranges[r];
+            const std::shared_ptr<Store>& segment = lookups[range.begin].segment->store;
+            const Store& store = *segment;
+            std::string buffer;
+            const char* data = store.view(range.offset, range.size);
+            const bool mapped = data != nullptr;
+            if (!mapped) {
+                buffer.resize(range.size);
+                if (!store.readRaw(range.offset, range.size, &buffer[0])) return;
+                data = buffer.data();
+            }
+            std::string inflated;
+            for (size_t i = range.begin; i < range.end; i++) {
+                const MetaData& metaData = lookups[i].metaData;
+                std::string_view value;
+                if (!store.decode(data + (metaData.byteOffset - range.offset), metaData.byteSize,
+                    inflated, value, &compressionCounters)) {
+                    continue;
+                }
+                if (valueCache) {
+                    valueCache->fill(keys[lookups[i].index], value, lookups[i].cacheVersion);
+                }
+                const bool inPlace = mapped && value.data() != inflated.data();
+                results[lookups[i].index] = inPlace ? ValueHandle::view(segment, value)
+                    : ValueHandle::copy(std::string(value));
+            }
+        };
+        if (ranges.size() > 1 && totalBytes >= PARALLEL_BYTES) {
+            parallelFor(ranges.size(), readRange);
+        }
+        else {
+            for (size_t r = 0; r < ranges.size(); r++) {
+                readRange(r);
+            }
+        }
+        if (metrics.enabled()) {
+            uint64_t bytes = 0, misses = 0;
+            for (const auto& result : results) {
+                bytes += result.value().size();
+                misses += result ? 0 : 1;
+            }
+            metrics.add(Counter::ReadBytes, bytes);
+            metrics.add(Counter::GetMisses, misses);
+        }
+        return results;
+    }
+
+    // Counters of the value cache, all zero when it is disabled
+    ValueCacheStats cacheStats() const {
+        return valueCache ? valueCache->stats() : ValueCacheStats{};
+    }
+
+    // Compression done by writes and merges, and decompression by reads
+    CompressionStats compressionStats() const {
+        return compressionCounters.snapshot();
+    }
+
+    // Metrics, cache and compression counters, and the live and dead record
+    // bytes of every segment. Takes no lock, so concurrent writes may be
+    // partly included.
+    EngineStats stats() const {
+        EngineStats result;
+        result.metrics = metrics.snapshot();
+        result.cache = cacheStats();
+        result.compression = compressionStats();
+        EpochGuard guard;
+        const SegmentSet& set = *segments.load(std::memory_order_acquire);
+        for (const auto& segment : set.segments) {
+            SegmentStats stats;
+            stats.id = segment.store->id();
+            stats.path = segment.store->path();
+            stats.active = &segment == &set.active();
+            stats.liveBytes = segment.store->liveBytes();
+            stats.deadBytes = segment.store->deadBytes();
+            stats.tombstoneBytes = segment.store->tombstoneBytes();
+            result.liveBytes += stats.liveBytes;
+            result.deadBytes += stats.deadBytes;
+            result.segments.push_back(std::move(stats));
+        }
+        return result;
+    }
+
+    // Trains the zstd dictionary a merge of inputs compresses with, from the
+    // newest values of up to 1 MiB of keys. nullptr when merges do not use one.
+    std::unique_ptr<ZstdDictionary> trainDictionary(const std::vector<Segment>& inputs) {
+        const CompressionOptions& compression = options.compression;
+        if (compression.codec != Compression::Zstd || !compression.mergeDictionary || !KV_HAVE_ZSTD) {
+            return nullptr;
+        }
+        const size_t SAMPLE_BYTES = 1 << 20;
+        std::string samples;
+        std::vector<size_t> sampleSizes;
+        KeySet<KeyCodec> seen;
+        std::string value;
+        for (const auto& segment : inputs) {
+            const Store* input = segment.store.get();
+            input->forEach([&](const Key& key, const MetaData& metaData) {
+                if (samples.size() >= SAMPLE_BYTES || !seen.insert(key).second) return;
+                if (!input->read(metaData, value) || value.size() < compression.minValueBytes) return;
+                samples += value;
+                sampleSizes.push_back(value.size());
+            });
+            if (samples.size() >= SAMPLE_BYTES) break;
+        }
+        return ZstdDictionary::train(samples, sampleSizes, compression.dictionaryBytes, compression.zstdLevel);
+    }
+
+    // Iterates the live keys in [lo, hi] in ascending order. The keys are
+    // collected from the index when the scan starts (the whole index is
+    // visited, being unordered); values are read scan.batchKeys at a time
+    // through multiGet, so each batch costs a few coalesced reads per
+    // segment. A key deleted after the scan started is skipped, one
+    // overwritten is returned with its newer value. Keys are ordered by
+    // their operator<.
+    ScanIterator scan(const Key& lo, const Key& hi) const {
+        auto keys = std::make_shared<std::vector<Key>>();
+        {
+            EpochGuard guard;
+            if (options.indexMode == IndexMode::KeyDir) {
+                keyDir.forEach([&](const Key& key, const KeyDirEntry&) {
+                    if (!(key < lo) && !(hi < key)) keys->push_back(key);
+                });
+            }
+            else {
+                // Newest segment first: the first record seen of a key decides
+                KeySet<KeyCodec> seen;
+                for (const auto& segment : segments.load(std::memory_order_acquire)->segments) {
+                    segment.store->forEach([&](const Key& key, const MetaData& metaData) {
+                        if (key < lo || hi < key || !seen.insert(key).second) return;
+                        if (!(metaData.flags & RECORD_FLAG_TOMBSTONE)) keys->push_back(key);
+                    });
+                }
+            }
+        }
+        std::sort(keys->begin(), keys->end());
+        const size_t batchKeys = std::max<size_t>(options.scan.batchKeys, 1);
+        size_t next = 0;
+        return ScanIterator([this, keys, batchKeys, next](std::vector<typename ScanIterator::Entry>& out) mutable {
+            const size_t end = std::min(next + batchKeys, keys->size());
+            std::span<const Key> batch(keys->data() + next, end - next);
+            std::vector<ValueHandle> values = multiGet(batch);
+            for (size_t i = 0; i < values.size(); i++) {
+                if (values[i]) out.emplace_back(batch[i], std::move(values[i]));
+            }
+            next = end;
+            return next < keys->size();
+        });
+    }
+
+    // Compacts every sealed segment into one, dropping all dead records and
+    // the tombstones that shadow nothing older. One shadowing a record in an
+    // older input is kept until that input is durably unlinked, and dropped
+    // by the next merge of the result. Segments retained for replication are
+    // left out. Returns false when there was nothing to merge or the merge
+    // failed.
+    bool merge() {
+        std::lock_guard<std::mutex> running(mergeRunMutex);
+        std::vector<Segment> all = snapshotSegments();
+        waitForSeals();
+        settleShadowing(all);
+        const size_t floor = retainedFrom();
+        std::vector<Segment> inputs;
+        for (size_t i = 1; i < all.size(); i++) {
+            if (all[i].store->id() < floor) {
+                inputs.push_back(all[i]);
+            }
+        }
+        if (inputs.empty() || (inputs.size() == 1 && inputs.front().store->reclaimableBytes() == 0)) return false;
+        return mergeSegments(all, inputs);
+    }
+
+    // Merges the sealed segments that reclaim the most space for the bytes
+    // rewritten (see pickMergeInputs), which may be a single segment or ones
+    // far apart in age. This is what background merges run. Returns false
+    // when no segment qualifies or the merge failed.
+    bool reclaim() {
+        std::lock_guard<std::mutex> running(mergeRunMutex);
+        std::vector<Segment> all = snapshotSegments();
+        waitForSeals();
+        settleShadowing(all);
+        std::vector<Segment> inputs = pickMergeInputs(all);
+        if (inputs.empty()) return false;
+        return mergeSegments(all, inputs);
+    }
+
+    // Adds sealed segments written outside the engine, such as kv_bulkload's,
+    // as one step. Each data file needs the hint file next to it that
+    // describes it, since that is all that is read: nothing is replayed. The
+    // files are moved into the engine's directory (so they must be on its
+    // filesystem) under file ids past every segment so far, and the active
+    // segment is rotated behind them, so their records shadow every record
+    // written before the call and none written after; among themselves,
+    // later files shadow earlier ones. Gets see their keys one by one while
+    // the key directory takes them over. A crash leaves either all of the
+    // files in the engine or none. False, with nothing changed, when any of
+    // them could not be taken.
+    bool ingest(const std::vector<std::string>& files) {
+        std::vector<std::shared_ptr<Store>> stores;
+        for (const std::string& file : files) {
+            std::shared_ptr<Store> store = Store::openSealed(file, 0);
+            if (store == nullptr) {
+                log(LogLevel::Error, "Cannot ingest " + file + ": no hint file describes it");
+                return false;
+            }
+            stores.push_back(std::move(store));
+        }
+        if (stores.empty()) return true;
+
+        std::unique_lock<std::mutex> lock(writeMutex);
+        drain(lock);
+        size_t first;
+        {
+            std::unique_lock<std::mutex> spareLock(spareMutex);
+            spareWake.wait(spareLock, [this] { return !preparingSpare; });
+            first = totalFiles + 1;
+            totalFiles += stores.size();
+        }
+
+        // Linked rather than moved until the marker is written, so up to
+        // then an interrupted ingest leaves its inputs as they were
+        auto unstage = [&] {
+            for (size_t i = 0; i < stores.size(); i++) {
+                ::unlink((stagedPath(first + i) + ".hint").c_str());
+                ::unlink(stagedPath(first + i).c_str());
+            }
+        };
+        for (size_t i = 0; i < files.size(); i++) {
+            const std::string staged = stagedPath(first + i);
+            if (::link(files[i].c_str(), staged.c_str()) != 0 ||
+                ::link((files[i] + ".hint").c_str(), (staged + ".hint").c_str()) != 0) {
+                log(LogLevel::Error, "Cannot ingest " + files[i] + ": " + std::strerror(errno));
+                unstage();
+                return false;
+            }
+        }
+        // The links and the marker must be on disk before any rename, and
+        // the renames before the marker goes
+        const int marker = ::open(ingestMarker().c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (marker < 0 || ::fsync(marker) != 0 || !syncDirectory(options.directory)) {
+            log(LogLevel::Error, "Cannot write " + ingestMarker() + ": " + std::strerror(errno));
+            if (marker >= 0) ::close(marker);
+            ::unlink(ingestMarker().c_str());
+            unstage();
+            return false;
+        }
+        ::close(marker);
+        for (size_t i = 0; i < stores.size(); i++) {
+            const std::string staged = stagedPath(first + i);
+            const std::string path = segmentPath(first + i);
+            if (::rename((staged + ".hint").c_str(), (path + ".hint").c_str()) != 0 ||
+                ::rename(staged.c_str(), path.c_str()) != 0) {
+                // The marker stays, so the next open moves the rest
+                log(LogLevel::Error, "Failed to move " + staged + " into place: " + std::strerror(errno));
+                return false;
+            }
+            stores[i]->moved(path, first + i);
+        }
+        if (!syncDirectory(options.directory)) {
+            // As for a failed rename, the marker stays for the next open
+            log(LogLevel::Error, "Failed to sync " + options.directory + ": " + std::strerror(errno));
+            return false;
+        }
+        ::unlink(ingestMarker().c_str());
+
+        // One list with the ingested segments between the new active segment
+        // and the one it replaces, so no reader or replication stream sees
+        // the rotation without them. An empty active segment is dropped.
+        const std::shared_ptr<Store> previous = current().active().store;
+        const bool dropPrevious = previous->getTotalBytes() <= sizeof(FileHeader);
+        if (!dropPrevious) {
+            if (options.durability.policy != SyncPolicy::None) {
+                syncStore(*previous);
+            }
+            unsynced = false;
+            previous->seal(options.sealedReadMode, options.accessPattern);
+        }
+        std::vector<uint32_t> uids;
+        for (const auto& store : stores) {
+            store->seal(options.sealedReadMode, options.accessPattern);
+            store->attachIo(io);
+            uids.push_back(nextUid++);
+        }
+        std::vector<Segment> list{ { nextUid++, takeSpare(first + stores.size()) } };
+        for (size_t i = stores.size(); i-- > 0;) {
+            list.push_back({ uids[i], stores[i] });
+        }
+        for (const auto& segment : current().segments) {
+            if (!dropPrevious || segment.store != previous) {
+                list.push_back(segment);
+            }
+        }
+        publish(std::make_unique<SegmentSet>(std::move(list)));
+
+        auto storeOf = [this](uint32_t segmentUid) -> Store* {
+            const Segment* segment = current().find(segmentUid);
+            return segment == nullptr ? nullptr : segment->store.get();
+        };
+        size_t records = 0;
+        for (size_t i = 0; i < stores.size(); i++) {
+            addToKeyDir(*stores[i], uids[i], storeOf);
+            // Only now, so that a value a get read from an older location
+            // and is about to cache is dropped or refused
+            if (valueCache) {
+                stores[i]->forEach([&](const Key& key, const MetaData&) {
+                    valueCache->invalidate(key);
+                });
+            }
+            records += stores[i]->recordCount();
+        }
+        advanceLog();
+        if (dropPrevious) {
+            ::unlink(previous->path().c_str());
+        }
+        if (options.merge.enabled) {
+            std::lock_guard<std::mutex> mergeLock(mergeMutex);
+            mergeRequested = true;
+            mergeWake.notify_one();
+        }
+        lock.unlock();
+
+        for (const std::string& file : files) {
+            ::unlink((file + ".hint").c_str());
+            ::unlink(file.c_str());
+        }
+        log(LogLevel::Info, "Ingested " + std::to_string(stores.size()) + " segments (" + std::to_string(records) +
+            " records) into " + prefixFileName);
+        return true;
+    }
+
+    // Replication. A ReplicationLeader streams the log of its engine up to
+    // logEnd(), and a ReplicationFollower feeds what it receives to
+    // applyLog and rotateLog of its own engine, which nothing else writes.
+
+    // End of the last commit, on a follower of the last record applied
+    LogPosition logEnd() const {
+        std::lock_guard<std::mutex> lock(logMutex);
+        return logTail;
+    }
+
+    // Waits until the log ends somewhere other than seen, or for timeout,
+    // and returns where it ends
+    LogPosition waitForLog(const LogPosition& seen, std::chrono::milliseconds timeout) const {
+        std::unique_lock<std::mutex> lock(logMutex);
+        logAdvanced.wait_for(lock, timeout, [&] { return !(logTail == seen); });
+        return logTail;
+    }
+
+    // Every segment, oldest first and so the active one last
+    std::vector<std::shared_ptr<const Store>> logSegments() const {
+        EpochGuard guard;
+        const SegmentSet& set = *segments.load(std::memory_order_acquire);
+        std::vector<std::shared_ptr<const Store>> stores;
+        stores.reserve(set.segments.size());
+        for (auto it = set.segments.rbegin(); it != set.segments.rend(); ++it) {
+            stores.push_back(it->store);
+        }
+        return stores;
+    }
+
+    // Record bytes of the log past `from`. Segments between it and the end
+    // count whole.
+    uint64_t logBytesAfter(const LogPosition& from) const {
+        const LogPosition end = logEnd();
+        if (from.segment == end.segment) {
+            return end.offset > from.offset ? end.offset - from.offset : 0;
+        }
+        if (from.segment > end.segment) return 0;
+        uint64_t bytes = end.offset - std::min<uint64_t>(end.offset, sizeof(FileHeader));
+        EpochGuard guard;
+        for (const auto& segment : segments.load(std::memory_order_acquire)->segments) {
+            const Store& store = *segment.store;
+            if (store.id() == from.segment) {
+                bytes += store.getTotalBytes() > from.offset ? store.getTotalBytes() - from.offset : 0;
+            }
+            else if (store.id() > from.segment && store.id() < end.segment) {
+                bytes += store.recordBytes();
+            }
+        }
+        return bytes;
+    }
+
+    // Keeps merges away from segment `from` and every newer one until the
+    // matching releaseSegments, so whoever streams them reads them as they
+    // were written. A merge already past choosing its inputs gives up
+    // rather than replace a segment retained meanwhile.
+    void retainSegments(size_t from) {
+        std::lock_guard<std::mutex> lock(retainMutex);
+        retained.insert(from);
+    }
+
+    void releaseSegments(size_t from) {
+        std::lock_guard<std::mutex> lock(retainMutex);
+        auto it = retained.find(from);
+        if (it != retained.end()) {
+            retained.erase(it);
+        }
+    }
+
+    // Where the log of a follower ends, for the leader to continue from:
+    // the end of the active segment or, while that is still empty, of the
+    // newest sealed one. recordOffset and recordCrc identify the last
+    // record before that point (both 0 without one), so the leader can tell
+    // whether its own segment of that id holds the same records.
+    LogPosition replicaPosition(uint64_t& recordOffset, uint32_t& recordCrc) {
+        std::lock_guard<std::mutex> lock(writeMutex);
+        recordOffset = 0;
+        recordCrc = 0;
+        const SegmentSet& set = current();
+        const Store* store = set.active().store.get();
+        if (store->getTotalBytes() <= sizeof(FileHeader) && set.segments.size() > 1) {
+            store = set.segments[1].store.get();
+        }
+        if (!store->isLegacy()) {
+            store->forEach([&](const Key&, const MetaData& metaData) {
+                recordOffset = std::max(recordOffset, metaData.byteOffset);
+            });
+            if (recordOffset > 0 &&
+                !store->readRaw(recordOffset, sizeof(recordCrc), reinterpret_cast<char*>(&recordCrc))) {
+                recordOffset = 0;
+            }
+        }
+        return { store->id(), store->getTotalBytes() };
+    }
+
+    // Appends records a leader wrote at `at` to the end of this log and
+    // indexes them. Only whole batches are taken; applied is set to the
+    // bytes used from the front of records, and the rest is for the next
+    // call together with what follows it. `at` must be the end of the log,
+    // or the start of a segment when the active one is still empty. False
+    // on any other position and on a corrupt record.
+    bool applyLog(const LogPosition& at, std::string_view records, size_t& applied) {
+        applied = 0;
+        std::unique_lock<std::mutex> lock(writeMutex);
+        drain(lock);
+        replicated.clear();
+        size_t offset = 0;
+        size_t complete = 0;
+        size_t batches = 0;
+        RecordHeader header;
+        while (records.size() - offset >= sizeof(header)) {
+            std::memcpy(&header, records.data() + offset, sizeof(header));
+            const size_t recordSize = sizeof(header) + static_cast<size_t>(header.keySize) + header.valueSize;
+            if (records.size() - offset < recordSize) break;
+            std::string_view keyBytes;
+            std::string_view value;
+            uint8_t flags;
+            Key key{};
+            if (!decodeRecord<KeyCodec>(records.data() + offset, recordSize, keyBytes, value, flags) ||
+                (flags & RECORD_FLAG_DICTIONARY) || !KeyCodec::decode(keyBytes, key)) {
+                log(LogLevel::Error, "Corrupt replicated record at offset " + std::to_string(at.offset + offset) +
+                    " of segment " + std::to_string(at.segment));
+                return false;
+            }
+            replicated.push_back({ std::move(key), static_cast<uint32_t>(recordSize), flags });
+            offset += recordSize;
+            if (!(flags & RECORD_FLAG_BATCH)) {
+                complete = offset;
+                batches = replicated.size();
+            }
+        }
+        replicated.resize(batches);
+        if (complete == 0) return true;
+
+        const Store& active = *current().active().store;
+        if (active.id() != at.segment && active.getTotalBytes() == sizeof(FileHeader) &&
+            at.offset == sizeof(FileHeader)) {
+            replaceEmptyActive(at.segment);
+        }
+        const uint32_t uid = current().active().uid;
+        Store& store = *current().active().store;
+        if (store.id() != at.segment || store.getTotalBytes() != at.offset) {
+            log(LogLevel::Error, "Replicated records for segment " + std::to_string(at.segment) + " at " +
+                std::to_string(at.offset) + " do not continue " + store.path());
+            return false;
+        }
+        bool ok;
+        {
+            Metrics::Timer timer = metrics.time(Op::Flush);
+            ok = store.append(records.data(), complete);
+        }
+        if (ok && options.durability.policy == SyncPolicy::EveryCommit) {
+            ok = syncStore(store);
+        }
+        if (!ok) return false;
+        indexRecords(store, uid, replicated);
+        metrics.add(Counter::WrittenBytes, complete);
+        unsynced = options.durability.policy == SyncPolicy::Interval;
+        advanceLog();
+        applied = complete;
+        return true;
+    }
+
+    // Seals the active segment where the leader sealed its segment of the
+    // same id, at `end`, and continues the log in a new segment of file id
+    // nextId. A follower that already sealed it only renames its empty
+    // active segment.
+    bool rotateLog(const LogPosition& end, size_t nextId) {
+        std::unique_lock<std::mutex> lock(writeMutex);
+        drain(lock);
+        const SegmentSet& set = current();
+        const Store& active = *set.active().store;
+        if (active.id() == end.segment && active.getTotalBytes() == end.offset) {
+            onCapacityExceeded(nextId);
+            return true;
+        }
+        const bool empty = active.getTotalBytes() == sizeof(FileHeader);
+        const bool sealedAlready = set.segments.size() > 1 && set.segments[1].store->id() == end.segment &&
+            set.segments[1].store->getTotalBytes() == end.offset;
+        if (empty && (sealedAlready || end.offset == sizeof(FileHeader))) {
+            if (active.id() != nextId) {
+                replaceEmptyActive(nextId);
+            }
+            return true;
+        }
+        log(LogLevel::Error, "Replicated rotation of segment " + std::to_string(end.segment) + " at " +
+            std::to_string(end.offset) + " does not continue " + active.path());
+        return false;
+    }
+
+private:
+    // Lowest segment id retained for replication, SIZE_MAX without any
+    size_t retainedFrom() const {
+        std::lock_guard<std::mutex> lock(retainMutex);
+        return retained.empty() ? SIZE_MAX : *retained.begin();
+    }
+
+    std::vector<Segment> snapshotSegments() {
+        std::lock_guard<std::mutex> lock(writeMutex);
+        return current().segments;
+    }
+
+    // Without a key directory a write cannot know what it shadows in older
+    // segments, so that is worked out here instead, off the write path: for
+    // every key of a sealed segment not settled yet, the key's newest record
+    // in an older segment is counted dead. Requires mergeRunMutex.
+    void settleShadowing(const std::vector<Segment>& all) {
+        if (options.indexMode == IndexMode::KeyDir) return;
+        for (size_t i = all.size(); i-- > 1;) {
+            Store& store = *all[i].store;
+            if (store.settled) continue;
+            store.forEach([&](const Key& key, const MetaData&) {
+                for (size_t j = i + 1; j < all.size(); j++) {
+                    Store& older = *all[j].store;
+                    if (!older.mayContain(key)) continue;
+                    const MetaData previous = older.find(key);
+                    if (previous.byteSize == 0) continue;
+                    if (!(previous.flags & RECORD_FLAG_TOMBSTONE)) {
+                        older.supersede(previous.byteSize);
+                    }
+                    break;
+                }
+            });
+            store.settled = true;
+        }
+    }
+
+    // Picks merge inputs among the sealed segments of all (a segment list,
+    // newest first): every segment with at least minGarbageRatio of its bytes
+    // reclaimable and, while the space amplification of the sealed segments
+    // is above maxSpaceAmplification, the most reclaimable ones after them
+    // until it would no longer be. Segments under a quarter of segmentBytes,
+    // mostly outputs of earlier merges, then come along while there is room,
+    // so merging does not leave ever more small files behind. At most
+    // maxInputs, newest first, and none retained for replication.
+    std::vector<Segment> pickMergeInputs(const std::vector<Segment>& all) const {
+        struct Candidate {
+            size_t position;
+            uint64_t reclaimable;
+            double ratio;
+        };
+        std::vector<Candidate> candidates;
+        std::vector<size_t> small;
+        uint64_t live = 0, total = 0;
+        const size_t floor = retainedFrom();
+        for (size_t i = 1; i < all.size(); i++) {
+            const Store& store = *all[i].store;
+            const uint64_t bytes = store.liveBytes() + store.deadBytes();
+            live += store.liveBytes();
+            total += bytes;
+            const uint64_t reclaimable = store.reclaimableBytes();
+            if (store.id() >= floor) {
+                continue;
+            }
+            if (reclaimable > 0) {
+                candidates.push_back({ i, reclaimable, static_cast<double>(reclaimable) / bytes });
+            }
+            else if (bytes < options.segmentBytes / 4) {
+                small.push_back(i);
+            }
+        }
+        std::sort(candidates.begin(), candidates.end(), [](const Candidate& a, const Candidate& b) {
+            return a.ratio != b.ratio ? a.ratio > b.ratio : a.reclaimable > b.reclaimable;
+        });
+
+        const MergeOptions& merge = options.merge;
+        std::vector<size_t> picked;
+        for (const Candidate& candidate : candidates) {
+            if (picked.size() >= std::max<size_t>(merge.maxInputs, 1)) break;
+            const bool amplified = static_cast<double>(total) > merge.maxSpaceAmplification * live;
+            if (candidate.ratio < merge.minGarbageRatio && !amplified) break;
+            picked.push_back(candidate.position);
+            total -= candidate.reclaimable;
+        }
+        for (size_t i = 0; i < small.size() && !picked.empty() && picked.size() < merge.maxInputs; i++) {
+            picked.push_back(small[i]);
+        }
+        std::sort(picked.begin(), picked.end());
+        std::vector<Segment> inputs;
+        for (size_t position : picked) {
+            inputs.push_back(all[position]);
+        }
+        return inputs;
+    }
+
+    // Whether the record of key at metaData, in the input all[position], is
+    // the newest record of the key. In PerSegment mode only the segments
+    // outside the merge are checked, newer inputs are the caller's business.
+    bool isNewest(const Key& key, const MetaData& metaData, const std::vector<Segment>& all,
+        size_t position, const std::unordered_set<uint32_t>& inputUids) const {
+        if (options.indexMode == IndexMode::KeyDir) {
+            EpochGuard guard;
+            KeyDirEntry entry;
+            const bool indexed = keyDir.find(key, entry);
+            // A deleted key has no entry; one written again points past the tombstone
+            if (metaData.flags & RECORD_FLAG_TOMBSTONE) return !indexed;
+            return indexed && entry.segmentUid == all[position].uid &&
+                entry.metaData.byteOffset == metaData.byteOffset;
+        }
+        for (size_t i = 0; i < position; i++) {
+            if (inputUids.count(all[i].uid) == 0 && all[i].store->mayContain(key) &&
+                all[i].store->find(key).byteSize > 0) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Whether a segment older than all[position] has a record of key, which a
+    // tombstone there must go on shadowing. Only segments not being merged
+    // count unless withInputs: the older inputs count too until they are
+    // durably unlinked, since a crash before that brings them back.
+    static bool shadowsOlder(const Key& key, const std::vector<Segment>& all, size_t position,
+        const std::unordered_set<uint32_t>& inputUids, bool withInputs) {
+        for (size_t i = position + 1; i < all.size(); i++) {
+            if ((withInputs || inputUids.count(all[i].uid) == 0) && all[i].store->mayContain(key) &&
+                all[i].store->find(key).byteSize > 0) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Rewrites the newest record of every key in inputs (sealed segments of
+    // all, both newest first) into one segment, dropping dead records and
+    // tombstones that shadow nothing older. The result takes the id (and file
+    // name) of the newest input: every record copied is still the newest of
+    // its key, so sorting there is correct even when segments not merged sit
+    // between the inputs. A tombstone shadowing only older inputs is kept, as
+    // they outlive the rename of the result until unlinked, but counted
+    // reclaimable so that a later merge drops it. Requires mergeRunMutex.
+    bool mergeSegments(const std::vector<Segment>& all, const std::vector<Segment>& inputs) {
+        Metrics::Timer timer = metrics.time(Op::Compaction);
+        // Segments unlinked by earlier merges must be gone for good before
+        // their absence lets a tombstone go
+        if (!syncDirectory(options.directory)) {
+            log(LogLevel::Error, "Merge skipped, cannot sync " + options.directory + ": " + std::strerror(errno));
+            return false;
+        }
+        std::unordered_set<uint32_t> inputUids;
+        for (const auto& segment : inputs) {
+            inputUids.insert(segment.uid);
+        }
+
+        const Store& newest = *inputs.front().store;
+        const std::string finalPath = newest.path();
+        const std::string tmpPath = finalPath + ".merge";
+        ::unlink(tmpPath.c_str());
+        ::unlink((tmpPath + ".hint").c_str());
+
+        RateLimiter limiter(options.merge.bytesPerSecond);
+        KeySet<KeyCodec> copied;
+        // Tombstones kept only for older inputs
+        KeySet<KeyCodec> shadowingInputs;
+        bool ok = true;
+        {
+            Store output(tmpPath, newest.id());
+            std::string buffer;
+            std::vector<std::tuple<Key, uint32_t, uint8_t>> records;
+            std::string value;
+            std::string stored;
+            auto flush = [&] {
+                limiter.acquire(buffer.size());
+                ok = ok && output.append(buffer.data(), buffer.size());
+                for (const auto& [key, bytes, flags] : records) {
+                    output.index(key, bytes, flags);
+                }
+                buffer.clear();
+                records.clear();
+            };
+
+            // The dictionary goes first, so opening the segment finds it
+            std::unique_ptr<ZstdDictionary> dictionary = trainDictionary(inputs);
+            if (dictionary) {
+                ok = output.appendDictionary(dictionary->data());
+            }
+
+            size_t position = 0;
+            for (const auto& segment : inputs) {
+                const Store* input = segment.store.get();
+                while (all[position].uid != segment.uid) position++;
+                input->forEach([&](const Key& key, const MetaData& metaData) {
+                    if (!ok || !copied.insert(key).second) return;
+                    if (!isNewest(key, metaData, all, position, inputUids)) return;
+                    if (metaData.flags & RECORD_FLAG_TOMBSTONE) {
+                        if (!shadowsOlder(key, all, position, inputUids, false)) {
+                            if (!shadowsOlder(key, all, position, inputUids, true)) return;
+                            shadowingInputs.insert(key);
+                        }
+                        const size_t bytes = encodeRecord(buffer, KeyCodec::view(key), {}, RECORD_FLAG_TOMBSTONE);
+                        records.emplace_back(key, static_cast<uint32_t>(bytes), RECORD_FLAG_TOMBSTONE);
+                        return;
+                    }
+                    if (!input->read(metaData, value)) {
+                        ok = false;
+                        return;
+                    }
+                    limiter.acquire(value.size());
+                    stored.clear();
+                    uint8_t flags = 0;
+                    if (compress(value, stored, dictionary.get())) {
+                        flags = RECORD_FLAG_COMPRESSED;
+                    }
+                    std::string_view record = flags ? std::string_view(stored) : std::string_view(value);
+                    const size_t bytes = encodeRecord(buffer, KeyCodec::view(key), record, flags);
+                    records.emplace_back(key, static_cast<uint32_t>(bytes), flags);
+                    if (buffer.size() >= (1u << 20)) {
+                        flush();
+                    }
+                });
+            }
+            flush();
+            ok = ok && output.sync();
+            output.seal(SealedReadMode::Pread, AccessPattern::Sequential);
+        }
+        if (!ok) {
+            log(LogLevel::Error, "Merge failed, keeping inputs: " + finalPath);
+            ::unlink(tmpPath.c_str());
+            ::unlink((tmpPath + ".hint").c_str());
+            return false;
+        }
+
+        // Held until the merged segment is installed, so that no follower
+        // starts streaming an input in between
+        std::unique_lock<std::mutex> retaining(retainMutex);
+        for (const auto& segment : inputs) {
+            if (!retained.empty() && segment.store->id() >= *retained.begin()) {
+                log(LogLevel::Info, "Merge abandoned, " + segment.store->path() + " is being replicated");
+                ::unlink(tmpPath.c_str());
+                ::unlink((tmpPath + ".hint").c_str());
+                return false;
+            }
+        }
+
+        // Install the merged file under the newest input's name. Removing the
+        // old hint first means a crash in between can only cost a rescan. The
+        // rename is made durable before any older input is unlinked, which
+        // would otherwise lose the records only they and the newest held.
+        ::unlink((finalPath + ".hint").c_str());
+        if (::rename(tmpPath.c_str(), finalPath.c_str()) != 0 ||
+            ::rename((tmpPath + ".hint").c_str(), (finalPath + ".hint").c_str()) != 0 ||
+            !syncDirectory(options.directory)) {
+            log(LogLevel::Error, "Failed to install merged segment " + finalPath);
+            return false;
+        }
+        std::shared_ptr<Store> merged = std::make_shared<Store>(finalPath, newest.id());
+        merged->seal(options.sealedReadMode, options.accessPattern);
+        merged->attachIo(io);
+        // What the inputs shadowed is counted already
+        merged->settled = true;
+
+        {
+            std::lock_guard<std::mutex> lock(writeMutex);
+            const uint32_t mergedUid = nextUid++;
+
+            // First publish the merged segment next to its inputs, so a reader
+            // holding either an old or a new key directory entry can resolve it
+            std::vector<Segment> withMerged;
+            for (const auto& segment : current().segments) {
+                if (segment.store.get() == &newest) {
+                    withMerged.push_back({ mergedUid, merged });
+                }
+                withMerged.push_back(segment);
+            }
+            publish(std::make_unique<SegmentSet>(std::move(withMerged)));
+
+            // Keys rewritten since the merge started already point at newer
+            // segments; everything else that lived in an input moves over
+            merged->forEach([&](const Key& key, const MetaData& metaData) {
+                if (metaData.flags & RECORD_FLAG_TOMBSTONE) {
+                    if (shadowingInputs.count(key) > 0) {
+                        merged->addDead(metaData.byteSize);
+                    }
+                    else {
+                        merged->addTombstone(metaData.byteSize);
+                    }
+                    return;
+                }
+                if (options.indexMode != IndexMode::KeyDir) {
+                    merged->addLive(metaData.byteSize);
+                    return;
+                }
+                KeyDirEntry entry;
+                if (keyDir.find(key, entry) && inputUids.count(entry.segmentUid) > 0) {
+                    keyDir.put(key, { mergedUid, metaData });
+                    merged->addLive(metaData.byteSize);
+                }
+                else {
+                    merged->addDead(metaData.byteSize);
+                }
+            });
+
+            // Then drop the inputs, which no entry points at any more
+            std::vector<Segment> remaining;
+            for (const auto& segment : current().segments) {
+                if (inputUids.count(segment.uid) == 0) {
+                    remaining.push_back(segment);
+                }
+            }
+            publish(std::make_unique<SegmentSet>(std::move(remaining)));
+            totalMerged += 1;
+        }
+        retaining.unlock();
+
+        // New lookups can no longer reach the inputs. Outstanding value handles
+        // keep their mappings alive after the files are unlinked.
+        for (const auto& segment : inputs) {
+            const Store* store = segment.store.get();
+            if (store->path() != finalPath) {
+                ::unlink(store->path().c_str());
+                ::unlink((store->path() + ".hint").c_str());
+            }
+        }
+        uint64_t inputBytes = 0;
+        for (const auto& segment : inputs) {
+            inputBytes += segment.store->getTotalBytes();
+        }
+        metrics.add(Counter::CompactionReadBytes, inputBytes);
+        metrics.add(Counter::CompactionWrittenBytes, merged->getTotalBytes());
+        log(LogLevel::Info, "Merged " + std::to_string(inputs.size()) + " segments into " + finalPath +
+            " (" + std::to_string(merged->recordCount()) + " records)");
+        return true;
+    }
+};
+
+// Intrusive multi-producer, single-consumer queue (Vyukov). push is one
+// atomic exchange and never blocks; pop is consumer-only and may report the
+// queue empty while a push is still linking its node in.
+class MpscQueue {
+public:
+    struct Node {
+        std::atomic<Node*> next{ nullptr };
+    };
+
+private:
+    std::atomic<Node*> head;
+    Node* tail;
+    Node stub;
+
+public:
+    MpscQueue() : head(&stub), tail(&stub) {}
+
+    void push(Node* node) {
+        node->next.store(nullptr, std::memory_order_relaxed);
+        Node* previous = head.exchange(node, std::memory_order_acq_rel);
+        previous->next.store(node, std::memory_order_release);
+    }
+
+    Node* pop() {
+        Node* first = tail;
+        Node* next = first->next.load(std::memory_order_acquire);
+        if (first == &stub) {
+            if (next == nullptr) return nullptr;
+            tail = next;
+            first = next;
+            next = next->next.load(std::memory_order_acquire);
+        }
+        if (next != nullptr) {
+            tail = next;
+            return first;
+        }
+        if (first != head.load(std::memory_order_acquire)) return nullptr;
+        // first is the only node; the stub takes its place so it can be handed out
+        push(&stub);
+        next = first->next.load(std::memory_order_acquire);
+        if (next == nullptr) return nullptr;
+        tail = next;
+        return first;
+    }
+};
+
+// Load of one shard as reported by ShardedStorageEngine::stats()
+struct ShardStats {
+    std::string prefix;
+    uint64_t records = 0;      // puts and deletes written
+    uint64_t bytes = 0;        // encoded bytes written
+    uint64_t commits = 0;      // engine writes issued by the shard's writer
+    uint64_t reads = 0;        // keys looked up
+    EngineStats engine;        // set latency is that of the combined writes
+};
+
+struct ShardingStats {
+    std::vector<ShardStats> shards;
+    // Busiest shard over the mean, 1.0 when perfectly balanced
+    double writeSkew = 1.0;
+    double readSkew = 1.0;
+    MetricsSnapshot metrics;   // of all shards together
+};
+
+// Per-shard series carry a shard="<index>" label
+inline std::string toPrometheus(const ShardingStats& stats) {
+    PrometheusWriter writer;
+    for (size_t i = 0; i < stats.shards.size(); i++) {
+        addEngineStats(writer, stats.shards[i].engine, "shard=\"" + std::to_string(i) + "\"");
+    }
+    writer.gauge("kv_write_skew", "Records written by the busiest shard over the mean", stats.writeSkew);
+    writer.gauge("kv_read_skew", "Keys read from the busiest shard over the mean", stats.readSkew);
+    return writer.text();
+}
+
+// Front end that hash-partitions keys over independent StorageEngines, each
+// with its own segment files, index and write stream. Every shard has a
+// dedicated writer thread fed by an MpscQueue: callers enqueue their batch
+// and wait, the writer combines whatever is queued into one engine write.
+// Shards can live on different devices, so write throughput scales with
+// them instead of being bound to one append point. Reads go straight to the
+// owning engine.
+//
+// The key -> shard mapping depends only on the key and the shard count, so a
+// store must always be reopened with the same number of shards.
+template <typename Key = int, typename Value = std::string, typename Codec = DefaultCodec<Key, Value>>
+class ShardedStorageEngine {
+public:
+    using Engine = StorageEngine<Key, Value, Codec>;
+    using KeyCodec = typename Engine::KeyCodec;
+    using WriteBatch = typename Engine::WriteBatch;
+    using ScanIterator = typename Engine::ScanIterator;
+
+private:
+    using ValueParam = typename Engine::ValueCodec::Param;
+
+    struct Request : MpscQueue::Node {
+        const WriteBatch* batch = nullptr;
+        std::atomic<uint32_t> status{ 0 };  // 0 pending, 1 applied, 2 failed
+    };
+
+    struct alignas(64) Shard {
+        EngineOptions options;
+        std::unique_ptr<Engine> engine;
+        MpscQueue queue;
+        // Bumped on every push so that the idle writer can sleep on it
+        std::atomic<uint32_t> signal{ 0 };
+        std::thread writer;
+        std::atomic<uint64_t> records{ 0 };
+        std::atomic<uint64_t> bytes{ 0 };
+        std::atomic<uint64_t> commits{ 0 };
+        // Bumped by readers, kept off the writer's cache line
+        alignas(64) mutable std::atomic<uint64_t> reads{ 0 };
+    };
+
+    // Requests combined into one engine write at most
+    static constexpr size_t MAX_GROUP = 256;
+    static constexpr size_t MAX_GROUP_BYTES = 1 << 20;
+
+    std::vector<std::unique_ptr<Shard>> shards;
+    std::atomic<bool> stopping{ false };
+
+    // Independent of the FlatTable hash, so that the keys of one shard still
+    // spread over its engine's tables
+    static uint32_t mix(uint64_t keyHash) {
+        uint32_t h = static_cast<uint32_t>(keyHash ^ (keyHash >> 32));
+        h ^= h >> 16;
+        h *= 0x85EBCA6B;
+        h ^= h >> 13;
+        h *= 0xC2B2AE35;
+        h ^= h >> 16;
+        return h;
+    }
+
+    size_t shardOf(const Key& key) const {
+        return (static_cast<uint64_t>(mix(KeyCodec::hash(key))) * shards.size()) >> 32;
+    }
+
+    void writerLoop(Shard& shard) {
+        std::vector<Request*> group;
+        WriteBatch combined;
+        for (;;) {
+            uint32_t seen = shard.signal.load(std::memory_order_acquire);
+            size_t groupBytes = 0;
+            while (group.size() < MAX_GROUP && groupBytes < MAX_GROUP_BYTES) {
+                Request* request = static_cast<Request*>(shard.queue.pop());
+                if (request == nullptr) break;
+                group.push_back(request);
+                groupBytes += request->batch->byteSize();
+            }
+            if (group.empty()) {
+                if (stopping.load(std::memory_order_acquire)) return;
+                shard.signal.wait(seen, std::memory_order_acquire);
+                continue;
+            }
+
+            bool ok;
+            uint64_t records = 0;
+            if (group.size() == 1) {
+                records = group.front()->batch->count();
+                ok = shard.engine->write(*group.front()->batch);
+            }
+            else {
+                combined.clear();
+                for (const Request* request : group) {
+                    combined.append(*request->batch);
+                }
+                records = combined.count();
+                ok = shard.engine->write(combined);
+            }
+            shard.commits.fetch_add(1, std::memory_order_relaxed);
+            if (ok) {
+                shard.records.fetch_add(records, std::memory_order_relaxed);
+                shard.bytes.fetch_add(groupBytes, std::memory_order_relaxed);
+            }
+            // The request lives on its caller's stack: untouchable once signalled
+            for (Request* request : group) {
+                request->status.store(ok ? 1 : 2, std::memory_order_release);
+                request->status.notify_one();
+            }
+            group.clear();
+        }
+    }
+
+    bool submit(size_t index, const WriteBatch& batch) {
+        Shard& shard = *shards[index];
+        Request request;
+        request.batch = &batch;
+        shard.queue.push(&request);
+        shard.signal.fetch_add(1, std::memory_order_release);
+        shard.signal.notify_one();
+        request.status.wait(0, std::memory_order_acquire);
+        return request.status.load(std::memory_order_acquire) == 1;
+    }
+
+public:
+    // One shard per entry; give the shards directories on separate devices
+    // to spread the write load
+    explicit ShardedStorageEngine(const std::vector<EngineOptions>& shardOptions) {
+        shards.resize(shardOptions.size());
+        // Shards recover independently
+        parallelFor(shards.size(), [&](size_t i) {
+            shards[i] = std::make_unique<Shard>();
+            shards[i]->options = shardOptions[i];
+            shards[i]->engine = std::make_unique<Engine>(shardOptions[i]);
+        });
+        for (auto& shard : shards) {
+            shard->writer = std::thread(&ShardedStorageEngine::writerLoop, this, std::ref(*shard));
+        }
+    }
+
+    // count copies of base named "<name>_s0" .. "<name>_s<count - 1>", for
+    // shards sharing a directory
+    static std::vector<EngineOptions> layout(const EngineOptions& base, size_t count) {
+        std::vector<EngineOptions> result(count, base);
+        for (size_t i = 0; i < count; i++) {
+            result[i].name = base.name + "_s" + std::to_string(i);
+        }
+        return result;
+    }
+
+    // Callers must have returned from every set and write before this runs
+    ~ShardedStorageEngine() {
+        stopping.store(true, std::memory_order_release);
+        for (auto& shard : shards) {
+            shard->signal.fetch_add(1, std::memory_order_release);
+            shard->signal.notify_one();
+        }
+        for (auto& shard : shards) {
+            shard->writer.join();
+        }
+    }
+
+    size_t shardCount() const {
+        return shards.size();
+    }
+
+    bool set(const Key& key, ValueParam value) {
+        WriteBatch& batch = WriteBatch::scratch();
+        return batch.put(key, value) && submit(shardOf(key), batch);
+    }
+
+    bool remove(const Key& key) {
+        WriteBatch& batch = WriteBatch::scratch();
+        return batch.remove(key) && submit(shardOf(key), batch);
+    }
+
+    // The batch is applied atomically within each shard it touches, but not
+    // across shards
+    bool write(const WriteBatch& batch) {
+        if (batch.count() == 0) return true;
+        std::vector<WriteBatch> perShard(shards.size());
+        batch.forEach([&](const Key& key, std::string_view value, bool isDelete) {
+            WriteBatch& target = perShard[shardOf(key)];
+            // The value is encoded already
+            target.add(key, value, isDelete ? RECORD_FLAG_TOMBSTONE : 0);
+        });
+        bool ok = true;
+        for (size_t i = 0; i < shards.size(); i++) {
+            if (perShard[i].count() > 0) {
+                ok = submit(i, perShard[i]) && ok;
+            }
+        }
+        return ok;
+    }
+
+    ValueHandle get(const Key& key) const {
+        const Shard& shard = *shards[shardOf(key)];
+        shard.reads.fetch_add(1, std::memory_order_relaxed);
+        return shard.engine->get(key);
+    }
+
+    bool get(const Key& key, Value& out) const {
+        const Shard& shard = *shards[shardOf(key)];
+        shard.reads.fetch_add(1, std::memory_order_relaxed);
+        return shard.engine->get(key, out);
+    }
+
+    // Splits the keys by shard and runs one multiGet per shard
+    std::vector<ValueHandle> multiGet(std::span<const Key> keys) const {
+        std::vector<std::vector<Key>> shardKeys(shards.size());
+        std::vector<std::vector<size_t>> positions(shards.size());
+        for (size_t i = 0; i < keys.size(); i++) {
+            size_t index = shardOf(keys[i]);
+            shardKeys[index].push_back(keys[i]);
+            positions[index].push_back(i);
+        }
+        std::vector<ValueHandle> results(keys.size());
+        for (size_t s = 0; s < shards.size(); s++) {
+            if (shardKeys[s].empty()) continue;
+            shards[s]->reads.fetch_add(shardKeys[s].size(), std::memory_order_relaxed);
+            std::vector<ValueHandle> found = shards[s]->engine->multiGet(shardKeys[s]);
+            for (size_t i = 0; i < found.size(); i++) {
+                results[positions[s][i]] = std::move(found[i]);
+            }
+        }
+        return results;
+    }
+
+    // See StorageEngine::getAsync; every shard has its own I/O backend
+    void getAsync(const Key& key, std::function<void(ValueHandle)> done) const {
+        const Shard& shard = *shards[shardOf(key)];
+        shard.reads.fetch_add(1, std::memory_order_relaxed);
+        shard.engine->getAsync(key, std::move(done));
+    }
+
+    // One submission per shard the keys fall into
+    void getAsync(std::span<const Key> keys, std::function<void(size_t, ValueHandle)> done) const {
+        std::vector<std::vector<Key>> shardKeys(shards.size());
+        auto positions = std::make_shared<std::vector<std::vector<size_t>>>(shards.size());
+        for (size_t i = 0; i < keys.size(); i++) {
+            size_t index = shardOf(keys[i]);
+            shardKeys[index].push_back(keys[i]);
+            (*positions)[index].push_back(i);
+        }
+        auto shared = std::make_shared<std::function<void(size_t, ValueHandle)>>(std::move(done));
+        for (size_t s = 0; s < shards.size(); s++) {
+            if (shardKeys[s].empty()) continue;
+            shards[s]->reads.fetch_add(shardKeys[s].size(), std::memory_order_relaxed);
+            shards[s]->engine->getAsync(shardKeys[s], [shared, positions, s](size_t i, ValueHandle handle) {
+                (*shared)((*positions)[s][i], std::move(handle));
+            });
+        }
+    }
+
+    std::future<ValueHandle> getAsync(const Key& key) const {
+        const Shard& shard = *shards[shardOf(key)];
+        shard.reads.fetch_add(1, std::memory_order_relaxed);
+        return shard.engine->getAsync(key);
+    }
+
+    AsyncResult<ValueHandle> awaitGet(const Key& key) const {
+        const Shard& shard = *shards[shardOf(key)];
+        shard.reads.fetch_add(1, std::memory_order_relaxed);
+        return shard.engine->awaitGet(key);
+    }
+
+    // Goes to the shard's engine directly rather than through its writer
+    // thread, which would only add a hop to a call nobody waits on
+    void setAsync(const Key& key, ValueParam value, std::function<void(bool)> done) {
+        shards[shardOf(key)]->engine->setAsync(key, value, std::move(done));
+    }
+
+    std::future<bool> setAsync(const Key& key, ValueParam value) {
+        return shards[shardOf(key)]->engine->setAsync(key, value);
+    }
+
+    AsyncResult<bool> awaitSet(const Key& key, Value value) {
+        return shards[shardOf(key)]->engine->awaitSet(key, std::move(value));
+    }
+
+    // Iterates the live keys in [lo, hi] of all shards in ascending order,
+    // merging one scan per shard
+    ScanIterator scan(const Key& lo, const Key& hi) const {
+        auto cursors = std::make_shared<std::vector<ScanIterator>>();
+        for (const auto& shard : shards) {
+            cursors->push_back(shard->engine->scan(lo, hi));
+        }
+        const size_t batchKeys = std::max<size_t>(shards.front()->options.scan.batchKeys, 1);
+        return ScanIterator([cursors, batchKeys](std::vector<typename ScanIterator::Entry>& out) {
+            while (out.size() < batchKeys) {
+                ScanIterator* smallest = nullptr;
+                for (auto& cursor : *cursors) {
+                    if (cursor.valid() && (smallest == nullptr || cursor.key() < smallest->key())) {
+                        smallest = &cursor;
+                    }
+                }
+                if (smallest == nullptr) return false;
+                out.emplace_back(smallest->key(), smallest->handle());
+                smallest->next();
+            }
+            return true;
+        });
+    }
+
+    // Merges every shard's sealed segments
+    bool merge() {
+        bool merged = false;
+        for (auto& shard : shards) {
+            merged = shard->engine->merge() || merged;
+        }
+        return merged;
+    }
+
+    // Runs StorageEngine::reclaim on every shard
+    bool reclaim() {
+        bool merged = false;
+        for (auto& shard : shards) {
+            merged = shard->engine->reclaim() || merged;
+        }
+        return merged;
+    }
+
+    ShardingStats stats() const {
+        ShardingStats result;
+        uint64_t maxRecords = 0, maxReads = 0, totalRecords = 0, totalReads = 0;
+        for (const auto& shard : shards) {
+            ShardStats stats;
+            stats.prefix = shard->options.prefix();
+            stats.records = shard->records.load(std::memory_order_relaxed);
+            stats.bytes = shard->bytes.load(std::memory_order_relaxed);
+            stats.commits = shard->commits.load(std::memory_order_relaxed);
+            stats.reads = shard->reads.load(std::memory_order_relaxed);
+            stats.engine = shard->engine->stats();
+            result.metrics.merge(stats.engine.metrics);
+            maxRecords = std::max(maxRecords, stats.records);
+            maxReads = std::max(maxReads, stats.reads);
+            totalRecords += stats.records;
+            totalReads += stats.reads;
+            result.shards.push_back(std::move(stats));
+        }
+        if (totalRecords > 0) {
+            result.writeSkew = static_cast<double>(maxRecords) * shards.size() / totalRecords;
+        }
+        if (totalReads > 0) {
+            result.readSkew = static_cast<double>(maxReads) * shards.size() / totalReads;
+        }
+        return result;
+    }
+};
+
+// ---------------------------------------------------------------------------
+// Replication
+//
+// A ReplicationLeader ships the log of a StorageEngine to read replicas over
+// TCP. Segments only grow at the end and follow each other in id order, so
+// a follower's place in the log is a LogPosition and catching up is copying
+// what comes after it: the leader sends the records appended since, and a
+// rotation event wherever a segment was sealed and the log went on in the
+// next one. A ReplicationFollower appends them to segments of the same ids
+// in its own engine, indexes them as a commit would and serves reads. The
+// segments a connected follower still has to read are retained, so leader
+// merges never rewrite them under it; either side merges the rest on its
+// own.
+//
+// A follower started on an empty directory bootstraps first: the leader
+// copies its sealed segments and their hint files as they are, then streams
+// the active segment from its start.
+//
+// Every frame is a ReplicationFrame followed by `size` bytes of payload:
+//
+//   Hello         F->L  end of the follower's log (segment 0 asks for a
+//                       bootstrap); payload: ReplicationHello
+//   File          L->F  bytes of sealed segment `segment` at `offset`, of a
+//                       file of `value` bytes; REPLICATION_FLAG_HINT for its
+//                       hint file
+//   Bootstrapped  L->F  all sealed segments sent, the log goes on in `segment`
+//   Records       L->F  records written to `segment` at `offset`; value: log
+//                       bytes after them
+//   Rotate        L->F  `segment` was sealed at `offset` bytes; value: file id
+//                       of the next segment
+//   Heartbeat     L->F  end of the leader's log; value: log bytes after what
+//                       was sent
+//   Ack           F->L  end of the follower's log
+//   Reject        L->F  the leader cannot continue the follower's log;
+//                       payload: why
+//
+// Records carry their own CRC, which applyLog checks, so frames have none.
+// ---------------------------------------------------------------------------
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <poll.h>
+
+const uint32_t REPLICATION_MAGIC = 0x4C504552; // "REPL"
+const uint16_t REPLICATION_VERSION = 1;
+const uint8_t REPLICATION_FLAG_HINT = 1;
+// Larger frames are taken for a broken stream
+const uint32_t REPLICATION_MAX_PAYLOAD = 256 << 20;
+
+enum class FrameType : uint8_t {
+    Hello = 1,
+    File,
+    Bootstrapped,
+    Records,
+    Rotate,
+    Heartbeat,
+    Ack,
+    Reject,
+};
+
+struct ReplicationFrame {
+    uint8_t type;
+    uint8_t flags;
+    uint16_t reserved;
+    uint32_t size;
+    uint64_t segment;
+    uint64_t offset;
+    uint64_t value;
+};
+
+struct ReplicationHello {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t keySize;       // KeyCodec::SIZE, 0 for variable-size keys
+    uint64_t recordOffset;  // see StorageEngine::replicaPosition
+    uint32_t recordCrc;
+    uint32_t reserved;
+};
+
+static_assert(sizeof(ReplicationFrame) == 32, "ReplicationFrame must be packed");
+static_assert(sizeof(ReplicationHello) == 24, "ReplicationHello must be packed");
+
+// Sends all of data. False once the peer is gone or the send timed out.
+inline bool sendFully(int fd, const void* data, size_t size, int flags = 0) {
+    const char* bytes = static_cast<const char*>(data);
+    while (size > 0) {
+        ssize_t n = ::send(fd, bytes, size, flags | MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        bytes += n;
+        size -= n;
+    }
+    return true;
+}
+
+inline bool recvFully(int fd, void* data, size_t size) {
+    char* bytes = static_cast<char*>(data);
+    while (size > 0) {
+        ssize_t n = ::recv(fd, bytes, size, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        bytes += n;
+        size -= n;
+    }
+    return true;
+}
+
+inline bool sendFrame(int fd, FrameType type, uint64_t segment, uint64_t offset, uint64_t value,
+    std::string_view payload = {}, uint8_t flags = 0) {
+    const ReplicationFrame frame{ static_cast<uint8_t>(type), flags, 0, static_cast<uint32_t>(payload.size()),
+        segment, offset, value };
+    return sendFully(fd, &frame, sizeof(frame), payload.empty() ? 0 : MSG_MORE) &&
+        sendFully(fd, payload.data(), payload.size());
+}
+
+// Reads a frame, and its payload into payload
+inline bool recvFrame(int fd, ReplicationFrame& frame, std::string& payload) {
+    if (!recvFully(fd, &frame, sizeof(frame)) || frame.size > REPLICATION_MAX_PAYLOAD) return false;
+    payload.resize(frame.size);
+    return frame.size == 0 || recvFully(fd, &payload[0], frame.size);
+}
+
+// Bounds every send and receive (and a connect) by timeout, and turns off
+// Nagle's algorithm, which would hold back acknowledgements
+inline void configureSocket(int fd, std::chrono::milliseconds timeout) {
+    timeval limit{ static_cast<time_t>(timeout.count() / 1000),
+        static_cast<suseconds_t>(timeout.count() % 1000 * 1000) };
+    ::setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &limit, sizeof(limit));
+    ::setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &limit, sizeof(limit));
+    const int one = 1;
+    ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+// A TCP connection to host:port, -1 if none could be made
+inline int connectTo(const std::string& host, uint16_t port, std::chrono::milliseconds timeout) {
+    addrinfo hints{};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* addresses = nullptr;
+    if (::getaddrinfo(host.empty() ? nullptr : host.c_str(), std::to_string(port).c_str(), &hints, &addresses) != 0) {
+        return -1;
+    }
+    int fd = -1;
+    for (const addrinfo* address = addresses; address != nullptr && fd < 0; address = address->ai_next) {
+        fd = ::socket(address->ai_family, address->ai_socktype | SOCK_CLOEXEC, address->ai_protocol);
+        if (fd < 0) continue;
+        configureSocket(fd, timeout);
+        if (::connect(fd, address->ai_addr, address->ai_addrlen) != 0) {
+            ::close(fd);
+            fd = -1;
+        }
+    }
+    ::freeaddrinfo(addresses);
+    return fd;
+}
+
+// A socket listening on host:port (every address when host is empty), -1 on
+// failure. Port 0 takes any free port; bound is set to the one taken.
+inline int listenOn(const std::string& host, uint16_t port, uint16_t& bound) {
+    addrinfo hints{};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    addrinfo* addresses = nullptr;
+    if (::getaddrinfo(host.empty() ? nullptr : host.c_str(), std::to_string(port).c_str(), &hints, &addresses) != 0) {
+        return -1;
+    }
+    int fd = -1;
+    for (const addrinfo* address = addresses; address != nullptr && fd < 0; address = address->ai_next) {
+        fd = ::socket(address->ai_family, address->ai_socktype | SOCK_CLOEXEC, address->ai_protocol);
+        if (fd < 0) continue;
+        const int one = 1;
+        ::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (::bind(fd, address->ai_addr, address->ai_addrlen) != 0 || ::listen(fd, 16) != 0) {
+            ::close(fd);
+            fd = -1;
+        }
+    }
+    ::freeaddrinfo(addresses);
+    if (fd < 0) return -1;
+
+    sockaddr_storage local{};
+    socklen_t length = sizeof(local);
+    ::getsockname(fd, reinterpret_cast<sockaddr*>(&local), &length);
+    bound = ntohs(local.ss_family == AF_INET6 ? reinterpret_cast<const sockaddr_in6&>(local).sin6_port
+        : reinterpret_cast<const sockaddr_in&>(local).sin_port);
+    return fd;
+}
+
+// "host:port" of a peer
+inline std::string peerName(const sockaddr_storage& address, socklen_t length) {
+    char host[NI_MAXHOST];
+    char service[NI_MAXSERV];
+    if (::getnameinfo(reinterpret_cast<const sockaddr*>(&address), length, host, sizeof(host), service,
+        sizeof(service), NI_NUMERICHOST | NI_NUMERICSERV) != 0) {
+        return "unknown";
+    }
+    return std::string(host) + ":" + service;
+}
+
+enum class ReplicaState {
+    Connecting,     // no connection to the leader
+    Bootstrapping,  // the leader's sealed segments are being copied
+    Streaming,
+    Diverged,       // the leader rejected the follower's log, which has to be rebuilt
+};
+
+inline const char* replicaStateName(ReplicaState state) {
+    static const char* const names[] = { "connecting", "bootstrapping", "streaming", "diverged" };
+    return names[static_cast<size_t>(state)];
+}
+
+// One follower as the leader or the follower itself sees it. The lag is
+// what the follower has still to apply: the bytes of the leader's log past
+// its position, and the time since it last had all of them.
+struct ReplicaStats {
+    std::string peer;                     // the follower's address at the leader, the leader's at a follower
+    ReplicaState state = ReplicaState::Connecting;
+    LogPosition position;                 // end of the follower's log, as last acknowledged
+    uint64_t lagBytes = 0;
+    double lagSeconds = 0;
+    uint64_t streamedBytes = 0;           // record and file bytes sent or received
+    uint64_t connects = 0;
+};
+
+// Adds stats to writer, every sample carrying labels
+inline void addReplicaStats(PrometheusWriter& writer, const ReplicaStats& stats, const std::string& labels = {}) {
+    writer.gauge("kv_replication_lag_bytes", "Bytes of the leader's log the follower has not applied",
+        static_cast<double>(stats.lagBytes), labels);
+    writer.gauge("kv_replication_lag_seconds", "Time since the follower last had all of the leader's log",
+        stats.lagSeconds, labels);
+    writer.counter("kv_replication_streamed_bytes_total", "Record and segment file bytes shipped",
+        stats.streamedBytes, labels);
+    writer.counter("kv_replication_connects_total", "Connections made to the leader", stats.connects, labels);
+    writer.gauge("kv_replication_diverged", "1 once the leader rejected the follower's log",
+        stats.state == ReplicaState::Diverged ? 1.0 : 0.0, labels);
+}
+
+inline std::string toPrometheus(const ReplicaStats& stats) {
+    PrometheusWriter writer;
+    addReplicaStats(writer, stats);
+    return writer.text();
+}
+
+// The followers of a leader, each series with a follower="<address>" label
+inline std::string toPrometheus(const std::vector<ReplicaStats>& followers) {
+    PrometheusWriter writer;
+    writer.gauge("kv_replication_followers", "Followers connected", static_cast<double>(followers.size()));
+    for (const auto& follower : followers) {
+        addReplicaStats(writer, follower, "follower=\"" + follower.peer + "\"");
+    }
+    return writer.text();
+}
+
+// Serves the log of an engine to the followers connecting on options.host
+// and options.port, each from a thread of its own. Writers never wait for
+// followers: replication is asynchronous, and a follower falling behind
+// only shows in its lag. The engine must outlive the leader.
+template <typename Engine = StorageEngine<>>
+class ReplicationLeader {
+    using KeyCodec = typename Engine::KeyCodec;
+    using Store = ::Store<KeyCodec>;
+
+    struct Follower {
+        int fd = -1;                      // closed with followersMutex held
+        std::thread thread;
+        std::atomic<bool> finished{ false };
+        mutable std::mutex mutex;         // guards stats and caughtUp
+        ReplicaStats stats;
+        std::chrono::steady_clock::time_point caughtUp = std::chrono::steady_clock::now();
+    };
+
+    Engine& engine;
+    ReplicationOptions options;
+    int listenFd = -1;
+    uint16_t boundPort = 0;
+    std::atomic<bool> stopping{ false };
+    mutable std::mutex followersMutex;
+    std::vector<std::unique_ptr<Follower>> followers;
+    std::thread acceptThread;
+
+    void acceptLoop() {
+        while (!stopping.load()) {
+            pollfd poller{ listenFd, POLLIN, 0 };
+            const int ready = ::poll(&poller, 1, static_cast<int>(options.heartbeatInterval.count()));
+            reap();
+            if (ready <= 0) continue;
+            sockaddr_storage address{};
+            socklen_t length = sizeof(address);
+            const int fd = ::accept4(listenFd, reinterpret_cast<sockaddr*>(&address), &length, SOCK_CLOEXEC);
+            if (fd < 0) continue;
+            configureSocket(fd, options.ioTimeout);
+
+            auto follower = std::make_unique<Follower>();
+            follower->fd = fd;
+            follower->stats.peer = peerName(address, length);
+            follower->stats.connects = 1;
+            std::lock_guard<std::mutex> lock(followersMutex);
+            Follower& added = *follower;
+            followers.push_back(std::move(follower));
+            added.thread = std::thread(&ReplicationLeader::serve, this, std::ref(added));
+        }
+    }
+
+    // Joins the threads of followers that disconnected
+    void reap() {
+        std::lock_guard<std::mutex> lock(followersMutex);
+        for (auto it = followers.begin(); it != followers.end();) {
+            if ((*it)->finished.load()) {
+                (*it)->thread.join();
+                it = followers.erase(it);
+            }
+            else {
+                ++it;
+            }
+        }
+    }
+
+    void serve(Follower& follower) {
+        ReplicationFrame frame;
+        std::string payload;
+        ReplicationHello hello{};
+        if (recvFrame(follower.fd, frame, payload) && frame.type == static_cast<uint8_t>(FrameType::Hello) &&
+            payload.size() == sizeof(hello)) {
+            std::memcpy(&hello, payload.data(), sizeof(hello));
+            stream(follower, { frame.segment, frame.offset }, hello);
+        }
+        log(LogLevel::Info, "Follower " + follower.stats.peer + " disconnected");
+        {
+            std::lock_guard<std::mutex> lock(followersMutex);
+            ::close(follower.fd);
+            follower.fd = -1;
+        }
+        follower.finished = true;
+    }
+
+    void setState(Follower& follower, ReplicaState state, const LogPosition& position) {
+        std::lock_guard<std::mutex> lock(follower.mutex);
+        follower.stats.state = state;
+        follower.stats.position = position;
+    }
+
+    void addStreamed(Follower& follower, uint64_t bytes) {
+        std::lock_guard<std::mutex> lock(follower.mutex);
+        follower.stats.streamedBytes += bytes;
+    }
+
+    void reject(Follower& follower, const std::string& reason) {
+        log(LogLevel::Warning, "Rejected follower " + follower.stats.peer + ": " + reason);
+        sendFrame(follower.fd, FrameType::Reject, 0, 0, 0, reason);
+    }
+
+    // Streams the log to a follower from the end of its log, `from`, until
+    // the connection fails or the leader stops
+    void stream(Follower& follower, const LogPosition& from, const ReplicationHello& hello) {
+        if (hello.magic != REPLICATION_MAGIC || hello.version != REPLICATION_VERSION) {
+            reject(follower, "unsupported protocol version");
+            return;
+        }
+        if (hello.keySize != (KeyCodec::FIXED ? KeyCodec::SIZE : 0)) {
+            reject(follower, "keys differ from the leader's");
+            return;
+        }
+        std::shared_ptr<const Store> store;
+        uint64_t sent;
+        if (from.segment == 0) {
+            store = bootstrap(follower);
+            if (store == nullptr) return;
+            sent = sizeof(FileHeader);
+        }
+        else {
+            engine.retainSegments(from.segment);
+            std::string reason;
+            store = resume(from, hello, reason);
+            if (store == nullptr) {
+                engine.releaseSegments(from.segment);
+                reject(follower, reason);
+                return;
+            }
+            sent = from.offset;
+        }
+        setState(follower, ReplicaState::Streaming, { store->id(), sent });
+        log(LogLevel::Info, "Streaming segment " + std::to_string(store->id()) + " from " + std::to_string(sent) +
+            " to follower " + follower.stats.peer);
+
+        std::string buffer;
+        LogPosition end = engine.logEnd();
+        while (!stopping.load() && readAcks(follower)) {
+            // A segment that is no longer the active one is sealed, and so complete
+            const uint64_t limit = store->id() == end.segment ? end.offset : store->getTotalBytes();
+            if (sent < limit) {
+                const size_t size = static_cast<size_t>(std::min<uint64_t>(limit - sent, options.frameBytes));
+                buffer.resize(size);
+                if (!store->readRaw(sent, size, &buffer[0])) {
+                    log(LogLevel::Error, "Failed to read " + store->path() + " for follower " + follower.stats.peer);
+                    break;
+                }
+                const uint64_t behind = engine.logBytesAfter({ store->id(), sent + size });
+                if (!sendFrame(follower.fd, FrameType::Records, store->id(), sent, behind, buffer)) break;
+                sent += size;
+                addStreamed(follower, size);
+                continue;
+            }
+            if (store->id() != end.segment) {
+                // The log goes on in the next segment, which is retained
+                // before this one is let go
+                std::shared_ptr<const Store> next;
+                for (const auto& candidate : engine.logSegments()) {
+                    if (candidate->id() > store->id()) {
+                        next = candidate;
+                        break;
+                    }
+                }
+                if (next == nullptr) break;
+                engine.retainSegments(next->id());
+                engine.releaseSegments(store->id());
+                const uint64_t sealed = store->id();
+                store = std::move(next);
+                if (!sendFrame(follower.fd, FrameType::Rotate, sealed, sent, store->id())) break;
+                sent = sizeof(FileHeader);
+                continue;
+            }
+            const LogPosition seen = end;
+            end = engine.waitForLog(seen, options.heartbeatInterval);
+            if (end == seen && !sendFrame(follower.fd, FrameType::Heartbeat, end.segment, end.offset,
+                engine.logBytesAfter({ store->id(), sent }))) {
+                break;
+            }
+        }
+        engine.releaseSegments(store->id());
+    }
+
+    // The segment the follower's log ends in, provided the leader's segment
+    // of that id holds the same records, else nullptr and why
+    std::shared_ptr<const Store> resume(const LogPosition& from, const ReplicationHello& hello,
+        std::string& reason) const {
+        const std::string segment = "segment " + std::to_string(from.segment);
+        for (const auto& store : engine.logSegments()) {
+            if (store->id() != from.segment) continue;
+            uint32_t crc = 0;
+            if (store->getTotalBytes() < from.offset) {
+                reason = segment + " is shorter on the leader";
+            }
+            else if (hello.recordOffset != 0 && (hello.recordOffset + sizeof(crc) > from.offset ||
+                !store->readRaw(hello.recordOffset, sizeof(crc), reinterpret_cast<char*>(&crc)) ||
+                crc != hello.recordCrc)) {
+                reason = segment + " holds other records on the leader";
+            }
+            else {
+                return store;
+            }
+            return nullptr;
+        }
+        reason = segment + " is gone from the leader";
+        return nullptr;
+    }
+
+    // Copies every sealed segment, with its hint file, then hands over to
+    // streaming from the start of the active segment, which is returned
+    // retained
+    std::shared_ptr<const Store> bootstrap(Follower& follower) {
+        setState(follower, ReplicaState::Bootstrapping, {});
+        // With everything retained for a moment no merge can replace the
+        // active segment before it is retained on its own
+        engine.retainSegments(0);
+        const LogPosition end = engine.logEnd();
+        engine.retainSegments(end.segment);
+        engine.releaseSegments(0);
+
+        std::shared_ptr<const Store> active;
+        bool ok = true;
+        size_t copied = 0;
+        for (const auto& store : engine.logSegments()) {
+            if (store->id() == end.segment) {
+                active = store;
+            }
+            else if (ok && store->id() < end.segment) {
+                ok = sendSegment(follower, *store);
+                copied++;
+            }
+        }
+        if (ok && active != nullptr && sendFrame(follower.fd, FrameType::Bootstrapped, end.segment, 0, 0)) {
+            log(LogLevel::Info, "Bootstrapped follower " + follower.stats.peer + " with " + std::to_string(copied) +
+                " segments");
+            return active;
+        }
+        engine.releaseSegments(end.segment);
+        return nullptr;
+    }
+
+    // Sends a sealed segment and its hint file, if that still describes it
+    bool sendSegment(Follower& follower, const Store& store) {
+        const uint64_t total = store.getTotalBytes();
+        std::string buffer;
+        for (uint64_t offset = 0; offset < total;) {
+            const size_t size = static_cast<size_t>(std::min<uint64_t>(total - offset, options.frameBytes));
+            buffer.resize(size);
+            if (!store.readRaw(offset, size, &buffer[0]) ||
+                !sendFrame(follower.fd, FrameType::File, store.id(), offset, total, buffer)) {
+                return false;
+            }
+            offset += size;
+            addStreamed(follower, size);
+        }
+
+        // A merge may have replaced the hint since, which its data size gives away
+        std::ifstream in(store.path() + ".hint", std::ios::binary);
+        std::string hint((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        HintHeader header;
+        if (hint.size() < sizeof(header)) return true;
+        std::memcpy(&header, hint.data(), sizeof(header));
+        if (header.dataSize != total) return true;
+        for (uint64_t offset = 0; offset < hint.size();) {
+            const size_t size = static_cast<size_t>(std::min<uint64_t>(hint.size() - offset, options.frameBytes));
+            if (!sendFrame(follower.fd, FrameType::File, store.id(), offset, hint.size(),
+                std::string_view(hint).substr(offset, size), REPLICATION_FLAG_HINT)) {
+                return false;
+            }
+            offset += size;
+            addStreamed(follower, size);
+        }
+        return true;
+    }
+
+    // Takes the acknowledgements the follower has sent, without waiting for
+    // more. False once the follower is gone.
+    bool readAcks(Follower& follower) {
+        ReplicationFrame frame;
+        std::string payload;
+        for (;;) {
+            pollfd poller{ follower.fd, POLLIN, 0 };
+            const int ready = ::poll(&poller, 1, 0);
+            if (ready == 0) return true;
+            if (ready < 0) return errno == EINTR;
+            if (!recvFrame(follower.fd, frame, payload) || frame.type != static_cast<uint8_t>(FrameType::Ack)) {
+                return false;
+            }
+            const LogPosition position{ frame.segment, frame.offset };
+            const bool caughtUp = engine.logBytesAfter(position) == 0;
+            std::lock_guard<std::mutex> lock(follower.mutex);
+            follower.stats.position = position;
+            if (caughtUp) {
+                follower.caughtUp = std::chrono::steady_clock::now();
+            }
+        }
+    }
+
+public:
+    ReplicationLeader(Engine& engine, const ReplicationOptions& options) : engine(engine), options(options) {
+        listenFd = listenOn(options.host, options.port, boundPort);
+        if (listenFd < 0) {
+            log(LogLevel::Error, "Failed to listen for followers on port " + std::to_string(options.port) + ": " +
+                std::strerror(errno));
+            return;
+        }
+        log(LogLevel::Info, "Listening for followers on port " + std::to_string(boundPort));
+        acceptThread = std::thread(&ReplicationLeader::acceptLoop, this);
+    }
+
+    ~ReplicationLeader() {
+        stopping = true;
+        if (acceptThread.joinable()) {
+            acceptThread.join();
+        }
+        {
+            std::lock_guard<std::mutex> lock(followersMutex);
+            for (const auto& follower : followers) {
+                if (follower->fd >= 0) {
+                    ::shutdown(follower->fd, SHUT_RDWR);
+                }
+            }
+        }
+        for (const auto& follower : followers) {
+            follower->thread.join();
+        }
+        if (listenFd >= 0) {
+            ::close(listenFd);
+        }
+    }
+
+    ReplicationLeader(const ReplicationLeader&) = delete;
+    ReplicationLeader& operator=(const ReplicationLeader&) = delete;
+
+    bool listening() const {
+        return listenFd >= 0;
+    }
+
+    // Port followers connect to, the one picked when options.port was 0
+    uint16_t port() const {
+        return boundPort;
+    }
+
+    // The connected followers, with their lag now
+    std::vector<ReplicaStats> stats() const {
+        std::vector<ReplicaStats> result;
+        std::lock_guard<std::mutex> lock(followersMutex);
+        const auto now = std::chrono::steady_clock::now();
+        for (const auto& follower : followers) {
+            if (follower->finished.load()) continue;
+            std::lock_guard<std::mutex> guard(follower->mutex);
+            ReplicaStats stats = follower->stats;
+            stats.lagBytes = engine.logBytesAfter(stats.position);
+            stats.lagSeconds = stats.lagBytes == 0 ? 0.0
+                : std::chrono::duration<double>(now - follower->caughtUp).count();
+            result.push_back(std::move(stats));
+        }
+        return result;
+    }
+};
+
+// A read replica of the engine behind a ReplicationLeader. The follower owns
+// an engine over engineOptions that only the replication stream writes to;
+// engine() is there for reads. On an empty directory the constructor first
+// bootstraps it from the leader, retrying until the leader answers. Then a
+// background thread streams the leader's log into it, reconnecting whenever
+// the connection drops, while it serves reads.
+//
+// A follower whose log the leader cannot continue, say because a leader
+// merge rewrote the segment it stopped in while it was away, stays in
+// ReplicaState::Diverged and has to be rebuilt from an empty directory.
+template <typename Engine = StorageEngine<>>
+class ReplicationFollower {
+    using KeyCodec = typename Engine::KeyCodec;
+
+    EngineOptions engineOptions;
+    ReplicationOptions options;
+    std::unique_ptr<Engine> replica;
+    std::atomic<bool> stopping{ false };
+    // The connection, shut down by the destructor to interrupt the stream
+    std::mutex connectionMutex;
+    int connection = -1;
+    std::mutex wakeMutex;
+    std::condition_variable wake;
+    mutable std::mutex statsMutex;
+    ReplicaStats progress;
+    std::chrono::steady_clock::time_point caughtUp = std::chrono::steady_clock::now();
+    // Segment the follower would resume from, which its own merges leave alone
+    size_t retainedSegment = 0;
+    // Records received but not applied yet, the start of a batch
+    std::string pending;
+    std::thread thread;
+
+    std::string bootstrapMarker() const {
+        return engineOptions.prefix() + ".bootstrap";
+    }
+
+    // Whether there is nothing to serve yet: no segments, or only those of a
+    // bootstrap that was interrupted, which are removed
+    bool needsBootstrap() const {
+        const std::string prefix = engineOptions.prefix();
+        const std::vector<std::pair<size_t, std::string>> segments = discoverFiles(prefix, ".txt");
+        if (!std::filesystem::exists(bootstrapMarker())) return segments.empty();
+        for (const auto& segment : segments) {
+            ::unlink(segment.second.c_str());
+            ::unlink((segment.second + ".hint").c_str());
+        }
+        return true;
+    }
+
+    void setState(ReplicaState state) {
+        std::lock_guard<std::mutex> lock(statsMutex);
+        progress.state = state;
+    }
+
+    void addStreamed(uint64_t bytes) {
+        std::lock_guard<std::mutex> lock(statsMutex);
+        progress.streamedBytes += bytes;
+    }
+
+    // Accounts streamed bytes received and the leader's log bytes the
+    // follower is still missing
+    void advance(uint64_t streamed, uint64_t behind, const LogPosition& position) {
+        std::lock_guard<std::mutex> lock(statsMutex);
+        progress.streamedBytes += streamed;
+        progress.lagBytes = behind;
+        progress.position = position;
+        if (behind == 0) {
+            caughtUp = std::chrono::steady_clock::now();
+        }
+    }
+
+    int connectLeader() {
+        const int fd = connectTo(options.host, options.port, options.ioTimeout);
+        if (fd < 0) return -1;
+        std::lock_guard<std::mutex> lock(connectionMutex);
+        if (stopping.load()) {
+            ::close(fd);
+            return -1;
+        }
+        connection = fd;
+        std::lock_guard<std::mutex> guard(statsMutex);
+        progress.connects++;
+        return fd;
+    }
+
+    void disconnect(int fd) {
+        std::lock_guard<std::mutex> lock(connectionMutex);
+        ::close(fd);
+        connection = -1;
+    }
+
+    bool sendHello(int fd, const LogPosition& position, uint64_t recordOffset, uint32_t recordCrc) {
+        const ReplicationHello hello{ REPLICATION_MAGIC, REPLICATION_VERSION,
+            static_cast<uint16_t>(KeyCodec::FIXED ? KeyCodec::SIZE : 0), recordOffset, recordCrc, 0 };
+        return sendFrame(fd, FrameType::Hello, position.segment, position.offset, 0,
+            { reinterpret_cast<const char*>(&hello), sizeof(hello) });
+    }
+
+    // Writes bytes at offset of the file at path, syncing it after the last chunk
+    static bool writeChunk(const std::string& path, uint64_t offset, std::string_view bytes, bool last) {
+        const int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | (offset == 0 ? O_TRUNC : 0), 0644);
+        if (fd < 0) return false;
+        size_t done = 0;
+        while (done < bytes.size()) {
+            ssize_t n = ::pwrite(fd, bytes.data() + done, bytes.size() - done, static_cast<off_t>(offset + done));
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            done += n;
+        }
+        const bool ok = done == bytes.size() && (!last || ::fdatasync(fd) == 0);
+        ::close(fd);
+        if (!ok) {
+            log(LogLevel::Error, "Failed to write " + path + ": " + std::strerror(errno));
+        }
+        return ok;
+    }
+
+    // Copies the leader's sealed segments and hint files into the
+    // directory. Returns the connection, which goes on streaming from next,
+    // or -1; rejected is set when retrying is pointless.
+    int bootstrap(LogPosition& next, bool& rejected) {
+        const std::string prefix = engineOptions.prefix();
+        setState(ReplicaState::Bootstrapping);
+        std::ofstream(bootstrapMarker()).close();
+        const int fd = connectLeader();
+        if (fd < 0) return -1;
+        ReplicationFrame frame;
+        std::string payload;
+        if (sendHello(fd, {}, 0, 0)) {
+            while (recvFrame(fd, frame, payload)) {
+                if (frame.type == static_cast<uint8_t>(FrameType::File)) {
+                    const std::string path = prefix + "_" + std::to_string(frame.segment) + ".txt" +
+                        (frame.flags & REPLICATION_FLAG_HINT ? ".hint" : "");
+                    if (!writeChunk(path, frame.offset, payload, frame.offset + payload.size() >= frame.value)) break;
+                    addStreamed(payload.size());
+                    continue;
+                }
+                if (frame.type == static_cast<uint8_t>(FrameType::Bootstrapped)) {
+                    ::unlink(bootstrapMarker().c_str());
+                    next = { frame.segment, sizeof(FileHeader) };
+                    log(LogLevel::Info, "Bootstrapped " + prefix + " from " + progress.peer);
+                    return fd;
+                }
+                if (frame.type == static_cast<uint8_t>(FrameType::Reject)) {
+                    log(LogLevel::Error, "Leader " + progress.peer + " rejected " + prefix + ": " + payload);
+                    rejected = true;
+                }
+                break;
+            }
+        }
+        disconnect(fd);
+        return -1;
+    }
+
+    // Keeps the follower's merges off the segment it would resume from
+    void retain(size_t segment) {
+        if (segment == retainedSegment) return;
+        replica->retainSegments(segment);
+        if (retainedSegment != 0) {
+            replica->releaseSegments(retainedSegment);
+        }
+        retainedSegment = segment;
+    }
+
+    bool sendAck(int fd, const LogPosition& position) {
+        return sendFrame(fd, FrameType::Ack, position.segment, position.offset, 0);
+    }
+
+    // Applies what the leader streams, records continuing the log at next,
+    // until the connection fails. True when the leader rejected the log.
+    bool follow(int fd, LogPosition next) {
+        ReplicationFrame frame;
+        std::string payload;
+        pending.clear();
+        while (!stopping.load() && recvFrame(fd, frame, payload)) {
+            switch (static_cast<FrameType>(frame.type)) {
+            case FrameType::Records: {
+                if (frame.segment != next.segment || frame.offset != next.offset) {
+                    log(LogLevel::Warning, "Replicated records out of order, reconnecting");
+                    return false;
+                }
+                pending += payload;
+                next.offset += payload.size();
+                const LogPosition at{ next.segment, next.offset - pending.size() };
+                size_t applied;
+                if (!replica->applyLog(at, pending, applied)) return false;
+                pending.erase(0, applied);
+                const LogPosition end{ at.segment, at.offset + applied };
+                advance(payload.size(), frame.value + pending.size(), end);
+                if (!sendAck(fd, end)) return false;
+                break;
+            }
+            case FrameType::Rotate: {
+                if (!pending.empty() || frame.segment != next.segment || frame.offset != next.offset ||
+                    !replica->rotateLog({ frame.segment, frame.offset }, frame.value)) {
+                    return false;
+                }
+                retain(frame.segment);
+                next = { frame.value, sizeof(FileHeader) };
+                advance(0, progress.lagBytes, next);
+                if (!sendAck(fd, next)) return false;
+                break;
+            }
+            case FrameType::Heartbeat: {
+                const LogPosition end{ next.segment, next.offset - pending.size() };
+                advance(0, frame.value + pending.size(), end);
+                if (!sendAck(fd, end)) return false;
+                break;
+            }
+            case FrameType::Reject:
+                log(LogLevel::Error, "Leader " + progress.peer + " rejected " + engineOptions.prefix() + ": " +
+                    payload);
+                return true;
+            default:
+                log(LogLevel::Warning, "Unexpected replication frame, reconnecting");
+                return false;
+            }
+        }
+        return false;
+    }
+
+    // Streams until stopped, reconnecting after every failure. fd is a
+    // connection already streaming from next, or -1.
+    void run(int fd, LogPosition next) {
+        while (!stopping.load()) {
+            if (fd < 0) {
+                fd = connectLeader();
+                uint64_t recordOffset;
+                uint32_t recordCrc;
+                next = replica->replicaPosition(recordOffset, recordCrc);
+                if (fd >= 0 && !sendHello(fd, next, recordOffset, recordCrc)) {
+                    disconnect(fd);
+                    fd = -1;
+                }
+                if (fd >= 0) {
+                    retain(next.segment);
+                }
+            }
+            if (fd >= 0) {
+                setState(ReplicaState::Streaming);
+                const bool rejected = follow(fd, next);
+                disconnect(fd);
+                fd = -1;
+                if (rejected) {
+                    setState(ReplicaState::Diverged);
+                    return;
+                }
+            }
+            setState(ReplicaState::Connecting);
+            std::unique_lock<std::mutex> lock(wakeMutex);
+            wake.wait_for(lock, options.reconnectInterval, [this] { return stopping.load(); });
+        }
+    }
+
+public:
+    ReplicationFollower(const EngineOptions& engineOptions, const ReplicationOptions& options)
+        : engineOptions(engineOptions), options(options) {
+        progress.peer = options.host + ":" + std::to_string(options.port);
+        std::error_code ec;
+        std::filesystem::create_directories(engineOptions.directory, ec);
+        int fd = -1;
+        bool rejected = false;
+        LogPosition next;
+        if (needsBootstrap()) {
+            while ((fd = bootstrap(next, rejected)) < 0 && !rejected) {
+                log(LogLevel::Warning, "Bootstrap from " + progress.peer + " failed, retrying");
+                std::this_thread::sleep_for(options.reconnectInterval);
+            }
+        }
+        replica = std::make_unique<Engine>(engineOptions);
+        if (rejected) {
+            setState(ReplicaState::Diverged);
+            return;
+        }
+        if (fd >= 0) {
+            // The fresh, empty active segment takes the id the log goes on in
+            replica->rotateLog({ 0, sizeof(FileHeader) }, next.segment);
+        }
+        thread = std::thread(&ReplicationFollower::run, this, fd, next);
+    }
+
+    ~ReplicationFollower() {
+        stopping = true;
+        {
+            std::lock_guard<std::mutex> lock(connectionMutex);
+            if (connection >= 0) {
+                ::shutdown(connection, SHUT_RDWR);
+            }
+        }
+        {
+            std::lock_guard<std::mutex> lock(wakeMutex);
+        }
+        wake.notify_all();
+        if (thread.joinable()) {
+            thread.join();
+        }
+    }
+
+    ReplicationFollower(const ReplicationFollower&) = delete;
+    ReplicationFollower& operator=(const ReplicationFollower&) = delete;
+
+    // The replica, for reads
+    const Engine& engine() const {
+        return *replica;
+    }
+
+    ReplicaStats stats() const {
+        std::lock_guard<std::mutex> lock(statsMutex);
+        ReplicaStats stats = progress;
+        stats.lagSeconds = stats.lagBytes == 0 ? 0.0
+            : std::chrono::duration<double>(std::chrono::steady_clock::now() - caughtUp).count();
+        return stats;
+    }
+};
+
+// ---------------------------------------------------------------------------
+// LSM engine
+//
+// LsmStorageEngine writes every batch to a write-ahead log (a Store that is
+// never sealed) and to a skiplist memtable. A full memtable is swapped for an
+// empty one and flushed to an SSTable in level 0 by a background thread, which
+// then deletes its log. Compaction merges tables into deeper levels, either
+// leveled (one sorted run per level) or tiered (a few runs per level).
+//
+// SSTable file:
+//
+//   | FileHeader | data blocks | Bloom filter | TableIndexEntry... | TableFooter |
+//
+// A data block is about blockBytes of records in the log format
+// (encodeRecord), sorted by key. The block index and the filter are loaded
+// when a table is opened, the blocks are read on demand. The tables making up
+// each level are listed in "<prefix>.manifest", which is replaced atomically
+// whenever a flush or compaction changes them.
+// ---------------------------------------------------------------------------
+
+const uint32_t TABLE_MAGIC = 0x5453564B; // "KVST"
+const uint32_t MANIFEST_MAGIC = 0x464D534C; // "LSMF"
+const uint16_t MANIFEST_VERSION = 1;
+
+struct TableIndexEntry {
+    int32_t firstKey;
+    int32_t lastKey;
+    uint64_t offset;
+    uint32_t size;
+    uint32_t reserved;
+};
+
+struct TableFooter {
+    uint64_t bloomOffset;
+    uint64_t indexOffset;
+    uint64_t records;
+    uint32_t bloomSize;
+    uint32_t blockCount;
+    uint32_t crc;        // CRC32C of the filter and the index
+    uint32_t magic;
+};
+
+// Manifest file: ManifestHeader, `count` ManifestEntry values ordered by
+// level, run and key range, then a CRC32C over both
+struct ManifestHeader {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t reserved;
+    uint64_t nextFileId;
+    uint64_t count;
+};
+
+struct ManifestEntry {
+    uint64_t tableId;
+    uint32_t level;
+    uint32_t run;       // 0 is the newest run of the level
+};
+
+static_assert(sizeof(TableIndexEntry) == 24, "TableIndexEntry must be packed");
+static_assert(sizeof(TableFooter) == 40, "TableFooter must be packed");
+static_assert(sizeof(ManifestHeader) == 24, "ManifestHeader must be packed");
+static_assert(sizeof(ManifestEntry) == 16, "ManifestEntry must be packed");
+
+// Sorted in-memory table of the newest writes of an LsmStorageEngine: a
+// skiplist with one writer (holding the engine's write lock) and any number
+// of lock-free readers. Every write inserts a new node, newer versions of a
+// key sorting before older ones, so a node never changes once it is linked
+// in. Nodes and values live in an arena freed with the memtable.
+class Memtable {
+    friend class MemtableIterator;
+
+    static constexpr int MAX_HEIGHT = 12;
+
+    struct Node {
+        int key;
+        uint8_t flags;
+        uint64_t sequence;
+        std::string_view value;
+        // height entries; the node is allocated with room for them
+        std::atomic<Node*> next[1];
+    };
+
+    std::vector<std::unique_ptr<char[]>> blocks;
+    char* cursor = nullptr;
+    size_t remaining = 0;
+    Node* head;
+    std::atomic<int> height{ 1 };
+    uint64_t sequence = 0;
+    uint64_t random = 0x2545F4914F6CDD1Dull;
+    std::atomic<size_t> usage{ 0 };
+    std::atomic<size_t> entries{ 0 };
+
+    char* allocate(size_t bytes) {
+        bytes = (bytes + 7) & ~size_t(7);
+        if (bytes > remaining) {
+            const size_t size = std::max<size_t>(bytes, 64 << 10);
+            blocks.emplace_back(new char[size]);
+            cursor = blocks.back().get();
+            remaining = size;
+        }
+        char* memory = cursor;
+        cursor += bytes;
+        remaining -= bytes;
+        return memory;
+    }
+
+    Node* newNode(int key, uint8_t flags, std::string_view value, int levels) {
+        const size_t size = sizeof(Node) + (levels - 1) * sizeof(std::atomic<Node*>);
+        char* memory = allocate(size + value.size());
+        Node* node = new (memory) Node{ key, flags, sequence, {}, { nullptr } };
+        for (int i = 1; i < levels; i++) {
+            new (&node->next[i]) std::atomic<Node*>(nullptr);
+        }
+        if (!value.empty()) {
+            std::memcpy(memory + size, value.data(), value.size());
+        }
+        node->value = std::string_view(memory + size, value.size());
+        usage.fetch_add(size + value.size(), std::memory_order_relaxed);
+        return node;
+    }
+
+    // Height of a new node: 1 + geometric with p = 1/4
+    int randomHeight() {
+        int levels = 1;
+        while (levels < MAX_HEIGHT) {
+            random ^= random << 13;
+            random ^= random >> 7;
+            random ^= random << 17;
+            if ((random & 3) != 0) break;
+            levels++;
+        }
+        return levels;
+    }
+
+    // Whether node sorts before version `sequence` of key
+    static bool before(const Node* node, int key, uint64_t sequence) {
+        return node->key < key || (node->key == key && node->sequence > sequence);
+    }
+
+    // First node at or after version `sequence` of key; fills prev with its
+    // predecessor on every level when given
+    Node* seek(int key, uint64_t sequence, Node** prev) const {
+        Node* node = head;
+        int level = height.load(std::memory_order_relaxed) - 1;
+        while (true) {
+            Node* next = node->next[level].load(std::memory_order_acquire);
+            if (next != nullptr && before(next, key, sequence)) {
+                node = next;
+            }
+            else {
+                if (prev != nullptr) prev[level] = node;
+                if (level == 0) return next;
+                level--;
+            }
+        }
+    }
+
+public:
+    Memtable() {
+        head = newNode(0, 0, {}, MAX_HEIGHT);
+        usage.store(0, std::memory_order_relaxed);
+    }
+
+    Memtable(const Memtable&) = delete;
+    Memtable& operator=(const Memtable&) = delete;
+
+    // Writer only. A tombstone is a record with RECORD_FLAG_TOMBSTONE.
+    void insert(int key, std::string_view value, uint8_t flags) {
+        sequence++;
+        Node* prev[MAX_HEIGHT];
+        seek(key, sequence, prev);
+        const int levels = randomHeight();
+        const int current = height.load(std::memory_order_relaxed);
+        if (levels > current) {
+            for (int i = current; i < levels; i++) {
+                prev[i] = head;
+            }
+            // A reader seeing the new height before the links just finds
+            // nothing on the new levels and descends
+            height.store(levels, std::memory_order_relaxed);
+        }
+        Node* node = newNode(key, flags, value, levels);
+        for (int i = 0; i < levels; i++) {
+            node->next[i].store(prev[i]->next[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+            prev[i]->next[i].store(node, std::memory_order_release);
+        }
+        entries.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // Newest record of key. value stays valid for the memtable's lifetime.
+    bool find(int key, std::string_view& value, uint8_t& flags) const {
+        const Node* node = seek(key, UINT64_MAX, nullptr);
+        if (node == nullptr || node->key != key) return false;
+        value = node->value;
+        flags = node->flags;
+        return true;
+    }
+
+    // Bytes of nodes and values, what the flush threshold is compared to
+    size_t bytes() const {
+        return usage.load(std::memory_order_relaxed);
+    }
+
+    bool empty() const {
+        return entries.load(std::memory_order_relaxed) == 0;
+    }
+};
+
+// Writes one SSTable. Records must be added in increasing key order; a
+// builder destroyed before finish() removes its partial file.
+class TableBuilder {
+    std::string filePath;
+    int fd = -1;
+    size_t blockBytes;
+    // Encoded bytes not yet written, flushed in chunks of about 1 MiB
+    std::string buffer;
+    uint64_t fileBytes = 0;
+    std::vector<TableIndexEntry> index;
+    std::vector<int> keys;
+    uint64_t blockOffset = 0;
+    int firstKey = 0;
+    int lastKey = 0;
+    bool inBlock = false;
+    bool ok = true;
+
+    void flushBuffer() {
+        size_t done = 0;
+        while (ok && done < buffer.size()) {
+            ssize_t n = ::write(fd, buffer.data() + done, buffer.size() - done);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) {
+                ok = false;
+                break;
+            }
+            done += n;
+        }
+        buffer.clear();
+    }
+
+    void finishBlock() {
+        if (!inBlock) return;
+        index.push_back({ firstKey, lastKey, blockOffset, static_cast<uint32_t>(fileBytes - blockOffset), 0 });
+        inBlock = false;
+        if (buffer.size() >= (1u << 20)) {
+            flushBuffer();
+        }
+    }
+
+public:
+    TableBuilder(std::string path, size_t blockBytes) : filePath(std::move(path)), blockBytes(blockBytes) {
+        fd = ::open(filePath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        ok = fd >= 0;
+        FileHeader header{ TABLE_MAGIC, FORMAT_VERSION, 0 };
+        buffer.append(reinterpret_cast<const char*>(&header), sizeof(header));
+        fileBytes = sizeof(header);
+    }
+
+    ~TableBuilder() {
+        if (fd >= 0) {
+            ::close(fd);
+            ::unlink(filePath.c_str());
+        }
+    }
+
+    TableBuilder(const TableBuilder&) = delete;
+    TableBuilder& operator=(const TableBuilder&) = delete;
+
+    void add(int key, std::string_view value, uint8_t flags) {
+        if (!inBlock) {
+            blockOffset = fileBytes;
+            firstKey = key;
+            inBlock = true;
+        }
+        fileBytes += encodeRecord(buffer, key, value, flags);
+        lastKey = key;
+        keys.push_back(key);
+        if (fileBytes - blockOffset >= blockBytes) {
+            finishBlock();
+        }
+    }
+
+    const std::string& path() const {
+        return filePath;
+    }
+
+    uint64_t size() const {
+        return fileBytes;
+    }
+
+    // Writes the filter, the index and the footer and syncs the file
+    bool finish() {
+        finishBlock();
+        BloomFilter filter(keys.size());
+        for (int key : keys) {
+            filter.add(key);
+        }
+        TableFooter footer{};
+        const size_t start = buffer.size();
+        footer.bloomOffset = fileBytes;
+        filter.save(buffer);
+        footer.bloomSize = static_cast<uint32_t>(buffer.size() - start);
+        footer.indexOffset = footer.bloomOffset + footer.bloomSize;
+        buffer.append(reinterpret_cast<const char*>(index.data()), index.size() * sizeof(TableIndexEntry));
+        footer.crc = crc32c(0, buffer.data() + start, buffer.size() - start);
+        footer.records = keys.size();
+        footer.blockCount = static_cast<uint32_t>(index.size());
+        footer.magic = TABLE_MAGIC;
+        buffer.append(reinterpret_cast<const char*>(&footer), sizeof(footer));
+        fileBytes += buffer.size() - start;
+
+        flushBuffer();
+        ok = ok && ::fdatasync(fd) == 0;
+        ok = ::close(fd) == 0 && ok;
+        fd = -1;
+        if (!ok) {
+            log(LogLevel::Error, "Failed to write table " + filePath + ": " + std::strerror(errno));
+            ::unlink(filePath.c_str());
+        }
+        return ok;
+    }
+};
+
+// An immutable table written by TableBuilder. Opening it loads the block
+// index and the Bloom filter; blocks are read on demand, from the mapping in
+// mmap mode and with pread otherwise. Safe for any number of readers.
+class SSTable {
+    std::string filePath;
+    uint64_t tableId;
+    int fd = -1;
+    const char* mapped = nullptr;
+    uint64_t fileSize = 0;
+    uint64_t recordCount = 0;
+    std::vector<TableIndexEntry> blocks;
+    std::unique_ptr<BloomFilter> bloom;
+
+    bool load(SealedReadMode mode, AccessPattern pattern) {
+        fd = ::open(filePath.c_str(), O_RDONLY);
+        struct stat st;
+        if (fd < 0 || ::fstat(fd, &st) != 0) return false;
+        fileSize = st.st_size;
+        TableFooter footer;
+        if (fileSize < sizeof(FileHeader) + sizeof(footer) ||
+            !readRaw(fileSize - sizeof(footer), sizeof(footer), reinterpret_cast<char*>(&footer))) {
+            return false;
+        }
+        const uint64_t indexBytes = static_cast<uint64_t>(footer.blockCount) * sizeof(TableIndexEntry);
+        if (footer.magic != TABLE_MAGIC || footer.blockCount == 0 ||
+            footer.bloomOffset + footer.bloomSize != footer.indexOffset ||
+            footer.indexOffset + indexBytes + sizeof(footer) != fileSize) {
+            return false;
+        }
+        std::string meta(footer.bloomSize + indexBytes, '\0');
+        if (!readRaw(footer.bloomOffset, meta.size(), &meta[0]) ||
+            crc32c(0, meta.data(), meta.size()) != footer.crc) {
+            return false;
+        }
+        bloom = BloomFilter::load(std::string_view(meta.data(), footer.bloomSize));
+        if (bloom == nullptr) return false;
+        blocks.resize(footer.blockCount);
+        std::memcpy(blocks.data(), meta.data() + footer.bloomSize, indexBytes);
+        recordCount = footer.records;
+
+        if (mode == SealedReadMode::Mmap) {
+            void* region = ::mmap(nullptr, fileSize, PROT_READ, MAP_SHARED, fd, 0);
+            if (region != MAP_FAILED) {
+                int advice = MADV_NORMAL;
+                switch (pattern) {
+                case AccessPattern::Normal: advice = MADV_NORMAL; break;
+                case AccessPattern::Random: advice = MADV_RANDOM; break;
+                case AccessPattern::Sequential: advice = MADV_SEQUENTIAL; break;
+                case AccessPattern::WillNeed: advice = MADV_WILLNEED; break;
+                }
+                ::madvise(region, fileSize, advice);
+                mapped = static_cast<const char*>(region);
+            }
+        }
+        return true;
+    }
+
+    bool readRaw(uint64_t offset, size_t size, char* out) const {
+        size_t done = 0;
+        while (done < size) {
+            ssize_t n = ::pread(fd, out + done, size - done, offset + done);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return false;
+            done += n;
+        }
+        return true;
+    }
+
+public:
+    SSTable(std::string path, uint64_t id) : filePath(std::move(path)), tableId(id) {}
+
+    ~SSTable() {
+        if (mapped != nullptr) {
+            ::munmap(const_cast<char*>(mapped), fileSize);
+        }
+        if (fd >= 0) {
+            ::close(fd);
+        }
+    }
+
+    SSTable(const SSTable&) = delete;
+    SSTable& operator=(const SSTable&) = delete;
+
+    // The table at path, or nullptr if it is missing or incomplete
+    static std::shared_ptr<SSTable> open(const std::string& path, uint64_t id,
+        SealedReadMode mode, AccessPattern pattern) {
+        auto table = std::make_shared<SSTable>(path, id);
+        if (!table->load(mode, pattern)) {
+            log(LogLevel::Error, "Unreadable table " + path);
+            return nullptr;
+        }
+        return table;
+    }
+
+    const std::string& path() const {
+        return filePath;
+    }
+
+    uint64_t id() const {
+        return tableId;
+    }
+
+    int smallest() const {
+        return blocks.front().firstKey;
+    }
+
+    int largest() const {
+        return blocks.back().lastKey;
+    }
+
+    uint64_t bytes() const {
+        return fileSize;
+    }
+
+    uint64_t records() const {
+        return recordCount;
+    }
+
+    bool isMapped() const {
+        return mapped != nullptr;
+    }
+
+    // Memory held for the table: its block index and Bloom filter
+    size_t memoryBytes() const {
+        return blocks.size() * sizeof(TableIndexEntry) + bloom->memoryBytes();
+    }
+
+    size_t blockCount() const {
+        return blocks.size();
+    }
+
+    // First block that can hold key or a later one, blockCount() if none
+    size_t lowerBound(int key) const {
+        auto it = std::lower_bound(blocks.begin(), blocks.end(), key,
+            [](const TableIndexEntry& entry, int k) { return entry.lastKey < k; });
+        return static_cast<size_t>(it - blocks.begin());
+    }
+
+    // Asks the kernel to start reading about bytes of blocks from block
+    // first on; returns the first block not covered
+    size_t prefetch(size_t first, uint64_t bytes) const {
+        const uint64_t start = blocks[first].offset;
+        size_t last = first;
+        uint64_t end = start;
+        while (last < blocks.size() && end - start < bytes) {
+            end = blocks[last].offset + blocks[last].size;
+            last++;
+        }
+        if (mapped != nullptr) {
+            const uint64_t page = static_cast<uint64_t>(::sysconf(_SC_PAGESIZE));
+            const uint64_t aligned = start & ~(page - 1);
+            ::madvise(const_cast<char*>(mapped) + aligned, end - aligned, MADV_WILLNEED);
+        }
+        else {
+            ::posix_fadvise(fd, start, end - start, POSIX_FADV_WILLNEED);
+        }
+        return last;
+    }
+
+    // Block i, a view of the mapping or read into scratch
+    bool readBlock(size_t i, std::string& scratch, std::string_view& out) const {
+        const TableIndexEntry& entry = blocks[i];
+        if (mapped != nullptr) {
+            out = std::string_view(mapped + entry.offset, entry.size);
+            return true;
+        }
+        scratch.resize(entry.size);
+        if (!readRaw(entry.offset, entry.size, &scratch[0])) return false;
+        out = scratch;
+        return true;
+    }
+
+    // Finds the record of key. value views the block (mapping or scratch) in
+    // its stored form; flags tells tombstones and compressed values apart.
+    bool find(int key, std::string& scratch, std::string_view& value, uint8_t& flags) const {
+        if (!bloom->mayContain(key)) return false;
+        const size_t i = lowerBound(key);
+        if (i == blocks.size() || blocks[i].firstKey > key) return false;
+        std::string_view block;
+        if (!readBlock(i, scratch, block)) return false;
+
+        // Only the matching record is checksummed
+        size_t pos = 0;
+        while (block.size() - pos >= sizeof(RecordHeader) + sizeof(int)) {
+            RecordHeader header;
+            std::memcpy(&header, block.data() + pos, sizeof(header));
+            const size_t size = sizeof(header) + header.keySize + header.valueSize;
+            if (header.keySize != sizeof(int) || size > block.size() - pos) break;
+            int recordKey;
+            std::memcpy(&recordKey, block.data() + pos + sizeof(header), sizeof(recordKey));
+            if (recordKey > key) return false;
+            if (recordKey == key) {
+                return decodeRecord(block.data() + pos, size, recordKey, value, flags);
+            }
+            pos += size;
+        }
+        log(LogLevel::Error, "Corrupt block in " + filePath);
+        return false;
+    }
+};
+
+// Sorted stream of records in their stored form, the common interface of
+// the memtable, table runs and their merge
+class RecordIterator {
+public:
+    virtual ~RecordIterator() = default;
+
+    virtual bool valid() const = 0;
+    // Positions on the first record with a key of at least key
+    virtual void seek(int key) = 0;
+    virtual void next() = 0;
+    virtual int key() const = 0;
+    // Valid until the iterator moves
+    virtual std::string_view value() const = 0;
+    virtual uint8_t flags() const = 0;
+    // False once a read failed or a corrupt record was found; the iterator
+    // is then no longer valid either
+    virtual bool ok() const {
+        return true;
+    }
+};
+
+// Newest record of every key in a memtable
+class MemtableIterator : public RecordIterator {
+    std::shared_ptr<const Memtable> memtable;
+    const Memtable::Node* node = nullptr;
+
+public:
+    explicit MemtableIterator(std::shared_ptr<const Memtable> memtable) : memtable(std::move(memtable)) {}
+
+    bool valid() const override {
+        return node != nullptr;
+    }
+
+    void seek(int key) override {
+        node = memtable->seek(key, UINT64_MAX, nullptr);
+    }
+
+    void next() override {
+        const int key = node->key;
+        do {
+            node = node->next[0].load(std::memory_order_acquire);
+        } while (node != nullptr && node->key == key);
+    }
+
+    int key() const override {
+        return node->key;
+    }
+
+    std::string_view value() const override {
+        return node->value;
+    }
+
+    uint8_t flags() const override {
+        return node->flags;
+    }
+};
+
+// Tables of one sorted run: ascending, with disjoint key ranges
+using TableRun = std::vector<std::shared_ptr<SSTable>>;
+
+// The table of run whose range holds key, or nullptr
+inline const std::shared_ptr<SSTable>* findTable(const TableRun& run, int key) {
+    auto it = std::lower_bound(run.begin(), run.end(), key,
+        [](const std::shared_ptr<SSTable>& table, int k) { return table->largest() < k; });
+    if (it == run.end() || (*it)->smallest() > key) return nullptr;
+    return &*it;
+}
+
+// Records of a run, block by block through its tables. With readAheadBytes
+// set, the blocks ahead are prefetched in windows of that size.
+class RunIterator : public RecordIterator {
+    TableRun run;
+    uint64_t readAheadBytes;
+    size_t tableIndex = 0;
+    size_t blockIndex = 0;
+    // First block of the current table not prefetched yet
+    size_t prefetched = 0;
+    size_t prefetchedTable = SIZE_MAX;
+    std::string scratch;
+    std::string_view block;
+    size_t pos = 0;
+    size_t recordSize = 0;
+    int recordKey = 0;
+    std::string_view recordValue;
+    uint8_t recordFlags = 0;
+    bool isValid = false;
+    bool failed = false;
+
+    bool loadBlock() {
+        while (tableIndex < run.size()) {
+            if (blockIndex < run[tableIndex]->blockCount()) {
+                pos = 0;
+                recordSize = 0;
+                if (readAheadBytes > 0 && (prefetchedTable != tableIndex || blockIndex >= prefetched)) {
+                    prefetched = run[tableIndex]->prefetch(blockIndex, readAheadBytes);
+                    prefetchedTable = tableIndex;
+                }
+                if (run[tableIndex]->readBlock(blockIndex, scratch, block)) return true;
+                log(LogLevel::Error, "Failed to read " + run[tableIndex]->path());
+                failed = true;
+                return false;
+            }
+            tableIndex++;
+            blockIndex = 0;
+        }
+        return false;
+    }
+
+    // Decodes the record at pos, moving on to later blocks as needed
+    void settle() {
+        while (pos >= block.size()) {
+            blockIndex++;
+            if (!loadBlock()) {
+                isValid = false;
+                return;
+            }
+        }
+        RecordHeader header;
+        if (block.size() - pos >= sizeof(header)) {
+            std::memcpy(&header, block.data() + pos, sizeof(header));
+            recordSize = sizeof(header) + header.keySize + header.valueSize;
+            if (recordSize <= block.size() - pos &&
+                decodeRecord(block.data() + pos, recordSize, recordKey, recordValue, recordFlags)) {
+                isValid = true;
+                return;
+            }
+        }
+        log(LogLevel::Error, "Corrupt block in " + run[tableIndex]->path());
+        failed = true;
+        isValid = false;
+    }
+
+public:
+    explicit RunIterator(TableRun run, uint64_t readAheadBytes = 0)
+        : run(std::move(run)), readAheadBytes(readAheadBytes) {}
+
+    bool valid() const override {
+        return isValid;
+    }
+
+    void seek(int key) override {
+        auto it = std::lower_bound(run.begin(), run.end(), key,
+            [](const std::shared_ptr<SSTable>& table, int k) { return table->largest() < k; });
+        tableIndex = static_cast<size_t>(it - run.begin());
+        blockIndex = it == run.end() ? 0 : (*it)->lowerBound(key);
+        if (!loadBlock()) {
+            isValid = false;
+            return;
+        }
+        settle();
+        while (isValid && recordKey < key) {
+            next();
+        }
+    }
+
+    void next() override {
+        pos += recordSize;
+        settle();
+    }
+
+    bool ok() const override {
+        return !failed;
+    }
+
+    int key() const override {
+        return recordKey;
+    }
+
+    std::string_view value() const override {
+        return recordValue;
+    }
+
+    uint8_t flags() const override {
+        return recordFlags;
+    }
+};
+
+// Merges sources given newest first into one sorted stream. Of the records a
+// key has in several sources, only the newest is produced.
+class MergingIterator : public RecordIterator {
+    std::vector<std::unique_ptr<RecordIterator>> sources;
+    RecordIterator* current = nullptr;
+
+    // Ties go to the earlier, newer source
+    void pickSmallest() {
+        current = nullptr;
+        for (auto& source : sources) {
+            if (source->valid() && (current == nullptr || source->key() < current->key())) {
+                current = source.get();
+            }
+        }
+    }
+
+public:
+    explicit MergingIterator(std::vector<std::unique_ptr<RecordIterator>> sources)
+        : sources(std::move(sources)) {}
+
+    bool valid() const override {
+        return current != nullptr;
+    }
+
+    void seek(int key) override {
+        for (auto& source : sources) {
+            source->seek(key);
+        }
+        pickSmallest();
+    }
+
+    void next() override {
+        const int key = current->key();
+        for (auto& source : sources) {
+            if (source->valid() && source->key() == key) {
+                source->next();
+            }
+        }
+        pickSmallest();
+    }
+
+    int key() const override {
+        return current->key();
+    }
+
+    std::string_view value() const override {
+        return current->value();
+    }
+
+    uint8_t flags() const override {
+        return current->flags();
+    }
+
+    bool ok() const override {
+        for (const auto& source : sources) {
+            if (!source->ok()) return false;
+        }
+        return true;
+    }
+};
+
+struct LsmLevel {
+    std::vector<TableRun> runs;  // newest first
+};
+
+// Immutable snapshot of an LSM engine, published and retired like SegmentSet.
+// Lookups go through the memtable, the immutable memtable and then every
+// run of every level, which is newest to oldest.
+struct LsmVersion {
+    std::shared_ptr<Memtable> memtable;
+    std::shared_ptr<Memtable> immutable;  // being flushed, may be null
+    std::vector<LsmLevel> levels;
+};
+
+struct LsmLevelStats {
+    size_t runs = 0;
+    size_t tables = 0;
+    uint64_t bytes = 0;
+    uint64_t records = 0;
+};
+
+struct LsmStats {
+    size_t memtableBytes = 0;        // memtable plus immutable memtable
+    std::vector<LsmLevelStats> levels;
+    uint64_t indexBytes = 0;         // block indexes and Bloom filters of all tables
+    uint64_t flushes = 0;
+    uint64_t compactions = 0;
+    uint64_t compactionBytesRead = 0;
+    uint64_t compactionBytesWritten = 0;
+    MetricsSnapshot metrics;
+};
+
+inline std::string toPrometheus(const LsmStats& stats) {
+    PrometheusWriter writer;
+    writer.metrics(stats.metrics);
+    writer.gauge("kv_memtable_bytes", "Bytes of the memtable and the immutable memtable",
+        static_cast<double>(stats.memtableBytes));
+    for (size_t level = 0; level < stats.levels.size(); level++) {
+        const std::string labels = "level=\"" + std::to_string(level) + "\"";
+        const LsmLevelStats& levelStats = stats.levels[level];
+        writer.gauge("kv_level_runs", "Sorted runs of a level", static_cast<double>(levelStats.runs), labels);
+        writer.gauge("kv_level_tables", "Tables of a level", static_cast<double>(levelStats.tables), labels);
+        writer.gauge("kv_level_bytes", "Table bytes of a level", static_cast<double>(levelStats.bytes), labels);
+    }
+    writer.gauge("kv_index_bytes", "Memory held by table indexes and Bloom filters",
+        static_cast<double>(stats.indexBytes));
+    return writer.text();
+}
+
+// Log-structured merge tree behind the StorageEngine set/get API, for
+// keyspaces too large to index in memory. Any number of threads may get
+// while others write; gets take no lock.
+class LsmStorageEngine {
+    EngineOptions options;
+    std::string prefixFileName;
+    // Current version. Readers only load it; it is replaced with writeMutex
+    // held (see publish).
+    std::atomic<const LsmVersion*> version{ nullptr };
+
+    // Guards the memtable, the log and publishing versions
+    std::mutex writeMutex;
+    std::condition_variable flushed;
+    std::condition_variable workWake;
+    std::shared_ptr<Store<>> wal;
+    // Logs of the immutable memtable, deleted once it is flushed
+    std::vector<std::string> immutableWals;
+    bool unsynced = false;
+    bool workRequested = false;
+    std::atomic<bool> stopping{ false };
+
+    // Serialises flushes and compactions, the only changes to the levels, so
+    // their holder can work on a copy of the levels without writeMutex
+    std::mutex workMutex;
+    // Leveled: largest key last compacted out of each level
+    std::vector<int> compactPointer;
+    std::thread workThread;
+
+    std::atomic<uint64_t> nextFileId{ 1 };
+    mutable CompressionCounters compressionCounters;
+    Metrics metrics;
+    std::atomic<uint64_t> flushCount{ 0 };
+    std::atomic<uint64_t> compactionCount{ 0 };
+    std::atomic<uint64_t> compactionBytesRead{ 0 };
+    std::atomic<uint64_t> compactionBytesWritten{ 0 };
+
+    // Inputs of one compaction, merged into outputLevel
+    struct Compaction {
+        std::vector<TableRun> inputs;  // newest first
+        size_t outputLevel = 0;
+        bool dropTombstones = false;
+    };
+
+    std::string tablePath(uint64_t id) const {
+        return prefixFileName + "_" + std::to_string(id) + ".sst";
+    }
+
+    std::string walPath(uint64_t id) const {
+        return prefixFileName + "_" + std::to_string(id) + ".wal";
+    }
+
+    std::string manifestPath() const {
+        return prefixFileName + ".manifest";
+    }
+
+    // The version as seen by the writer. Requires writeMutex held (or the
+    // engine not yet shared).
+    const LsmVersion& current() const {
+        return *version.load(std::memory_order_acquire);
+    }
+
+    // Makes next the current version, under the same locking as current().
+    // The replaced version is freed once no reader can be using it.
+    void publish(std::unique_ptr<LsmVersion> next) {
+        const LsmVersion* previous = version.exchange(next.release(), std::memory_order_acq_rel);
+        if (previous != nullptr) {
+            EpochManager::instance().retire([previous] { delete previous; });
+        }
+    }
+
+    std::shared_ptr<Store<>> makeWal() {
+        const uint64_t id = nextFileId++;
+        return std::make_shared<Store<>>(walPath(id), id, options.preallocate ? options.lsm.memtableBytes : 0);
+    }
+
+    // Writes the manifest to a temporary file and renames it into place
+    bool writeManifest(const std::vector<LsmLevel>& levels) const {
+        std::vector<ManifestEntry> entries;
+        for (size_t level = 0; level < levels.size(); level++) {
+            for (size_t run = 0; run < levels[level].runs.size(); run++) {
+                for (const auto& table : levels[level].runs[run]) {
+                    entries.push_back({ table->id(), static_cast<uint32_t>(level), static_cast<uint32_t>(run) });
+                }
+            }
+        }
+        ManifestHeader header{ MANIFEST_MAGIC, MANIFEST_VERSION, 0, nextFileId.load(), entries.size() };
+        const size_t entryBytes = entries.size() * sizeof(ManifestEntry);
+        uint32_t crc = crc32c(0, reinterpret_cast<const char*>(&header), sizeof(header));
+        crc = crc32c(crc, reinterpret_cast<const char*>(entries.data()), entryBytes);
+
+        const std::string tmpPath = manifestPath() + ".tmp";
+        int fd = ::open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) return false;
+        bool ok = ::write(fd, &header, sizeof(header)) == sizeof(header) &&
+            (entryBytes == 0 || ::write(fd, entries.data(), entryBytes) == static_cast<ssize_t>(entryBytes)) &&
+            ::write(fd, &crc, sizeof(crc)) == sizeof(crc) &&
+            ::fdatasync(fd) == 0;
+        ::close(fd);
+        if (!ok || ::rename(tmpPath.c_str(), manifestPath().c_str()) != 0) {
+            log(LogLevel::Error, "Failed to write manifest " + manifestPath());
+            ::unlink(tmpPath.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    // Opens the tables the manifest lists. A missing manifest is an empty tree.
+    bool readManifest(std::vector<LsmLevel>& levels) {
+        std::ifstream in(manifestPath(), std::ios::binary);
+        if (!in.is_open()) return true;
+
+        ManifestHeader header;
+        if (!in.read(reinterpret_cast<char*>(&header), sizeof(header)) ||
+            header.magic != MANIFEST_MAGIC || header.version != MANIFEST_VERSION) {
+            return false;
+        }
+        std::vector<ManifestEntry> entries(header.count);
+        const size_t entryBytes = entries.size() * sizeof(ManifestEntry);
+        uint32_t expectedCrc;
+        if (!in.read(reinterpret_cast<char*>(entries.data()), entryBytes) ||
+            !in.read(reinterpret_cast<char*>(&expectedCrc), sizeof(expectedCrc))) {
+            return false;
+        }
+        uint32_t crc = crc32c(0, reinterpret_cast<const char*>(&header), sizeof(header));
+        crc = crc32c(crc, reinterpret_cast<const char*>(entries.data()), entryBytes);
+        if (crc != expectedCrc) return false;
+
+        nextFileId = std::max<uint64_t>(nextFileId, header.nextFileId);
+        for (const ManifestEntry& entry : entries) {
+            if (entry.level >= levels.size()) return false;
+            auto table = SSTable::open(tablePath(entry.tableId), entry.tableId,
+                options.sealedReadMode, options.accessPattern);
+            if (table == nullptr) continue;
+            auto& runs = levels[entry.level].runs;
+            if (runs.size() <= entry.run) {
+                runs.resize(entry.run + 1);
+            }
+            runs[entry.run].push_back(std::move(table));
+        }
+        for (auto& level : levels) {
+            level.runs.erase(std::remove_if(level.runs.begin(), level.runs.end(),
+                [](const TableRun& run) { return run.empty(); }), level.runs.end());
+        }
+        return true;
+    }
+
+    void init() {
+        std::vector<LsmLevel> levels(std::max<size_t>(options.lsm.maxLevels, 2));
+        compactPointer.assign(levels.size(), INT_MIN);
+        if (!readManifest(levels)) {
+            log(LogLevel::Warning, "Unreadable manifest " + manifestPath() + ", starting empty");
+            levels.assign(levels.size(), LsmLevel{});
+        }
+
+        // Tables not in the manifest are left over from an interrupted flush
+        // or compaction
+        std::unordered_set<uint64_t> live;
+        for (const auto& level : levels) {
+            for (const auto& run : level.runs) {
+                for (const auto& table : run) {
+                    live.insert(table->id());
+                }
+            }
+        }
+        for (const auto& [id, path] : discoverFiles(prefixFileName, ".sst")) {
+            nextFileId = std::max<uint64_t>(nextFileId, id + 1);
+            if (live.count(id) == 0) {
+                ::unlink(path.c_str());
+            }
+        }
+
+        // Replay the logs oldest first into one memtable, which is flushed
+        // before any new write is accepted
+        auto recovered = std::make_shared<Memtable>();
+        for (const auto& [id, path] : discoverFiles(prefixFileName, ".wal")) {
+            nextFileId = std::max<uint64_t>(nextFileId, id + 1);
+            Store<> replayed(path, id);
+            std::string value;
+            replayed.forEach([&](int key, const MetaData& metaData) {
+                if (metaData.flags & RECORD_FLAG_TOMBSTONE) {
+                    recovered->insert(key, {}, RECORD_FLAG_TOMBSTONE);
+                }
+                else if (replayed.read(metaData, value)) {
+                    recovered->insert(key, value, 0);
+                }
+            });
+            immutableWals.push_back(path);
+        }
+
+        auto initial = std::make_unique<LsmVersion>();
+        initial->memtable = std::make_shared<Memtable>();
+        if (!recovered->empty()) {
+            initial->immutable = std::move(recovered);
+        }
+        initial->levels = std::move(levels);
+        publish(std::move(initial));
+        if (current().immutable == nullptr) {
+            for (const auto& path : immutableWals) {
+                ::unlink(path.c_str());
+            }
+            immutableWals.clear();
+        }
+        else if (!flushImmutable()) {
+            log(LogLevel::Error, "Failed to flush recovered log of " + prefixFileName);
+        }
+        wal = makeWal();
+    }
+
+    bool syncWal(const Store<>& log) const {
+        Metrics::Timer timer = metrics.time(Op::Fsync);
+        return log.sync();
+    }
+
+    // Swaps in an empty memtable and log. Requires writeMutex held and no
+    // immutable memtable.
+    void switchMemtable() {
+        Metrics::Timer timer = metrics.time(Op::Rotation);
+        auto next = std::make_unique<LsmVersion>(current());
+        next->immutable = std::move(next->memtable);
+        next->memtable = std::make_shared<Memtable>();
+        immutableWals.push_back(wal->path());
+        wal = makeWal();
+        publish(std::move(next));
+        workRequested = true;
+        workWake.notify_one();
+    }
+
+    // Waits, holding writeMutex, until the memtable has room. Writers stall
+    // while the previous memtable is still being flushed.
+    bool makeRoom(std::unique_lock<std::mutex>& lock) {
+        while (current().memtable->bytes() >= options.lsm.memtableBytes) {
+            if (stopping) return false;
+            if (current().immutable != nullptr) {
+                flushed.wait(lock);
+                continue;
+            }
+            switchMemtable();
+        }
+        return true;
+    }
+
+    std::vector<LsmLevel> currentLevels() {
+        std::lock_guard<std::mutex> lock(writeMutex);
+        return current().levels;
+    }
+
+    // Installs levels (and, after a flush, drops the immutable memtable)
+    void install(std::vector<LsmLevel> levels, bool flushedImmutable) {
+        std::lock_guard<std::mutex> lock(writeMutex);
+        auto next = std::make_unique<LsmVersion>(current());
+        next->levels = std::move(levels);
+        if (flushedImmutable) {
+            next->immutable = nullptr;
+        }
+        publish(std::move(next));
+    }
+
+    // Writes the records of it into tables of about tableBytes each. Values
+    // not stored compressed yet are compressed as configured.
+    bool writeRun(RecordIterator& it, bool dropTombstones, TableRun& out, RateLimiter* limiter) {
+        std::unique_ptr<TableBuilder> builder;
+        uint64_t id = 0;
+        std::string stored;
+        auto finish = [&] {
+            if (builder == nullptr) return true;
+            bool ok = builder->finish();
+            builder.reset();
+            std::shared_ptr<SSTable> table;
+            if (ok) {
+                table = SSTable::open(tablePath(id), id, options.sealedReadMode, options.accessPattern);
+            }
+            if (table == nullptr) return false;
+            compactionBytesWritten += table->bytes();
+            out.push_back(std::move(table));
+            return true;
+        };
+        auto fail = [&] {
+            for (const auto& table : out) {
+                ::unlink(table->path().c_str());
+            }
+            out.clear();
+            return false;
+        };
+
+        for (it.seek(INT_MIN); it.valid(); it.next()) {
+            uint8_t flags = it.flags();
+            if (dropTombstones && (flags & RECORD_FLAG_TOMBSTONE)) continue;
+            std::string_view value = it.value();
+            if (limiter != nullptr) {
+                limiter->acquire(value.size());
+            }
+            stored.clear();
+            if (!(flags & (RECORD_FLAG_TOMBSTONE | RECORD_FLAG_COMPRESSED)) &&
+                compressCounted(options.compression, value, stored, compressionCounters)) {
+                value = stored;
+                flags |= RECORD_FLAG_COMPRESSED;
+            }
+            if (builder == nullptr) {
+                id = nextFileId++;
+                builder = std::make_unique<TableBuilder>(tablePath(id), options.lsm.blockBytes);
+            }
+            builder->add(it.key(), value, flags);
+            if (builder->size() >= options.lsm.tableBytes && !finish()) return fail();
+        }
+        if (!it.ok()) return fail();
+        return finish() || fail();
+    }
+
+    // Flushes the immutable memtable, if any, to a new level 0 run.
+    // Requires workMutex (or the engine not yet shared).
+    bool flushImmutable() {
+        std::shared_ptr<Memtable> memtable;
+        std::vector<std::string> wals;
+        std::vector<LsmLevel> levels;
+        {
+            std::lock_guard<std::mutex> lock(writeMutex);
+            memtable = current().immutable;
+            if (memtable == nullptr) return true;
+            wals = immutableWals;
+            levels = current().levels;
+        }
+        Metrics::Timer timer = metrics.time(Op::Flush);
+        // With no tables at all there is nothing for a tombstone to shadow
+        bool empty = true;
+        for (const auto& level : levels) {
+            empty = empty && level.runs.empty();
+        }
+        MemtableIterator it(memtable);
+        TableRun run;
+        if (!writeRun(it, empty, run, nullptr)) {
+            log(LogLevel::Error, "Flush failed, keeping the log of " + prefixFileName);
+            return false;
+        }
+        if (!run.empty()) {
+            levels[0].runs.insert(levels[0].runs.begin(), run);
+        }
+        if (!writeManifest(levels)) {
+            for (const auto& table : run) {
+                ::unlink(table->path().c_str());
+            }
+            return false;
+        }
+        install(std::move(levels), true);
+        {
+            std::lock_guard<std::mutex> lock(writeMutex);
+            immutableWals.clear();
+        }
+        flushed.notify_all();
+        for (const auto& path : wals) {
+            ::unlink(path.c_str());
+        }
+        flushCount++;
+        return true;
+    }
+
+    static uint64_t levelBytes(const LsmLevel& level) {
+        uint64_t bytes = 0;
+        for (const auto& run : level.runs) {
+            for (const auto& table : run) {
+                bytes += table->bytes();
+            }
+        }
+        return bytes;
+    }
+
+    // Whether no level below `level` holds a table
+    static bool deepestLevel(const std::vector<LsmLevel>& levels, size_t level) {
+        for (size_t i = level + 1; i < levels.size(); i++) {
+            if (!levels[i].runs.empty()) return false;
+        }
+        return true;
+    }
+
+    // Tables of the single run of level whose ranges meet [lo, hi]
+    static TableRun overlapping(const LsmLevel& level, int lo, int hi) {
+        TableRun tables;
+        for (const auto& run : level.runs) {
+            for (const auto& table : run) {
+                if (table->largest() >= lo && table->smallest() <= hi) {
+                    tables.push_back(table);
+                }
+            }
+        }
+        return tables;
+    }
+
+    bool pickLeveled(const std::vector<LsmLevel>& levels, Compaction& compaction) {
+        const LsmOptions& lsm = options.lsm;
+        if (levels[0].runs.size() >= lsm.level0Runs) {
+            // All of level 0, since its runs overlap each other
+            int lo = INT_MAX;
+            int hi = INT_MIN;
+            for (const auto& run : levels[0].runs) {
+                compaction.inputs.push_back(run);
+                lo = std::min(lo, run.front()->smallest());
+                hi = std::max(hi, run.back()->largest());
+            }
+            compaction.inputs.push_back(overlapping(levels[1], lo, hi));
+            compaction.outputLevel = 1;
+        }
+        else {
+            uint64_t budget = lsm.levelBaseBytes;
+            size_t level = 1;
+            for (; level + 1 < levels.size(); level++, budget *= lsm.levelMultiplier) {
+                if (!levels[level].runs.empty() && levelBytes(levels[level]) > budget) break;
+            }
+            if (level + 1 >= levels.size()) return false;
+
+            // One table at a time, round-robin through the key space
+            const TableRun& run = levels[level].runs.front();
+            auto it = std::find_if(run.begin(), run.end(), [&](const std::shared_ptr<SSTable>& table) {
+                return table->smallest() > compactPointer[level];
+            });
+            const std::shared_ptr<SSTable>& table = it == run.end() ? run.front() : *it;
+            compactPointer[level] = table->largest();
+            compaction.inputs.push_back({ table });
+            compaction.inputs.push_back(overlapping(levels[level + 1], table->smallest(), table->largest()));
+            compaction.outputLevel = level + 1;
+        }
+        compaction.dropTombstones = deepestLevel(levels, compaction.outputLevel);
+        return true;
+    }
+
+    bool pickTiered(const std::vector<LsmLevel>& levels, Compaction& compaction) {
+        const LsmOptions& lsm = options.lsm;
+        for (size_t level = 0; level < levels.size(); level++) {
+            const size_t trigger = level == 0 ? lsm.level0Runs : lsm.tierRuns;
+            if (levels[level].runs.size() < std::max<size_t>(trigger, 2)) continue;
+            compaction.inputs = levels[level].runs;
+            // The last level merges its runs in place
+            compaction.outputLevel = std::min(level + 1, levels.size() - 1);
+            compaction.dropTombstones = deepestLevel(levels, compaction.outputLevel) &&
+                (compaction.outputLevel == level || levels[compaction.outputLevel].runs.empty());
+            return true;
+        }
+        return false;
+    }
+
+    // Runs the compaction the current shape of the tree calls for, if any.
+    // Requires workMutex.
+    bool compactOnce() {
+        std::vector<LsmLevel> levels = currentLevels();
+        Compaction compaction;
+        const bool picked = options.lsm.compaction == CompactionStyle::Leveled
+            ? pickLeveled(levels, compaction) : pickTiered(levels, compaction);
+        if (!picked) return false;
+        Metrics::Timer timer = metrics.time(Op::Compaction);
+
+        std::unordered_set<const SSTable*> inputs;
+        std::vector<std::unique_ptr<RecordIterator>> sources;
+        for (const auto& run : compaction.inputs) {
+            for (const auto& table : run) {
+                inputs.insert(table.get());
+                compactionBytesRead += table->bytes();
+            }
+            if (!run.empty()) {
+                sources.push_back(std::make_unique<RunIterator>(run, options.scan.readAheadBytes));
+            }
+        }
+        MergingIterator merged(std::move(sources));
+        RateLimiter limiter(options.merge.bytesPerSecond);
+        TableRun output;
+        if (!writeRun(merged, compaction.dropTombstones, output, &limiter)) {
+            log(LogLevel::Error, "Compaction failed, keeping inputs of " + prefixFileName);
+            return false;
+        }
+
+        for (auto& level : levels) {
+            for (auto& run : level.runs) {
+                run.erase(std::remove_if(run.begin(), run.end(), [&](const std::shared_ptr<SSTable>& table) {
+                    return inputs.count(table.get()) > 0;
+                }), run.end());
+            }
+            level.runs.erase(std::remove_if(level.runs.begin(), level.runs.end(),
+                [](const TableRun& run) { return run.empty(); }), level.runs.end());
+        }
+        auto& runs = levels[compaction.outputLevel].runs;
+        if (!output.empty()) {
+            if (options.lsm.compaction == CompactionStyle::Leveled && !runs.empty()) {
+                // The output replaces the overlapping part of the level's run
+                TableRun& run = runs.front();
+                run.insert(run.end(), output.begin(), output.end());
+                std::sort(run.begin(), run.end(), [](const auto& a, const auto& b) {
+                    return a->smallest() < b->smallest();
+                });
+            }
+            else {
+                runs.insert(runs.begin(), output);
+            }
+        }
+        if (!writeManifest(levels)) {
+            for (const auto& table : output) {
+                ::unlink(table->path().c_str());
+            }
+            return false;
+        }
+        install(std::move(levels), false);
+
+        // Handles and iterators still holding an input keep it readable
+        for (const SSTable* table : inputs) {
+            ::unlink(table->path().c_str());
+        }
+        compactionCount++;
+        return true;
+    }
+
+    void workLoop() {
+        std::unique_lock<std::mutex> lock(writeMutex);
+        while (!stopping) {
+            const auto wait = options.durability.policy == SyncPolicy::Interval
+                ? options.durability.interval : std::chrono::milliseconds(1000);
+            workWake.wait_for(lock, wait, [this] { return stopping || workRequested; });
+            if (unsynced) {
+                unsynced = false;
+                std::shared_ptr<Store<>> active = wal;
+                lock.unlock();
+                syncWal(*active);
+                lock.lock();
+            }
+            // A memtable whose flush failed is retried every round
+            if (stopping || (!workRequested && current().immutable == nullptr)) continue;
+            workRequested = false;
+            lock.unlock();
+            {
+                std::lock_guard<std::mutex> work(workMutex);
+                if (flushImmutable()) {
+                    while (!stopping && compactOnce()) {}
+                }
+            }
+            lock.lock();
+        }
+    }
+
+public:
+    explicit LsmStorageEngine(const EngineOptions& options)
+        : options(options), prefixFileName(options.prefix()), metrics(options.metrics) {
+        std::error_code ec;
+        std::filesystem::create_directories(options.directory, ec);
+        init();
+        workThread = std::thread(&LsmStorageEngine::workLoop, this);
+        {
+            // A tree recovered over its limits starts compacting right away
+            std::lock_guard<std::mutex> lock(writeMutex);
+            workRequested = true;
+        }
+        workWake.notify_one();
+    }
+
+    // Default options with files named "<prefixFileName>_<N>.sst|.wal"
+    explicit LsmStorageEngine(const std::string& prefixFileName)
+        : LsmStorageEngine(EngineOptions::fromPrefix(prefixFileName)) {}
+
+    ~LsmStorageEngine() {
+        {
+            std::lock_guard<std::mutex> lock(writeMutex);
+            stopping = true;
+        }
+        workWake.notify_all();
+        flushed.notify_all();
+        workThread.join();
+        // An immutable memtable not flushed yet stays in its log and is
+        // replayed by the next open
+        if (options.durability.policy != SyncPolicy::None) {
+            syncWal(*wal);
+        }
+        delete version.load();
+        EpochManager::instance().reclaim();
+    }
+
+    LsmStorageEngine(const LsmStorageEngine&) = delete;
+    LsmStorageEngine& operator=(const LsmStorageEngine&) = delete;
+
+    bool set(int key, const std::string& value) {
+        WriteBatch<>& batch = WriteBatch<>::scratch();
+        return batch.put(key, value) && write(batch);
+    }
+
+    // Inserts a tombstone for key, dropped once compaction reaches the last level
+    bool remove(int key) {
+        WriteBatch<>& batch = WriteBatch<>::scratch();
+        batch.remove(key);
+        return write(batch);
+    }
+
+    // Applies every put and delete of the batch, or none of them
+    bool write(const WriteBatch<>& batch) {
+        if (batch.count() == 0) return true;
+        Metrics::Timer timer = metrics.time(Op::Set);
+        std::unique_lock<std::mutex> lock(writeMutex);
+        if (!makeRoom(lock)) return false;
+        if (!wal->append(batch.buffer.data(), batch.buffer.size())) return false;
+        if (options.durability.policy == SyncPolicy::EveryCommit && !syncWal(*wal)) return false;
+        metrics.add(Counter::WrittenBytes, batch.byteSize());
+        unsynced = options.durability.policy == SyncPolicy::Interval;
+        Memtable& memtable = *current().memtable;
+        batch.forEach([&](int key, std::string_view value, bool isDelete) {
+            memtable.insert(key, value, isDelete ? RECORD_FLAG_TOMBSTONE : 0);
+        });
+        return true;
+    }
+
+    // Safe to call from any number of threads, concurrently with writes,
+    // flushes and compactions
+    ValueHandle get(int key) const {
+        Metrics::Timer timer = metrics.time(Op::Get);
+        ValueHandle handle = fetch(key);
+        if (handle) {
+            metrics.add(Counter::ReadBytes, handle.value().size());
+        }
+        else {
+            metrics.add(Counter::GetMisses);
+        }
+        return handle;
+    }
+
+    bool get(int key, std::string& out) const {
+        ValueHandle handle = get(key);
+        if (!handle) return false;
+        out.assign(handle.value());
+        return true;
+    }
+
+private:
+    ValueHandle fetch(int key) const {
+        EpochGuard guard;
+        const LsmVersion& v = *version.load(std::memory_order_acquire);
+        std::string_view value;
+        uint8_t flags;
+        for (const auto* memtable : { &v.memtable, &v.immutable }) {
+            if (*memtable != nullptr && (*memtable)->find(key, value, flags)) {
+                if (flags & RECORD_FLAG_TOMBSTONE) return {};
+                return ValueHandle::view(*memtable, value);
+            }
+        }
+        std::string scratch;
+        for (const LsmLevel& level : v.levels) {
+            for (const TableRun& run : level.runs) {
+                const std::shared_ptr<SSTable>* table = findTable(run, key);
+                if (table == nullptr || !(*table)->find(key, scratch, value, flags)) continue;
+                if (flags & RECORD_FLAG_TOMBSTONE) return {};
+                if (flags & RECORD_FLAG_COMPRESSED) {
+                    std::string inflated;
+                    if (!decompressValue(value, inflated, nullptr, &compressionCounters)) return {};
+                    return ValueHandle::copy(std::move(inflated));
+                }
+                if (!(*table)->isMapped()) {
+                    return ValueHandle::copy(std::string(value));
+                }
+                return ValueHandle::view(*table, value);
+            }
+        }
+        return {};
+    }
+
+public:
+    // Iterates the live keys in [lo, hi] in ascending order, merging the
+    // memtables and every run with read-ahead on the tables. The tables are
+    // those of the version current at the start; writes still going into the
+    // memtable may or may not be seen.
+    ScanIterator<> scan(int lo, int hi) const {
+        std::vector<std::unique_ptr<RecordIterator>> sources;
+        {
+            EpochGuard guard;
+            const LsmVersion& v = *version.load(std::memory_order_acquire);
+            for (const auto* memtable : { &v.memtable, &v.immutable }) {
+                if (*memtable != nullptr) {
+                    sources.push_back(std::make_unique<MemtableIterator>(*memtable));
+                }
+            }
+            for (const LsmLevel& level : v.levels) {
+                for (const TableRun& run : level.runs) {
+                    sources.push_back(std::make_unique<RunIterator>(run, options.scan.readAheadBytes));
+                }
+            }
+        }
+        auto merged = std::make_shared<MergingIterator>(std::move(sources));
+        merged->seek(lo);
+        const size_t batchKeys = std::max<size_t>(options.scan.batchKeys, 1);
+        return ScanIterator<>([this, merged, hi, batchKeys](std::vector<ScanIterator<>::Entry>& out) {
+            for (; merged->valid() && out.size() < batchKeys; merged->next()) {
+                if (merged->key() > hi) return false;
+                const uint8_t flags = merged->flags();
+                if (flags & RECORD_FLAG_TOMBSTONE) continue;
+                std::string value;
+                if (!(flags & RECORD_FLAG_COMPRESSED)) {
+                    value = merged->value();
+                }
+                else if (!decompressValue(merged->value(), value, nullptr, &compressionCounters)) {
+                    log(LogLevel::Error, "Undecodable value of key " + std::to_string(merged->key()) + " in " + prefixFileName);
+                    continue;
+                }
+                out.emplace_back(merged->key(), ValueHandle::copy(std::move(value)));
+            }
+            if (!merged->ok()) {
+                log(LogLevel::Error, "Scan of " + prefixFileName + " stopped at an unreadable table");
+                return false;
+            }
+            return merged->valid() && merged->key() <= hi;
+        });
+    }
+
+    // Flushes the memtable to level 0 now. Returns false if the flush failed.
+    bool flush() {
+        std::lock_guard<std::mutex> work(workMutex);
+        if (!flushImmutable()) return false;
+        {
+            std::unique_lock<std::mutex> lock(writeMutex);
+            if (current().memtable->empty()) return true;
+            switchMemtable();
+        }
+        return flushImmutable();
+    }
+
+    // Runs every compaction the shape of the tree calls for. Returns false
+    // when there was nothing to compact.
+    bool compact() {
+        std::lock_guard<std::mutex> work(workMutex);
+        bool compacted = false;
+        while (compactOnce()) {
+            compacted = true;
+        }
+        return compacted;
+    }
+
+    LsmStats stats() const {
+        EpochGuard guard;
+        const LsmVersion& v = *version.load(std::memory_order_acquire);
+        LsmStats stats;
+        stats.memtableBytes = v.memtable->bytes() + (v.immutable ? v.immutable->bytes() : 0);
+        for (const LsmLevel& level : v.levels) {
+            LsmLevelStats levelStats;
+            levelStats.runs = level.runs.size();
+            for (const auto& run : level.runs) {
+                for (const auto& table : run) {
+                    levelStats.tables++;
+                    levelStats.bytes += table->bytes();
+                    levelStats.records += table->records();
+                    stats.indexBytes += table->memoryBytes();
+                }
+            }
+            stats.levels.push_back(levelStats);
+        }
+        stats.flushes = flushCount.load();
+        stats.compactions = compactionCount.load();
+        stats.compactionBytesRead = compactionBytesRead.load();
+        stats.compactionBytesWritten = compactionBytesWritten.load();
+        stats.metrics = metrics.snapshot();
+        stats.metrics.counters[static_cast<size_t>(Counter::CompactionReadBytes)] = stats.compactionBytesRead;
+        stats.metrics.counters[static_cast<size_t>(Counter::CompactionWrittenBytes)] = stats.compactionBytesWritten;
+        return stats;
+    }
+
+    CompressionStats compressionStats() const {
+        return compressionCounters.snapshot();
+    }
+};